@@ -5,6 +5,6 @@ setuptools.setup(
 	version='0.1',
 	description='MySQL binlog parser',
 	ext_modules=[
-		setuptools.Extension('ybinlogp', ['ybinlogp.cc'], libraries=['boost_python'])
+		setuptools.Extension('ybinlogp', ['ybinlogp.cc'], libraries=['boost_python', 'pthread', 'z'])
 		]
 	)
@@ -0,0 +1,322 @@
+/*
+ * ybinlogp-bench: times the parser on a binlog (make one with
+ * ybinlogp-gen) and prints a JSON object per benchmark, so runs can
+ * be compared with a script rather than by eye.
+ *
+ * (C) 2010 Yelp, Inc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+#include "ybinlogp.hh"
+
+using namespace yelp;
+
+namespace {
+    double now () {
+        struct timeval tv;
+        gettimeofday (&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    /** What one run of a benchmark got through. */
+    struct result {
+        result () : events (0), bytes (0) { }
+        uint64_t events;
+        uint64_t bytes;
+    };
+
+    typedef result (*benchmark_fn) (const std::string &filename);
+
+    struct benchmark {
+        const char *name;
+        benchmark_fn run;
+        const char *description;
+    };
+
+    // Keeps the compiler from dropping work whose result isn't used
+    volatile uint64_t g_sink;
+
+    // Lookups for the seek benchmarks, spread over the file
+    unsigned int g_seeks = 200;
+
+    result iterate (const std::string &filename, binlog::read_mode mode) {
+        result r;
+        binlog log (filename, 0, 0, mode);
+        for (binlog::iterator it = log.begin (); it != log.end (); ++it) {
+            ++r.events;
+            r.bytes += it->view ().header ().length;
+        }
+        return r;
+    }
+
+    result iterate_mmap (const std::string &filename) {
+        return iterate (filename, binlog::READ_MMAP);
+    }
+
+    result iterate_syscall (const std::string &filename) {
+        return iterate (filename, binlog::READ_SYSCALL);
+    }
+
+    result copy_entries (const std::string &filename) {
+        result r;
+        binlog log (filename, 0, 0);
+        for (binlog::iterator it = log.begin (); it != log.end (); ++it) {
+            binlog::entry copy (*it);
+            ++r.events;
+            r.bytes += copy.view ().header ().length;
+        }
+        return r;
+    }
+
+    // The extent of the file, and its size, for the seek benchmarks
+    void file_extent (const std::string &filename, off64_t &size, time_t &first, time_t &last) {
+        binlog log (filename, 0, 0);
+        size = 0;
+        first = last = 0;
+        for (binlog::iterator it = log.begin (); it != log.end (); ++it) {
+            const event_buffer &header = it->view ().header ();
+            if (first == 0) {
+                first = header.timestamp;
+            }
+            last = header.timestamp;
+            size = header.offset + header.length;
+        }
+    }
+
+    // The first event the constructor finds for each target is a hit
+    // for events, the distance skipped doesn't count as bytes read
+    // since a seek shouldn't have read it.
+    result nearest_offset (const std::string &filename) {
+        off64_t size;
+        time_t first, last;
+        file_extent (filename, size, first, last);
+        result r;
+        for (unsigned int i = 0; i < g_seeks; ++i) {
+            off64_t target = 4 + (off64_t)((size - 4) * ((i + 0.5) / g_seeks));
+            binlog log (filename, target, 0);
+            binlog::iterator it = log.begin ();
+            if (it != log.end ()) {
+                ++r.events;
+                r.bytes += it->view ().header ().length;
+            }
+        }
+        return r;
+    }
+
+    result nearest_time (const std::string &filename) {
+        off64_t size;
+        time_t first, last;
+        file_extent (filename, size, first, last);
+        result r;
+        for (unsigned int i = 0; i < g_seeks; ++i) {
+            time_t target = first + (time_t)((last - first) * ((i + 0.5) / g_seeks));
+            binlog log (filename, 0, target);
+            binlog::iterator it = log.begin ();
+            if (it != log.end ()) {
+                ++r.events;
+                r.bytes += it->view ().header ().length;
+            }
+        }
+        return r;
+    }
+
+    result format (const std::string &filename, output_format style) {
+        result r;
+        binlog log (filename, 0, 0);
+        event_formatter formatter (style);
+        std::string out;
+        for (binlog::iterator it = log.begin (); it != log.end (); ++it) {
+            out.clear ();
+            formatter.format (out, it->view ().header ());
+            ++r.events;
+            r.bytes += it->view ().header ().length;
+        }
+        g_sink += out.size ();
+        return r;
+    }
+
+    result format_text (const std::string &filename) {
+        return format (filename, FORMAT_TEXT);
+    }
+
+    result format_json (const std::string &filename) {
+        return format (filename, FORMAT_JSON);
+    }
+
+    result format_tsv (const std::string &filename) {
+        return format (filename, FORMAT_TSV);
+    }
+
+    // operator<< into a stream that goes nowhere, how the CLI printed
+    // before event_formatter.
+    result format_ostream (const std::string &filename) {
+        result r;
+        binlog log (filename, 0, 0);
+        std::ostringstream os;
+        for (binlog::iterator it = log.begin (); it != log.end (); ++it) {
+            os.str (std::string ());
+            os << *it;
+            ++r.events;
+            r.bytes += it->view ().header ().length;
+        }
+        g_sink += os.str ().size ();
+        return r;
+    }
+
+    class counting_worker : public scan_worker {
+    public:
+        counting_worker () : m_events (0), m_bytes (0) { }
+
+        virtual void event (const binlog::event_view &ev, std::string &) {
+            ++m_events;
+            m_bytes += ev.header ().length;
+        }
+
+        uint64_t m_events;
+        uint64_t m_bytes;
+    };
+
+    result parallel_scan (const std::string &filename) {
+        long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        std::vector<counting_worker> counters (cpus > 0 ? cpus : 1);
+        std::vector<scan_worker*> workers;
+        for (size_t i = 0; i < counters.size (); ++i) {
+            workers.push_back (&counters[i]);
+        }
+        binlog log (filename, 0, 0);
+        std::ostringstream os;
+        log.parallel_scan (workers, os);
+        result r;
+        for (size_t i = 0; i < counters.size (); ++i) {
+            r.events += counters[i].m_events;
+            r.bytes += counters[i].m_bytes;
+        }
+        return r;
+    }
+
+    result stats (const std::string &filename) {
+        result r;
+        binlog log (filename, 0, 0);
+        event_stats totals;
+        for (binlog::iterator it = log.begin (); it != log.end (); ++it) {
+            totals.add (it->view ().header ());
+            ++r.events;
+            r.bytes += it->view ().header ().length;
+        }
+        std::ostringstream os;
+        totals.report (os);
+        g_sink += os.str ().size ();
+        return r;
+    }
+
+    const benchmark BENCHMARKS[] = {
+        { "iterate_mmap", iterate_mmap, "walk the file, mapped (read_event and next_after)" },
+        { "iterate_syscall", iterate_syscall, "walk the file with pread" },
+        { "copy_entries", copy_entries, "walk the file and copy every entry, like the python bindings" },
+        { "nearest_offset", nearest_offset, "open at offsets spread over the file (resync)" },
+        { "nearest_time", nearest_time, "open at times spread over the file (binary search)" },
+        { "format_text", format_text, "event_formatter, FORMAT_TEXT" },
+        { "format_json", format_json, "event_formatter, FORMAT_JSON" },
+        { "format_tsv", format_tsv, "event_formatter, FORMAT_TSV" },
+        { "format_ostream", format_ostream, "operator<< into an ostringstream" },
+        { "parallel_scan", parallel_scan, "parallel_scan, a counting worker per cpu" },
+        { "stats", stats, "event_stats over the whole file" }
+    };
+    const size_t BENCHMARK_COUNT = sizeof (BENCHMARKS) / sizeof (BENCHMARKS[0]);
+
+    void usage (void) {
+        fprintf (stderr, "Usage: ybinlogp-bench [options] binlog [benchmark ...]\n");
+        fprintf (stderr, "\n");
+        fprintf (stderr, "Runs the benchmarks (all of them by default) and prints a JSON object per\n");
+        fprintf (stderr, "benchmark with the best of the runs: benchmark, file, runs, events, bytes,\n");
+        fprintf (stderr, "seconds, events_per_sec and mb_per_sec.\n");
+        fprintf (stderr, "\t-r Runs per benchmark (default 3)\n");
+        fprintf (stderr, "\t-s Lookups for nearest_offset and nearest_time (default 200)\n");
+        fprintf (stderr, "\t-l List the benchmarks\n");
+    }
+}
+
+
+int main (int argc, char **argv) {
+    unsigned int runs = 3;
+    int opt;
+    while ((opt = getopt (argc, argv, "r:s:l")) != -1) {
+        switch (opt) {
+        case 'r':
+            runs = strtoul (optarg, NULL, 10);
+            break;
+        case 's':
+            g_seeks = strtoul (optarg, NULL, 10);
+            break;
+        case 'l':
+            for (size_t i = 0; i < BENCHMARK_COUNT; ++i) {
+                printf ("%-16s %s\n", BENCHMARKS[i].name, BENCHMARKS[i].description);
+            }
+            return 0;
+        default:
+            usage ();
+            return 1;
+        }
+    }
+    if (optind >= argc || runs == 0 || g_seeks == 0) {
+        usage ();
+        return 1;
+    }
+    std::string filename (argv[optind++]);
+    std::vector<const benchmark*> chosen;
+    for (int i = optind; i < argc; ++i) {
+        size_t b = 0;
+        while (b < BENCHMARK_COUNT && strcmp (BENCHMARKS[b].name, argv[i]) != 0) {
+            ++b;
+        }
+        if (b == BENCHMARK_COUNT) {
+            fprintf (stderr, "No benchmark called %s, -l lists them\n", argv[i]);
+            return 1;
+        }
+        chosen.push_back (&BENCHMARKS[b]);
+    }
+    if (chosen.empty ()) {
+        for (size_t b = 0; b < BENCHMARK_COUNT; ++b) {
+            chosen.push_back (&BENCHMARKS[b]);
+        }
+    }
+
+    try {
+        for (size_t b = 0; b < chosen.size (); ++b) {
+            result best;
+            double best_time = 0;
+            for (unsigned int run = 0; run < runs; ++run) {
+                double start = now ();
+                result r = chosen[b]->run (filename);
+                double elapsed = now () - start;
+                if (run == 0 || elapsed < best_time) {
+                    best = r;
+                    best_time = elapsed;
+                }
+            }
+            double seconds = best_time > 0 ? best_time : 1e-9;
+            std::cout << boost::format ("{\"benchmark\": \"%s\", \"file\": \"%s\", \"runs\": %u, \"events\": %llu, "
+                                        "\"bytes\": %llu, \"seconds\": %.6f, \"events_per_sec\": %.0f, \"mb_per_sec\": %.2f}")
+                % chosen[b]->name % filename % runs % (unsigned long long)best.events % (unsigned long long)best.bytes
+                % best_time % (best.events / seconds) % (best.bytes / seconds / (1024 * 1024))
+                      << std::endl;
+        }
+    } catch (std::exception &e) {
+        fprintf (stderr, "%s: %s\n", filename.c_str (), e.what ());
+        return 1;
+    }
+    return 0;
+}
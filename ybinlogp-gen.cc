@@ -0,0 +1,609 @@
+/*
+ * ybinlogp-gen: writes synthetic mysql binlogs, for benchmarks and
+ * for trying the parser on files we can make as big, as odd or as
+ * broken as we like.
+ *
+ * The same options and seed always give the same file.
+ *
+ * (C) 2010 Yelp, Inc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+namespace {
+    // Only what the generator writes
+    enum e_event_types {
+        QUERY_EVENT=2,
+        ROTATE_EVENT=4,
+        INTVAR_EVENT=5,
+        RAND_EVENT=13,
+        FORMAT_DESCRIPTION_EVENT=15,
+        XID_EVENT=16,
+        TABLE_MAP_EVENT=19,
+        WRITE_ROWS_EVENT=30,
+        UPDATE_ROWS_EVENT=31,
+        DELETE_ROWS_EVENT=32,
+        GTID_LOG_EVENT=33,
+        PREVIOUS_GTIDS_LOG_EVENT=35
+    };
+
+    const size_t EVENT_HEADER_SIZE = 19;
+    const char BINLOG_MAGIC[4] = {(char)0xfe, 0x62, 0x69, 0x6e};
+
+    // Post-header lengths a 5.6 server writes in its FDE
+    const uint8_t POST_HEADER_LEN[] = {
+        56, 13, 0, 8, 0, 18, 0, 4, 4, 4, 4, 18, 0, 0, 0, 84, 0, 4, 26, 8,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    const char *DATABASES[] = { "shop", "crm", "logs", "billing" };
+    const char *TABLES[] = { "orders", "items", "users", "events", "hits", "invoices" };
+    const size_t DATABASE_COUNT = sizeof (DATABASES) / sizeof (DATABASES[0]);
+    const size_t TABLE_COUNT = sizeof (TABLES) / sizeof (TABLES[0]);
+
+    // The tables' columns: id INT, amount BIGINT, name VARCHAR(255) NULL
+    const uint8_t COLUMN_TYPES[] = { 3, 8, 15 };
+    const size_t COLUMN_COUNT = sizeof (COLUMN_TYPES) / sizeof (COLUMN_TYPES[0]);
+
+    // xorshift64*, rand () isn't the same everywhere
+    class random_source {
+    public:
+        explicit random_source (uint64_t seed) : m_state (seed ? seed : 0x9e3779b97f4a7c15ULL) { }
+
+        uint64_t next () {
+            m_state ^= m_state >> 12;
+            m_state ^= m_state << 25;
+            m_state ^= m_state >> 27;
+            return m_state * 2685821657736338717ULL;
+        }
+        /** [lo, hi] */
+        uint64_t between (uint64_t lo, uint64_t hi) {
+            return hi <= lo ? lo : lo + next () % (hi - lo + 1);
+        }
+        /** true with probability p */
+        bool chance (double p) {
+            return (next () >> 11) * (1.0 / 9007199254740992.0) < p;
+        }
+
+    private:
+        uint64_t m_state;
+    };
+
+    uint32_t crc32 (uint32_t crc, const unsigned char *p, size_t len) {
+        static uint32_t table[256];
+        if (table[1] == 0) {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                }
+                table[i] = c;
+            }
+        }
+        crc = ~crc;
+        for (size_t i = 0; i < len; ++i) {
+            crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    void put_le (std::string &out, uint64_t v, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            out += (char)(v >> (8 * i));
+        }
+    }
+
+    // The packed integers of table maps and row events, small values only
+    void put_packed (std::string &out, uint64_t v) {
+        if (v < 251) {
+            out += (char)v;
+        } else {
+            out += (char)0xfc;
+            put_le (out, v, 2);
+        }
+    }
+
+    struct options {
+        options ()
+            : events (100000), bytes (0), query_weight (60), rows_weight (30), ddl_weight (10),
+              min_statement (20), max_statement (200), max_rows (20), corrupt (0.0), checksums (false),
+              seed (1), start_time (1600000000), rate (100), server_id (1), first_gno (1) { }
+
+        uint64_t events;
+        uint64_t bytes;
+        unsigned query_weight;
+        unsigned rows_weight;
+        unsigned ddl_weight;
+        size_t min_statement;
+        size_t max_statement;
+        size_t max_rows;
+        double corrupt;
+        bool checksums;
+        uint64_t seed;
+        uint32_t start_time;
+        unsigned rate;
+        uint32_t server_id;
+        std::string rotate_to;
+        // The server uuid's 16 bytes, empty to write no GTIDs
+        std::string sid;
+        uint64_t first_gno;
+    };
+
+    class generator {
+    public:
+        generator (FILE *out, const options &opts)
+            : m_out (out), m_opts (opts), m_random (opts.seed), m_position (0), m_events (0),
+              m_corrupted (0), m_time (opts.start_time), m_xid (1), m_insert_id (1),
+              m_gno (opts.first_gno), m_sequence (0)
+        { }
+
+        void run () {
+            write (BINLOG_MAGIC, sizeof (BINLOG_MAGIC));
+            format_description ();
+            if (!m_opts.sid.empty ()) {
+                previous_gtids ();
+            }
+            unsigned total = m_opts.query_weight + m_opts.rows_weight + m_opts.ddl_weight;
+            for (uint64_t t = 0; !done (); ++t) {
+                // rate transactions a second
+                m_time = m_opts.start_time + (uint32_t)(t / (m_opts.rate ? m_opts.rate : 1));
+                uint64_t pick = total ? m_random.between (1, total) : 1;
+                if (!m_opts.sid.empty ()) {
+                    gtid ();
+                }
+                if (pick <= m_opts.query_weight) {
+                    query_transaction ();
+                } else if (pick <= m_opts.query_weight + m_opts.rows_weight) {
+                    rows_transaction ();
+                } else {
+                    ddl ();
+                }
+            }
+            if (!m_opts.rotate_to.empty ()) {
+                std::string body;
+                put_le (body, 4, 8);
+                body += m_opts.rotate_to;
+                event (ROTATE_EVENT, body);
+            }
+        }
+
+        uint64_t events () const { return m_events; }
+        uint64_t bytes () const { return m_position; }
+        uint64_t corrupted () const { return m_corrupted; }
+        /** The gno the next file should start at. */
+        uint64_t next_gno () const { return m_gno; }
+
+    private:
+        bool done () const {
+            return m_opts.bytes ? m_position >= m_opts.bytes : m_events >= m_opts.events;
+        }
+
+        void write (const void *data, size_t len) {
+            if (fwrite (data, 1, len, m_out) != len) {
+                throw std::runtime_error (std::string ("write: ") + strerror (errno));
+            }
+            m_position += len;
+        }
+
+        void event (uint8_t type_code, const std::string &body) {
+            size_t checksum_len = m_opts.checksums ? 4 : 0;
+            uint32_t length = EVENT_HEADER_SIZE + body.size () + checksum_len;
+            std::string ev;
+            ev.reserve (length);
+            put_le (ev, m_time, 4);
+            ev += (char)type_code;
+            put_le (ev, m_opts.server_id, 4);
+            put_le (ev, length, 4);
+            put_le (ev, m_position + length, 4);
+            put_le (ev, 0, 2);
+            ev += body;
+            if (checksum_len) {
+                put_le (ev, crc32 (0, (const unsigned char*)ev.data (), ev.size ()), 4);
+            }
+            // Never the FDE, the file has to be readable at all
+            if (m_opts.corrupt > 0 && type_code != FORMAT_DESCRIPTION_EVENT && m_random.chance (m_opts.corrupt)) {
+                corrupt (ev);
+            }
+            write (ev.data (), ev.size ());
+            ++m_events;
+        }
+
+        // A flipped payload byte (which checksums catch) or a length
+        // that sends the chain off into the weeds (which resync has to
+        // get past).
+        void corrupt (std::string &ev) {
+            ++m_corrupted;
+            if (m_random.chance (0.5)) {
+                size_t at = m_random.between (EVENT_HEADER_SIZE, ev.size () - 1);
+                ev[at] = (char)(ev[at] ^ (1 + m_random.between (0, 254)));
+            } else {
+                std::string length;
+                put_le (length, m_random.between (EVENT_HEADER_SIZE, 0xffffffff), 4);
+                ev.replace (9, 4, length);
+            }
+        }
+
+        void format_description () {
+            std::string body;
+            put_le (body, 4, 2);
+            std::string version ("5.6.99-ybinlogp-gen");
+            version.resize (50, '\0');
+            body += version;
+            put_le (body, m_time, 4);
+            body += (char)EVENT_HEADER_SIZE;
+            body.append ((const char*)POST_HEADER_LEN, sizeof (POST_HEADER_LEN));
+            if (m_opts.checksums) {
+                // binlog_checksum=CRC32
+                body += (char)1;
+            }
+            event (FORMAT_DESCRIPTION_EVENT, body);
+        }
+
+        // Everything before first_gno was in earlier files
+        void previous_gtids () {
+            std::string body;
+            if (m_opts.first_gno > 1) {
+                put_le (body, 1, 8);
+                body += m_opts.sid;
+                put_le (body, 1, 8);
+                put_le (body, 1, 8);
+                put_le (body, m_opts.first_gno, 8);
+            } else {
+                put_le (body, 0, 8);
+            }
+            event (PREVIOUS_GTIDS_LOG_EVENT, body);
+        }
+
+        // 5.7's, with the logical clock
+        void gtid () {
+            std::string body;
+            body += (char)1;
+            body += m_opts.sid;
+            put_le (body, m_gno++, 8);
+            body += (char)2;
+            put_le (body, m_sequence, 8);
+            put_le (body, ++m_sequence, 8);
+            event (GTID_LOG_EVENT, body);
+        }
+
+        void query (const std::string &database, const std::string &statement, uint32_t query_time = 0, uint16_t error_code = 0) {
+            std::string body;
+            put_le (body, 1000 + m_random.between (0, 63), 4);
+            put_le (body, query_time, 4);
+            body += (char)database.size ();
+            put_le (body, error_code, 2);
+            put_le (body, 0, 2);
+            body += database;
+            body += '\0';
+            body += statement;
+            event (QUERY_EVENT, body);
+        }
+
+        void xid () {
+            std::string body;
+            put_le (body, m_xid++, 8);
+            event (XID_EVENT, body);
+        }
+
+        const char* database () {
+            return DATABASES[m_random.between (0, DATABASE_COUNT - 1)];
+        }
+
+        // Filler of the requested length for statements and strings
+        std::string text (size_t len) {
+            static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+            std::string s (len, 'x');
+            for (size_t i = 0; i < len; ++i) {
+                s[i] = letters[m_random.between (0, sizeof (letters) - 2)];
+            }
+            return s;
+        }
+
+        std::string statement () {
+            std::string s = (boost::format ("INSERT INTO %s VALUES (%llu, '")
+                             % TABLES[m_random.between (0, TABLE_COUNT - 1)]
+                             % (unsigned long long)m_insert_id).str ();
+            size_t len = m_random.between (m_opts.min_statement, m_opts.max_statement);
+            s += text (len > s.size () + 2 ? len - s.size () - 2 : 0);
+            s += "')";
+            return s;
+        }
+
+        void query_transaction () {
+            std::string db = database ();
+            query (db, "BEGIN");
+            if (m_random.chance (0.25)) {
+                std::string body;
+                // INSERT_ID
+                body += (char)2;
+                put_le (body, m_insert_id, 8);
+                event (INTVAR_EVENT, body);
+            } else if (m_random.chance (0.1)) {
+                std::string body;
+                put_le (body, m_random.next (), 8);
+                put_le (body, m_random.next (), 8);
+                event (RAND_EVENT, body);
+            }
+            // Mostly quick, the odd slow one and the odd failure
+            uint32_t query_time = m_random.chance (0.9) ? 0 : (uint32_t)m_random.between (1, 120);
+            uint16_t error_code = m_random.chance (0.98) ? 0 : 1062;
+            query (db, statement (), query_time, error_code);
+            ++m_insert_id;
+            xid ();
+        }
+
+        void ddl () {
+            query (database (), (boost::format ("ALTER TABLE %s ADD COLUMN c%llu INT")
+                                 % TABLES[m_random.between (0, TABLE_COUNT - 1)]
+                                 % (unsigned long long)m_events).str ());
+        }
+
+        void row_image (std::string &body) {
+            bool null_name = m_random.chance (0.1);
+            // NULL bitmap, only name can be
+            body += (char)(null_name ? 4 : 0);
+            put_le (body, m_insert_id++, 4);
+            put_le (body, m_random.next (), 8);
+            if (!null_name) {
+                size_t len = m_random.between (0, std::min<size_t> (255, m_opts.max_statement));
+                body += (char)len;
+                body += text (len);
+            }
+        }
+
+        void rows_transaction () {
+            size_t d = m_random.between (0, DATABASE_COUNT - 1);
+            size_t t = m_random.between (0, TABLE_COUNT - 1);
+            uint64_t table_id = 100 + d * TABLE_COUNT + t;
+            query (DATABASES[d], "BEGIN");
+
+            std::string map;
+            put_le (map, table_id, 6);
+            put_le (map, 1, 2);
+            map += (char)strlen (DATABASES[d]);
+            map += DATABASES[d];
+            map += '\0';
+            map += (char)strlen (TABLES[t]);
+            map += TABLES[t];
+            map += '\0';
+            put_packed (map, COLUMN_COUNT);
+            map.append ((const char*)COLUMN_TYPES, COLUMN_COUNT);
+            // VARCHAR(255) has 2 bytes of metadata, its max length
+            put_packed (map, 2);
+            put_le (map, 255, 2);
+            // nullable: name
+            map += (char)4;
+            event (TABLE_MAP_EVENT, map);
+
+            static const uint8_t types[] = { WRITE_ROWS_EVENT, WRITE_ROWS_EVENT, UPDATE_ROWS_EVENT, DELETE_ROWS_EVENT };
+            uint8_t type_code = types[m_random.between (0, 3)];
+            size_t rows = m_random.between (1, m_opts.max_rows ? m_opts.max_rows : 1);
+            std::string body;
+            put_le (body, table_id, 6);
+            // STMT_END_F
+            put_le (body, 1, 2);
+            // v2 extra data, just its own length
+            put_le (body, 2, 2);
+            put_packed (body, COLUMN_COUNT);
+            body += (char)((1 << COLUMN_COUNT) - 1);
+            if (type_code == UPDATE_ROWS_EVENT) {
+                body += (char)((1 << COLUMN_COUNT) - 1);
+            }
+            for (size_t r = 0; r < rows; ++r) {
+                row_image (body);
+                if (type_code == UPDATE_ROWS_EVENT) {
+                    row_image (body);
+                }
+            }
+            event (type_code, body);
+            xid ();
+        }
+
+        FILE *m_out;
+        options m_opts;
+        random_source m_random;
+        uint64_t m_position;
+        uint64_t m_events;
+        uint64_t m_corrupted;
+        uint32_t m_time;
+        uint64_t m_xid;
+        uint64_t m_insert_id;
+        uint64_t m_gno;
+        uint64_t m_sequence;
+    };
+
+    // 10k, 64M, 2G
+    uint64_t parse_size (const char *arg) {
+        char *end;
+        uint64_t n = strtoull (arg, &end, 10);
+        switch (*end) {
+        case 'k': case 'K': return n << 10;
+        case 'm': case 'M': return n << 20;
+        case 'g': case 'G': return n << 30;
+        default: return n;
+        }
+    }
+
+    // query=60,rows=30,ddl=10
+    bool parse_mix (const char *arg, options &opts) {
+        opts.query_weight = opts.rows_weight = opts.ddl_weight = 0;
+        std::string mix (arg);
+        size_t start = 0;
+        while (start < mix.size ()) {
+            size_t comma = mix.find (',', start);
+            std::string part = mix.substr (start, comma == std::string::npos ? std::string::npos : comma - start);
+            size_t eq = part.find ('=');
+            if (eq == std::string::npos) {
+                return false;
+            }
+            std::string name = part.substr (0, eq);
+            unsigned weight = (unsigned)atoi (part.c_str () + eq + 1);
+            if (name == "query") {
+                opts.query_weight = weight;
+            } else if (name == "rows") {
+                opts.rows_weight = weight;
+            } else if (name == "ddl") {
+                opts.ddl_weight = weight;
+            } else {
+                return false;
+            }
+            if (comma == std::string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+        return opts.query_weight + opts.rows_weight + opts.ddl_weight > 0;
+    }
+
+    // uuid:gno, the uuid with or without its dashes
+    bool parse_gtid (const char *arg, options &opts) {
+        std::string sid;
+        int digits = 0;
+        unsigned int byte = 0;
+        const char *p = arg;
+        for (; *p && *p != ':'; ++p) {
+            if (*p == '-') {
+                continue;
+            }
+            char c = (char)tolower ((unsigned char)*p);
+            int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if (v < 0) {
+                return false;
+            }
+            byte = (byte << 4) | v;
+            if (++digits % 2 == 0) {
+                sid += (char)byte;
+                byte = 0;
+            }
+        }
+        if (sid.size () != 16 || *p != ':' || !isdigit ((unsigned char)p[1])) {
+            return false;
+        }
+        opts.sid = sid;
+        opts.first_gno = strtoull (p + 1, NULL, 10);
+        return opts.first_gno > 0;
+    }
+
+    void usage (void) {
+        fprintf (stderr, "Usage: ybinlogp-gen [options] outfile\n");
+        fprintf (stderr, "\n");
+        fprintf (stderr, "Writes a synthetic binlog, the same one every time for the same options.\n");
+        fprintf (stderr, "\t-n Write about this many events (default 100000)\n");
+        fprintf (stderr, "\t-b Write until the file is this big instead, eg. 512M or 10G\n");
+        fprintf (stderr, "\t-m Transaction mix, as weights (default query=60,rows=30,ddl=10)\n");
+        fprintf (stderr, "\t\tquery: BEGIN, maybe an INTVAR or RAND, an INSERT, XID\n");
+        fprintf (stderr, "\t\trows: BEGIN, TABLE_MAP, a v2 write/update/delete rows event, XID\n");
+        fprintf (stderr, "\t\tddl: an ALTER TABLE on its own\n");
+        fprintf (stderr, "\t-l Statement length range, min-max bytes (default 20-200)\n");
+        fprintf (stderr, "\t-r Most rows per row event (default 20)\n");
+        fprintf (stderr, "\t-c Corrupt this fraction of events, eg. 0.001: flipped bytes or bogus lengths\n");
+        fprintf (stderr, "\t-k Write CRC32 checksums (binlog_checksum=CRC32)\n");
+        fprintf (stderr, "\t-s Random seed (default 1)\n");
+        fprintf (stderr, "\t-t Timestamp of the first event (default 1600000000)\n");
+        fprintf (stderr, "\t-p Transactions per second of binlog time (default 100)\n");
+        fprintf (stderr, "\t-R End with a ROTATE_EVENT to this file\n");
+        fprintf (stderr, "\t-g Start every transaction with a GTID_LOG_EVENT, numbered from this uuid:number on,\n");
+        fprintf (stderr, "\t\tafter a PREVIOUS_GTIDS_LOG_EVENT with the ones before it\n");
+        fprintf (stderr, "\t\tybinlogp-gen -b 1G -k -m query=20,rows=80 mysql-bin.000001\n");
+    }
+}
+
+
+int main (int argc, char **argv) {
+    options opts;
+    int opt;
+    while ((opt = getopt (argc, argv, "n:b:m:l:r:c:ks:t:p:R:g:")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.events = strtoull (optarg, NULL, 10);
+            break;
+        case 'b':
+            opts.bytes = parse_size (optarg);
+            break;
+        case 'm':
+            if (!parse_mix (optarg, opts)) {
+                fprintf (stderr, "Bad transaction mix %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l': {
+            unsigned long lo = 0, hi = 0;
+            if (sscanf (optarg, "%lu-%lu", &lo, &hi) != 2 || lo > hi) {
+                fprintf (stderr, "Bad statement length range %s\n", optarg);
+                return 1;
+            }
+            opts.min_statement = lo;
+            opts.max_statement = hi;
+            break;
+        }
+        case 'r':
+            opts.max_rows = strtoul (optarg, NULL, 10);
+            break;
+        case 'c':
+            opts.corrupt = atof (optarg);
+            break;
+        case 'k':
+            opts.checksums = true;
+            break;
+        case 's':
+            opts.seed = strtoull (optarg, NULL, 10);
+            break;
+        case 't':
+            opts.start_time = (uint32_t)strtoul (optarg, NULL, 10);
+            break;
+        case 'p':
+            opts.rate = (unsigned)strtoul (optarg, NULL, 10);
+            break;
+        case 'R':
+            opts.rotate_to = optarg;
+            break;
+        case 'g':
+            if (!parse_gtid (optarg, opts)) {
+                fprintf (stderr, "Bad GTID %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage ();
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage ();
+        return 1;
+    }
+
+    FILE *out = fopen (argv[optind], "wb");
+    if (out == NULL) {
+        fprintf (stderr, "%s: %s\n", argv[optind], strerror (errno));
+        return 1;
+    }
+    generator gen (out, opts);
+    try {
+        gen.run ();
+        if (fclose (out) != 0) {
+            throw std::runtime_error (std::string ("close: ") + strerror (errno));
+        }
+    } catch (std::exception &e) {
+        fprintf (stderr, "%s: %s\n", argv[optind], e.what ());
+        return 1;
+    }
+    fprintf (stderr, "Wrote %llu events, %llu bytes (%llu corrupted) to %s\n",
+             (unsigned long long)gen.events (), (unsigned long long)gen.bytes (),
+             (unsigned long long)gen.corrupted (), argv[optind]);
+    if (!opts.sid.empty ()) {
+        fprintf (stderr, "The next file's GTIDs start at %llu\n", (unsigned long long)gen.next_gno ());
+    }
+    return 0;
+}
@@ -0,0 +1,747 @@
+/*
+ * ybinlogp-serve: stands in for the replication side of a mysql
+ * server, handing binlog files to whatever logs in and asks for them
+ * with COM_BINLOG_DUMP (ybinlogp mysql://, say). It's for trying the
+ * client without a server: one client at a time, on localhost, and
+ * only the handful of commands a replica starts with.
+ *
+ * (C) 2010 Yelp, Inc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/scoped_ptr.hpp>
+
+namespace {
+    enum e_event_types {
+        ROTATE_EVENT=4,
+        FORMAT_DESCRIPTION_EVENT=15
+    };
+
+    const size_t EVENT_HEADER_SIZE = 19;
+    const char BINLOG_MAGIC[4] = {(char)0xfe, 0x62, 0x69, 0x6e};
+    // Where the header fields are
+    const size_t TYPE_CODE_AT = 4;
+    const size_t SERVER_ID_AT = 5;
+    const size_t LENGTH_AT = 9;
+    const size_t NEXT_POSITION_AT = 13;
+    const uint16_t LOG_EVENT_ARTIFICIAL_F = 0x20;
+
+    const uint8_t COM_QUIT = 0x01;
+    const uint8_t COM_QUERY = 0x03;
+    const uint8_t COM_PING = 0x0e;
+    const uint8_t COM_BINLOG_DUMP = 0x12;
+    const uint8_t COM_REGISTER_SLAVE = 0x15;
+    const uint16_t BINLOG_DUMP_NON_BLOCK = 1;
+    const uint32_t CAPABILITIES = 0x00000001 | 0x00000200 | 0x00002000 | 0x00008000 | 0x00080000;
+    const size_t MAX_PACKET = 0xffffff;
+    const size_t SCRAMBLE_LEN = 20;
+    const char *SERVER_VERSION = "5.6.99-ybinlogp-serve";
+
+    // Events are sent in writes of about this much, and read from
+    // the file this much at a time.
+    const size_t OUTPUT_BATCH = 1024 * 1024;
+    const size_t READ_CHUNK = 1024 * 1024;
+    // How often a dump that's caught up looks for more
+    const int FOLLOW_POLL_MS = 100;
+
+    uint32_t crc32 (uint32_t crc, const unsigned char *p, size_t len) {
+        static uint32_t table[256];
+        if (table[1] == 0) {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                }
+                table[i] = c;
+            }
+        }
+        crc = ~crc;
+        for (size_t i = 0; i < len; ++i) {
+            crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    inline uint32_t rotl32 (uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    std::string sha1 (const std::string &message) {
+        uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+        std::string m (message);
+        uint64_t bits = (uint64_t)message.size () * 8;
+        m += (char)0x80;
+        while (m.size () % 64 != 56) {
+            m += '\0';
+        }
+        for (int i = 7; i >= 0; --i) {
+            m += (char)(bits >> (i * 8));
+        }
+        for (size_t block = 0; block < m.size (); block += 64) {
+            const unsigned char *p = (const unsigned char*)m.data () + block;
+            uint32_t w[80];
+            for (int i = 0; i < 16; ++i) {
+                w[i] = (uint32_t)p[i * 4] << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 | p[i * 4 + 3];
+            }
+            for (int i = 16; i < 80; ++i) {
+                w[i] = rotl32 (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+            }
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for (int i = 0; i < 80; ++i) {
+                uint32_t f, k;
+                if (i < 20) {
+                    f = (b & c) | (~b & d);
+                    k = 0x5A827999;
+                } else if (i < 40) {
+                    f = b ^ c ^ d;
+                    k = 0x6ED9EBA1;
+                } else if (i < 60) {
+                    f = (b & c) | (b & d) | (c & d);
+                    k = 0x8F1BBCDC;
+                } else {
+                    f = b ^ c ^ d;
+                    k = 0xCA62C1D6;
+                }
+                uint32_t t = rotl32 (a, 5) + f + e + k + w[i];
+                e = d;
+                d = c;
+                c = rotl32 (b, 30);
+                b = a;
+                a = t;
+            }
+            h[0] += a;
+            h[1] += b;
+            h[2] += c;
+            h[3] += d;
+            h[4] += e;
+        }
+        std::string digest;
+        for (int i = 0; i < 5; ++i) {
+            for (int j = 3; j >= 0; --j) {
+                digest += (char)(h[i] >> (j * 8));
+            }
+        }
+        return digest;
+    }
+
+    // What a client that knows password answers scramble with
+    std::string native_password (const std::string &password, const std::string &scramble) {
+        if (password.empty ()) {
+            return std::string ();
+        }
+        std::string stage1 = sha1 (password);
+        std::string token = sha1 (scramble + sha1 (stage1));
+        for (size_t i = 0; i < token.size (); ++i) {
+            token[i] ^= stage1[i];
+        }
+        return token;
+    }
+
+    void put_le (std::string &out, uint64_t v, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            out += (char)(v >> (8 * i));
+        }
+    }
+
+    uint64_t get_le (const std::string &in, size_t at, size_t n) {
+        uint64_t v = 0;
+        for (size_t i = n; i > 0; --i) {
+            v = v << 8 | (unsigned char)in[at + i - 1];
+        }
+        return v;
+    }
+
+    void put_lenenc_string (std::string &out, const std::string &s) {
+        // Nothing we send is anywhere near 251 bytes
+        out += (char)s.size ();
+        out += s;
+    }
+
+    std::string base_name (const std::string &path) {
+        size_t slash = path.rfind ('/');
+        return slash == std::string::npos ? path : path.substr (slash + 1);
+    }
+
+    std::string lower (std::string s) {
+        for (size_t i = 0; i < s.size (); ++i) {
+            s[i] = tolower ((unsigned char)s[i]);
+        }
+        return s;
+    }
+
+    struct options {
+        options () : port (3307), check_password (false), once (false) { }
+
+        uint16_t port;
+        std::string user;
+        std::string password;
+        bool check_password;
+        // plugin to ask for with an auth switch, none if empty
+        std::string switch_plugin;
+        bool once;
+        std::vector<std::string> files;
+    };
+
+    // A binlog read an event at a time, through a buffer
+    class binlog_file {
+    public:
+        explicit binlog_file (const std::string &path)
+            : m_path (path), m_fd (::open (path.c_str (), O_RDONLY)), m_buffer_offset (0), m_checksummed (false)
+        {
+            if (m_fd < 0) {
+                throw std::runtime_error (path + ": " + strerror (errno));
+            }
+            char magic[sizeof (BINLOG_MAGIC)];
+            if (::pread (m_fd, magic, sizeof (magic), 0) != (ssize_t)sizeof (magic) ||
+                memcmp (magic, BINLOG_MAGIC, sizeof (magic)) != 0 ||
+                !read (sizeof (BINLOG_MAGIC), m_format) ||
+                (unsigned char)m_format[TYPE_CODE_AT] != FORMAT_DESCRIPTION_EVENT) {
+                ::close (m_fd);
+                throw std::runtime_error (path + ": not a binlog");
+            }
+            // Checksummed if the FDE ends in its own checksum
+            size_t n = m_format.size () - 4;
+            m_checksummed = crc32 (0, (const unsigned char*)m_format.data (), n) == get_le (m_format, n, 4);
+        }
+
+        ~binlog_file () {
+            ::close (m_fd);
+        }
+
+        /** The event at offset, false if there isn't all of one there (yet). */
+        bool read (uint64_t offset, std::string &event) {
+            if (!fill (offset, EVENT_HEADER_SIZE)) {
+                return false;
+            }
+            size_t at = offset - m_buffer_offset;
+            uint32_t length = get_le (m_buffer, at + LENGTH_AT, 4);
+            if (length < EVENT_HEADER_SIZE || !fill (offset, length)) {
+                return false;
+            }
+            at = offset - m_buffer_offset;
+            event.assign (m_buffer, at, length);
+            return true;
+        }
+
+        /** Whether an event starts at offset, by following the chain
+            from the first one. Where the next event will go counts. */
+        bool starts_event (uint64_t offset) {
+            uint64_t at = sizeof (BINLOG_MAGIC);
+            while (at < offset) {
+                if (!fill (at, EVENT_HEADER_SIZE)) {
+                    return false;
+                }
+                uint32_t length = get_le (m_buffer, at - m_buffer_offset + LENGTH_AT, 4);
+                if (length < EVENT_HEADER_SIZE) {
+                    return false;
+                }
+                at += length;
+            }
+            return at == offset;
+        }
+
+        uint64_t size () const {
+            struct stat st;
+            return ::fstat (m_fd, &st) == 0 ? st.st_size : 0;
+        }
+
+        const std::string& path () const { return m_path; }
+        const std::string& format () const { return m_format; }
+        bool checksummed () const { return m_checksummed; }
+
+    private:
+        // Have [offset, offset + len) in m_buffer
+        bool fill (uint64_t offset, size_t len) {
+            if (offset >= m_buffer_offset && offset + len <= m_buffer_offset + m_buffer.size ()) {
+                return true;
+            }
+            m_buffer.resize (std::max (len, READ_CHUNK));
+            ssize_t n = ::pread (m_fd, &m_buffer[0], m_buffer.size (), offset);
+            if (n < 0) {
+                throw std::runtime_error (m_path + ": " + strerror (errno));
+            }
+            m_buffer.resize (n);
+            m_buffer_offset = offset;
+            return (size_t)n >= len;
+        }
+
+        std::string m_path;
+        int m_fd;
+        std::string m_buffer;
+        uint64_t m_buffer_offset;
+        std::string m_format;
+        bool m_checksummed;
+    };
+
+    // One client, from login to hanging up
+    class connection {
+    public:
+        connection (int fd, const options &opts) : m_fd (fd), m_opts (opts), m_seq (0), m_checksum_aware (false) { }
+
+        void serve () {
+            if (!login ()) {
+                return;
+            }
+            std::string command;
+            for (;;) {
+                m_seq = 0;
+                if (!read_packet (command) || command.empty () || (uint8_t)command[0] == COM_QUIT) {
+                    return;
+                }
+                switch ((uint8_t)command[0]) {
+                case COM_PING:
+                case COM_REGISTER_SLAVE:
+                    send_ok ();
+                    break;
+                case COM_QUERY:
+                    query (command.substr (1));
+                    break;
+                case COM_BINLOG_DUMP:
+                    // The connection's the dump's from here on
+                    dump (command);
+                    return;
+                default:
+                    send_error (1047, "08S01", "Unknown command");
+                    break;
+                }
+                flush ();
+            }
+        }
+
+    private:
+        bool read_exactly (char *buf, size_t len) {
+            while (len > 0) {
+                ssize_t n = ::recv (m_fd, buf, len, 0);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                buf += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        // The next command, false if the client went away
+        bool read_packet (std::string &payload) {
+            payload.clear ();
+            for (;;) {
+                unsigned char h[4];
+                if (!read_exactly ((char*)h, sizeof (h))) {
+                    return false;
+                }
+                size_t len = h[0] | h[1] << 8 | h[2] << 16;
+                m_seq = h[3] + 1;
+                size_t at = payload.size ();
+                payload.resize (at + len);
+                if (len && !read_exactly (&payload[at], len)) {
+                    return false;
+                }
+                if (len < MAX_PACKET) {
+                    return true;
+                }
+            }
+        }
+
+        void queue_packet (const char *payload, size_t len) {
+            // Anything MAX_PACKET or longer goes in pieces, ending
+            // with a shorter (maybe empty) one.
+            for (;;) {
+                size_t n = std::min (len, MAX_PACKET);
+                put_le (m_out, n, 3);
+                m_out += (char)m_seq++;
+                m_out.append (payload, n);
+                payload += n;
+                len -= n;
+                if (n < MAX_PACKET) {
+                    return;
+                }
+            }
+        }
+
+        void queue_packet (const std::string &payload) {
+            queue_packet (payload.data (), payload.size ());
+        }
+
+        void flush () {
+            size_t sent = 0;
+            while (sent < m_out.size ()) {
+                ssize_t n = ::send (m_fd, m_out.data () + sent, m_out.size () - sent, 0);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    throw std::runtime_error (std::string ("send: ") + strerror (errno));
+                }
+                sent += n;
+            }
+            m_out.clear ();
+        }
+
+        void send_ok () {
+            queue_packet (std::string ("\x00\x00\x00\x02\x00\x00\x00", 7));
+        }
+
+        void send_eof () {
+            queue_packet (std::string ("\xfe\x00\x00\x02\x00", 5));
+        }
+
+        void send_error (uint16_t code, const char *state, const std::string &message) {
+            std::string err (1, (char)0xff);
+            put_le (err, code, 2);
+            err += '#';
+            err += state;
+            err += message;
+            queue_packet (err);
+        }
+
+        std::string make_scramble () {
+            // Printable and no NULs, like a server's
+            std::string scramble;
+            for (size_t i = 0; i < SCRAMBLE_LEN; ++i) {
+                scramble += (char)('!' + rand () % 90);
+            }
+            return scramble;
+        }
+
+        bool login () {
+            std::string scramble = make_scramble ();
+            std::string greeting (1, (char)10);
+            greeting += SERVER_VERSION;
+            greeting += '\0';
+            put_le (greeting, getpid (), 4);
+            greeting.append (scramble, 0, 8);
+            greeting += '\0';
+            put_le (greeting, CAPABILITIES & 0xffff, 2);
+            // utf8_general_ci, SERVER_STATUS_AUTOCOMMIT
+            greeting += (char)33;
+            put_le (greeting, 2, 2);
+            put_le (greeting, CAPABILITIES >> 16, 2);
+            greeting += (char)(SCRAMBLE_LEN + 1);
+            greeting.append (10, '\0');
+            greeting.append (scramble, 8, std::string::npos);
+            greeting += '\0';
+            greeting += "mysql_native_password";
+            greeting += '\0';
+            queue_packet (greeting);
+            flush ();
+
+            // Capabilities, max packet, charset, 23 reserved bytes,
+            // user, the token and the plugin it's for.
+            std::string response;
+            if (!read_packet (response) || response.size () < 32 + 1) {
+                return false;
+            }
+            size_t nul = response.find ('\0', 32);
+            if (nul == std::string::npos || nul + 1 >= response.size ()) {
+                return false;
+            }
+            std::string user = response.substr (32, nul - 32);
+            size_t token_len = (unsigned char)response[nul + 1];
+            std::string token = response.substr (nul + 2, token_len);
+
+            if (!m_opts.switch_plugin.empty ()) {
+                scramble = make_scramble ();
+                std::string request (1, (char)0xfe);
+                request += m_opts.switch_plugin;
+                request += '\0';
+                request += scramble;
+                request += '\0';
+                queue_packet (request);
+                flush ();
+                if (!read_packet (token)) {
+                    return false;
+                }
+            }
+
+            if ((!m_opts.user.empty () && user != m_opts.user) ||
+                (m_opts.check_password && token != native_password (m_opts.password, scramble))) {
+                send_error (1045, "28000", "Access denied for user '" + user + "'");
+                flush ();
+                return false;
+            }
+            send_ok ();
+            flush ();
+            return true;
+        }
+
+        // All a replica asks before a dump
+        void query (const std::string &statement) {
+            std::string s = lower (statement);
+            if (s.compare (0, 3, "set") == 0) {
+                if (s.find ("@master_binlog_checksum") != std::string::npos) {
+                    m_checksum_aware = true;
+                }
+                send_ok ();
+            } else if (s.compare (0, 6, "select") == 0 && s.find ("@@global.binlog_checksum") != std::string::npos) {
+                binlog_file first (m_opts.files[0]);
+                std::string column ("\x03" "def");
+                put_lenenc_string (column, "");
+                put_lenenc_string (column, "");
+                put_lenenc_string (column, "");
+                put_lenenc_string (column, "@@global.binlog_checksum");
+                put_lenenc_string (column, "");
+                // charset, length, VAR_STRING, flags, decimals, filler
+                column += (char)0x0c;
+                put_le (column, 33, 2);
+                put_le (column, 15, 4);
+                column += (char)0xfd;
+                put_le (column, 0, 2);
+                column += '\0';
+                put_le (column, 0, 2);
+                std::string row;
+                put_lenenc_string (row, first.checksummed () ? "CRC32" : "NONE");
+                queue_packet (std::string (1, (char)1));
+                queue_packet (column);
+                send_eof ();
+                queue_packet (row);
+                send_eof ();
+            } else {
+                send_error (1064, "42000", "ybinlogp-serve only knows SELECT @@global.binlog_checksum and SET");
+            }
+        }
+
+        // The rotate a server starts a dump with, naming the file
+        std::string rotate_event (const binlog_file &file, uint64_t position) {
+            std::string name = base_name (file.path ());
+            std::string ev;
+            put_le (ev, 0, 4);
+            ev += (char)ROTATE_EVENT;
+            put_le (ev, get_le (file.format (), SERVER_ID_AT, 4), 4);
+            put_le (ev, EVENT_HEADER_SIZE + 8 + name.size () + (file.checksummed () ? 4 : 0), 4);
+            put_le (ev, 0, 4);
+            put_le (ev, LOG_EVENT_ARTIFICIAL_F, 2);
+            put_le (ev, position, 8);
+            ev += name;
+            if (file.checksummed ()) {
+                put_le (ev, crc32 (0, (const unsigned char*)ev.data (), ev.size ()), 4);
+            }
+            return ev;
+        }
+
+        void queue_event (const std::string &event) {
+            m_packet.assign (1, '\0');
+            m_packet += event;
+            queue_packet (m_packet);
+        }
+
+        // Did the client go away in the next ms milliseconds?
+        bool client_gone (int ms) {
+            struct pollfd pfd;
+            pfd.fd = m_fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            return ::poll (&pfd, 1, ms) != 0;
+        }
+
+        void dump (const std::string &request) {
+            if (request.size () < 11) {
+                send_error (1064, "42000", "Malformed COM_BINLOG_DUMP");
+                flush ();
+                return;
+            }
+            uint64_t position = get_le (request, 1, 4);
+            uint16_t flags = get_le (request, 5, 2);
+            std::string name = request.substr (11);
+            size_t index = 0;
+            if (!name.empty ()) {
+                while (index < m_opts.files.size () && base_name (m_opts.files[index]) != name) {
+                    ++index;
+                }
+                if (index == m_opts.files.size ()) {
+                    send_error (1236, "HY000", "Could not find first log file name in binary log index file");
+                    flush ();
+                    return;
+                }
+            }
+            position = std::max<uint64_t> (position, sizeof (BINLOG_MAGIC));
+            boost::scoped_ptr<binlog_file> file (new binlog_file (m_opts.files[index]));
+            if (file->checksummed () && !m_checksum_aware) {
+                send_error (1236, "HY000", "Slave can not handle replication events with the checksum that master is configured to log");
+                flush ();
+                return;
+            }
+            if (position > file->size ()) {
+                send_error (1236, "HY000", "Client requested master to start replication from position > file size");
+                flush ();
+                return;
+            }
+            // A server reading from the middle of an event finds
+            // garbage and gives up, so don't stream it.
+            if (!file->starts_event (position)) {
+                send_error (1236, "HY000", "Client requested master to start replication from impossible position");
+                flush ();
+                return;
+            }
+
+            queue_event (rotate_event (*file, position));
+            if (position > sizeof (BINLOG_MAGIC)) {
+                // The FDE as if it came from nowhere
+                std::string format = file->format ();
+                format.replace (NEXT_POSITION_AT, 4, 4, '\0');
+                if (file->checksummed ()) {
+                    size_t n = format.size () - 4;
+                    format.resize (n);
+                    put_le (format, crc32 (0, (const unsigned char*)format.data (), n), 4);
+                }
+                queue_event (format);
+            }
+            std::string event;
+            bool rotated = false;
+            for (;;) {
+                if (file->read (position, event)) {
+                    queue_event (event);
+                    position += event.size ();
+                    rotated = (unsigned char)event[TYPE_CODE_AT] == ROTATE_EVENT;
+                    if (m_out.size () >= OUTPUT_BATCH) {
+                        flush ();
+                    }
+                    continue;
+                }
+                flush ();
+                if (rotated && index + 1 < m_opts.files.size ()) {
+                    file.reset (new binlog_file (m_opts.files[++index]));
+                    position = sizeof (BINLOG_MAGIC);
+                    rotated = false;
+                    continue;
+                }
+                if (flags & BINLOG_DUMP_NON_BLOCK) {
+                    send_eof ();
+                    flush ();
+                    return;
+                }
+                // Wait for the file to grow
+                if (client_gone (FOLLOW_POLL_MS)) {
+                    return;
+                }
+            }
+        }
+
+        int m_fd;
+        const options &m_opts;
+        uint8_t m_seq;
+        // packets not sent yet
+        std::string m_out;
+        std::string m_packet;
+        bool m_checksum_aware;
+    };
+
+    void usage (void) {
+        fprintf (stderr, "Usage: ybinlogp-serve [options] binlog [binlog ...]\n");
+        fprintf (stderr, "\n");
+        fprintf (stderr, "Serves the binlogs, in order, to replication clients on 127.0.0.1, one at a time.\n");
+        fprintf (stderr, "A dump moves on to the next binlog after a ROTATE_EVENT, and if the client\n");
+        fprintf (stderr, "didn't ask for a non-blocking dump, waits for the last one to grow.\n");
+        fprintf (stderr, "\t-p Port to listen on (default 3307, 0 picks one and prints it)\n");
+        fprintf (stderr, "\t-u Only let this user in\n");
+        fprintf (stderr, "\t-P Only let clients that know this password in (mysql_native_password)\n");
+        fprintf (stderr, "\t-s Ask clients to switch to this auth plugin after the handshake\n");
+        fprintf (stderr, "\t-1 Exit after the first client\n");
+        fprintf (stderr, "\t\tybinlogp-serve -1 -u repl -P secret mysql-bin.000001 mysql-bin.000002\n");
+    }
+}
+
+
+int main (int argc, char **argv) {
+    options opts;
+    int opt;
+    while ((opt = getopt (argc, argv, "p:u:P:s:1")) != -1) {
+        switch (opt) {
+        case 'p':
+            opts.port = (uint16_t)strtoul (optarg, NULL, 10);
+            break;
+        case 'u':
+            opts.user = optarg;
+            break;
+        case 'P':
+            opts.password = optarg;
+            opts.check_password = true;
+            break;
+        case 's':
+            opts.switch_plugin = optarg;
+            break;
+        case '1':
+            opts.once = true;
+            break;
+        default:
+            usage ();
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage ();
+        return 1;
+    }
+    try {
+        for (int i = optind; i < argc; ++i) {
+            binlog_file check (argv[i]);
+            opts.files.push_back (argv[i]);
+        }
+    } catch (std::exception &e) {
+        fprintf (stderr, "%s\n", e.what ());
+        return 1;
+    }
+
+    signal (SIGPIPE, SIG_IGN);
+    srand (time (NULL) ^ getpid ());
+    int listener = ::socket (AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    ::setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    struct sockaddr_in addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (opts.port);
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof (addr);
+    if (listener < 0 || ::bind (listener, (struct sockaddr*)&addr, sizeof (addr)) < 0 || ::listen (listener, 4) < 0 ||
+        ::getsockname (listener, (struct sockaddr*)&addr, &addr_len) < 0) {
+        fprintf (stderr, "listen on port %u: %s\n", opts.port, strerror (errno));
+        return 1;
+    }
+    fprintf (stderr, "Serving %lu binlogs on 127.0.0.1:%u\n", (unsigned long)opts.files.size (), ntohs (addr.sin_port));
+
+    for (;;) {
+        int fd = ::accept (listener, NULL, NULL);
+        if (fd < 0 && errno == EINTR) {
+            continue;
+        }
+        if (fd < 0) {
+            fprintf (stderr, "accept: %s\n", strerror (errno));
+            return 1;
+        }
+        try {
+            connection client (fd, opts);
+            client.serve ();
+        } catch (std::exception &e) {
+            fprintf (stderr, "%s\n", e.what ());
+        }
+        ::close (fd);
+        if (opts.once) {
+            break;
+        }
+    }
+    ::close (listener);
+    return 0;
+}
@@ -12,14 +12,47 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
 #include <alloca.h>
+#include <pthread.h>
+#include <glob.h>
+#include <getopt.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#if defined(YBINLOGP_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(DARWIN)
+#include <sys/event.h>
+#else
+#include <sys/inotify.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Built for any x86, the PCLMUL CRC32 is picked at runtime
+#define YBINLOGP_CRC32_PCLMUL 1
+#include <cpuid.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
 
 #include "ybinlogp.hh"
 
@@ -31,6 +64,9 @@
 #include <boost/format.hpp>
 #include <boost/bind.hpp>
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <deque>
 
 // Python bindings
 
@@ -60,6 +96,586 @@ namespace {
         }
         return new T (*entry.get_buffer ());
     }
+
+    // Columns as plain python values: None, int, float, bytes for
+    // strings and blobs and str for the ones we formatted.
+    boost::python::object column_object (const yelp::binlog::column_value &v) {
+        using namespace boost::python;
+        switch (v.kind) {
+        case yelp::binlog::column_value::INT:
+            return object ((long long)v.int_value);
+        case yelp::binlog::column_value::UINT:
+            return object ((unsigned long long)v.uint_value);
+        case yelp::binlog::column_value::DOUBLE:
+            return object (v.double_value);
+        case yelp::binlog::column_value::BYTES:
+            return object (handle<> (PyBytes_FromStringAndSize (v.string_value.data (), v.string_value.size ())));
+        case yelp::binlog::column_value::TEXT:
+            return object (v.string_value);
+        default:
+            return object ();
+        }
+    }
+
+    boost::python::object row_value (const yelp::binlog::rows_entry::row &row, size_t column) {
+        return column_object (row.value (column));
+    }
+
+    boost::python::list format_description_post_header_len (const yelp::binlog::format_description_entry &format) {
+        boost::python::list lengths;
+        for (size_t i = 0; i < format.post_header_len.size (); ++i) {
+            lengths.append ((int)format.post_header_len[i]);
+        }
+        return lengths;
+    }
+
+    boost::python::list table_map_column_types (const yelp::binlog::table_map_entry &table) {
+        boost::python::list types;
+        for (size_t c = 0; c < table.columns (); ++c) {
+            types.append ((int)table.column_types[c]);
+        }
+        return types;
+    }
+
+    boost::python::object table_map_cache_find (const yelp::table_map_cache &tables, uint64_t table_id) {
+        boost::shared_ptr<const yelp::binlog::table_map_entry> table = tables.find (table_id);
+        return table ? boost::python::object (*table) : boost::python::object ();
+    }
+
+    bool table_map_cache_update (yelp::table_map_cache &tables, const yelp::binlog::entry &entry) {
+        return tables.update (*entry.get_buffer ());
+    }
+
+    bool statement_search_matches (const yelp::statement_search &search, const yelp::binlog::entry &entry) {
+        return search.matches (*entry.get_buffer ());
+    }
+
+    void event_filter_set_search (yelp::event_filter &filter, boost::shared_ptr<yelp::statement_search> search) {
+        filter.set_search (search);
+    }
+
+    inline bool is_rows_event (uint8_t type_code);
+
+    // None for anything that isn't a row event
+    yelp::binlog::rows_entry* table_map_cache_rows (const yelp::table_map_cache &tables, const yelp::binlog::entry &entry) {
+        const event_buffer *ev = entry.get_buffer ();
+        if (!is_rows_event (ev->type_code)) {
+            return NULL;
+        }
+        return new yelp::binlog::rows_entry (*ev, tables);
+    }
+
+    // Lets other python threads run while it's around, and holds the
+    // binlog's lock if given one. Nothing that touches python objects
+    // may happen meanwhile.
+    class without_gil : boost::noncopyable {
+    public:
+        explicit without_gil (pthread_mutex_t *lock = NULL)
+            : m_state (PyEval_SaveThread ()), m_lock (lock)
+        {
+            if (m_lock) {
+                pthread_mutex_lock (m_lock);
+            }
+        }
+        ~without_gil () {
+            if (m_lock) {
+                pthread_mutex_unlock (m_lock);
+            }
+            PyEval_RestoreThread (m_state);
+        }
+
+    private:
+        PyThreadState *m_state;
+        pthread_mutex_t *m_lock;
+    };
+
+    // The fd of a python file, for yelp::binlog's constructor. As a
+    // temporary in py_binlog's initializer it holds the GIL released
+    // until the constructor is done, that reads the FDE.
+    struct fileno_without_gil : boost::noncopyable {
+        explicit fileno_without_gil (int fd) : fd (fd) { }
+        int fd;
+        without_gil unlocked;
+    };
+
+    // The binlog python sees, which also remembers how far
+    // read_batch has got. Reading happens without the GIL, so lock
+    // serializes whatever's using the binlog: iterators, batches and
+    // prefetchers share its allocator and end of file state.
+    struct py_binlog : yelp::binlog {
+        py_binlog (boost::python::object file)
+            : yelp::binlog (fileno_without_gil (boost::python::extract<int> (file.attr ("fileno") ())).fd),
+              m_batch_started (false)
+        {
+            pthread_mutex_init (&lock, NULL);
+        }
+        ~py_binlog () {
+            pthread_mutex_destroy (&lock);
+        }
+
+        pthread_mutex_t lock;
+        yelp::binlog::iterator m_batch_it;
+        bool m_batch_started;
+    };
+
+    // Typed arrays for the vectors, the format characters are the
+    // struct module's
+    inline const char* array_format (const std::vector<uint8_t>&) { return "B"; }
+    inline const char* array_format (const std::vector<uint16_t>&) { return "H"; }
+    inline const char* array_format (const std::vector<uint32_t>&) { return "I"; }
+    inline const char* array_format (const std::vector<uint64_t>&) { return "Q"; }
+
+    // A memoryview of a copy of v, one allocation however long v is,
+    // that numpy.asarray and friends take without another copy.
+    template <typename T>
+    boost::python::object array_object (const std::vector<T> &v) {
+        using namespace boost::python;
+        object bytes (handle<> (PyBytes_FromStringAndSize (v.empty () ? NULL : (const char*)&v[0], v.size () * sizeof (T))));
+        object view (handle<> (PyMemoryView_FromObject (bytes.ptr ())));
+        return view.attr ("cast") (array_format (v));
+    }
+
+    // Strings as one (offsets, bytes) pair for the lot
+    boost::python::object strings_object (const std::vector<uint64_t> &offsets, const std::string &data) {
+        using namespace boost::python;
+        return make_tuple (array_object (offsets), handle<> (PyBytes_FromStringAndSize (data.data (), data.size ())));
+    }
+
+    boost::python::dict binlog_read_batch (py_binlog &binlog, size_t n, boost::python::object fields) {
+        using namespace boost::python;
+        unsigned wanted = yelp::event_batch::ALL_FIELDS;
+        if (!fields.is_none ()) {
+            wanted = 0;
+            for (ssize_t i = 0, len = boost::python::len (fields); i < len; ++i) {
+                wanted |= yelp::event_batch::field_named (extract<std::string> (fields[i]));
+            }
+        }
+        yelp::event_batch batch (wanted);
+        {
+            without_gil unlocked (&binlog.lock);
+            if (!binlog.m_batch_started) {
+                binlog.m_batch_it = binlog.begin ();
+                binlog.m_batch_started = true;
+            }
+            batch.read (binlog.m_batch_it, binlog.end (), n);
+        }
+
+        dict result;
+        for (size_t i = 0; i < yelp::event_batch::FIELD_COUNT; ++i) {
+            const char *name = yelp::event_batch::field_name (i);
+            switch (wanted & (1 << i)) {
+            case yelp::event_batch::OFFSET:
+                result[name] = array_object (batch.offset);
+                break;
+            case yelp::event_batch::TIMESTAMP:
+                result[name] = array_object (batch.timestamp);
+                break;
+            case yelp::event_batch::TYPE_CODE:
+                result[name] = array_object (batch.type_code);
+                break;
+            case yelp::event_batch::SERVER_ID:
+                result[name] = array_object (batch.server_id);
+                break;
+            case yelp::event_batch::LENGTH:
+                result[name] = array_object (batch.length);
+                break;
+            case yelp::event_batch::NEXT_POSITION:
+                result[name] = array_object (batch.next_position);
+                break;
+            case yelp::event_batch::FLAGS:
+                result[name] = array_object (batch.flags);
+                break;
+            case yelp::event_batch::THREAD_ID:
+                result[name] = array_object (batch.thread_id);
+                break;
+            case yelp::event_batch::QUERY_TIME:
+                result[name] = array_object (batch.query_time);
+                break;
+            case yelp::event_batch::ERROR_CODE:
+                result[name] = array_object (batch.error_code);
+                break;
+            case yelp::event_batch::DATABASE:
+                result[name] = strings_object (batch.database_offsets, batch.databases);
+                break;
+            case yelp::event_batch::STATEMENT:
+                result[name] = strings_object (batch.statement_offsets, batch.statements);
+                break;
+            default:
+                break;
+            }
+        }
+        return result;
+    }
+
+    boost::python::dict binlog_counters (py_binlog &binlog) {
+        using namespace boost::python;
+        yelp::binlog_counters counters;
+        {
+            // A prefetcher may be reading meanwhile
+            without_gil unlocked (&binlog.lock);
+            counters = binlog.counters ();
+        }
+        dict result;
+        result["enabled"] = yelp::binlog_counters::enabled ();
+        result["syscalls"] = counters.syscalls;
+        result["bytes_read"] = counters.bytes_read;
+        result["events"] = counters.events;
+        result["event_bytes"] = counters.event_bytes;
+        result["resyncs"] = counters.resyncs;
+        result["resync_bytes_skipped"] = counters.resync_bytes_skipped;
+        result["allocations"] = counters.allocations;
+        result["bytes_allocated"] = counters.bytes_allocated;
+        dict by_type;
+        for (int t = 0; t < 256; ++t) {
+            if (counters.events_by_type[t]) {
+                by_type[t] = counters.events_by_type[t];
+            }
+        }
+        result["events_by_type"] = by_type;
+        dict phases;
+        for (int p = 0; p < yelp::binlog_counters::PHASE_COUNT; ++p) {
+            phases[yelp::binlog_counters::phase_name (p)] = counters.seconds (p);
+        }
+        result["seconds"] = phases;
+        return result;
+    }
+
+    void binlog_reset_counters (py_binlog &binlog) {
+        without_gil unlocked (&binlog.lock);
+        binlog.reset_counters ();
+    }
+
+    bool binlog_seek_gtid (py_binlog &binlog, const std::string &id) {
+        yelp::gtid target = yelp::gtid::parse (id);
+        without_gil unlocked (&binlog.lock);
+        return binlog.seek_gtid (target);
+    }
+
+    std::string binlog_previous_gtids (py_binlog &binlog) {
+        without_gil unlocked (&binlog.lock);
+        return binlog.previous_gtids ().str ();
+    }
+
+    // boost.python's own iterator<> returns *it++ as the iterator's
+    // reference type, which for yelp::binlog::iterator is a reference
+    // into the iterator. Hand python an owning copy instead, python
+    // objects outlive both the iterator and the binlog's mapping.
+    struct py_iterator {
+        py_iterator (boost::python::object binlog)
+            : m_binlog (binlog),
+              m_log (&boost::python::extract<py_binlog&> (binlog) ()),
+              m_started (false)
+        { }
+
+        // The entry m_it holds goes back to the binlog's allocator,
+        // which a prefetcher may be using.
+        ~py_iterator () {
+            if (m_started) {
+                without_gil unlocked (&m_log->lock);
+                m_it = m_end;
+            }
+        }
+
+        yelp::binlog::entry next () {
+            yelp::binlog::entry entry;
+            bool done;
+            {
+                // begin () reads too, so it waits for the first next ()
+                without_gil unlocked (&m_log->lock);
+                if (!m_started) {
+                    m_it = m_log->begin ();
+                    m_started = true;
+                } else if (m_it != m_end) {
+                    ++m_it;
+                }
+                done = m_it == m_end;
+                if (!done) {
+                    entry = *m_it;
+                }
+            }
+            if (done) {
+                boost::python::objects::stop_iteration_error ();
+            }
+            return entry;
+        }
+
+        // Keeps the binlog alive while iterating.
+        boost::python::object m_binlog;
+        py_binlog *m_log;
+        bool m_started;
+        yelp::binlog::iterator m_it;
+        yelp::binlog::iterator m_end;
+    };
+
+    // binlog.prefetch: a thread of its own runs an iterator ahead of
+    // python, copying events into a queue, so parsing carries on while
+    // python deals with what it has. python takes the whole queue at
+    // once when it runs out, rather than locking (and letting go of
+    // the GIL) for every event, so there are up to depth events in
+    // the queue and as many again on python's side of it.
+    class py_prefetcher : boost::noncopyable {
+    public:
+        py_prefetcher (boost::python::object binlog, size_t depth)
+            : m_binlog (binlog),
+              m_log (&boost::python::extract<py_binlog&> (binlog) ()),
+              m_depth (depth ? depth : 1), m_done (false), m_stop (false), m_waiting (false)
+        {
+            // Following, the thread may be waiting for the file to
+            // grow when we want it to stop. Writing to m_wake gets it
+            // out of there.
+            if (::pipe (m_wake) < 0) {
+                throw std::runtime_error (std::string ("pipe: ") + ::strerror (errno));
+            }
+            {
+                without_gil unlocked (&m_log->lock);
+                m_log->set_follow_interrupt (m_wake[0]);
+            }
+            pthread_mutex_init (&m_lock, NULL);
+            pthread_cond_init (&m_cond, NULL);
+            int rc = pthread_create (&m_thread, NULL, &py_prefetcher::run, this);
+            if (rc != 0) {
+                pthread_cond_destroy (&m_cond);
+                pthread_mutex_destroy (&m_lock);
+                close_wake ();
+                throw std::runtime_error (std::string ("pthread_create: ") + ::strerror (rc));
+            }
+        }
+
+        ~py_prefetcher () {
+            {
+                without_gil unlocked;
+                pthread_mutex_lock (&m_lock);
+                m_stop = true;
+                pthread_cond_broadcast (&m_cond);
+                pthread_mutex_unlock (&m_lock);
+                // Nothing reads it, one byte keeps it readable for good
+                while (::write (m_wake[1], "", 1) < 0 && errno == EINTR) {
+                }
+                pthread_join (m_thread, NULL);
+            }
+            close_wake ();
+            clear (m_queue);
+            clear (m_ready);
+            pthread_cond_destroy (&m_cond);
+            pthread_mutex_destroy (&m_lock);
+        }
+
+        // python owns what this returns
+        yelp::binlog::entry* next () {
+            if (m_ready.empty ()) {
+                std::string error;
+                {
+                    without_gil unlocked;
+                    pthread_mutex_lock (&m_lock);
+                    while (m_queue.empty () && !m_done) {
+                        m_waiting = true;
+                        pthread_cond_wait (&m_cond, &m_lock);
+                    }
+                    m_waiting = false;
+                    m_ready.swap (m_queue);
+                    if (m_ready.empty ()) {
+                        error = m_error;
+                    }
+                    pthread_cond_broadcast (&m_cond);
+                    pthread_mutex_unlock (&m_lock);
+                }
+                if (m_ready.empty ()) {
+                    if (!error.empty ()) {
+                        throw std::runtime_error (error);
+                    }
+                    boost::python::objects::stop_iteration_error ();
+                }
+            }
+            yelp::binlog::entry *entry = m_ready.front ();
+            m_ready.pop_front ();
+            return entry;
+        }
+
+    private:
+        static void* run (void *arg) {
+            ((py_prefetcher*)arg)->produce ();
+            return NULL;
+        }
+
+        void close_wake () {
+            {
+                without_gil unlocked (&m_log->lock);
+                if (m_log->follow_interrupt () == m_wake[0]) {
+                    m_log->set_follow_interrupt (-1);
+                }
+            }
+            ::close (m_wake[0]);
+            ::close (m_wake[1]);
+        }
+
+        static void clear (std::deque<yelp::binlog::entry*> &queue) {
+            for (size_t i = 0; i < queue.size (); ++i) {
+                delete queue[i];
+            }
+            queue.clear ();
+        }
+
+        void produce () {
+            std::string error;
+            yelp::binlog::iterator it, end;
+            try {
+                bool started = false;
+                for (;;) {
+                    pthread_mutex_lock (&m_log->lock);
+                    yelp::binlog::entry *copy = NULL;
+                    try {
+                        if (!started) {
+                            it = m_log->begin ();
+                            started = true;
+                        } else {
+                            ++it;
+                        }
+                        // A copy owns its payload, the iterator's comes
+                        // from the binlog's allocator.
+                        if (it != end) {
+                            copy = new yelp::binlog::entry (*it);
+                        }
+                    } catch (...) {
+                        pthread_mutex_unlock (&m_log->lock);
+                        throw;
+                    }
+                    pthread_mutex_unlock (&m_log->lock);
+                    if (copy == NULL) {
+                        break;
+                    }
+
+                    pthread_mutex_lock (&m_lock);
+                    while (m_queue.size () >= m_depth && !m_stop) {
+                        pthread_cond_wait (&m_cond, &m_lock);
+                    }
+                    bool stop = m_stop;
+                    if (!stop) {
+                        m_queue.push_back (copy);
+                        if (m_waiting) {
+                            pthread_cond_broadcast (&m_cond);
+                        }
+                    }
+                    pthread_mutex_unlock (&m_lock);
+                    if (stop) {
+                        delete copy;
+                        break;
+                    }
+                }
+            } catch (std::exception &e) {
+                error = e.what ();
+            }
+            // Its entry goes back to the binlog's allocator, which
+            // isn't thread safe
+            pthread_mutex_lock (&m_log->lock);
+            it = end;
+            pthread_mutex_unlock (&m_log->lock);
+
+            pthread_mutex_lock (&m_lock);
+            m_done = true;
+            m_error = error;
+            pthread_cond_broadcast (&m_cond);
+            pthread_mutex_unlock (&m_lock);
+        }
+
+        // Keeps the binlog alive while the thread reads it.
+        boost::python::object m_binlog;
+        py_binlog *m_log;
+        size_t m_depth;
+        std::deque<yelp::binlog::entry*> m_queue;
+        // python's side, only touched with the GIL
+        std::deque<yelp::binlog::entry*> m_ready;
+        bool m_done;
+        bool m_stop;
+        // python is waiting for the queue to fill
+        bool m_waiting;
+        std::string m_error;
+        pthread_mutex_t m_lock;
+        pthread_cond_t m_cond;
+        pthread_t m_thread;
+        int m_wake[2];
+    };
+
+    // binlog.transactions, transaction_reader as a python iterator
+    struct py_transactions {
+        py_transactions (boost::python::object binlog, uint64_t max_buffered)
+            : m_binlog (binlog),
+              m_log (&boost::python::extract<py_binlog&> (binlog) ()),
+              m_reader (new yelp::transaction_reader (*m_log, max_buffered)),
+              m_started (false)
+        { }
+
+        // Like py_iterator's, and the reader holds an iterator of its own
+        ~py_transactions () {
+            if (m_started) {
+                without_gil unlocked (&m_log->lock);
+                m_it = m_end;
+                if (m_reader.unique ()) {
+                    m_reader.reset ();
+                }
+            }
+        }
+
+        // python owns what this returns
+        yelp::transaction* next () {
+            yelp::transaction *t = NULL;
+            {
+                without_gil unlocked (&m_log->lock);
+                if (!m_started) {
+                    m_it = m_reader->begin ();
+                    m_started = true;
+                } else if (m_it != m_end) {
+                    ++m_it;
+                }
+                if (m_it != m_end) {
+                    t = new yelp::transaction (*m_it);
+                }
+            }
+            if (t == NULL) {
+                boost::python::objects::stop_iteration_error ();
+            }
+            return t;
+        }
+
+        // Keeps the binlog alive while iterating.
+        boost::python::object m_binlog;
+        py_binlog *m_log;
+        boost::shared_ptr<yelp::transaction_reader> m_reader;
+        bool m_started;
+        yelp::transaction_reader::iterator m_it;
+        yelp::transaction_reader::iterator m_end;
+    };
+
+    py_transactions binlog_transactions (boost::python::object binlog, uint64_t max_buffered) {
+        return py_transactions (binlog, max_buffered);
+    }
+
+    py_transactions& py_transactions_iter (py_transactions &it) {
+        return it;
+    }
+
+    boost::python::list transaction_entries (const yelp::transaction &t) {
+        boost::python::list entries;
+        for (size_t i = 0; i < t.entries.size (); ++i) {
+            entries.append (t.entries[i]);
+        }
+        return entries;
+    }
+
+    boost::shared_ptr<py_prefetcher> binlog_prefetch (boost::python::object binlog, size_t depth) {
+        return boost::shared_ptr<py_prefetcher> (new py_prefetcher (binlog, depth));
+    }
+
+    py_prefetcher& py_prefetcher_iter (py_prefetcher &it) {
+        return it;
+    }
+
+    py_iterator binlog_iter (boost::python::object binlog) {
+        return py_iterator (binlog);
+    }
+
+    py_iterator& py_iterator_iter (py_iterator &it) {
+        return it;
+    }
 }
 
 
@@ -83,6 +699,9 @@ BOOST_PYTHON_MODULE(ybinlogp) {
         .def_readonly ("format_version", &yelp::binlog::format_description_entry::format_version, "docstrings go here..")
         .def_readonly ("create_timestamp", &yelp::binlog::format_description_entry::create_timestamp)
         .def_readonly ("server_version", &yelp::binlog::format_description_entry::server_version)
+        .def_readonly ("header_len", &yelp::binlog::format_description_entry::header_len)
+        .def_readonly ("checksum_alg", &yelp::binlog::format_description_entry::checksum_alg, "0 none, 1 CRC32, 255 predates checksums")
+        .add_property ("post_header_len", &format_description_post_header_len)
         ;
 
     class_<yelp::binlog::query_entry> ("query", "A MySQL query event", no_init)
@@ -128,25 +747,148 @@ BOOST_PYTHON_MODULE(ybinlogp) {
                                                 return_value_policy<manage_new_object> ()))
         .add_property ("xid", make_function (new_from_entry<yelp::binlog::xid_entry, 16>,
                                              return_value_policy<manage_new_object> ()))
+        .add_property ("table_map", make_function (new_from_entry<yelp::binlog::table_map_entry, 19>,
+                                                   return_value_policy<manage_new_object> ()))
+        .add_property ("gtid", make_function (new_from_entry<yelp::binlog::gtid_entry, 33>,
+                                              return_value_policy<manage_new_object> ()))
+        ;
+
+    class_<yelp::binlog::gtid_entry> ("gtid", "A MySQL GTID event", no_init)
+        .add_property ("gtid", &yelp::binlog::gtid_entry::str, "uuid:gno")
+        .def_readonly ("flags", &yelp::binlog::gtid_entry::flags)
+        .def_readonly ("last_committed", &yelp::binlog::gtid_entry::last_committed, "0 before 5.7")
+        .def_readonly ("sequence_number", &yelp::binlog::gtid_entry::sequence_number, "0 before 5.7")
+        ;
+
+    class_<yelp::binlog::table_map_entry> ("table_map", "A MySQL table map event", no_init)
+        .def_readonly ("table_id", &yelp::binlog::table_map_entry::table_id)
+        .def_readonly ("flags", &yelp::binlog::table_map_entry::flags)
+        .def_readonly ("database", &yelp::binlog::table_map_entry::database)
+        .def_readonly ("table", &yelp::binlog::table_map_entry::table)
+        .add_property ("columns", &yelp::binlog::table_map_entry::columns)
+        .add_property ("column_types", &table_map_column_types, "MYSQL_TYPE_* of each column")
+        ;
+
+    class_<yelp::binlog::rows_entry::row> ("row", "One row image of a rows event, columns are decoded when indexed", no_init)
+        .def ("__len__", &yelp::binlog::rows_entry::row::columns)
+        .def ("__getitem__", &row_value)
+        .def ("present", &yelp::binlog::rows_entry::row::present)
+        .def ("is_null", &yelp::binlog::rows_entry::row::is_null)
+        ;
+
+    class_<yelp::binlog::rows_entry> ("rows", "A MySQL write/update/delete rows event", no_init)
+        .def_readonly ("type_code", &yelp::binlog::rows_entry::type_code)
+        .def_readonly ("table_id", &yelp::binlog::rows_entry::table_id)
+        .def_readonly ("flags", &yelp::binlog::rows_entry::flags)
+        .add_property ("table", make_function (&yelp::binlog::rows_entry::table, return_value_policy<copy_const_reference> ()))
+        .def ("__len__", &yelp::binlog::rows_entry::size)
+        .def ("__getitem__", &yelp::binlog::rows_entry::operator[])
+        .def ("before", &yelp::binlog::rows_entry::before)
+        .def ("after", &yelp::binlog::rows_entry::after)
+        ;
+
+    class_<yelp::table_map_cache, boost::noncopyable> ("table_maps", "The table maps seen so far, which rows events need")
+        .def ("update", &table_map_cache_update, "Show it an entry, returns True if it was a table map")
+        .def ("rows", &table_map_cache_rows, return_value_policy<manage_new_object> (),
+              "The rows of a rows entry, None for other entries")
+        .def ("find", &table_map_cache_find)
+        .def ("clear", &yelp::table_map_cache::clear)
+        .def ("__len__", &yelp::table_map_cache::size)
+        ;
+
+    class_<yelp::event_filter, boost::shared_ptr<yelp::event_filter> > ("filter", "Which events a binlog hands out, everything until told otherwise")
+        .def ("add_type", &yelp::event_filter::add_type)
+        .def ("add_server_id", &yelp::event_filter::add_server_id)
+        .def ("set_time_range", &yelp::event_filter::set_time_range, (arg ("start") = 0, arg ("until") = 0),
+              "Inclusive, 0 leaves that end open")
+        .def ("set_flags", &yelp::event_filter::set_flags, (arg ("require") = 0, arg ("reject") = 0))
+        .def ("add_database", &yelp::event_filter::add_database)
+        .def ("add_table", &yelp::event_filter::add_table, "table or database.table")
+        .def ("set_search", &event_filter_set_search, "Only pass the QUERY_EVENTs a search matches")
+        ;
+
+    class_<yelp::statement_search, boost::shared_ptr<yelp::statement_search>, boost::noncopyable> ("search", "Literals and regexes to look for in statements")
+        .def ("add_literal", &yelp::statement_search::add_literal)
+        .def ("add_regex", &yelp::statement_search::add_regex, "POSIX extended regex")
+        .def ("matches", &statement_search_matches, "Does the entry's statement match? Only queries have one.")
+        ;
+
+    class_<py_iterator> ("binlog.iterator", "This is MySQL binlog iterator", no_init)
+        .def ("__iter__", &py_iterator_iter, return_internal_reference<> ())
+        .def ("__next__", &py_iterator::next)
+        .def ("next", &py_iterator::next)
+        ;
+
+    enum_<yelp::transaction::ending_t> ("transaction_ending")
+        .value ("COMMIT", yelp::transaction::COMMIT)
+        .value ("ROLLBACK", yelp::transaction::ROLLBACK)
+        .value ("AUTOCOMMIT", yelp::transaction::AUTOCOMMIT)
+        .value ("UNFINISHED", yelp::transaction::UNFINISHED)
+        ;
+
+    class_<yelp::transaction> ("transaction", "Events committed together", no_init)
+        .def_readonly ("start", &yelp::transaction::start, "Offset of the first event")
+        .def_readonly ("end", &yelp::transaction::end, "Offset just past the last event")
+        .def_readonly ("timestamp", &yelp::transaction::timestamp, "When it committed")
+        .def_readonly ("xid", &yelp::transaction::xid)
+        .def_readonly ("events", &yelp::transaction::events)
+        .def_readonly ("bytes", &yelp::transaction::bytes)
+        .def_readonly ("ending", &yelp::transaction::ending)
+        .def_readonly ("buffered", &yelp::transaction::buffered, "False if it was too big to keep the entries of")
+        .add_property ("entries", &transaction_entries)
+        ;
+
+    class_<py_transactions> ("binlog.transactions", "Iterates over a binlog's transactions", no_init)
+        .def ("__iter__", &py_transactions_iter, return_internal_reference<> ())
+        .def ("__next__", &py_transactions::next, return_value_policy<manage_new_object> ())
+        .def ("next", &py_transactions::next, return_value_policy<manage_new_object> ())
         ;
 
-    class_<yelp::binlog::iterator> ("binlog.iterator", "This is MySQL binlog iterator")
+    class_<py_prefetcher, boost::shared_ptr<py_prefetcher>, boost::noncopyable> ("binlog.prefetcher", "Iterates a binlog that a thread of its own reads ahead", no_init)
+        .def ("__iter__", &py_prefetcher_iter, return_internal_reference<> ())
+        .def ("__next__", &py_prefetcher::next, return_value_policy<manage_new_object> ())
+        .def ("next", &py_prefetcher::next, return_value_policy<manage_new_object> ())
         ;
 
     // Exposing the other ctor could be nice too, eg. via a
     // classmethod
     // (http://wiki.python.org/moin/boost.python/HowTo#staticclassfunctions)
-    class_<yelp::binlog> ("binlog", "This is MySQL binlog file parser", init<object> ())
-        .def ("__iter__", iterator<yelp::binlog> (), "docstrings go here..")
+    class_<py_binlog, boost::noncopyable> ("binlog", "This is MySQL binlog file parser", init<object> ())
+        .def ("__iter__", &binlog_iter, "docstrings go here..")
+        .def ("verify_checksums", &yelp::binlog::set_verify_checksums, (arg ("verify") = true),
+              "Check event checksums while iterating (the default), raising on a mismatch.")
+        .def ("follow", &yelp::binlog::set_follow, (arg ("follow") = true, arg ("timeout_ms") = -1),
+              "Wait for events as they're written instead of stopping at the end of the file.")
+        .def ("set_filter", &yelp::binlog::set_filter, "Only iterate over the events a filter passes, set it before iterating.")
+        .def ("transactions", &binlog_transactions, (arg ("max_buffered") = 16 * 1024 * 1024),
+              "Iterate over transactions rather than events. Ones bigger than max_buffered bytes come\n"
+              "without their entries, read their [start, end) again for those. Don't set a filter.")
+        .def ("prefetch", &binlog_prefetch, (arg ("depth") = 1024),
+              "Iterate with a native thread reading and parsing up to depth events ahead, without\n"
+              "the GIL, while python works on the ones it has.")
+        .def ("read_batch", &binlog_read_batch, (arg ("n"), arg ("fields") = object ()),
+              "The next n events (fewer at the end, none after it) as a dict of field name to\n"
+              "typed memoryview, one value per event. Strings (database, statement) are an\n"
+              "(offsets, bytes) pair, event i's is bytes[offsets[i]:offsets[i + 1]]. fields\n"
+              "picks which to decode, all of them by default. Batches carry on from each other,\n"
+              "independently of iterating the binlog.")
+        .def ("counters", &binlog_counters,
+              "What reading the file has cost so far, as a dict: syscalls, bytes_read, events,\n"
+              "event_bytes, events_by_type (type_code to count), resyncs, resync_bytes_skipped,\n"
+              "allocations, bytes_allocated and seconds (phase to seconds spent opening, seeking,\n"
+              "reading, waiting and scanning). enabled is False if they were compiled out.")
+        .def ("reset_counters", &binlog_reset_counters, "Zero the counters.")
+        .def ("seek_gtid", &binlog_seek_gtid,
+              "Start iterating at the GTID event of a uuid:gno instead, False if the file hasn't\n"
+              "got it. Call it before iterating.")
+        .def ("previous_gtids", &binlog_previous_gtids,
+              "The GTIDs of the binlogs before this one, as MySQL prints a set of them.")
         ;
 }
 
 // End of python bindings.
 
 namespace {
-    // how many bytes to seek ahead looking for a record
-    static const uint32_t MAX_RETRIES = 102400;
-
     // The binlog version we support
     const unsigned int BINLOG_VERSION = 4;
     
@@ -155,15 +897,120 @@ namespace {
 
     // binlog parameters
     static const uint16_t MIN_TYPE_CODE = 0;
-    static const uint16_t MAX_TYPE_CODE = 27;
+    // Up to 8.0's, HEARTBEAT_LOG_EVENT_V2
+    static const uint16_t MAX_TYPE_CODE = 42;
     static const uint16_t MIN_EVENT_LENGTH = 19;
     // Can't see why you'd have events >10MB.
     static const uint32_t MAX_EVENT_LENGTH = 10485760;
+    // How many bytes to scan looking for a record. Any position is
+    // less than an event away from the next one, and scanning is
+    // cheap, so look at least that far.
+    static const uint32_t MAX_RETRIES = MAX_EVENT_LENGTH + EVENT_HEADER_SIZE;
+    // nearest_offset reads this much to start with, and doubles it
+    // each round up to RESYNC_MAX_BLOCK. Probes usually land within
+    // a few hundred bytes of an event, no need to fault in a megabyte.
+    static const size_t RESYNC_MIN_BLOCK = 4096;
+    static const size_t RESYNC_MAX_BLOCK = 1024 * 1024;
+    // How many events after a candidate have to check out too
+    static const int RESYNC_CONFIRM_HOPS = 3;
+    // seek_gtid stops bisecting and reads the headers once it's
+    // down to this much of the file
+    static const off64_t GTID_BISECT_SPAN = 64 * 1024;
+    // Likewise nearest_time, which reads the events from there on
+    static const off64_t TIME_BISECT_SPAN = 64 * 1024;
+    // parallel_scan chunk sizes, aiming for a few chunks per thread
+    static const off64_t SCAN_MIN_CHUNK = 1024 * 1024;
+    static const off64_t SCAN_MAX_CHUNK = 64 * 1024 * 1024;
+    static const size_t SCAN_CHUNKS_PER_THREAD = 4;
+    // How much of the next file binlog_set asks the kernel to read ahead
+    static const off64_t PREFETCH_BYTES = 64 * 1024 * 1024;
+    // stream_buffer's ring, it grows for an event that won't fit
+    static const size_t STREAM_RING_SIZE = 1024 * 1024;
     // 0 <= server_id  <= 2**31
     static const uint32_t MAX_SERVER_ID = 4294967295;
 
     static const char BINLOG_MAGIC[4] = {0xfe, 0x62, 0x69, 0x6e};
 
+    // flags, see flags[] below
+    static const uint16_t LOG_EVENT_ARTIFICIAL_F = 0x20;
+
+    // Sidecar index, see yelp::binlog_index
+    static const char INDEX_MAGIC[4] = {'Y', 'B', 'I', 'X'};
+    // 2 added the GTIDs
+    static const uint32_t INDEX_VERSION = 2;
+
+    // Compressed binlogs, see yelp::compressed_file
+    static const char SPAN_INDEX_MAGIC[4] = {'Y', 'B', 'C', 'Z'};
+    static const uint32_t SPAN_INDEX_VERSION = 1;
+    // Uncompressed bytes per span. A gzip span runs on to the end of
+    // the deflate block it reaches this in.
+    static const size_t SPAN_SIZE = 4 * 1024 * 1024;
+    // Compressed input read at a time, and output decompressed at a time
+    static const size_t SPAN_INPUT_CHUNK = 256 * 1024;
+    static const size_t SPAN_OUTPUT_CHUNK = 256 * 1024;
+    // deflate's history, what a span in the middle of a member needs
+    static const size_t DEFLATE_WINDOW = 32768;
+    // Decompressed spans kept, and how many the readahead thread keeps ready
+    static const size_t SPAN_CACHE = 8;
+    static const size_t SPAN_READAHEAD = 2;
+    static const size_t NO_SPAN = (size_t)-1;
+    // zstd's seekable format: a skippable frame at the end listing
+    // the frames, found by the footer that ends it
+    static const uint32_t ZSTD_SKIPPABLE_MAGIC = 0x184D2A5E;
+    static const uint32_t ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1;
+    static const size_t ZSTD_SEEKABLE_FOOTER = 9;
+
+    // Replication protocol, see yelp::replication_stream
+    static const uint8_t COM_QUERY = 0x03;
+    static const uint8_t COM_BINLOG_DUMP = 0x12;
+    static const uint32_t CLIENT_LONG_PASSWORD = 0x00000001;
+    static const uint32_t CLIENT_PROTOCOL_41 = 0x00000200;
+    static const uint32_t CLIENT_TRANSACTIONS = 0x00002000;
+    static const uint32_t CLIENT_SECURE_CONNECTION = 0x00008000;
+    static const uint32_t CLIENT_PLUGIN_AUTH = 0x00080000;
+    static const uint16_t BINLOG_DUMP_NON_BLOCK = 1;
+    // A packet this long is continued in the next one
+    static const size_t MAX_PACKET = 0xffffff;
+    static const uint8_t PACKET_OK = 0x00;
+    static const uint8_t PACKET_EOF = 0xfe;
+    static const uint8_t PACKET_ERR = 0xff;
+    // What mysql_native_password scrambles the password with
+    static const size_t SCRAMBLE_LEN = 20;
+    // Socket buffer, and what's read at a time: a burst of events
+    // comes in with a few recv ()s rather than one per packet.
+    static const size_t STREAM_BUFFER = 4 * 1024 * 1024;
+
+    // Columnar export, see yelp::column_writer
+    static const char COLUMN_MAGIC[4] = {'Y', 'B', 'C', 'X'};
+    static const char COLUMN_BATCH_MAGIC[4] = {'Y', 'B', 'C', 'B'};
+    static const char COLUMN_FOOTER_MAGIC[4] = {'Y', 'B', 'C', 'F'};
+    static const uint32_t COLUMN_VERSION = 1;
+
+    struct column_spec {
+        const char *name;
+        uint32_t kind;
+        uint32_t width;
+    };
+
+    // What column_writer writes, in this order
+    const column_spec export_columns[] = {
+        { "offset", COLUMN_UINT, 8 },
+        { "timestamp", COLUMN_UINT, 4 },
+        { "type_code", COLUMN_UINT, 1 },
+        { "server_id", COLUMN_UINT, 4 },
+        { "length", COLUMN_UINT, 4 },
+        { "thread_id", COLUMN_UINT, 4 },
+        { "query_time", COLUMN_UINT, 4 },
+        { "error_code", COLUMN_UINT, 2 },
+        { "database", COLUMN_DICTIONARY, 4 },
+        { "statement", COLUMN_BLOB, 8 },
+    };
+    const size_t EXPORT_COLUMNS = sizeof (export_columns) / sizeof (export_columns[0]);
+
+    inline uint64_t pad8 (uint64_t n) {
+        return (n + 7) & ~(uint64_t)7;
+    }
+
     // Used in main to toggle dumping query details or not.
     int q_mode = 0;
 
@@ -189,15 +1036,30 @@ namespace {
         EXECUTE_LOAD_QUERY_EVENT=18,
         TABLE_MAP_EVENT=19,
         PRE_GA_WRITE_ROWS_EVENT=20,
-        PRE_GA_DELETE_ROWS_EVENT=21,
-        WRITE_ROWS_EVENT=22,
-        UPDATE_ROWS_EVENT=23,
-        DELETE_ROWS_EVENT=24,
-        INCIDENT_EVENT=25,
-        HEARTBEAT_LOG_EVENT=26
+        PRE_GA_UPDATE_ROWS_EVENT=21,
+        PRE_GA_DELETE_ROWS_EVENT=22,
+        WRITE_ROWS_EVENT_V1=23,
+        UPDATE_ROWS_EVENT_V1=24,
+        DELETE_ROWS_EVENT_V1=25,
+        INCIDENT_EVENT=26,
+        HEARTBEAT_LOG_EVENT=27,
+        IGNORABLE_LOG_EVENT=28,
+        ROWS_QUERY_LOG_EVENT=29,
+        WRITE_ROWS_EVENT=30,
+        UPDATE_ROWS_EVENT=31,
+        DELETE_ROWS_EVENT=32,
+        GTID_LOG_EVENT=33,
+        ANONYMOUS_GTID_LOG_EVENT=34,
+        PREVIOUS_GTIDS_LOG_EVENT=35,
+        TRANSACTION_CONTEXT_EVENT=36,
+        VIEW_CHANGE_EVENT=37,
+        XA_PREPARE_LOG_EVENT=38,
+        PARTIAL_UPDATE_ROWS_EVENT=39,
+        TRANSACTION_PAYLOAD_EVENT=40,
+        HEARTBEAT_LOG_EVENT_V2=41
     };
 
-    const char* event_types[27] = {
+    const char* event_types[42] = {
         "UNKNOWN_EVENT",			// 0
         "START_EVENT_V3",			// 1
         "QUERY_EVENT",				// 2
@@ -219,638 +1081,7020 @@ namespace {
         "EXECUTE_LOAD_QUERY_EVENT",		// 18
         "TABLE_MAP_EVENT",			// 19
         "PRE_GA_WRITE_ROWS_EVENT",		// 20
-        "PRE_GA_DELETE_ROWS_EVENT",		// 21
-        "WRITE_ROWS_EVENT",			// 22
-        "UPDATE_ROWS_EVENT",			// 23
-        "DELETE_ROWS_EVENT",			// 24
-        "INCIDENT_EVENT",			// 25
-        "HEARTBEAT_LOG_EVENT"			// 26
-    };
-
-    /*
-      // Why aren't these used
-    const char* variable_types[10] = {
-        "Q_FLAGS2_CODE",			// 0
-        "Q_SQL_MODE_CODE",			// 1
-        "Q_CATALOG_CODE",			// 2
-        "Q_AUTO_INCREMENT",			// 3
-        "Q_CHARSET_CODE",			// 4
-        "Q_TIME_ZONE_CODE",			// 5
-        "Q_CATALOG_NZ_CODE",			// 6
-        "Q_LC_TIME_NAMES_CODE",			// 7
-        "Q_CHARSET_DATABASE_CODE",		// 8
-        "Q_TABLE_MAP_FOR_UPDATE_CODE",		// 9
+        "PRE_GA_UPDATE_ROWS_EVENT",		// 21
+        "PRE_GA_DELETE_ROWS_EVENT",		// 22
+        "WRITE_ROWS_EVENT_V1",			// 23
+        "UPDATE_ROWS_EVENT_V1",			// 24
+        "DELETE_ROWS_EVENT_V1",			// 25
+        "INCIDENT_EVENT",			// 26
+        "HEARTBEAT_LOG_EVENT",			// 27
+        "IGNORABLE_LOG_EVENT",			// 28
+        "ROWS_QUERY_LOG_EVENT",			// 29
+        "WRITE_ROWS_EVENT",			// 30
+        "UPDATE_ROWS_EVENT",			// 31
+        "DELETE_ROWS_EVENT",			// 32
+        "GTID_LOG_EVENT",			// 33
+        "ANONYMOUS_GTID_LOG_EVENT",		// 34
+        "PREVIOUS_GTIDS_LOG_EVENT",		// 35
+        "TRANSACTION_CONTEXT_EVENT",		// 36
+        "VIEW_CHANGE_EVENT",			// 37
+        "XA_PREPARE_LOG_EVENT",			// 38
+        "PARTIAL_UPDATE_ROWS_EVENT",		// 39
+        "TRANSACTION_PAYLOAD_EVENT",		// 40
+        "HEARTBEAT_LOG_EVENT_V2"		// 41
     };
-    */
 
-    const char* intvar_types[3] = {
-        "",
-        "LAST_INSERT_ID_EVENT",			// 1
-        "INSERT_ID_EVENT",			// 2
+    // Column types in TABLE_MAP_EVENTs, as in mysql_com.h
+    enum e_column_types {
+        MYSQL_TYPE_DECIMAL=0,
+        MYSQL_TYPE_TINY=1,
+        MYSQL_TYPE_SHORT=2,
+        MYSQL_TYPE_LONG=3,
+        MYSQL_TYPE_FLOAT=4,
+        MYSQL_TYPE_DOUBLE=5,
+        MYSQL_TYPE_NULL=6,
+        MYSQL_TYPE_TIMESTAMP=7,
+        MYSQL_TYPE_LONGLONG=8,
+        MYSQL_TYPE_INT24=9,
+        MYSQL_TYPE_DATE=10,
+        MYSQL_TYPE_TIME=11,
+        MYSQL_TYPE_DATETIME=12,
+        MYSQL_TYPE_YEAR=13,
+        MYSQL_TYPE_NEWDATE=14,
+        MYSQL_TYPE_VARCHAR=15,
+        MYSQL_TYPE_BIT=16,
+        MYSQL_TYPE_TIMESTAMP2=17,
+        MYSQL_TYPE_DATETIME2=18,
+        MYSQL_TYPE_TIME2=19,
+        MYSQL_TYPE_JSON=245,
+        MYSQL_TYPE_NEWDECIMAL=246,
+        MYSQL_TYPE_ENUM=247,
+        MYSQL_TYPE_SET=248,
+        MYSQL_TYPE_TINY_BLOB=249,
+        MYSQL_TYPE_MEDIUM_BLOB=250,
+        MYSQL_TYPE_LONG_BLOB=251,
+        MYSQL_TYPE_BLOB=252,
+        MYSQL_TYPE_VAR_STRING=253,
+        MYSQL_TYPE_STRING=254,
+        MYSQL_TYPE_GEOMETRY=255
     };
 
-    const char* flags[16] = {
-        "LOG_EVENT_BINLOG_IN_USE",		// 0x01
-        "LOG_EVENT_FORCED_ROTATE",		// 0x02 (deprecated)
-        "LOG_EVENT_THREAD_SPECIFIC",		// 0x04
-        "LOG_EVENT_SUPPRESS_USE",		// 0x08
-        "LOG_EVENT_UPDATE_TABLE_MAP_VERSION",	// 0x10
-        "LOG_EVENT_ARTIFICIAL",			// 0x20
-        "LOG_EVENT_RELAY_LOG",			// 0x40
-        "",
-        "",
-    };
+    inline bool ends_with (const std::string &s, const std::string &suffix) {
+        return s.size () >= suffix.size () && s.compare (s.size () - suffix.size (), suffix.size (), suffix) == 0;
+    }
 
-    void usage (void) {
-        fprintf (stderr, "Usage: ybinlogp [mode] logfile [mode-args]\n");
-        fprintf (stderr, "\n");
-        fprintf (stderr, "ybinlogp supports several different modes:\n");
-        fprintf (stderr, "\t-o Find the first event after the given offset\n");
-        fprintf (stderr, "\t\tybinlogp -o offset logfile\n");
-        fprintf (stderr, "\t-t Find the event closest to the given unix time\n");
-        fprintf (stderr, "\t\tybinlogp -t timestamp logfile\n");
-        fprintf (stderr, "\t-a When used with one of the above, print N items after the first one\n");
-        fprintf (stderr, "\t\tAccepts either an integer or the text 'all'\n");
-        fprintf (stderr, "\t\tybinlogp -a N -t timestamp logfile\n");
-        fprintf (stderr, "\t-q Be slightly quieter when printing (don't print statement contents\n");
-        fprintf (stderr, "\t-Q Be much quieter (only print offset, timestamp, and type code)\n");
+    // "dir/" of path, or "" if it's just a file name
+    inline std::string dir_name (const std::string &path) {
+        size_t slash = path.rfind ('/');
+        return slash == std::string::npos ? std::string () : path.substr (0, slash + 1);
     }
 
+    inline std::string base_name (const std::string &path) {
+        size_t slash = path.rfind ('/');
+        return slash == std::string::npos ? path : path.substr (slash + 1);
+    }
 
-    inline void init_event (struct event_buffer *evbuf) {
-        memset (evbuf, 0, sizeof (struct event_buffer));
+    // Wait for something to happen on an inotify instance (or kqueue
+    // on Darwin) and swallow the events. Returns 0 on timeout, -1 if
+    // interrupt_fd (unless it's -1) became readable first.
+    int wait_watch (int watch_fd, int timeout_ms, int interrupt_fd = -1) {
+        for (;;) {
+#if defined(DARWIN)
+            struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+            struct kevent change, ev;
+            EV_SET (&change, interrupt_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+            int rc = ::kevent (watch_fd, &change, interrupt_fd >= 0 ? 1 : 0, &ev, 1, timeout_ms < 0 ? NULL : &ts);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            } else if (rc < 0) {
+                throw std::runtime_error (std::string ("kevent: ") + ::strerror (errno));
+            } else if (rc > 0 && interrupt_fd >= 0 && ev.filter == EVFILT_READ && (int)ev.ident == interrupt_fd) {
+                return -1;
+            }
+            return rc;
+#else
+            struct pollfd p[2];
+            p[0].fd = watch_fd;
+            p[0].events = POLLIN;
+            p[1].fd = interrupt_fd;
+            p[1].events = POLLIN;
+            p[1].revents = 0;
+            int rc = ::poll (p, interrupt_fd >= 0 ? 2 : 1, timeout_ms);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            } else if (rc < 0) {
+                throw std::runtime_error (std::string ("poll: ") + ::strerror (errno));
+            } else if (rc == 0) {
+                return 0;
+            } else if (p[1].revents) {
+                return -1;
+            }
+            char events[4096];
+            if (::read (watch_fd, events, sizeof (events)) < 0 && errno != EINTR) {
+                throw std::runtime_error (std::string ("read inotify: ") + ::strerror (errno));
+            }
+            return rc;
+#endif
+        }
     }
 
+    inline bool file_size_at_least (const std::string &path, off64_t size) {
+        struct stat st;
+        return ::stat (path.c_str (), &st) == 0 && st.st_size >= size;
+    }
 
-    inline void dispose_event (struct event_buffer *evbuf) {
-        if (evbuf == NULL) {
-            return;
+    // Wait for path to be created with at least min_size bytes in it,
+    // giving up after timeout_ms (-1: never) of nothing happening in
+    // its directory.
+    bool wait_for_file (const std::string &path, off64_t min_size, int timeout_ms) {
+        std::string dir = path.rfind ('/') == std::string::npos ? std::string (".") : path.substr (0, path.rfind ('/') + 1);
+#if defined(DARWIN)
+        int dir_fd = ::open (dir.c_str (), O_RDONLY);
+        int watch_fd = ::kqueue ();
+        if (dir_fd < 0 || watch_fd < 0) {
+            if (dir_fd >= 0) ::close (dir_fd);
+            if (watch_fd >= 0) ::close (watch_fd);
+            return file_size_at_least (path, min_size);
+        }
+        struct kevent change;
+        EV_SET (&change, dir_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+        ::kevent (watch_fd, &change, 1, NULL, 0, NULL);
+#else
+        int dir_fd = -1;
+        int watch_fd = ::inotify_init ();
+        if (watch_fd < 0 || ::inotify_add_watch (watch_fd, dir.c_str (), IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            if (watch_fd >= 0) ::close (watch_fd);
+            return file_size_at_least (path, min_size);
         }
-        delete[] evbuf->heaped;
-#if DEBUG
-        evbuf->heaped = (char*)0xdeadbeef;
-        evbuf->data = (char*)0xdeadbeef;
 #endif
-        free (evbuf);
+        bool found;
+        while (!(found = file_size_at_least (path, min_size)) && wait_watch (watch_fd, timeout_ms) > 0) {
+        }
+        ::close (watch_fd);
+        if (dir_fd >= 0) {
+            ::close (dir_fd);
+        }
+        return found;
     }
 
+    // A file is finished once the server rotates away from it or
+    // shuts down. Relay logs start with an artificial rotate, that
+    // one doesn't count.
+    inline bool ends_file (const event_buffer *ev) {
+        return (ev->type_code == ROTATE_EVENT && !(ev->flags & LOG_EVENT_ARTIFICIAL_F)) ||
+            ev->type_code == STOP_EVENT;
+    }
 
-    inline void reset_event (struct event_buffer *evbuf) {
-#if DEBUG
-        fprintf (stderr, "Resetting event\n");
-#endif
-        delete[] evbuf->heaped;
-        evbuf->heaped = NULL;
-        evbuf->data = NULL;
-        init_event (evbuf);
+    // Garbage (eg. while resyncing) can have any type_code
+    inline const char* event_type_name (uint8_t type_code) {
+        if (type_code >= sizeof (event_types) / sizeof (event_types[0])) {
+            return event_types[UNKNOWN_EVENT];
+        }
+        return event_types[type_code];
     }
 
+    inline bool is_rows_event (uint8_t type_code) {
+        return (type_code >= WRITE_ROWS_EVENT_V1 && type_code <= DELETE_ROWS_EVENT_V1) ||
+            (type_code >= WRITE_ROWS_EVENT && type_code <= DELETE_ROWS_EVENT);
+    }
 
-    // dest and source must not overlap
-    int copy_event (event_buffer *dest, const event_buffer *source) {
-#if DEBUG
-        fprintf(stderr, "About to copy 0x%p to 0x%p\n", source, dest);
+    inline bool is_update_rows_event (uint8_t type_code) {
+        return type_code == UPDATE_ROWS_EVENT_V1 || type_code == UPDATE_ROWS_EVENT;
+    }
+
+    // A GTID_LOG_EVENT's id, false for anything else or one too short to have it
+    inline bool event_gtid (const event_buffer &ev, yelp::gtid &id) {
+        if (ev.type_code != GTID_LOG_EVENT || ev.data == NULL || event_data_len ((&ev)) < sizeof (struct gtid_event_buffer)) {
+            return false;
+        }
+        const struct gtid_event_buffer *g = (const struct gtid_event_buffer*)ev.data;
+        memcpy (id.sid, g->sid, sizeof (id.sid));
+        id.gno = g->gno;
+        return true;
+    }
+
+    // The order of the sidecar index's GTIDs, which binlog_index::find_gtid bisects
+    inline bool gtid_record_less (const index_gtid_record &a, const index_gtid_record &b) {
+        int c = memcmp (a.sid, b.sid, sizeof (a.sid));
+        return c < 0 || (c == 0 && a.gno < b.gno);
+    }
+
+    // Row event decoding. Offsets are into the payload, and anything
+    // running past its end means the event (or table map) is bad.
+
+    inline void check_span (size_t offset, size_t len, size_t size) {
+        if (offset > size || len > size - offset) {
+            throw std::runtime_error ("row event data runs past the end of the event");
+        }
+    }
+
+    inline uint64_t read_le (const unsigned char *p, size_t n) {
+        uint64_t v = 0;
+        for (size_t i = n; i > 0; --i) {
+            v = (v << 8) | p[i-1];
+        }
+        return v;
+    }
+
+    // -1 if c isn't a hex digit
+    inline int hex_value (char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    // A TABLE_MAP_EVENT's table_id and names, false if it's too short to have them
+    bool table_map_names (const event_buffer &evbuf, uint64_t &table_id, std::string &database, std::string &table) {
+        if (evbuf.data == NULL || event_data_len ((&evbuf)) < sizeof (struct table_map_event_buffer) + 4) {
+            return false;
+        }
+        const unsigned char *p = (const unsigned char*)evbuf.data;
+        size_t size = event_data_len ((&evbuf));
+        table_id = read_le (p, sizeof (((struct table_map_event_buffer*)0)->table_id));
+        size_t offset = sizeof (struct table_map_event_buffer);
+        std::string *names[2] = { &database, &table };
+        for (int i = 0; i < 2; ++i) {
+            if (offset >= size || offset + 1 + p[offset] > size) {
+                return false;
+            }
+            names[i]->assign ((const char*)p + offset + 1, p[offset]);
+            offset += p[offset] + 2;
+        }
+        return true;
+    }
+
+    inline uint64_t read_be (const unsigned char *p, size_t n) {
+        uint64_t v = 0;
+        for (size_t i = 0; i < n; ++i) {
+            v = (v << 8) | p[i];
+        }
+        return v;
+    }
+
+    // MySQL's packed (length encoded) integer
+    uint64_t read_packed (const std::string &buf, size_t &offset) {
+        check_span (offset, 1, buf.size ());
+        const unsigned char *p = (const unsigned char*)buf.data () + offset;
+        size_t n;
+        switch (p[0]) {
+        case 252: n = 2; break;
+        case 253: n = 3; break;
+        case 254: n = 8; break;
+        default:
+            if (p[0] > 250) {
+                throw std::runtime_error ("bad packed integer in row event");
+            }
+            offset += 1;
+            return p[0];
+        }
+        check_span (offset + 1, n, buf.size ());
+        offset += 1 + n;
+        return read_le (p + 1, n);
+    }
+
+    // CRC32 as binlog_checksum=CRC32 (and zlib) computes it, ie. the
+    // reflected 0x04C11DB7 polynomial. That's not the CRC32C the
+    // SSE4.2 crc32 instruction does, so it's folded with PCLMULQDQ
+    // where the CPU has it, and done slicing-by-8 otherwise and for
+    // the odd bytes.
+    struct crc32_tables {
+        uint32_t t[8][256];
+        crc32_tables () {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+                }
+                t[0][i] = c;
+            }
+            for (uint32_t i = 0; i < 256; ++i) {
+                for (int k = 1; k < 8; ++k) {
+                    t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+                }
+            }
+        }
+    };
+    const crc32_tables CRC32_TABLES;
+
+    // crc is the running (inverted) value
+    uint32_t crc32_slice8 (uint32_t crc, const unsigned char *p, size_t len) {
+        const uint32_t (*t)[256] = CRC32_TABLES.t;
+        for (; len >= 8; p += 8, len -= 8) {
+            uint32_t a, b;
+            memcpy (&a, p, 4);
+            memcpy (&b, p + 4, 4);
+            a ^= crc;
+            crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+                t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+        }
+        while (len--) {
+            crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#if defined(YBINLOGP_CRC32_PCLMUL)
+    bool have_pclmul () {
+        unsigned int eax, ebx, ecx, edx;
+        return __get_cpuid (1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+    }
+    const bool HAVE_PCLMUL = have_pclmul ();
+
+    // Fold 64 bytes at a time, then 16, then Barrett reduce, see
+    // Intel's "Fast CRC Computation for Generic Polynomials Using
+    // PCLMULQDQ". len is a multiple of 16 and at least 64, crc is the
+    // running (inverted) value.
+    __attribute__ ((target ("pclmul,sse4.1")))
+    uint32_t crc32_pclmul (uint32_t crc, const unsigned char *p, size_t len) {
+        static const uint64_t k1k2[2] __attribute__ ((aligned (16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+        static const uint64_t k3k4[2] __attribute__ ((aligned (16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+        static const uint64_t k5k0[2] __attribute__ ((aligned (16))) = { 0x0163cd6124ULL, 0x0000000000ULL };
+        static const uint64_t poly[2] __attribute__ ((aligned (16))) = { 0x01db710641ULL, 0x01f7011641ULL };
+
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+        x1 = _mm_loadu_si128 ((const __m128i*)(p + 0x00));
+        x2 = _mm_loadu_si128 ((const __m128i*)(p + 0x10));
+        x3 = _mm_loadu_si128 ((const __m128i*)(p + 0x20));
+        x4 = _mm_loadu_si128 ((const __m128i*)(p + 0x30));
+        x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 ((int)crc));
+        x0 = _mm_load_si128 ((const __m128i*)k1k2);
+        p += 64;
+        len -= 64;
+
+        for (; len >= 64; p += 64, len -= 64) {
+            x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+            x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+            x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+            x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+            x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+            x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+            x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+            x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+            x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), _mm_loadu_si128 ((const __m128i*)(p + 0x00)));
+            x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), _mm_loadu_si128 ((const __m128i*)(p + 0x10)));
+            x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), _mm_loadu_si128 ((const __m128i*)(p + 0x20)));
+            x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), _mm_loadu_si128 ((const __m128i*)(p + 0x30)));
+        }
+
+        // four lanes down to one
+        x0 = _mm_load_si128 ((const __m128i*)k3k4);
+        x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+        x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+        x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+        x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+        x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+        x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+        for (; len >= 16; p += 16, len -= 16) {
+            x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+            x1 = _mm_xor_si128 (_mm_xor_si128 (x1, _mm_loadu_si128 ((const __m128i*)p)), x5);
+        }
+
+        // 128 bits to 64
+        x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+        x3 = _mm_setr_epi32 (~0, 0, ~0, 0);
+        x1 = _mm_xor_si128 (_mm_srli_si128 (x1, 8), x2);
+        x0 = _mm_loadl_epi64 ((const __m128i*)k5k0);
+        x2 = _mm_srli_si128 (x1, 4);
+        x1 = _mm_and_si128 (x1, x3);
+        x1 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+        x1 = _mm_xor_si128 (x1, x2);
+
+        // Barrett reduction to 32
+        x0 = _mm_load_si128 ((const __m128i*)poly);
+        x2 = _mm_and_si128 (x1, x3);
+        x2 = _mm_clmulepi64_si128 (x2, x0, 0x10);
+        x2 = _mm_and_si128 (x2, x3);
+        x2 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+        x1 = _mm_xor_si128 (x1, x2);
+        return _mm_extract_epi32 (x1, 1);
+    }
 #endif
-        init_event (dest);
-        memcpy (dest, source, sizeof (struct event_buffer));
-        if (source->data != 0) {
-#if DEBUG
-            fprintf (stderr, "newing %lu bytes for the target\n", source->length - EVENT_HEADER_SIZE);
+
+    // Same as zlib's crc32 (crc, buf, len)
+    uint32_t binlog_crc32 (uint32_t crc, const char *buf, size_t len) {
+        const unsigned char *p = (const unsigned char*)buf;
+        crc = ~crc;
+#if defined(YBINLOGP_CRC32_PCLMUL)
+        if (HAVE_PCLMUL && len >= 64) {
+            size_t chunk = len & ~(size_t)15;
+            crc = crc32_pclmul (crc, p, chunk);
+            p += chunk;
+            len -= chunk;
+        }
 #endif
-            if (source->length - EVENT_HEADER_SIZE > sizeof (dest->payload)) {
-                if ((dest->heaped = new char[source->length - EVENT_HEADER_SIZE]) == NULL) {
-                    perror ("new:");
-                    return -1;
+        return ~crc32_slice8 (crc, p, len);
+    }
+
+    // Servers since 5.6.1 put the checksum algorithm in the FDE
+    bool checksum_aware (const std::string &server_version) {
+        int major = 0, minor = 0, patch = 0;
+        sscanf (server_version.c_str (), "%d.%d.%d", &major, &minor, &patch);
+        return major > 5 || (major == 5 && (minor > 6 || (minor == 6 && patch >= 1)));
+    }
+
+    // Does evbuf end in the CRC32 of the event as it was written? The
+    // checksum covers the header as it was on disk, which is exactly
+    // the start of event_buffer.
+    bool checksum_matches (const event_buffer *evbuf) {
+        if (evbuf->length < EVENT_HEADER_SIZE + evbuf->checksum_len) {
+            return false;
+        }
+        size_t len = event_data_len (evbuf);
+        uint32_t crc = binlog_crc32 (0, (const char*)evbuf, EVENT_HEADER_SIZE);
+        crc = binlog_crc32 (crc, evbuf->data, len);
+        uint32_t stored;
+        memcpy (&stored, evbuf->data + len, sizeof (stored));
+        return crc == stored;
+    }
+
+    inline uint32_t rotl32 (uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    // mysql_native_password is SHA1 based, which isn't worth a
+    // dependency for three 20 byte hashes at login.
+    std::string sha1 (const std::string &message) {
+        uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+        std::string m (message);
+        uint64_t bits = (uint64_t)message.size () * 8;
+        m += (char)0x80;
+        while (m.size () % 64 != 56) {
+            m += '\0';
+        }
+        for (int i = 7; i >= 0; --i) {
+            m += (char)(bits >> (i * 8));
+        }
+        for (size_t block = 0; block < m.size (); block += 64) {
+            const unsigned char *p = (const unsigned char*)m.data () + block;
+            uint32_t w[80];
+            for (int i = 0; i < 16; ++i) {
+                w[i] = (uint32_t)p[i * 4] << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 | p[i * 4 + 3];
+            }
+            for (int i = 16; i < 80; ++i) {
+                w[i] = rotl32 (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+            }
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for (int i = 0; i < 80; ++i) {
+                uint32_t f, k;
+                if (i < 20) {
+                    f = (b & c) | (~b & d);
+                    k = 0x5A827999;
+                } else if (i < 40) {
+                    f = b ^ c ^ d;
+                    k = 0x6ED9EBA1;
+                } else if (i < 60) {
+                    f = (b & c) | (b & d) | (c & d);
+                    k = 0x8F1BBCDC;
+                } else {
+                    f = b ^ c ^ d;
+                    k = 0xCA62C1D6;
                 }
-                dest->data = dest->heaped;
-            } else {
-                dest->heaped = NULL;
-                dest->data = (char*)&(dest->payload);
+                uint32_t t = rotl32 (a, 5) + f + e + k + w[i];
+                e = d;
+                d = c;
+                c = rotl32 (b, 30);
+                b = a;
+                a = t;
             }
-#if DEBUG
-            fprintf (stderr, "copying extra data from 0x%p to 0x%p\n", source->data, dest->data);
-#endif
-            memcpy (dest->data, source->data, source->length - EVENT_HEADER_SIZE);
+            h[0] += a;
+            h[1] += b;
+            h[2] += c;
+            h[3] += d;
+            h[4] += e;
+        }
+        std::string digest;
+        for (int i = 0; i < 5; ++i) {
+            for (int j = 3; j >= 0; --j) {
+                digest += (char)(h[i] >> (j * 8));
+            }
+        }
+        return digest;
+    }
+
+    // mysql_native_password's answer to the server's scramble:
+    // SHA1 (password) XOR SHA1 (scramble + SHA1 (SHA1 (password)))
+    std::string native_password (const std::string &password, const std::string &scramble) {
+        if (password.empty ()) {
+            return std::string ();
+        }
+        std::string stage1 = sha1 (password);
+        std::string token = sha1 (scramble + sha1 (stage1));
+        for (size_t i = 0; i < token.size (); ++i) {
+            token[i] ^= stage1[i];
+        }
+        return token;
+    }
+
+    inline void put_le16 (std::string &out, uint16_t v) {
+        out += (char)v;
+        out += (char)(v >> 8);
+    }
+
+    inline void put_le32 (std::string &out, uint32_t v) {
+        put_le16 (out, (uint16_t)v);
+        put_le16 (out, (uint16_t)(v >> 16));
+    }
+
+    // A length encoded integer, false if it runs past end.
+    bool get_lenenc (const char *&p, const char *end, uint64_t &value) {
+        if (p >= end) {
+            return false;
+        }
+        const unsigned char *u = (const unsigned char*)p;
+        size_t n = 0;
+        if (u[0] == 0xfc) {
+            n = 2;
+        } else if (u[0] == 0xfd) {
+            n = 3;
+        } else if (u[0] == 0xfe) {
+            n = 8;
+        } else if (u[0] > 0xfa) {
+            // 0xfb is a NULL, 0xff an error
+            return false;
+        }
+        if (end - p < (ptrdiff_t)(1 + n)) {
+            return false;
+        }
+        value = n ? 0 : u[0];
+        for (size_t i = n; i > 0; --i) {
+            value = value << 8 | u[i];
+        }
+        p += 1 + n;
+        return true;
+    }
+
+    // "message (code)" out of an ERR packet
+    std::string server_error (const char *p, size_t len) {
+        if (len < 3) {
+            return "unknown error";
+        }
+        const unsigned char *u = (const unsigned char*)p;
+        unsigned int code = u[1] | u[2] << 8;
+        size_t start = 3;
+        // 4.1 and later put the SQL state in first, #HY000
+        if (len >= 9 && p[3] == '#') {
+            start = 9;
+        }
+        return (boost::format ("%s (%u)") % std::string (p + start, len - start) % code).str ();
+    }
+
+    // TCP to host:port, with a receive buffer big enough to keep a
+    // busy server streaming. It has to be set before connect () for
+    // the window to scale to it.
+    int connect_server (const std::string &host, uint16_t port) {
+        struct addrinfo hints, *addrs;
+        memset (&hints, 0, sizeof (hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        std::string service = (boost::format ("%u") % port).str ();
+        int rc = ::getaddrinfo (host.c_str (), service.c_str (), &hints, &addrs);
+        if (rc != 0) {
+            throw std::runtime_error (std::string ("getaddrinfo ") + host + ": " + ::gai_strerror (rc));
+        }
+        int fd = -1;
+        int error = 0;
+        for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+            fd = ::socket (a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd < 0) {
+                error = errno;
+                continue;
+            }
+            int size = STREAM_BUFFER;
+            ::setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+            if (::connect (fd, a->ai_addr, a->ai_addrlen) == 0) {
+                break;
+            }
+            error = errno;
+            ::close (fd);
+            fd = -1;
+        }
+        ::freeaddrinfo (addrs);
+        if (fd < 0) {
+            throw std::runtime_error ((boost::format ("connect %s:%u: %s") % host % port % ::strerror (error)).str ());
+        }
+        // Login is a few small round trips
+        int one = 1;
+        ::setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+        return fd;
+    }
+
+    // rows_entry::row column offsets that aren't offsets
+    static const uint32_t NULL_COLUMN = 0xfffffffe;
+    static const uint32_t ABSENT_COLUMN = 0xffffffff;
+
+    inline bool bit_set (const char *bitmap, size_t bit) {
+        return (bitmap[bit / 8] >> (bit % 8)) & 1;
+    }
+
+    // How many metadata bytes a TABLE_MAP_EVENT has for a column type
+    size_t column_meta_size (uint8_t type) {
+        switch (type) {
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+        case MYSQL_TYPE_TINY_BLOB:
+        case MYSQL_TYPE_MEDIUM_BLOB:
+        case MYSQL_TYPE_LONG_BLOB:
+        case MYSQL_TYPE_BLOB:
+        case MYSQL_TYPE_GEOMETRY:
+        case MYSQL_TYPE_JSON:
+        case MYSQL_TYPE_TIMESTAMP2:
+        case MYSQL_TYPE_DATETIME2:
+        case MYSQL_TYPE_TIME2:
+            return 1;
+        case MYSQL_TYPE_VARCHAR:
+        case MYSQL_TYPE_VAR_STRING:
+        case MYSQL_TYPE_BIT:
+        case MYSQL_TYPE_NEWDECIMAL:
+        case MYSQL_TYPE_STRING:
+        case MYSQL_TYPE_ENUM:
+        case MYSQL_TYPE_SET:
+            return 2;
+        default:
+            return 0;
+        }
+    }
+
+    // CHAR, ENUM and SET all show up as MYSQL_TYPE_STRING, the real
+    // type and the length are squeezed into the metadata.
+    void string_meta (uint16_t meta, uint8_t &real_type, size_t &max_length) {
+        uint8_t b0 = meta & 0xff, b1 = meta >> 8;
+        if ((b0 & 0x30) != 0x30) {
+            real_type = b0 | 0x30;
+            max_length = b1 | (((b0 & 0x30) ^ 0x30) << 4);
+        } else {
+            real_type = b0;
+            max_length = b1;
+        }
+    }
+
+    inline size_t decimal_size (int precision, int scale) {
+        static const int dig2bytes[10] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+        // A corrupt (or not MySQL's) table map could say anything, and
+        // a negative intg would index off the front of dig2bytes.
+        if (scale > precision) {
+            throw std::runtime_error ((boost::format ("bad DECIMAL(%d,%d) in table map") % precision % scale).str ());
+        }
+        int intg = precision - scale;
+        return (intg / 9) * 4 + dig2bytes[intg % 9] + (scale / 9) * 4 + dig2bytes[scale % 9];
+    }
+
+    // Bytes of fractional seconds in TIME2, DATETIME2 and TIMESTAMP2
+    inline size_t fsp_size (uint16_t meta) {
+        return ((meta & 0xff) + 1) / 2;
+    }
+
+    // Size of the column value at offset, including any length prefix.
+    size_t column_size (uint8_t type, uint16_t meta, const std::string &buf, size_t offset) {
+        const unsigned char *p = (const unsigned char*)buf.data () + offset;
+        size_t prefix;
+        switch (type) {
+        case MYSQL_TYPE_NULL: return 0;
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_YEAR: return 1;
+        case MYSQL_TYPE_SHORT: return 2;
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_NEWDATE:
+        case MYSQL_TYPE_TIME: return 3;
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_TIMESTAMP: return 4;
+        case MYSQL_TYPE_LONGLONG:
+        case MYSQL_TYPE_DOUBLE:
+        case MYSQL_TYPE_DATETIME: return 8;
+        case MYSQL_TYPE_TIMESTAMP2: return 4 + fsp_size (meta);
+        case MYSQL_TYPE_DATETIME2: return 5 + fsp_size (meta);
+        case MYSQL_TYPE_TIME2: return 3 + fsp_size (meta);
+        case MYSQL_TYPE_BIT: return (meta >> 8) + ((meta & 0xff) ? 1 : 0);
+        case MYSQL_TYPE_NEWDECIMAL: return decimal_size (meta & 0xff, meta >> 8);
+        case MYSQL_TYPE_ENUM:
+        case MYSQL_TYPE_SET: return meta >> 8;
+        case MYSQL_TYPE_VARCHAR:
+        case MYSQL_TYPE_VAR_STRING:
+            prefix = meta > 255 ? 2 : 1;
+            break;
+        case MYSQL_TYPE_STRING: {
+            uint8_t real_type;
+            size_t max_length;
+            string_meta (meta, real_type, max_length);
+            if (real_type == MYSQL_TYPE_ENUM || real_type == MYSQL_TYPE_SET) {
+                return meta >> 8;
+            }
+            prefix = max_length > 255 ? 2 : 1;
+            break;
+        }
+        case MYSQL_TYPE_TINY_BLOB:
+        case MYSQL_TYPE_MEDIUM_BLOB:
+        case MYSQL_TYPE_LONG_BLOB:
+        case MYSQL_TYPE_BLOB:
+        case MYSQL_TYPE_GEOMETRY:
+        case MYSQL_TYPE_JSON:
+            prefix = meta & 0xff;
+            if (prefix < 1 || prefix > 4) {
+                throw std::runtime_error ((boost::format ("bad blob length size %d in table map") % prefix).str ());
+            }
+            break;
+        default:
+            throw std::runtime_error ((boost::format ("can't decode column type %d") % (int)type).str ());
+        }
+        check_span (offset, prefix, buf.size ());
+        return prefix + read_le (p, prefix);
+    }
+
+    std::string format_decimal (const unsigned char *p, int precision, int scale) {
+        static const int dig2bytes[10] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+        // Groups of 9 digits, big-endian, with the sign in the top bit
+        // and negative numbers stored inverted.
+        unsigned char buf[64];
+        size_t size = decimal_size (precision, scale);
+        if (size > sizeof (buf)) {
+            throw std::runtime_error ((boost::format ("bad DECIMAL(%d,%d) in table map") % precision % scale).str ());
+        }
+        memcpy (buf, p, size);
+        bool negative = !(buf[0] & 0x80);
+        buf[0] ^= 0x80;
+        if (negative) {
+            for (size_t i = 0; i < size; ++i) {
+                buf[i] ^= 0xff;
+            }
+        }
+        int intg = precision - scale;
+        std::string out (negative ? "-" : "");
+        std::string digits;
+        size_t pos = 0;
+        if (intg % 9) {
+            size_t n = dig2bytes[intg % 9];
+            uint64_t v = read_be (buf + pos, n);
+            pos += n;
+            if (v) {
+                digits = (boost::format ("%u") % v).str ();
+            }
+        }
+        for (int i = 0; i < intg / 9; ++i, pos += 4) {
+            uint64_t v = read_be (buf + pos, 4);
+            if (!digits.empty ()) {
+                digits += (boost::format ("%09u") % v).str ();
+            } else if (v) {
+                digits = (boost::format ("%u") % v).str ();
+            }
+        }
+        out += digits.empty () ? std::string ("0") : digits;
+        if (scale) {
+            out += ".";
+            for (int i = 0; i < scale / 9; ++i, pos += 4) {
+                out += (boost::format ("%09u") % read_be (buf + pos, 4)).str ();
+            }
+            if (scale % 9) {
+                char frac[16];
+                snprintf (frac, sizeof (frac), "%0*llu", scale % 9, (unsigned long long)read_be (buf + pos, dig2bytes[scale % 9]));
+                out += frac;
+            }
+        }
+        return out;
+    }
+
+    // ".123" for fractional seconds, fsp digits of them
+    std::string format_fraction (uint64_t micro, int fsp) {
+        if (fsp <= 0) {
+            return std::string ();
+        }
+        for (int i = fsp; i < 6; ++i) {
+            micro /= 10;
+        }
+        char frac[16];
+        snprintf (frac, sizeof (frac), ".%0*llu", fsp, (unsigned long long)micro);
+        return frac;
+    }
+
+    // Fractional seconds of TIME2/DATETIME2/TIMESTAMP2 in microseconds,
+    // stored in fsp_size bytes at whatever precision those hold
+    inline uint64_t fraction_micro (uint64_t raw, size_t bytes) {
+        return bytes == 1 ? raw * 10000 : bytes == 2 ? raw * 100 : raw;
+    }
+
+    yelp::binlog::column_value decode_column (uint8_t type, uint16_t meta, const std::string &buf, size_t offset, size_t size) {
+        typedef yelp::binlog::column_value column_value;
+        const unsigned char *p = (const unsigned char*)buf.data () + offset;
+        column_value v;
+        v.type = type;
+        switch (type) {
+        case MYSQL_TYPE_NULL:
+            break;
+        case MYSQL_TYPE_TINY:
+            v.kind = column_value::INT;
+            v.int_value = (int8_t)p[0];
+            break;
+        case MYSQL_TYPE_SHORT:
+            v.kind = column_value::INT;
+            v.int_value = (int16_t)read_le (p, 2);
+            break;
+        case MYSQL_TYPE_INT24:
+            v.kind = column_value::INT;
+            v.int_value = (int32_t)(read_le (p, 3) << 8) >> 8;
+            break;
+        case MYSQL_TYPE_LONG:
+            v.kind = column_value::INT;
+            v.int_value = (int32_t)read_le (p, 4);
+            break;
+        case MYSQL_TYPE_LONGLONG:
+            v.kind = column_value::INT;
+            v.int_value = (int64_t)read_le (p, 8);
+            break;
+        case MYSQL_TYPE_FLOAT: {
+            float f;
+            memcpy (&f, p, sizeof (f));
+            v.kind = column_value::DOUBLE;
+            v.double_value = f;
+            break;
+        }
+        case MYSQL_TYPE_DOUBLE:
+            v.kind = column_value::DOUBLE;
+            memcpy (&v.double_value, p, sizeof (v.double_value));
+            break;
+        case MYSQL_TYPE_YEAR:
+            v.kind = column_value::UINT;
+            v.uint_value = p[0] ? 1900 + p[0] : 0;
+            break;
+        case MYSQL_TYPE_TIMESTAMP:
+            v.kind = column_value::UINT;
+            v.uint_value = read_le (p, 4);
+            break;
+        case MYSQL_TYPE_BIT:
+            v.kind = column_value::UINT;
+            v.uint_value = read_be (p, size);
+            break;
+        case MYSQL_TYPE_ENUM:
+        case MYSQL_TYPE_SET:
+            v.kind = column_value::UINT;
+            v.uint_value = read_le (p, size);
+            break;
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_NEWDATE: {
+            uint64_t d = read_le (p, 3);
+            v.kind = column_value::TEXT;
+            v.string_value = (boost::format ("%04u-%02u-%02u") % (d >> 9) % ((d >> 5) & 15) % (d & 31)).str ();
+            break;
+        }
+        case MYSQL_TYPE_TIME: {
+            int32_t t = (int32_t)(read_le (p, 3) << 8) >> 8;
+            uint32_t a = t < 0 ? -t : t;
+            v.kind = column_value::TEXT;
+            v.string_value = (boost::format ("%s%02u:%02u:%02u") % (t < 0 ? "-" : "") % (a / 10000) % (a / 100 % 100) % (a % 100)).str ();
+            break;
+        }
+        case MYSQL_TYPE_DATETIME: {
+            uint64_t dt = read_le (p, 8);
+            uint64_t d = dt / 1000000, t = dt % 1000000;
+            v.kind = column_value::TEXT;
+            v.string_value = (boost::format ("%04u-%02u-%02u %02u:%02u:%02u")
+                              % (d / 10000) % (d / 100 % 100) % (d % 100)
+                              % (t / 10000) % (t / 100 % 100) % (t % 100)).str ();
+            break;
+        }
+        case MYSQL_TYPE_TIMESTAMP2: {
+            size_t fb = fsp_size (meta);
+            v.kind = column_value::TEXT;
+            v.string_value = (boost::format ("%u") % read_be (p, 4)).str () +
+                format_fraction (fraction_micro (read_be (p + 4, fb), fb), meta & 0xff);
+            break;
+        }
+        case MYSQL_TYPE_DATETIME2: {
+            // 1 bit sign (always set), 17 bits year * 13 + month,
+            // 5 bits day, 5 bits hour, 6 bits minute, 6 bits second
+            size_t fb = fsp_size (meta);
+            uint64_t packed = read_be (p, 5) - 0x8000000000ULL;
+            uint64_t ymd = packed >> 17, ym = ymd >> 5, hms = packed & 0x1ffff;
+            v.kind = column_value::TEXT;
+            v.string_value = (boost::format ("%04u-%02u-%02u %02u:%02u:%02u")
+                              % (ym / 13) % (ym % 13) % (ymd & 31)
+                              % (hms >> 12) % ((hms >> 6) & 63) % (hms & 63)).str () +
+                format_fraction (fraction_micro (read_be (p + 5, fb), fb), meta & 0xff);
+            break;
+        }
+        case MYSQL_TYPE_TIME2: {
+            // Hours, minutes and seconds followed by the fraction, the
+            // lot stored as one offset big-endian number.
+            size_t fb = fsp_size (meta);
+            int64_t packed = (int64_t)read_be (p, 3 + fb) - ((int64_t)0x800000 << (8 * fb));
+            uint64_t a = packed < 0 ? -packed : packed;
+            uint64_t hms = a >> (8 * fb);
+            v.kind = column_value::TEXT;
+            v.string_value = (boost::format ("%s%02u:%02u:%02u") % (packed < 0 ? "-" : "")
+                              % ((hms >> 12) & 0x3ff) % ((hms >> 6) & 63) % (hms & 63)).str () +
+                format_fraction (fraction_micro (a & ((1ULL << (8 * fb)) - 1), fb), meta & 0xff);
+            break;
+        }
+        case MYSQL_TYPE_NEWDECIMAL:
+            v.kind = column_value::TEXT;
+            v.string_value = format_decimal (p, meta & 0xff, meta >> 8);
+            break;
+        case MYSQL_TYPE_STRING: {
+            uint8_t real_type;
+            size_t max_length;
+            string_meta (meta, real_type, max_length);
+            if (real_type == MYSQL_TYPE_ENUM || real_type == MYSQL_TYPE_SET) {
+                v.kind = column_value::UINT;
+                v.uint_value = read_le (p, size);
+                break;
+            }
+            size_t prefix = max_length > 255 ? 2 : 1;
+            v.kind = column_value::BYTES;
+            v.string_value.assign ((const char*)p + prefix, size - prefix);
+            break;
+        }
+        default: {
+            // VARCHAR and the blobs
+            size_t prefix = type == MYSQL_TYPE_VARCHAR || type == MYSQL_TYPE_VAR_STRING ? (meta > 255 ? 2 : 1) : meta & 0xff;
+            v.kind = column_value::BYTES;
+            v.string_value.assign ((const char*)p + prefix, size - prefix);
+            break;
+        }
+        }
+        return v;
+    }
+
+    /*
+      // Why aren't these used
+    const char* variable_types[10] = {
+        "Q_FLAGS2_CODE",			// 0
+        "Q_SQL_MODE_CODE",			// 1
+        "Q_CATALOG_CODE",			// 2
+        "Q_AUTO_INCREMENT",			// 3
+        "Q_CHARSET_CODE",			// 4
+        "Q_TIME_ZONE_CODE",			// 5
+        "Q_CATALOG_NZ_CODE",			// 6
+        "Q_LC_TIME_NAMES_CODE",			// 7
+        "Q_CHARSET_DATABASE_CODE",		// 8
+        "Q_TABLE_MAP_FOR_UPDATE_CODE",		// 9
+    };
+    */
+
+    const char* intvar_types[3] = {
+        "",
+        "LAST_INSERT_ID_EVENT",			// 1
+        "INSERT_ID_EVENT",			// 2
+    };
+
+    const char* flags[16] = {
+        "LOG_EVENT_BINLOG_IN_USE",		// 0x01
+        "LOG_EVENT_FORCED_ROTATE",		// 0x02 (deprecated)
+        "LOG_EVENT_THREAD_SPECIFIC",		// 0x04
+        "LOG_EVENT_SUPPRESS_USE",		// 0x08
+        "LOG_EVENT_UPDATE_TABLE_MAP_VERSION",	// 0x10
+        "LOG_EVENT_ARTIFICIAL",			// 0x20
+        "LOG_EVENT_RELAY_LOG",			// 0x40
+        "",
+        "",
+    };
+
+#ifndef YBINLOGP_NO_MAIN
+    void usage (void) {
+        fprintf (stderr, "Usage: ybinlogp [mode] logfile [mode-args]\n");
+        fprintf (stderr, "\n");
+        fprintf (stderr, "ybinlogp supports several different modes:\n");
+        fprintf (stderr, "\t-o Find the first event after the given offset\n");
+        fprintf (stderr, "\t\tybinlogp -o offset logfile\n");
+        fprintf (stderr, "\t-t Find the event closest to the given unix time\n");
+        fprintf (stderr, "\t\tybinlogp -t timestamp logfile\n");
+        fprintf (stderr, "\t--gtid Start at the transaction with this uuid:number. With -S the file to start in\n");
+        fprintf (stderr, "\t\tis picked by the files' PREVIOUS_GTIDS_LOG_EVENTs, within the file it's found\n");
+        fprintf (stderr, "\t\twith the index (see -i), or by bisecting it without one\n");
+        fprintf (stderr, "\t\tybinlogp -S -a all --gtid 3e11fa47-71ca-11e1-9e33-c80aa9429562:23 mysql-bin.index\n");
+        fprintf (stderr, "\t-a When used with one of the above, print N items after the first one\n");
+        fprintf (stderr, "\t\tAccepts either an integer or the text 'all'\n");
+        fprintf (stderr, "\t\tybinlogp -a N -t timestamp logfile\n");
+        fprintf (stderr, "\t-q Be slightly quieter when printing (don't print statement contents\n");
+        fprintf (stderr, "\t-Q Be much quieter (only print offset, timestamp, and type code)\n");
+        fprintf (stderr, "\t-S Read a series of binlogs as one, following rotations\n");
+        fprintf (stderr, "\t\tEach logfile can be a mysql-bin.index, a (quoted) glob or a binlog.\n");
+        fprintf (stderr, "\t\t-o applies to the first file, -t picks the file to start in.\n");
+        fprintf (stderr, "\t\tybinlogp -S -a all mysql-bin.index\n");
+        fprintf (stderr, "\t-f Follow the binlog(s) as they're written, like tail -f, into rotated files too\n");
+        fprintf (stderr, "\t\tAccepts the same logfiles as -S. With -a N it stops after N events.\n");
+        fprintf (stderr, "\t\tybinlogp -f -t timestamp logfile\n");
+        fprintf (stderr, "\t-D Only show events for this database (QUERY_EVENTs by their default database, row events by table)\n");
+        fprintf (stderr, "\t-T Only show row events (and their table maps) for this table or database.table\n");
+        fprintf (stderr, "\t-e Only show events of this type, by number or name (eg. QUERY_EVENT)\n");
+        fprintf (stderr, "\t-s Only show events from this server id\n");
+        fprintf (stderr, "\t-U Only show events up to this unix time\n");
+        fprintf (stderr, "\t-g Only show QUERY_EVENTs whose statement contains this literal\n");
+        fprintf (stderr, "\t-G Only show QUERY_EVENTs whose statement matches this (extended) regex\n");
+        fprintf (stderr, "\t\tWith -g or -G, every match is shown unless -a says otherwise.\n");
+        fprintf (stderr, "\t\t-D, -T, -e, -s, -g and -G can be given several times, any of the values will do.\n");
+        fprintf (stderr, "\t\tybinlogp -a all -e QUERY_EVENT -D prod logfile\n");
+        fprintf (stderr, "\t\tybinlogp -Q -g users -G '^(ALTER|DROP) ' logfile\n");
+        fprintf (stderr, "\t-F Output format: text (the default), json (an object per line) or tsv\n");
+        fprintf (stderr, "\t\tTSV columns: offset, timestamp, type, server id, length, next pos, flags, database,\n");
+        fprintf (stderr, "\t\tand the statement, next file, xid, intvar, seeds, table, table id, gtid or gtid set.\n");
+        fprintf (stderr, "\t\t-q leaves the statement out, -Q everything past the header.\n");
+        fprintf (stderr, "\t\tybinlogp -F json -a all logfile\n");
+        fprintf (stderr, "\t-X Export offset, timestamp, type, server id, length and the query's thread id,\n");
+        fprintf (stderr, "\t\tquery time, error code, database and statement of every event to a column file\n");
+        fprintf (stderr, "\t\t(see column_file_header in ybinlogp.hh) instead of printing them\n");
+        fprintf (stderr, "\t\tybinlogp -X events.ybcol logfile\n");
+        fprintf (stderr, "\t--stats Instead of printing events, report events and bytes by type, database, table\n");
+        fprintf (stderr, "\t\tand minute, QUERY_EVENT query_time and error code counts. Takes -j, -S and filters.\n");
+        fprintf (stderr, "\t\tybinlogp --stats -j 8 logfile\n");
+        fprintf (stderr, "\t--stats-io When done, report syscalls, bytes read, events read by type, resyncs,\n");
+        fprintf (stderr, "\t\tallocations and time spent opening, seeking, reading and waiting to stderr\n");
+        fprintf (stderr, "\t\tybinlogp --stats-io -a all logfile > /dev/null\n");
+        fprintf (stderr, "\t-C Don't verify event checksums (binlog_checksum=CRC32), for the fastest scans\n");
+        fprintf (stderr, "\t-j With -a all or --stats, scan the file on N threads (output stays in file order)\n");
+        fprintf (stderr, "\t\tybinlogp -j N -a all logfile\n");
+        fprintf (stderr, "\t-i (Re)build the sidecar index (logfile.ybidx) of every Nth event, and every GTID, and exit\n");
+        fprintf (stderr, "\t\t-o, -t and --gtid use the index when it matches the logfile\n");
+        fprintf (stderr, "\t\tybinlogp -i N logfile\n");
+        fprintf (stderr, "\n");
+        fprintf (stderr, "A gzip or zstd compressed logfile is read as it is (not with -f), offsets are\n");
+        fprintf (stderr, "into the uncompressed binlog. Its span index (logfile.ybcz) is written the first\n");
+        fprintf (stderr, "time it's read through, after that -o and -t only decompress what they land in.\n");
+        fprintf (stderr, "\n");
+        fprintf (stderr, "A logfile of mysql://[user[:password]@]host[:port][/binlog] reads the server's binlogs\n");
+        fprintf (stderr, "as a replica would, starting with the binlog at -o (an event's position, 4 by default)\n");
+        fprintf (stderr, "or with the first binlog the server has. -f keeps waiting for more. The account needs\n");
+        fprintf (stderr, "REPLICATION SLAVE and mysql_native_password, MYSQL_PWD is the password if the url has none.\n");
+        fprintf (stderr, "\t--server-id Replica id to ask the server as (default 31074), no real replica may be using it\n");
+        fprintf (stderr, "\t\tybinlogp -a all mysql://repl@db1/mysql-bin.000042\n");
+        fprintf (stderr, "\n");
+        fprintf (stderr, "A logfile of - reads a binlog from stdin, a pipe is fine. It's read once, front to\n");
+        fprintf (stderr, "back: -o and -t read up to where they land, -f prints events as they come in.\n");
+        fprintf (stderr, "\t\tzcat mysql-bin.000042.gz | ybinlogp -a all -\n");
+    }
+#endif
+
+
+#if !defined(YBINLOGP_NO_COUNTERS)
+    inline uint64_t now_ns () {
+#if defined(DARWIN)
+        struct timeval tv;
+        gettimeofday (&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#else
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    }
+
+    // Adds the time until it goes out of scope to one of
+    // binlog_counters' phases.
+    class phase_timer : boost::noncopyable {
+    public:
+        explicit phase_timer (uint64_t &ns) : m_ns (ns), m_start (now_ns ()) { }
+        ~phase_timer () { m_ns += now_ns () - m_start; }
+
+    private:
+        uint64_t &m_ns;
+        uint64_t m_start;
+    };
+
+    inline void count_event (yelp::binlog_counters &counters, const event_buffer &ev) {
+        ++counters.events;
+        ++counters.events_by_type[ev.type_code];
+        counters.event_bytes += ev.length;
+    }
+
+#define COUNT(statement) do { statement; } while (0)
+#else
+    class phase_timer : boost::noncopyable {
+    public:
+        explicit phase_timer (uint64_t &) { }
+    };
+
+    inline void count_event (yelp::binlog_counters &, const event_buffer &) { }
+
+#define COUNT(statement) do { } while (0)
+#endif
+
+
+    inline uint32_t read_le32 (const unsigned char *p) {
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+
+
+    // compressed_file keeps (and saves) deflate windows compressed,
+    // they're 32K a span otherwise.
+    std::string deflate_window (const char *history, size_t len) {
+        uLongf out_len = compressBound (len);
+        std::string out (out_len, '\0');
+        if (compress2 ((Bytef*)&out[0], &out_len, (const Bytef*)history, len, Z_BEST_SPEED) != Z_OK) {
+            throw std::runtime_error ("compress2: can't compress a deflate window");
+        }
+        out.resize (out_len);
+        return out;
+    }
+
+
+    inline void init_event (struct event_buffer *evbuf) {
+        memset (evbuf, 0, sizeof (struct event_buffer));
+    }
+
+
+    // Give evbuf's heaped payload back to wherever it came from.
+    inline void release_payload (struct event_buffer *evbuf) {
+        if (evbuf->heaped == NULL) {
+            return;
+        }
+        if (evbuf->allocator) {
+            evbuf->allocator->release (evbuf->heaped, evbuf->length - EVENT_HEADER_SIZE);
+        } else {
+            delete[] evbuf->heaped;
+        }
+    }
+
+
+    inline void dispose_event (struct event_buffer *evbuf) {
+        if (evbuf == NULL) {
+            return;
+        }
+        release_payload (evbuf);
+#if DEBUG
+        evbuf->heaped = (char*)0xdeadbeef;
+        evbuf->data = (char*)0xdeadbeef;
+#endif
+        free (evbuf);
+    }
+
+
+    inline void reset_event (struct event_buffer *evbuf) {
+#if DEBUG
+        fprintf (stderr, "Resetting event\n");
+#endif
+        release_payload (evbuf);
+        evbuf->heaped = NULL;
+        evbuf->data = NULL;
+        init_event (evbuf);
+    }
+
+
+    // dest and source must not overlap
+    int copy_event (event_buffer *dest, const event_buffer *source) {
+#if DEBUG
+        fprintf(stderr, "About to copy 0x%p to 0x%p\n", source, dest);
+#endif
+        init_event (dest);
+        memcpy (dest, source, sizeof (struct event_buffer));
+        // copies always own their payload
+        dest->allocator = NULL;
+        if (source->data != 0) {
+#if DEBUG
+            fprintf (stderr, "newing %lu bytes for the target\n", source->length - EVENT_HEADER_SIZE);
+#endif
+            if (source->length - EVENT_HEADER_SIZE > sizeof (dest->payload)) {
+                if ((dest->heaped = new char[source->length - EVENT_HEADER_SIZE]) == NULL) {
+                    perror ("new:");
+                    return -1;
+                }
+                dest->data = dest->heaped;
+            } else {
+                dest->heaped = NULL;
+                dest->data = (char*)&(dest->payload);
+            }
+#if DEBUG
+            fprintf (stderr, "copying extra data from 0x%p to 0x%p\n", source->data, dest->data);
+#endif
+            memcpy (dest->data, source->data, source->length - EVENT_HEADER_SIZE);
+        }
+        return 0;
+    }
+
+    // Hand source's payload over to dest without copying it. Only the
+    // inline payload has to move, anything heaped or mapped just
+    // changes hands. source ends up empty.
+    void move_event (event_buffer *dest, event_buffer *source) {
+        memcpy (dest, source, sizeof (struct event_buffer));
+        if (source->data == (char*)&(source->payload)) {
+            dest->data = (char*)&(dest->payload);
+        }
+        init_event (source);
+    }
+
+    // The checks check_event does, straight off a raw header.
+    inline bool plausible_header (const char *h, time_t min_timestamp, time_t max_timestamp) {
+        uint32_t timestamp, server_id, length;
+        uint8_t type_code = (uint8_t)h[offsetof (event_buffer, type_code)];
+        memcpy (&timestamp, h + offsetof (event_buffer, timestamp), sizeof (timestamp));
+        memcpy (&server_id, h + offsetof (event_buffer, server_id), sizeof (server_id));
+        memcpy (&length, h + offsetof (event_buffer, length), sizeof (length));
+        return server_id < MAX_SERVER_ID &&
+            type_code > MIN_TYPE_CODE &&
+            type_code < MAX_TYPE_CODE &&
+            length > MIN_EVENT_LENGTH &&
+            length < MAX_EVENT_LENGTH &&
+            timestamp >= min_timestamp &&
+            timestamp <= max_timestamp;
+    }
+
+    inline uint32_t header_length (const char *h) {
+        uint32_t length;
+        memcpy (&length, h + offsetof (event_buffer, length), sizeof (length));
+        return length;
+    }
+
+#if defined(__SSE2__)
+    // Bytes past a position that resync_mask looks at
+    const size_t RESYNC_MASK_SPAN = 16 + 12;
+
+    // Cheap first pass over the 16 headers that would start at
+    // p[0..15], a bit set for each that might be an event. Every
+    // field tested is a single byte, so 16 positions are 16
+    // consecutive bytes:
+    //  - type_code, p[4..19], has to be 1..MAX_TYPE_CODE-1
+    //  - the top byte of length, p[12..27], is 0 (MAX_EVENT_LENGTH < 2**24)
+    //  - the top byte of timestamp, p[3..18], is within the top bytes
+    //    of the min and max timestamps
+    // Range checks are x - lo <= hi - lo, unsigned, via min_epu8.
+    inline unsigned int resync_mask (const char *p, __m128i ts_lo, __m128i ts_span) {
+        const __m128i one = _mm_set1_epi8 (1);
+        const __m128i type_span = _mm_set1_epi8 ((char)(MAX_TYPE_CODE - 2));
+        __m128i type = _mm_sub_epi8 (_mm_loadu_si128 ((const __m128i*)(p + 4)), one);
+        __m128i ok = _mm_cmpeq_epi8 (_mm_min_epu8 (type, type_span), type);
+        __m128i len_hi = _mm_loadu_si128 ((const __m128i*)(p + 12));
+        ok = _mm_and_si128 (ok, _mm_cmpeq_epi8 (len_hi, _mm_setzero_si128 ()));
+        __m128i ts_hi = _mm_sub_epi8 (_mm_loadu_si128 ((const __m128i*)(p + 3)), ts_lo);
+        ok = _mm_and_si128 (ok, _mm_cmpeq_epi8 (_mm_min_epu8 (ts_hi, ts_span), ts_hi));
+        return (unsigned int)_mm_movemask_epi8 (ok);
+    }
+#endif
+
+    inline bool literal_at (const char *p, const std::string &literal) {
+        return memcmp (p, literal.data (), literal.size ()) == 0;
+    }
+
+    // Does any of literals occur in p[0..n)? With SSE2 each pass
+    // looks at 16 starting positions for every literal: only where
+    // the literal's first and last bytes both line up does it get
+    // compared in full. Statements are short and literals few, so
+    // one pass over the statement for all of them beats one per
+    // literal.
+    bool find_literal (const char *p, size_t n, const std::vector<std::string> &literals) {
+        for (size_t l = 0; l < literals.size (); ++l) {
+            if (literals[l].empty ()) {
+                return true;
+            }
+        }
+        size_t i = 0;
+#if defined(__SSE2__)
+        for (; i + 16 <= n; i += 16) {
+            const __m128i block = _mm_loadu_si128 ((const __m128i*)(p + i));
+            for (size_t l = 0; l < literals.size (); ++l) {
+                const std::string &literal = literals[l];
+                size_t last = literal.size () - 1;
+                if (i + last + 16 > n) {
+                    // Too close to the end to load the last bytes.
+                    for (size_t j = i; j < i + 16 && j + last < n; ++j) {
+                        if (literal_at (p + j, literal)) {
+                            return true;
+                        }
+                    }
+                    continue;
+                }
+                __m128i first = _mm_cmpeq_epi8 (block, _mm_set1_epi8 (literal[0]));
+                __m128i ends = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*)(p + i + last)), _mm_set1_epi8 (literal[last]));
+                unsigned int mask = (unsigned int)_mm_movemask_epi8 (_mm_and_si128 (first, ends));
+                while (mask) {
+                    unsigned int bit = __builtin_ctz (mask);
+                    if (literal_at (p + i + bit, literal)) {
+                        return true;
+                    }
+                    mask &= mask - 1;
+                }
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            for (size_t l = 0; l < literals.size (); ++l) {
+                if (i + literals[l].size () <= n && p[i] == literals[l][0] && literal_at (p + i, literals[l])) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Output helpers for event_formatter, std::string appends without
+    // any formatting machinery in between.
+    template<size_t N>
+    inline void append (std::string &out, const char (&literal)[N]) {
+        out.append (literal, N - 1);
+    }
+
+    inline void append_cstr (std::string &out, const char *s) {
+        out.append (s, strlen (s));
+    }
+
+    // At most len bytes of s, stopping at a NUL like a C string would
+    inline void append_cstr (std::string &out, const char *s, size_t len) {
+        out.append (s, strnlen (s, len));
+    }
+
+    inline void append_uint (std::string &out, unsigned long long v) {
+        char buf[20];
+        char *p = buf + sizeof (buf);
+        do {
+            *--p = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        out.append (p, buf + sizeof (buf) - p);
+    }
+
+    inline void append_int (std::string &out, long long v) {
+        if (v < 0) {
+            out += '-';
+            append_uint (out, 0ULL - (unsigned long long)v);
+        } else {
+            append_uint (out, v);
+        }
+    }
+
+    inline char* put_2digits (char *p, int v) {
+        p[0] = '0' + v / 10;
+        p[1] = '0' + v % 10;
+        return p + 2;
+    }
+
+    // Bytes that can go into a JSON string as they are
+    inline bool json_plain (unsigned char c) {
+        return c >= 0x20 && c < 0x80 && c != '"' && c != '\\';
+    }
+
+    // Length of the valid UTF-8 sequence at p, 0 if there isn't one
+    inline size_t utf8_sequence (const unsigned char *p, size_t avail) {
+        unsigned char c = p[0];
+        size_t len;
+        unsigned char lo = 0x80, hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            len = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            len = 3;
+            // no overlongs, no surrogates
+            lo = c == 0xe0 ? 0xa0 : 0x80;
+            hi = c == 0xed ? 0x9f : 0xbf;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            lo = c == 0xf0 ? 0x90 : 0x80;
+            hi = c == 0xf4 ? 0x8f : 0xbf;
+        } else {
+            return 0;
+        }
+        if (avail < len || p[1] < lo || p[1] > hi) {
+            return 0;
+        }
+        for (size_t i = 2; i < len; ++i) {
+            if (p[i] < 0x80 || p[i] > 0xbf) {
+                return 0;
+            }
+        }
+        return len;
+    }
+
+    // How many bytes from p on can be copied as they are, up to n.
+    // With SSE2 16 at a time: a signed compare against 0x20 catches
+    // both control characters and bytes >= 0x80.
+    inline size_t json_plain_run (const unsigned char *p, size_t n) {
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128i space = _mm_set1_epi8 (0x20);
+        const __m128i quote = _mm_set1_epi8 ('"');
+        const __m128i backslash = _mm_set1_epi8 ('\\');
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128 ((const __m128i*)(p + i));
+            __m128i special = _mm_or_si128 (_mm_cmplt_epi8 (v, space),
+                                            _mm_or_si128 (_mm_cmpeq_epi8 (v, quote), _mm_cmpeq_epi8 (v, backslash)));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8 (special);
+            if (mask) {
+                return i + __builtin_ctz (mask);
+            }
+        }
+#endif
+        while (i < n && json_plain (p[i])) {
+            ++i;
+        }
+        return i;
+    }
+
+    // s[0..len) as a quoted JSON string, in one pass. Statements are
+    // bytes rather than text: valid UTF-8 goes through as it is,
+    // anything else is escaped as \u00XX.
+    void append_json (std::string &out, const char *s, size_t len) {
+        static const char hex[] = "0123456789abcdef";
+        const unsigned char *p = (const unsigned char*)s;
+        out += '"';
+        size_t i = 0;
+        while (i < len) {
+            size_t run = json_plain_run (p + i, len - i);
+            out.append (s + i, run);
+            i += run;
+            if (i == len) {
+                break;
+            }
+            unsigned char c = p[i];
+            size_t seq;
+            if (c >= 0x80 && (seq = utf8_sequence (p + i, len - i)) != 0) {
+                out.append (s + i, seq);
+                i += seq;
+                continue;
+            }
+            switch (c) {
+            case '"': append (out, "\\\""); break;
+            case '\\': append (out, "\\\\"); break;
+            case '\n': append (out, "\\n"); break;
+            case '\r': append (out, "\\r"); break;
+            case '\t': append (out, "\\t"); break;
+            default: {
+                char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+                out.append (esc, sizeof (esc));
+                break;
+            }
+            }
+            ++i;
+        }
+        out += '"';
+    }
+
+    // s[0..len) as a TSV field, with \t, \n, \r, \0 and \\ escaped
+    void append_tsv (std::string &out, const char *s, size_t len) {
+        size_t start = 0;
+        for (size_t i = 0; i < len; ++i) {
+            char esc;
+            switch (s[i]) {
+            case '\t': esc = 't'; break;
+            case '\n': esc = 'n'; break;
+            case '\r': esc = 'r'; break;
+            case '\0': esc = '0'; break;
+            case '\\': esc = '\\'; break;
+            default: continue;
+            }
+            out.append (s + start, i - start);
+            out += '\\';
+            out += esc;
+            start = i + 1;
+        }
+        out.append (s + start, len - start);
+    }
+
+    // What ctime_r writes into buf ("Sun Sep 13 12:26:40 2020\n"), returns its length.
+    size_t format_ctime (time_t t, char *buf) {
+        static const char days[] = "SunMonTueWedThuFriSat";
+        static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        struct tm tm;
+        if (localtime_r (&t, &tm) == NULL || tm.tm_year + 1900 > 9999 || tm.tm_year + 1900 < 1000) {
+            char *s = ctime_r (&t, buf);
+            return s ? strlen (s) : 0;
+        }
+        char *p = buf;
+        memcpy (p, days + 3 * tm.tm_wday, 3);
+        p[3] = ' ';
+        memcpy (p + 4, months + 3 * tm.tm_mon, 3);
+        p[7] = ' ';
+        p += 8;
+        if (tm.tm_mday < 10) {
+            *p++ = ' ';
+            *p++ = '0' + tm.tm_mday;
+        } else {
+            p = put_2digits (p, tm.tm_mday);
+        }
+        *p++ = ' ';
+        p = put_2digits (p, tm.tm_hour);
+        *p++ = ':';
+        p = put_2digits (p, tm.tm_min);
+        *p++ = ':';
+        p = put_2digits (p, tm.tm_sec);
+        *p++ = ' ';
+        int year = tm.tm_year + 1900;
+        p = put_2digits (p, year / 100);
+        p = put_2digits (p, year % 100);
+        *p++ = '\n';
+        return p - buf;
+    }
+
+#ifndef YBINLOGP_NO_MAIN
+    void print_statement_event(yelp::event_printer &out, const event_buffer &ev, int verbosity) {
+        if (ev.data == NULL) {
+            return;
+        }
+        switch ((enum e_event_types)ev.type_code) {
+        case QUERY_EVENT: {
+            const char *statement = query_event_statement((&ev));
+            // Up to a NUL, like a C string
+            size_t statement_len = strnlen (statement, query_event_statement_len((&ev)));
+            if (verbosity <= 1 || statement_len < 5 || memcmp (statement, "BEGIN", 5) != 0) {
+                out.write (statement, statement_len);
+                out.write ("\n", 1);
+            }
+            break;
+        }
+        case XID_EVENT: {
+            if (verbosity <= 1) {
+                out.write ("COMMIT\n", 7);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    // The -a loop, over a binlog or a binlog_set
+    template<typename Iterator>
+    void print_events (Iterator it, Iterator end, int show_all, int num_to_show, yelp::output_format format) {
+        yelp::event_printer out (STDOUT_FILENO, format);
+        // JSON and TSV lines end themselves
+        bool text = format == yelp::FORMAT_TEXT;
+        try {
+            if (show_all) {
+                for (; it != end; ++it) {
+                    out.print (*it->get_buffer ());
+                    if (text) {
+                        out.write ("\n", 1);
+                    }
+                }
+                return;
+            }
+            for (int n = 0; n < num_to_show && it != end ; ++n, ++it) {
+                if (q_mode && text) {
+                    ::print_statement_event(out, *(it->get_buffer()), q_mode);
+                }
+                out.print (*it->get_buffer ());
+            }
+        } catch (...) {
+            // Whatever made it this far should be out before we go.
+            out.flush ();
+            throw;
+        }
+    }
+
+    // -X, the events' metadata into a column file
+    template<typename Iterator>
+    uint64_t export_events (Iterator it, Iterator end, const char *path) {
+        yelp::column_writer writer (path);
+        for (; it != end; ++it) {
+            writer.add (*it->get_buffer ());
+        }
+        writer.close ();
+        return writer.rows ();
+    }
+
+    // mysql://[user[:password]@]host[:port][/binlog]
+    struct server_url {
+        server_url () : port (3306) { }
+        std::string user;
+        std::string password;
+        std::string host;
+        uint16_t port;
+        std::string file;
+    };
+
+    bool parse_server_url (const std::string &url, server_url &out) {
+        static const std::string scheme ("mysql://");
+        if (url.compare (0, scheme.size (), scheme) != 0) {
+            return false;
+        }
+        std::string rest = url.substr (scheme.size ());
+        size_t slash = rest.find ('/');
+        if (slash != std::string::npos) {
+            out.file = rest.substr (slash + 1);
+            rest.erase (slash);
+        }
+        size_t at = rest.rfind ('@');
+        if (at != std::string::npos) {
+            std::string login = rest.substr (0, at);
+            rest.erase (0, at + 1);
+            size_t colon = login.find (':');
+            out.user = login.substr (0, colon);
+            if (colon != std::string::npos) {
+                out.password = login.substr (colon + 1);
+            }
+        }
+        size_t colon = rest.rfind (':');
+        // [::1]:3306
+        if (!rest.empty () && rest[0] == '[') {
+            size_t close = rest.find (']');
+            if (close == std::string::npos) {
+                return false;
+            }
+            colon = rest.find (':', close);
+            out.host = rest.substr (1, close - 1);
+        } else {
+            out.host = rest.substr (0, colon);
+        }
+        if (colon != std::string::npos) {
+            char *end;
+            unsigned long port = strtoul (rest.c_str () + colon + 1, &end, 10);
+            if (*end != '\0' || port == 0 || port > 65535) {
+                return false;
+            }
+            out.port = (uint16_t)port;
+        }
+        return !out.host.empty ();
+    }
+#endif
+
+    // event_stats::report's orders
+    bool bytes_descending (const std::pair<std::string, yelp::event_stats::counter> &a,
+                           const std::pair<std::string, yelp::event_stats::counter> &b) {
+        return a.second.bytes != b.second.bytes ? a.second.bytes > b.second.bytes : a.first < b.first;
+    }
+
+    bool minute_ascending (const std::pair<uint32_t, yelp::event_stats::counter> &a,
+                           const std::pair<uint32_t, yelp::event_stats::counter> &b) {
+        return a.first < b.first;
+    }
+
+    // Does a QUERY_EVENT's statement start with the keyword word
+    // (upper case), give or take case and leading whitespace? rest is
+    // left at what follows it.
+    bool statement_is (const event_buffer &ev, const char *word, const char **rest = NULL) {
+        const struct query_event_buffer *q = (const struct query_event_buffer*)ev.data;
+        if (ev.type_code != QUERY_EVENT || q == NULL || event_data_len ((&ev)) < sizeof (*q) ||
+            sizeof (*q) + q->status_var_len + q->db_name_len + 1 > event_data_len ((&ev))) {
+            return false;
+        }
+        const char *p = query_event_statement ((&ev));
+        const char *end = p + query_event_statement_len ((&ev));
+        while (p < end && isspace ((unsigned char)*p)) {
+            ++p;
+        }
+        size_t len = strlen (word);
+        if ((size_t)(end - p) < len || strncasecmp (p, word, len) != 0) {
+            return false;
+        }
+        p += len;
+        if (p < end && (isalnum ((unsigned char)*p) || *p == '_')) {
+            return false;
+        }
+        if (rest) {
+            *rest = p;
+        }
+        return true;
+    }
+
+    // ROLLBACK, but not ROLLBACK TO SAVEPOINT, which carries on.
+    bool statement_is_rollback (const event_buffer &ev) {
+        const char *rest;
+        if (!statement_is (ev, "ROLLBACK", &rest)) {
+            return false;
+        }
+        const char *end = query_event_statement ((&ev)) + query_event_statement_len ((&ev));
+        while (rest < end && isspace ((unsigned char)*rest)) {
+            ++rest;
+        }
+        return !(end - rest >= 2 && strncasecmp (rest, "TO", 2) == 0 &&
+                 (end - rest == 2 || !isalnum ((unsigned char)rest[2])));
+    }
+
+#ifndef YBINLOGP_NO_MAIN
+    // -e takes a type_code or its name, -1 if it's neither
+    int parse_event_type (const char *arg) {
+        char *end;
+        long type_code = strtol (arg, &end, 10);
+        if (*arg != '\0' && *end == '\0') {
+            return type_code >= 0 && type_code < 256 ? (int)type_code : -1;
+        }
+        for (size_t i = 0; i < sizeof (event_types) / sizeof (event_types[0]); ++i) {
+            if (strcasecmp (arg, event_types[i]) == 0) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    // -s and --server-id, a server id is 32 bits unsigned
+    bool parse_server_id (const char *arg, uint32_t &server_id) {
+        char *end;
+        errno = 0;
+        unsigned long long id = strtoull (arg, &end, 10);
+        if (!isdigit ((unsigned char)*arg) || *end != '\0' || errno == ERANGE || id > 0xffffffffULL) {
+            return false;
+        }
+        server_id = (uint32_t)id;
+        return true;
+    }
+
+    // -f, everything from here on (or the first limit events, 0 for
+    // no limit) as soon as it's been written.
+    template <typename Iterator>
+    void follow_events (Iterator it, Iterator end, int limit, yelp::output_format format) {
+        yelp::event_printer out (STDOUT_FILENO, format);
+        for (int n = 0; it != end; ) {
+            out.print (*it->get_buffer ());
+            if (format == yelp::FORMAT_TEXT) {
+                out.write ("\n", 1);
+            }
+            out.flush ();
+            // Don't go waiting for one more than we want
+            if (limit && ++n >= limit) {
+                break;
+            }
+            ++it;
+        }
+    }
+
+    // -S, -f and a server: whatever the options ask for, over a
+    // binlog_set or a replication_stream.
+    template<typename Source>
+    void read_events (Source &source, bool stats, const char *export_path, bool follow, int show_all, int num_to_show,
+                      yelp::output_format format) {
+        if (stats) {
+            yelp::event_stats totals;
+            for (typename Source::iterator it = source.begin (); it != source.end (); ++it) {
+                totals.add (*it->get_buffer ());
+            }
+            totals.report (std::cout);
+        } else if (export_path) {
+            uint64_t n = export_events (source.begin (), source.end (), export_path);
+            fprintf (stderr, "Exported %llu events to %s\n", (unsigned long long)n, export_path);
+        } else if (follow) {
+            source.set_follow (true);
+            follow_events (source.begin (), source.end (), show_all ? 0 : num_to_show, format);
+        } else {
+            print_events (source.begin (), source.end (), show_all, num_to_show, format);
+        }
+    }
+
+    // parallel_scan worker printing events the way -a all does.
+    class print_worker : public yelp::scan_worker {
+    public:
+        explicit print_worker (yelp::output_format format) : m_formatter (format) { }
+
+        virtual void event (const yelp::binlog::event_view &ev, std::string &out) {
+            m_formatter.format (out, ev.header ());
+            if (m_formatter.style () == yelp::FORMAT_TEXT) {
+                out += '\n';
+            }
+        }
+    private:
+        yelp::event_formatter m_formatter;
+    };
+
+    // parallel_scan worker for --stats, every thread counts on its own
+    class stats_worker : public yelp::scan_worker {
+    public:
+        virtual void event (const yelp::binlog::event_view &ev, std::string &) {
+            m_stats.add (ev.header ());
+        }
+        yelp::event_stats& stats () { return m_stats; }
+    private:
+        yelp::event_stats m_stats;
+    };
+
+    // --stats-io, after everything else. Whatever elapsed time the
+    // phases don't account for went on parsing, formatting and writing.
+    void report_io (const yelp::binlog_counters &counters, const struct timeval &started) {
+        struct timeval now;
+        gettimeofday (&now, NULL);
+        double elapsed = (now.tv_sec - started.tv_sec) + (now.tv_usec - started.tv_usec) / 1e6;
+        std::cerr << "io counters" << std::endl;
+        counters.report (std::cerr);
+        std::cerr << boost::format ("  %-40s %16.6f\n") % "elapsed (s)" % elapsed;
+    }
+
+    // Long options that have no short one
+    enum {
+        OPT_STATS = 256,
+        OPT_STATS_IO,
+        OPT_SERVER_ID,
+        OPT_GTID
+    };
+
+    const struct option long_options[] = {
+        { "stats", no_argument, NULL, OPT_STATS },
+        { "stats-io", no_argument, NULL, OPT_STATS_IO },
+        { "server-id", required_argument, NULL, OPT_SERVER_ID },
+        { "gtid", required_argument, NULL, OPT_GTID },
+        { NULL, 0, NULL, 0 }
+    };
+#endif
+}
+
+
+namespace yelp {
+    event_formatter::event_formatter (output_format format)
+        : m_format (format), m_date_time (-1), m_date_len (0)
+    { }
+
+
+    void event_formatter::format (std::string &out, const event_buffer &ev) {
+        switch (m_format) {
+        case FORMAT_JSON:
+            format_json (out, ev);
+            break;
+        case FORMAT_TSV:
+            format_tsv (out, ev);
+            break;
+        default:
+            format_text (out, ev);
+            break;
+        }
+    }
+
+
+    void event_formatter::format_text (std::string &out, const event_buffer &ev) {
+        const time_t t = ev.timestamp;
+        if (t != m_date_time) {
+            m_date_len = format_ctime (t, m_date);
+            m_date_time = t;
+        }
+        append (out, "BYTE OFFSET ");
+        append_int (out, (long long)ev.offset);
+        append (out, "\n------------------------\ntimestamp:          ");
+        append_uint (out, ev.timestamp);
+        append (out, " = ");
+        out.append (m_date, m_date_len);
+        append (out, "type_code:          ");
+        append_cstr (out, event_type_name (ev.type_code));
+        append (out, "\n");
+        if (q_mode > 1) {
+            return;
+        }
+        append (out, "server id:          ");
+        append_uint (out, ev.server_id);
+        append (out, "\nlength:             ");
+        append_uint (out, ev.length);
+        append (out, "\nnext pos:           ");
+        append_uint (out, ev.next_position);
+        append (out, "\nflags:              ");
+        char bits[17];
+        for (int i=16; i > 0; --i) {
+            bits[16 - i] = get_bit (ev.flags, i) ? '1' : '0';
+        }
+        bits[16] = '\n';
+        out.append (bits, sizeof (bits));
+        for (int i=16; i > 0; --i) {
+            if (get_bit (ev.flags, i)) {
+                append (out, "                        ");
+                // only the low bits have names
+                append_cstr (out, flags[i-1] ? flags[i-1] : "");
+                append (out, "\n");
+            }
+        }
+        if (ev.data == NULL) {
+            return;
+        }
+        switch ((e_event_types)ev.type_code) {
+        case QUERY_EVENT: {
+            struct query_event_buffer *q = (struct query_event_buffer*)(ev.data);
+            const char* db_name = query_event_db_name((&ev));
+            size_t statement_len = query_event_statement_len((&ev));
+            append (out, "thread id:          ");
+            append_uint (out, q->thread_id);
+            append (out, "\nquery time (s):     ");
+            append_uint (out, q->query_time);
+            append (out, q->error_code == 0 ? "\nerror code:         " : "\nERROR CODE:         ");
+            append_uint (out, q->error_code);
+            append (out, "\nstatus var length:  ");
+            append_uint (out, q->status_var_len);
+            append (out, "\ndb_name:            ");
+            append_cstr (out, db_name, q->db_name_len);
+            append (out, "\nstatement length:   ");
+            append_uint (out, statement_len);
+            append (out, "\n");
+            if (q_mode == 0) {
+                // Like a C string, the statement stops at a NUL
+                append (out, "statement:          ");
+                append_cstr (out, query_event_statement((&ev)), statement_len);
+                append (out, "\n");
+            }
+            break;
+        }
+        case ROTATE_EVENT: {
+            struct rotate_event_buffer *r = (struct rotate_event_buffer*)ev.data;
+            append (out, "next log position:  ");
+            append_uint (out, r->next_position);
+            append (out, "\nnext file name:     ");
+            append_cstr (out, rotate_event_file_name((&ev)), rotate_event_file_name_len((&ev)));
+            append (out, "\n");
+            break;
+        }
+        case INTVAR_EVENT: {
+            struct intvar_event_buffer *i = (struct intvar_event_buffer*)ev.data;
+            append (out, "variable type:      ");
+            append_cstr (out, i->type < sizeof (intvar_types) / sizeof (intvar_types[0]) ? intvar_types[i->type] : "");
+            append (out, "\nvalue: \t            ");
+            append_uint (out, i->value);
+            append (out, "\n");
+            break;
+        }
+        case RAND_EVENT: {
+            struct rand_event_buffer *r = (struct rand_event_buffer*)ev.data;
+            append (out, "seed 1:\t            ");
+            append_uint (out, r->seed_1);
+            append (out, "\nseed 2:\t            ");
+            append_uint (out, r->seed_2);
+            append (out, "\n");
+            break;
+        }
+        case FORMAT_DESCRIPTION_EVENT: {
+            struct format_description_event_buffer *f = (struct format_description_event_buffer*)ev.data;
+            append (out, "binlog version:     ");
+            append_uint (out, f->format_version);
+            append (out, "\nserver version:     ");
+            append_cstr (out, f->server_version, sizeof (f->server_version));
+            append (out, "\nvariable length:    ");
+            append_uint (out, format_description_event_data_len((&ev)));
+            append (out, "\n");
+            break;
+        }
+        case XID_EVENT: {
+            struct xid_event_buffer *x = (struct xid_event_buffer*)ev.data;
+            append (out, "xid id:             ");
+            append_uint (out, x->id);
+            append (out, "\n");
+            break;
+        }
+        case GTID_LOG_EVENT: {
+            binlog::gtid_entry g;
+            try {
+                g = binlog::gtid_entry (ev);
+            } catch (const std::runtime_error &) {
+                break;
+            }
+            append (out, "gtid:               ");
+            out += g.id.str ();
+            append (out, "\nlast committed:     ");
+            append_int (out, g.last_committed);
+            append (out, "\nsequence number:    ");
+            append_int (out, g.sequence_number);
+            append (out, "\n");
+            break;
+        }
+        case PREVIOUS_GTIDS_LOG_EVENT: {
+            gtid_set previous;
+            try {
+                previous = gtid_set (ev);
+            } catch (const std::runtime_error &) {
+                break;
+            }
+            append (out, "previous gtids:     ");
+            out += previous.str ();
+            append (out, "\n");
+            break;
+        }
+        case ROWS_QUERY_LOG_EVENT: {
+            if (q_mode == 0 && event_data_len ((&ev)) >= sizeof (struct rows_query_event_buffer)) {
+                append (out, "statement:          ");
+                out.append (rows_query_event_statement ((&ev)), rows_query_event_statement_len ((&ev)));
+                append (out, "\n");
+            }
+            break;
+        }
+        case TABLE_MAP_EVENT: {
+            binlog::table_map_entry t;
+            try {
+                t = binlog::table_map_entry (ev);
+            } catch (const std::runtime_error &) {
+                break;
+            }
+            append (out, "table id:           ");
+            append_uint (out, t.table_id);
+            append (out, "\ndb_name:            ");
+            out += t.database;
+            append (out, "\ntable name:         ");
+            out += t.table;
+            append (out, "\ncolumns:            ");
+            append_uint (out, t.columns ());
+            append (out, "\n");
+            break;
+        }
+        case WRITE_ROWS_EVENT_V1:
+        case UPDATE_ROWS_EVENT_V1:
+        case DELETE_ROWS_EVENT_V1:
+        case WRITE_ROWS_EVENT:
+        case UPDATE_ROWS_EVENT:
+        case DELETE_ROWS_EVENT: {
+            if (event_data_len ((&ev)) < sizeof (struct rows_event_buffer)) {
+                break;
+            }
+            struct rows_event_buffer *r = (struct rows_event_buffer*)ev.data;
+            append (out, "table id:           ");
+            append_uint (out, read_le (r->table_id, sizeof (r->table_id)));
+            append (out, "\n");
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+
+    void event_formatter::format_json (std::string &out, const event_buffer &ev) {
+        append (out, "{\"offset\":");
+        append_int (out, (long long)ev.offset);
+        append (out, ",\"timestamp\":");
+        append_uint (out, ev.timestamp);
+        append (out, ",\"type_code\":");
+        append_uint (out, ev.type_code);
+        append (out, ",\"type\":\"");
+        append_cstr (out, event_type_name (ev.type_code));
+        append (out, "\",\"server_id\":");
+        append_uint (out, ev.server_id);
+        append (out, ",\"length\":");
+        append_uint (out, ev.length);
+        append (out, ",\"next_position\":");
+        append_uint (out, ev.next_position);
+        append (out, ",\"flags\":");
+        append_uint (out, ev.flags);
+        if (ev.data == NULL || q_mode > 1) {
+            append (out, "}\n");
+            return;
+        }
+        size_t size = event_data_len ((&ev));
+        switch ((e_event_types)ev.type_code) {
+        case QUERY_EVENT: {
+            struct query_event_buffer *q = (struct query_event_buffer*)(ev.data);
+            if (size < sizeof (*q) || sizeof (*q) + q->status_var_len + q->db_name_len + 1 > size) {
+                break;
+            }
+            append (out, ",\"query\":{\"thread_id\":");
+            append_uint (out, q->thread_id);
+            append (out, ",\"query_time\":");
+            append_uint (out, q->query_time);
+            append (out, ",\"error_code\":");
+            append_uint (out, q->error_code);
+            append (out, ",\"database\":");
+            append_json (out, query_event_db_name ((&ev)), q->db_name_len);
+            if (q_mode == 0) {
+                append (out, ",\"statement\":");
+                append_json (out, query_event_statement ((&ev)), query_event_statement_len ((&ev)));
+            }
+            out += '}';
+            break;
+        }
+        case ROTATE_EVENT: {
+            if (size < sizeof (struct rotate_event_buffer)) {
+                break;
+            }
+            struct rotate_event_buffer *r = (struct rotate_event_buffer*)ev.data;
+            append (out, ",\"rotate\":{\"next_position\":");
+            append_uint (out, r->next_position);
+            append (out, ",\"next_file\":");
+            append_json (out, rotate_event_file_name ((&ev)), rotate_event_file_name_len ((&ev)));
+            out += '}';
+            break;
+        }
+        case INTVAR_EVENT: {
+            if (size < sizeof (struct intvar_event_buffer)) {
+                break;
+            }
+            struct intvar_event_buffer *i = (struct intvar_event_buffer*)ev.data;
+            append (out, ",\"intvar\":{\"type\":");
+            append_uint (out, i->type);
+            append (out, ",\"value\":");
+            append_uint (out, i->value);
+            out += '}';
+            break;
+        }
+        case RAND_EVENT: {
+            if (size < sizeof (struct rand_event_buffer)) {
+                break;
+            }
+            struct rand_event_buffer *r = (struct rand_event_buffer*)ev.data;
+            append (out, ",\"rand\":{\"seed_1\":");
+            append_uint (out, r->seed_1);
+            append (out, ",\"seed_2\":");
+            append_uint (out, r->seed_2);
+            out += '}';
+            break;
+        }
+        case FORMAT_DESCRIPTION_EVENT: {
+            if (size < sizeof (struct format_description_event_buffer)) {
+                break;
+            }
+            struct format_description_event_buffer *f = (struct format_description_event_buffer*)ev.data;
+            append (out, ",\"format_description\":{\"format_version\":");
+            append_uint (out, f->format_version);
+            append (out, ",\"server_version\":");
+            append_json (out, f->server_version, strnlen (f->server_version, sizeof (f->server_version)));
+            append (out, ",\"create_timestamp\":");
+            append_uint (out, f->create_timestamp);
+            append (out, ",\"header_len\":");
+            append_uint (out, f->header_len);
+            out += '}';
+            break;
+        }
+        case XID_EVENT: {
+            if (size < sizeof (struct xid_event_buffer)) {
+                break;
+            }
+            struct xid_event_buffer *x = (struct xid_event_buffer*)ev.data;
+            append (out, ",\"xid\":{\"id\":");
+            append_uint (out, x->id);
+            out += '}';
+            break;
+        }
+        case GTID_LOG_EVENT: {
+            binlog::gtid_entry g;
+            try {
+                g = binlog::gtid_entry (ev);
+            } catch (const std::runtime_error &) {
+                break;
+            }
+            std::string id = g.id.str ();
+            append (out, ",\"gtid\":{\"gtid\":");
+            append_json (out, id.data (), id.size ());
+            append (out, ",\"flags\":");
+            append_uint (out, g.flags);
+            append (out, ",\"last_committed\":");
+            append_int (out, g.last_committed);
+            append (out, ",\"sequence_number\":");
+            append_int (out, g.sequence_number);
+            out += '}';
+            break;
+        }
+        case PREVIOUS_GTIDS_LOG_EVENT: {
+            gtid_set previous;
+            try {
+                previous = gtid_set (ev);
+            } catch (const std::runtime_error &) {
+                break;
+            }
+            std::string gtids = previous.str ();
+            append (out, ",\"previous_gtids\":{\"gtids\":");
+            append_json (out, gtids.data (), gtids.size ());
+            out += '}';
+            break;
+        }
+        case ROWS_QUERY_LOG_EVENT: {
+            if (q_mode == 0 && size >= sizeof (struct rows_query_event_buffer)) {
+                append (out, ",\"rows_query\":{\"statement\":");
+                append_json (out, rows_query_event_statement ((&ev)), rows_query_event_statement_len ((&ev)));
+                out += '}';
+            }
+            break;
+        }
+        case TABLE_MAP_EVENT: {
+            binlog::table_map_entry t;
+            try {
+                t = binlog::table_map_entry (ev);
+            } catch (const std::runtime_error &) {
+                break;
+            }
+            append (out, ",\"table_map\":{\"table_id\":");
+            append_uint (out, t.table_id);
+            append (out, ",\"database\":");
+            append_json (out, t.database.data (), t.database.size ());
+            append (out, ",\"table\":");
+            append_json (out, t.table.data (), t.table.size ());
+            append (out, ",\"columns\":");
+            append_uint (out, t.columns ());
+            out += '}';
+            break;
+        }
+        case WRITE_ROWS_EVENT_V1:
+        case UPDATE_ROWS_EVENT_V1:
+        case DELETE_ROWS_EVENT_V1:
+        case WRITE_ROWS_EVENT:
+        case UPDATE_ROWS_EVENT:
+        case DELETE_ROWS_EVENT: {
+            if (size < sizeof (struct rows_event_buffer)) {
+                break;
+            }
+            struct rows_event_buffer *r = (struct rows_event_buffer*)ev.data;
+            append (out, ",\"rows\":{\"table_id\":");
+            append_uint (out, read_le (r->table_id, sizeof (r->table_id)));
+            out += '}';
+            break;
+        }
+        default:
+            break;
+        }
+        append (out, "}\n");
+    }
+
+
+    void event_formatter::format_tsv (std::string &out, const event_buffer &ev) {
+        append_int (out, (long long)ev.offset);
+        out += '\t';
+        append_uint (out, ev.timestamp);
+        out += '\t';
+        append_cstr (out, event_type_name (ev.type_code));
+        out += '\t';
+        append_uint (out, ev.server_id);
+        out += '\t';
+        append_uint (out, ev.length);
+        out += '\t';
+        append_uint (out, ev.next_position);
+        out += '\t';
+        append_uint (out, ev.flags);
+        // database and detail
+        out += '\t';
+        if (ev.data == NULL || q_mode > 1) {
+            append (out, "\t\n");
+            return;
+        }
+        size_t size = event_data_len ((&ev));
+        switch ((e_event_types)ev.type_code) {
+        case QUERY_EVENT: {
+            struct query_event_buffer *q = (struct query_event_buffer*)(ev.data);
+            if (size < sizeof (*q) || sizeof (*q) + q->status_var_len + q->db_name_len + 1 > size) {
+                out += '\t';
+                break;
+            }
+            append_tsv (out, query_event_db_name ((&ev)), q->db_name_len);
+            out += '\t';
+            if (q_mode == 0) {
+                append_tsv (out, query_event_statement ((&ev)), query_event_statement_len ((&ev)));
+            }
+            break;
+        }
+        case ROTATE_EVENT:
+            out += '\t';
+            if (size >= sizeof (struct rotate_event_buffer)) {
+                append_tsv (out, rotate_event_file_name ((&ev)), rotate_event_file_name_len ((&ev)));
+            }
+            break;
+        case INTVAR_EVENT:
+            out += '\t';
+            if (size >= sizeof (struct intvar_event_buffer)) {
+                struct intvar_event_buffer *i = (struct intvar_event_buffer*)ev.data;
+                append_uint (out, i->type);
+                out += '=';
+                append_uint (out, i->value);
+            }
+            break;
+        case RAND_EVENT:
+            out += '\t';
+            if (size >= sizeof (struct rand_event_buffer)) {
+                struct rand_event_buffer *r = (struct rand_event_buffer*)ev.data;
+                append_uint (out, r->seed_1);
+                out += ',';
+                append_uint (out, r->seed_2);
+            }
+            break;
+        case XID_EVENT:
+            out += '\t';
+            if (size >= sizeof (struct xid_event_buffer)) {
+                append_uint (out, ((struct xid_event_buffer*)ev.data)->id);
+            }
+            break;
+        case GTID_LOG_EVENT: {
+            out += '\t';
+            yelp::gtid id;
+            if (event_gtid (ev, id)) {
+                out += id.str ();
+            }
+            break;
+        }
+        case PREVIOUS_GTIDS_LOG_EVENT: {
+            out += '\t';
+            gtid_set previous;
+            try {
+                previous = gtid_set (ev);
+            } catch (const std::runtime_error &) {
+                break;
+            }
+            out += previous.str ();
+            break;
+        }
+        case ROWS_QUERY_LOG_EVENT:
+            out += '\t';
+            if (q_mode == 0 && size >= sizeof (struct rows_query_event_buffer)) {
+                append_tsv (out, rows_query_event_statement ((&ev)), rows_query_event_statement_len ((&ev)));
+            }
+            break;
+        case TABLE_MAP_EVENT: {
+            binlog::table_map_entry t;
+            try {
+                t = binlog::table_map_entry (ev);
+            } catch (const std::runtime_error &) {
+                out += '\t';
+                break;
+            }
+            append_tsv (out, t.database.data (), t.database.size ());
+            out += '\t';
+            append_tsv (out, t.table.data (), t.table.size ());
+            break;
+        }
+        case WRITE_ROWS_EVENT_V1:
+        case UPDATE_ROWS_EVENT_V1:
+        case DELETE_ROWS_EVENT_V1:
+        case WRITE_ROWS_EVENT:
+        case UPDATE_ROWS_EVENT:
+        case DELETE_ROWS_EVENT:
+            out += '\t';
+            if (size >= sizeof (struct rows_event_buffer)) {
+                append_uint (out, read_le (((struct rows_event_buffer*)ev.data)->table_id, 6));
+            }
+            break;
+        default:
+            out += '\t';
+            break;
+        }
+        out += '\n';
+    }
+
+
+    event_batch::event_batch (unsigned fields)
+        : m_fields (fields & ALL_FIELDS), m_size (0)
+    {
+        clear ();
+    }
+
+
+    const char* event_batch::field_name (size_t i) {
+        static const char *names[FIELD_COUNT] = {
+            "offset", "timestamp", "type_code", "server_id", "length", "next_position", "flags",
+            "thread_id", "query_time", "error_code", "database", "statement"
+        };
+        return i < FIELD_COUNT ? names[i] : NULL;
+    }
+
+
+    event_batch::field event_batch::field_named (const std::string &name) {
+        for (size_t i = 0; i < FIELD_COUNT; ++i) {
+            if (name == field_name (i)) {
+                return (field)(1 << i);
+            }
+        }
+        throw std::invalid_argument ((boost::format ("no field called '%s'") % name).str ());
+    }
+
+
+    void event_batch::clear () {
+        m_size = 0;
+        offset.clear ();
+        timestamp.clear ();
+        type_code.clear ();
+        server_id.clear ();
+        length.clear ();
+        next_position.clear ();
+        flags.clear ();
+        thread_id.clear ();
+        query_time.clear ();
+        error_code.clear ();
+        database_offsets.assign (1, 0);
+        databases.clear ();
+        statement_offsets.assign (1, 0);
+        statements.clear ();
+    }
+
+
+    void event_batch::add (const event_buffer &evbuf) {
+        if (m_fields & OFFSET) {
+            offset.push_back (evbuf.offset);
+        }
+        if (m_fields & TIMESTAMP) {
+            timestamp.push_back (evbuf.timestamp);
+        }
+        if (m_fields & TYPE_CODE) {
+            type_code.push_back (evbuf.type_code);
+        }
+        if (m_fields & SERVER_ID) {
+            server_id.push_back (evbuf.server_id);
+        }
+        if (m_fields & LENGTH) {
+            length.push_back (evbuf.length);
+        }
+        if (m_fields & NEXT_POSITION) {
+            next_position.push_back (evbuf.next_position);
+        }
+        if (m_fields & FLAGS) {
+            flags.push_back (evbuf.flags);
+        }
+        ++m_size;
+        if (!(m_fields & (THREAD_ID | QUERY_TIME | ERROR_CODE | DATABASE | STATEMENT))) {
+            return;
+        }
+
+        uint32_t thread = 0, time = 0;
+        uint16_t error = 0;
+        const struct query_event_buffer *q = (const struct query_event_buffer*)evbuf.data;
+        if (evbuf.type_code == QUERY_EVENT && q != NULL && event_data_len ((&evbuf)) >= sizeof (*q) &&
+            sizeof (*q) + q->status_var_len + q->db_name_len + 1 <= event_data_len ((&evbuf))) {
+            thread = q->thread_id;
+            time = q->query_time;
+            error = q->error_code;
+            if (m_fields & DATABASE) {
+                databases.append (query_event_db_name ((&evbuf)), q->db_name_len);
+            }
+            if (m_fields & STATEMENT) {
+                statements.append (query_event_statement ((&evbuf)), query_event_statement_len ((&evbuf)));
+            }
+        }
+        if (m_fields & THREAD_ID) {
+            thread_id.push_back (thread);
+        }
+        if (m_fields & QUERY_TIME) {
+            query_time.push_back (time);
+        }
+        if (m_fields & ERROR_CODE) {
+            error_code.push_back (error);
+        }
+        if (m_fields & DATABASE) {
+            database_offsets.push_back (databases.size ());
+        }
+        if (m_fields & STATEMENT) {
+            statement_offsets.push_back (statements.size ());
+        }
+    }
+
+
+    column_writer::column_writer (const std::string &filename, uint32_t batch_rows)
+        : m_filename (filename), m_tmp (filename + ".tmp"), m_file (NULL), m_position (0),
+          m_batch_rows (batch_rows ? batch_rows : 1), m_rows (0)
+    {
+        if ((m_file = fopen (m_tmp.c_str (), "wb")) == NULL) {
+            throw std::runtime_error (std::string ("fopen: ") + ::strerror (errno));
+        }
+        setvbuf (m_file, NULL, _IOFBF, 1 << 20);
+        struct column_file_header h;
+        memset (&h, 0, sizeof (h));
+        memcpy (h.magic, COLUMN_MAGIC, sizeof (h.magic));
+        h.version = COLUMN_VERSION;
+        h.column_count = EXPORT_COLUMNS;
+        h.batch_rows = m_batch_rows;
+        write (&h, sizeof (h));
+        for (size_t c = 0; c < EXPORT_COLUMNS; ++c) {
+            struct column_desc d;
+            memset (&d, 0, sizeof (d));
+            strncpy (d.name, export_columns[c].name, sizeof (d.name) - 1);
+            d.kind = export_columns[c].kind;
+            d.width = export_columns[c].width;
+            write (&d, sizeof (d));
+        }
+    }
+
+
+    column_writer::~column_writer () {
+        if (m_file) {
+            fclose (m_file);
+            unlink (m_tmp.c_str ());
+        }
+    }
+
+
+    void column_writer::write (const void *data, size_t len) {
+        if (len && fwrite (data, len, 1, m_file) != 1) {
+            throw std::runtime_error (std::string ("fwrite: ") + ::strerror (errno));
+        }
+        m_position += len;
+    }
+
+
+    void column_writer::pad () {
+        static const char zeros[8] = { 0 };
+        write (zeros, pad8 (m_position) - m_position);
+    }
+
+
+    template <typename T>
+    void column_writer::write_column (const std::vector<T> &column) {
+        if (!column.empty ()) {
+            write (&column[0], column.size () * sizeof (T));
+        }
+        pad ();
+    }
+
+
+    void column_writer::add (const event_buffer &evbuf) {
+        uint32_t thread_id = 0, query_time = 0, database = COLUMN_NONE;
+        uint16_t error_code = 0;
+        const struct query_event_buffer *q = (const struct query_event_buffer*)evbuf.data;
+        if (evbuf.type_code == QUERY_EVENT && q != NULL && event_data_len ((&evbuf)) >= sizeof (*q) &&
+            sizeof (*q) + q->status_var_len + q->db_name_len + 1 <= event_data_len ((&evbuf))) {
+            thread_id = q->thread_id;
+            query_time = q->query_time;
+            error_code = q->error_code;
+            std::string db (query_event_db_name ((&evbuf)), q->db_name_len);
+            std::map<std::string, uint32_t>::iterator it = m_dictionary_ids.find (db);
+            if (it == m_dictionary_ids.end ()) {
+                it = m_dictionary_ids.insert (std::make_pair (db, (uint32_t)m_dictionary.size ())).first;
+                m_dictionary.push_back (db);
+            }
+            database = it->second;
+            m_statements.append (query_event_statement ((&evbuf)), query_event_statement_len ((&evbuf)));
+        }
+        m_offset.push_back (evbuf.offset);
+        m_timestamp.push_back (evbuf.timestamp);
+        m_type_code.push_back (evbuf.type_code);
+        m_server_id.push_back (evbuf.server_id);
+        m_length.push_back (evbuf.length);
+        m_thread_id.push_back (thread_id);
+        m_query_time.push_back (query_time);
+        m_error_code.push_back (error_code);
+        m_database.push_back (database);
+        m_statement_end.push_back (m_statements.size ());
+        ++m_rows;
+        if (m_offset.size () >= m_batch_rows) {
+            write_batch ();
+        }
+    }
+
+
+    void column_writer::write_batch () {
+        size_t rows = m_offset.size ();
+        if (rows == 0) {
+            return;
+        }
+        struct column_batch_header h;
+        memcpy (h.magic, COLUMN_BATCH_MAGIC, sizeof (h.magic));
+        h.rows = rows;
+        h.size = sizeof (h);
+        for (size_t c = 0; c < EXPORT_COLUMNS; ++c) {
+            if (export_columns[c].kind == COLUMN_BLOB) {
+                h.size += pad8 ((rows + 1) * sizeof (uint64_t) + m_statements.size ());
+            } else {
+                h.size += pad8 (rows * export_columns[c].width);
+            }
+        }
+        m_batches.push_back (m_position);
+        write (&h, sizeof (h));
+        write_column (m_offset);
+        write_column (m_timestamp);
+        write_column (m_type_code);
+        write_column (m_server_id);
+        write_column (m_length);
+        write_column (m_thread_id);
+        write_column (m_query_time);
+        write_column (m_error_code);
+        write_column (m_database);
+        // offsets, starting with the 0 the ends don't have
+        uint64_t zero = 0;
+        write (&zero, sizeof (zero));
+        write (&m_statement_end[0], rows * sizeof (uint64_t));
+        write (m_statements.data (), m_statements.size ());
+        pad ();
+
+        m_offset.clear ();
+        m_timestamp.clear ();
+        m_type_code.clear ();
+        m_server_id.clear ();
+        m_length.clear ();
+        m_thread_id.clear ();
+        m_query_time.clear ();
+        m_error_code.clear ();
+        m_database.clear ();
+        m_statement_end.clear ();
+        m_statements.clear ();
+    }
+
+
+    void column_writer::close () {
+        if (m_file == NULL) {
+            return;
+        }
+        write_batch ();
+        struct column_footer f;
+        memcpy (f.magic, COLUMN_FOOTER_MAGIC, sizeof (f.magic));
+        f.dictionary_count = m_dictionary.size ();
+        f.rows = m_rows;
+        f.batch_count = m_batches.size ();
+        struct column_trailer t;
+        t.footer_offset = m_position;
+        memcpy (t.magic, COLUMN_MAGIC, sizeof (t.magic));
+        t.version = COLUMN_VERSION;
+
+        write (&f, sizeof (f));
+        write_column (m_batches);
+        std::vector<uint64_t> ends (1, 0);
+        std::vector<char> names;
+        for (size_t i = 0; i < m_dictionary.size (); ++i) {
+            names.insert (names.end (), m_dictionary[i].begin (), m_dictionary[i].end ());
+            ends.push_back (names.size ());
+        }
+        write_column (ends);
+        write_column (names);
+        write (&t, sizeof (t));
+
+        FILE *file = m_file;
+        m_file = NULL;
+        if (fclose (file) != 0 || rename (m_tmp.c_str (), m_filename.c_str ()) != 0) {
+            int err = errno;
+            unlink (m_tmp.c_str ());
+            throw std::runtime_error (std::string ("write columns: ") + ::strerror (err));
+        }
+    }
+
+
+    column_file::column_file (const std::string &filename)
+        : m_map (NULL), m_map_size (0), m_header (NULL), m_columns (NULL), m_footer (NULL),
+          m_dictionary_offsets (NULL), m_dictionary (NULL)
+    {
+        int fd = ::open (filename.c_str (), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error (std::string ("open: ") + ::strerror (errno));
+        }
+        struct stat st;
+        if (::fstat (fd, &st) < 0) {
+            int err = errno;
+            ::close (fd);
+            throw std::runtime_error (std::string ("fstat: ") + ::strerror (err));
+        }
+        m_map_size = (size_t)st.st_size;
+        if (m_map_size < sizeof (struct column_file_header) + sizeof (struct column_trailer)) {
+            ::close (fd);
+            throw std::runtime_error (filename + " is too short for a column file");
+        }
+        void *map = ::mmap (NULL, m_map_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close (fd);
+        if (map == MAP_FAILED) {
+            throw std::runtime_error (std::string ("mmap: ") + ::strerror (errno));
+        }
+        m_map = (const char*)map;
+
+        // Check everything we'll hand out lies within the file.
+        const char *error = NULL;
+        m_header = (const struct column_file_header*)m_map;
+        const struct column_trailer *t = (const struct column_trailer*)(m_map + m_map_size - sizeof (struct column_trailer));
+        if (memcmp (m_header->magic, COLUMN_MAGIC, sizeof (m_header->magic)) != 0 ||
+            memcmp (t->magic, COLUMN_MAGIC, sizeof (t->magic)) != 0) {
+            error = "not a column file";
+        } else if (m_header->version != COLUMN_VERSION || t->version != COLUMN_VERSION) {
+            error = "unknown column file version";
+        } else if (sizeof (*m_header) + (uint64_t)m_header->column_count * sizeof (struct column_desc) > m_map_size ||
+                   t->footer_offset < sizeof (*m_header) ||
+                   t->footer_offset > m_map_size - sizeof (*t) - sizeof (struct column_footer)) {
+            error = "truncated column file";
+        } else {
+            m_columns = (const struct column_desc*)(m_map + sizeof (*m_header));
+            m_footer = (const struct column_footer*)(m_map + t->footer_offset);
+            const uint64_t *batch_offsets = (const uint64_t*)(m_footer + 1);
+            uint64_t footer_end = t->footer_offset + sizeof (*m_footer);
+            if (memcmp (m_footer->magic, COLUMN_FOOTER_MAGIC, sizeof (m_footer->magic)) != 0 ||
+                m_footer->batch_count > (m_map_size - footer_end) / 8 ||
+                m_footer->dictionary_count >= (m_map_size - footer_end) / 8 - m_footer->batch_count) {
+                error = "bad column file footer";
+            } else {
+                m_dictionary_offsets = batch_offsets + m_footer->batch_count;
+                m_dictionary = (const char*)(m_dictionary_offsets + m_footer->dictionary_count + 1);
+                if (m_dictionary_offsets[m_footer->dictionary_count] > (uint64_t)(m_map + m_map_size - m_dictionary)) {
+                    error = "bad column file dictionary";
+                }
+            }
+            for (uint64_t b = 0; error == NULL && b < m_footer->batch_count; ++b) {
+                uint64_t at = batch_offsets[b];
+                const struct column_batch_header *h = (const struct column_batch_header*)(m_map + at);
+                if (at > t->footer_offset - sizeof (*h) || memcmp (h->magic, COLUMN_BATCH_MAGIC, sizeof (h->magic)) != 0 ||
+                    h->size > t->footer_offset - at) {
+                    error = "bad column file batch";
+                    break;
+                }
+                batch bt;
+                bt.rows = h->rows;
+                uint64_t pos = at + sizeof (*h), end = at + h->size;
+                for (size_t c = 0; c < m_header->column_count; ++c) {
+                    uint64_t len = (uint64_t)h->rows * m_columns[c].width;
+                    if (m_columns[c].kind == COLUMN_BLOB) {
+                        len = (uint64_t)(h->rows + 1) * sizeof (uint64_t);
+                    }
+                    if (pos + len > end) {
+                        error = "bad column file batch";
+                        break;
+                    }
+                    bt.columns.push_back (m_map + pos);
+                    if (m_columns[c].kind == COLUMN_BLOB) {
+                        const uint64_t *offsets = (const uint64_t*)(m_map + pos);
+                        len += offsets[h->rows];
+                        if (pos + len > end) {
+                            error = "bad column file blob";
+                            break;
+                        }
+                    }
+                    pos += pad8 (len);
+                }
+                m_batches.push_back (bt);
+            }
+        }
+        if (error) {
+            ::munmap ((void*)m_map, m_map_size);
+            throw std::runtime_error (filename + ": " + error);
+        }
+    }
+
+
+    column_file::~column_file () {
+        ::munmap ((void*)m_map, m_map_size);
+    }
+
+
+    size_t column_file::find_column (const std::string &name) const {
+        for (size_t c = 0; c < columns (); ++c) {
+            if (name == std::string (m_columns[c].name, strnlen (m_columns[c].name, sizeof (m_columns[c].name)))) {
+                return c;
+            }
+        }
+        return columns ();
+    }
+
+
+    std::string column_file::blob (size_t b, size_t c, size_t i) const {
+        const uint64_t *offsets = (const uint64_t*)m_batches[b].columns[c];
+        const char *bytes = (const char*)(offsets + m_batches[b].rows + 1);
+        if (m_columns[c].kind != COLUMN_BLOB || i >= m_batches[b].rows || offsets[i] > offsets[i + 1] || offsets[i + 1] > offsets[m_batches[b].rows]) {
+            return std::string ();
+        }
+        return std::string (bytes + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+
+    std::string column_file::dictionary (uint32_t id) const {
+        if (id >= dictionary_size ()) {
+            return std::string ();
+        }
+        return std::string (m_dictionary + m_dictionary_offsets[id], m_dictionary_offsets[id + 1] - m_dictionary_offsets[id]);
+    }
+
+
+    std::ostream& operator<< (std::ostream &os, const event_buffer &ev) {
+        event_formatter formatter;
+        std::string out;
+        formatter.format (out, ev);
+        return os.write (out.data (), out.size ());
+    }
+
+
+    event_printer::event_printer (int fd, output_format format, size_t buffer_size)
+        : m_fd (fd), m_buffer_size (buffer_size), m_formatter (format)
+    {
+        // Room for the last event to go past buffer_size before it's flushed.
+        m_buffer.reserve (buffer_size + buffer_size / 4);
+    }
+
+
+    event_printer::~event_printer () {
+        try {
+            flush ();
+        } catch (const std::exception &e) {
+            fprintf (stderr, "%s\n", e.what ());
+        }
+    }
+
+
+    void event_printer::flush () {
+        size_t done = 0;
+        while (done < m_buffer.size ()) {
+            ssize_t n = ::write (m_fd, m_buffer.data () + done, m_buffer.size () - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                m_buffer.clear ();
+                throw std::runtime_error (std::string ("write: ") + ::strerror (errno));
+            }
+            done += n;
+        }
+        m_buffer.clear ();
+    }
+
+    slab_allocator::slab_allocator (size_t max_cached)
+        : m_max_cached (max_cached), m_cached (0), m_reuses (0)
+    { }
+
+
+    slab_allocator::~slab_allocator () {
+        for (size_t c = 0; c < m_free.size (); ++c) {
+            for (size_t i = 0; i < m_free[c].size (); ++i) {
+                delete[] m_free[c][i];
+            }
+        }
+    }
+
+
+    // Classes are powers of two starting at 64 bytes, anything smaller
+    // than that fits in class 0.
+    size_t slab_allocator::size_class (size_t size) {
+        size_t c = 0;
+        for (size_t cap = 64; cap < size; cap <<= 1) {
+            ++c;
+        }
+        return c;
+    }
+
+
+    char* slab_allocator::allocate (size_t size) {
+        size_t c = size_class (size);
+        note_allocate (size);
+        if (c < m_free.size () && !m_free[c].empty ()) {
+            char *buf = m_free[c].back ();
+            m_free[c].pop_back ();
+            m_cached -= (size_t)64 << c;
+            ++m_reuses;
+            return buf;
+        }
+        return new char[(size_t)64 << c];
+    }
+
+
+    void slab_allocator::release (char *buf, size_t size) {
+        size_t c = size_class (size);
+        note_release (size);
+        if (m_cached + ((size_t)64 << c) > m_max_cached) {
+            delete[] buf;
+            return;
+        }
+        if (c >= m_free.size ()) {
+            m_free.resize (c + 1);
+        }
+        m_free[c].push_back (buf);
+        m_cached += (size_t)64 << c;
+    }
+
+
+    void binlog_counters::reset () {
+        memset (this, 0, sizeof (*this));
+    }
+
+
+    void binlog_counters::merge (const binlog_counters &rhs) {
+        syscalls += rhs.syscalls;
+        bytes_read += rhs.bytes_read;
+        events += rhs.events;
+        event_bytes += rhs.event_bytes;
+        for (size_t i = 0; i < sizeof (events_by_type) / sizeof (events_by_type[0]); ++i) {
+            events_by_type[i] += rhs.events_by_type[i];
+        }
+        resyncs += rhs.resyncs;
+        resync_bytes_skipped += rhs.resync_bytes_skipped;
+        allocations += rhs.allocations;
+        bytes_allocated += rhs.bytes_allocated;
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            phase_ns[p] += rhs.phase_ns[p];
+        }
+    }
+
+
+    bool binlog_counters::enabled () {
+#if defined(YBINLOGP_NO_COUNTERS)
+        return false;
+#else
+        return true;
+#endif
+    }
+
+
+    const char* binlog_counters::phase_name (int phase) {
+        static const char *names[PHASE_COUNT] = { "open", "seek", "read", "wait", "scan" };
+        return phase >= 0 && phase < PHASE_COUNT ? names[phase] : "";
+    }
+
+
+    void binlog_counters::report (std::ostream &os) const {
+        if (!enabled ()) {
+            os << "counters compiled out (YBINLOGP_NO_COUNTERS)" << std::endl;
+            return;
+        }
+        const struct { const char *name; uint64_t value; } totals[] = {
+            { "syscalls", syscalls },
+            { "bytes read", bytes_read },
+            { "events read", events },
+            { "event bytes", event_bytes },
+            { "resyncs", resyncs },
+            { "resync bytes skipped", resync_bytes_skipped },
+            { "allocations", allocations },
+            { "bytes allocated", bytes_allocated }
+        };
+        for (size_t i = 0; i < sizeof (totals) / sizeof (totals[0]); ++i) {
+            if (totals[i].value) {
+                os << boost::format ("  %-40s %16llu\n") % totals[i].name % (unsigned long long)totals[i].value;
+            }
+        }
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            if (phase_ns[p]) {
+                os << boost::format ("  %-40s %16.6f\n") % (std::string (phase_name (p)) + " (s)") % seconds (p);
+            }
+        }
+        for (size_t t = 0; t < sizeof (events_by_type) / sizeof (events_by_type[0]); ++t) {
+            if (events_by_type[t]) {
+                std::string name = t < sizeof (event_types) / sizeof (event_types[0])
+                    ? event_types[t] : (boost::format ("type %d") % t).str ();
+                os << boost::format ("  %-40s %16llu\n") % name % (unsigned long long)events_by_type[t];
+            }
+        }
+    }
+
+
+    binlog::binlog (const std::string &filename, off64_t starting_offset, time_t starting_time, read_mode mode)
+        : m_filename (filename), m_fd (-1), m_owns_file (true), m_stbuf (new struct stat), m_evbuf (NULL),
+          m_map (NULL), m_map_size (0), m_compressed (NULL), m_stream (NULL), m_allocator (new slab_allocator),
+          m_min_timestamp (0), m_max_timestamp (::time(NULL)),
+          m_checksum_len (0), m_verify (true), m_follow (false), m_follow_timeout (-1), m_file_ended (false),
+          m_watch_fd (-1), m_interrupt_fd (-1)
+    {
+        {
+            phase_timer opening (m_counters.phase_ns[binlog_counters::PHASE_OPEN]);
+            if (stat (filename.c_str (), m_stbuf)) {
+                throw std::runtime_error (std::string ("stat: ") + ::strerror (errno));
+            }
+
+            int oflags = O_RDONLY;
+#ifndef DARWIN
+            oflags |= O_LARGEFILE;
+#endif /* DARWIN */
+            if ((m_fd = ::open (filename.c_str (), oflags)) <= 0) {
+                throw std::runtime_error (std::string ("open: ") + ::strerror (errno));
+            }
+            compressed_file::format kind = compressed_file::detect (m_fd);
+            if (stream_buffer::is_stream (m_fd)) {
+                m_stream = new stream_buffer (m_fd);
+            } else if (kind != compressed_file::NOT_COMPRESSED) {
+                m_compressed = new compressed_file (m_fd, kind, filename);
+            } else if (mode == READ_MMAP) {
+                map_file ();
+            }
+
+            m_evbuf = (struct event_buffer*)malloc (sizeof (struct event_buffer));
+            init_event (m_evbuf);
+            if (check_file (m_evbuf) < 0) {
+                throw std::runtime_error (std::string ("read_fde: ") + ::strerror (errno));
+            }
+            m_min_timestamp = m_evbuf->timestamp;
+
+            // Seeking hops all over the file, don't let readahead drag in
+            // pages we'll never look at.
+            if (m_map && (starting_time > 0 || starting_offset)) {
+                ::madvise ((void*)m_map, m_map_size, MADV_RANDOM);
+            }
+        }
+
+        off64_t offset = 0;
+        if (starting_time > 0 || starting_offset) {
+            phase_timer seeking (m_counters.phase_ns[binlog_counters::PHASE_SEEK]);
+            binlog_index index;
+            if (m_stream) {
+                offset = stream_seek (starting_offset, starting_time, m_evbuf);
+            } else if (index.open (filename, *m_stbuf)) {
+                offset = indexed_seek (index, starting_offset, starting_time, m_evbuf);
+            } else if (starting_time > 0) {
+                offset = nearest_time (starting_time, m_evbuf);
+            } else {
+                offset = nearest_offset (starting_offset, m_evbuf, 1, m_counters);
+            }
+        }
+
+        if (offset < 0) {
+            // -2 is just nothing there, errno only means something for -1
+            throw std::runtime_error (offset == -1 ? std::string ("no records found: ") + ::strerror (errno)
+                                      : std::string ("no records found"));
+        }
+        if (m_map) {
+            ::madvise ((void*)m_map, m_map_size, MADV_SEQUENTIAL);
+        }
+    }
+
+
+    binlog::binlog (int fd, read_mode mode)
+        : m_fd (fd), m_owns_file (false), m_stbuf (NULL), m_evbuf (NULL),
+          m_map (NULL), m_map_size (0), m_compressed (NULL), m_stream (NULL), m_allocator (new slab_allocator),
+          m_min_timestamp (0), m_max_timestamp (::time(NULL)),
+          m_checksum_len (0), m_verify (true), m_follow (false), m_follow_timeout (-1), m_file_ended (false),
+          m_watch_fd (-1), m_interrupt_fd (-1)
+    {
+        phase_timer opening (m_counters.phase_ns[binlog_counters::PHASE_OPEN]);
+        // Where a compressed fd is positioned means nothing to us, start at the beginning.
+        off64_t offset = ::lseek (m_fd, 0, SEEK_CUR);
+        compressed_file::format kind = compressed_file::detect (m_fd);
+        if (stream_buffer::is_stream (m_fd)) {
+            m_stream = new stream_buffer (m_fd);
+            offset = stream_start ();
+        } else if (kind != compressed_file::NOT_COMPRESSED) {
+            m_compressed = new compressed_file (m_fd, kind, std::string ());
+            offset = sizeof (BINLOG_MAGIC);
+        } else if (mode == READ_MMAP && map_file ()) {
+            ::madvise ((void*)m_map, m_map_size, MADV_SEQUENTIAL);
+        }
+        m_evbuf = (struct event_buffer*)malloc (sizeof (struct event_buffer));
+        init_event (m_evbuf);
+        read_event (m_evbuf, offset);
+        if (m_evbuf->type_code == FORMAT_DESCRIPTION_EVENT && m_evbuf->data != NULL) {
+            note_format (m_evbuf);
+        }
+        m_min_timestamp = m_evbuf->timestamp;
+    }
+
+
+    binlog::binlog(boost::python::object file) 
+        : m_fd (boost::python::extract<int> (file.attr("fileno") ())), m_owns_file (false), m_stbuf (NULL), m_evbuf (NULL),
+          m_map (NULL), m_map_size (0), m_compressed (NULL), m_stream (NULL), m_allocator (new slab_allocator),
+          m_min_timestamp (0), m_max_timestamp (::time(NULL)),
+          m_checksum_len (0), m_verify (true), m_follow (false), m_follow_timeout (-1), m_file_ended (false),
+          m_watch_fd (-1), m_interrupt_fd (-1)
+    {
+        phase_timer opening (m_counters.phase_ns[binlog_counters::PHASE_OPEN]);
+        off64_t offset = ::lseek (m_fd, 0, SEEK_CUR);
+        compressed_file::format kind = compressed_file::detect (m_fd);
+        if (stream_buffer::is_stream (m_fd)) {
+            m_stream = new stream_buffer (m_fd);
+            offset = stream_start ();
+        } else if (kind != compressed_file::NOT_COMPRESSED) {
+            m_compressed = new compressed_file (m_fd, kind, std::string ());
+            offset = sizeof (BINLOG_MAGIC);
+        } else if (map_file ()) {
+            ::madvise ((void*)m_map, m_map_size, MADV_SEQUENTIAL);
+        }
+        m_evbuf = (struct event_buffer*)malloc (sizeof (struct event_buffer));
+        init_event (m_evbuf);
+        read_event (m_evbuf, offset);
+        if (m_evbuf->type_code == FORMAT_DESCRIPTION_EVENT && m_evbuf->data != NULL) {
+            note_format (m_evbuf);
+        }
+        m_min_timestamp = m_evbuf->timestamp;
+    }
+
+
+    binlog::~binlog () {
+        // m_evbuf may point into the mapping, but dispose_event only
+        // frees what was heaped.
+        dispose_event (m_evbuf);
+        if (m_map) {
+            ::munmap ((void*)m_map, m_map_size);
+        }
+        if (m_watch_fd >= 0) {
+            ::close (m_watch_fd);
+        }
+        delete m_compressed;
+        delete m_stream;
+        if (m_owns_file) {
+            ::close (m_fd);
+        }
+        delete m_stbuf;
+    }
+
+
+    void binlog::set_allocator (boost::shared_ptr<payload_allocator> allocator) {
+        // m_evbuf (the FDE read by the constructor, at least) and any
+        // live iterator entries release into the old allocator, so it
+        // has to stay around until they're done with it. in_use ()
+        // can't be trusted to say when that is, a subclass needn't
+        // keep the counts.
+        if (m_allocator && m_allocator != allocator) {
+            m_retired_allocators.push_back (m_allocator);
+        }
+        m_allocator = allocator;
+    }
+
+
+    void binlog::set_follow (bool follow, int timeout_ms) {
+        m_follow_timeout = timeout_ms;
+        if (follow == m_follow) {
+            return;
+        }
+        if (follow && m_compressed) {
+            throw std::runtime_error ("can't follow a compressed binlog");
+        }
+        if (follow && m_stream) {
+            throw std::runtime_error ("can't follow a pipe, reading one waits for more anyway");
+        }
+        m_follow = follow;
+        if (!follow) {
+            ::close (m_watch_fd);
+            m_watch_fd = -1;
+            return;
+        }
+        if (m_map) {
+            // m_evbuf may point into the mapping, give it its own copy first.
+            struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof (struct event_buffer));
+            init_event (evbuf);
+            copy_event (evbuf, m_evbuf);
+            dispose_event (m_evbuf);
+            m_evbuf = evbuf;
+            ::munmap ((void*)m_map, m_map_size);
+            m_map = NULL;
+            m_map_size = 0;
+        }
+#if defined(DARWIN)
+        if ((m_watch_fd = ::kqueue ()) < 0) {
+            throw std::runtime_error (std::string ("kqueue: ") + ::strerror (errno));
+        }
+        struct kevent change;
+        EV_SET (&change, m_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+        if (::kevent (m_watch_fd, &change, 1, NULL, 0, NULL) < 0) {
+            throw std::runtime_error (std::string ("kevent: ") + ::strerror (errno));
+        }
+#else
+        if ((m_watch_fd = ::inotify_init ()) < 0) {
+            throw std::runtime_error (std::string ("inotify_init: ") + ::strerror (errno));
+        }
+        // fds we were handed have no name, but /proc knows it.
+        std::string path = m_filename;
+        if (path.empty ()) {
+            path = (boost::format ("/proc/self/fd/%d") % m_fd).str ();
+        }
+        if (::inotify_add_watch (m_watch_fd, path.c_str (), IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+            throw std::runtime_error (std::string ("inotify_add_watch: ") + ::strerror (errno));
+        }
+#endif
+    }
+
+
+    bool binlog::wait_for_data (off64_t size) {
+        phase_timer waiting (m_counters.phase_ns[binlog_counters::PHASE_WAIT]);
+        for (;;) {
+            // Check after setting up the watch, anything written since
+            // shows up here or wakes us up below.
+            struct stat st;
+            COUNT (++m_counters.syscalls);
+            if (::fstat (m_fd, &st) < 0) {
+                throw std::runtime_error (std::string ("fstat: ") + ::strerror (errno));
+            }
+            if (st.st_size >= size) {
+                return true;
+            }
+            if (st.st_nlink == 0) {
+                return false;
+            }
+            int rc = wait_watch (m_watch_fd, m_follow_timeout, m_interrupt_fd);
+            if (rc <= 0) {
+                return false;
+            }
+        }
+    }
+
+
+    bool binlog::map_file () {
+        struct stat st;
+        if (::fstat (m_fd, &st) < 0 || !S_ISREG (st.st_mode) || st.st_size <= 0) {
+            return false;
+        }
+        // Can't map a file bigger than the address space, eg. 32 bit.
+        if ((unsigned long long)st.st_size > (size_t)-1) {
+            return false;
+        }
+        void *map = ::mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (map == MAP_FAILED) {
+#if DEBUG
+            fprintf (stderr, "mmap: %s, falling back to read()\n", ::strerror (errno));
+#endif
+            return false;
+        }
+        m_map = (const char*)map;
+        m_map_size = (size_t)st.st_size;
+        return true;
+    }
+
+
+    /**
+     * Read the FDE and set the server-id
+     **/
+    int binlog::check_file (struct event_buffer *evbuf) {
+        char magic[sizeof(BINLOG_MAGIC)];
+        if (m_map) {
+            if (m_map_size < sizeof(BINLOG_MAGIC)) {
+                return -1;
+            }
+            memcpy (magic, m_map, sizeof(BINLOG_MAGIC));
+        } else if (read_at (magic, sizeof(BINLOG_MAGIC), 0, m_counters) != sizeof(BINLOG_MAGIC)) {
+            std::cout << "ass\n";
+            return -1;
+        }
+        if (::memcmp (magic, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (read_event (evbuf, sizeof(BINLOG_MAGIC)) < 0) {
+            return -1;
+        }
+#if DEBUG
+        std::cout << *evbuf;
+#endif
+        struct format_description_event_buffer *f = (struct format_description_event_buffer*) evbuf->data;
+        if (evbuf->type_code != FORMAT_DESCRIPTION_EVENT || evbuf->data == NULL ||
+            evbuf->length < EVENT_HEADER_SIZE + sizeof (struct format_description_event_buffer) ||
+            f->format_version != BINLOG_VERSION || f->header_len != EVENT_HEADER_SIZE) {
+            errno = EINVAL;
+            return -1;
+        }
+        note_format (evbuf);
+        return 0;
+    }
+
+
+    void binlog::note_format (struct event_buffer *evbuf) {
+        m_format = format_description_entry (*evbuf);
+        m_checksum_len = m_format.checksum_len ();
+        // A server that knows about checksums always leaves room for
+        // one in its FDE, whether or not the rest of the file has them.
+        evbuf->checksum_len = m_format.checksum_alg == format_description_entry::CHECKSUM_UNDEF ? 0 : 4;
+    }
+
+
+    void binlog::verify_event (const struct event_buffer *evbuf) const {
+        if (!m_verify || !m_checksum_len || !evbuf->checksum_len || evbuf->data == NULL) {
+            return;
+        }
+        if (!checksum_matches (evbuf)) {
+            throw std::runtime_error ((boost::format ("checksum mismatch in event at offset %d") % evbuf->offset).str ());
+        }
+    }
+
+
+    int binlog::read_event (struct event_buffer *evbuf, off64_t offset) {
+        if (m_map) {
+            if (offset < 0 || (size_t)offset + EVENT_HEADER_SIZE > m_map_size) {
+                evbuf->offset = offset;
+                evbuf->data = NULL;
+                return -1;
+            }
+            // Only the header gets copied, the payload stays in the mapping.
+            memcpy ((void*)evbuf, m_map + offset, EVENT_HEADER_SIZE);
+            evbuf->checksum_len = m_checksum_len;
+            evbuf->offset = offset;
+            evbuf->heaped = NULL;
+            evbuf->allocator = NULL;
+            if (evbuf->length < EVENT_HEADER_SIZE || evbuf->length > MAX_EVENT_LENGTH ||
+                (size_t)offset + evbuf->length > m_map_size) {
+                evbuf->data = NULL;
+            } else {
+                evbuf->data = (char*)m_map + offset + EVENT_HEADER_SIZE;
+            }
+            return 0;
+        }
+
+        if (offset < 0) {
+            throw std::runtime_error (std::string ("read_event: ") + ::strerror (EINVAL));
+        }
+        size_t amt_read = read_at ((void*)evbuf, EVENT_HEADER_SIZE, offset, m_counters);
+        evbuf->offset = offset;
+        evbuf->checksum_len = m_checksum_len;
+        evbuf->data = NULL;
+        evbuf->allocator = NULL;
+        if (amt_read != EVENT_HEADER_SIZE) {
+            return -1;
+        }
+        // Here we could check the timestamp, but there's a tendency
+        // for timestamps to not always be in linear order... huh?
+        // The length however has to be sane before we go new'ing it,
+        // nearest_offset feeds us plenty of garbage.
+        if (evbuf->length < EVENT_HEADER_SIZE || evbuf->length > MAX_EVENT_LENGTH) {
+            evbuf->heaped = NULL;
+            return 0;
+        }
+#if DEBUG
+        fprintf (stdout, "newing %lu bytes\n", evbuf->length - EVENT_HEADER_SIZE);
+#endif
+        if (evbuf->length - EVENT_HEADER_SIZE > sizeof (evbuf->payload)) {
+            COUNT (++m_counters.allocations; m_counters.bytes_allocated += evbuf->length - EVENT_HEADER_SIZE);
+            if (m_allocator) {
+                evbuf->heaped = m_allocator->allocate (evbuf->length - EVENT_HEADER_SIZE);
+                evbuf->allocator = m_allocator.get ();
+            } else {
+                evbuf->heaped = new char[evbuf->length - EVENT_HEADER_SIZE];
+            }
+            evbuf->data = evbuf->heaped;
+        } else {
+            evbuf->heaped = NULL;
+            evbuf->data = (char*)&(evbuf->payload);
+        }
+#if DEBUG
+        fprintf(stderr, "newed %lu bytes at 0x%p for a %s\n", evbuf->length - EVENT_HEADER_SIZE, evbuf->data, event_type_name (evbuf->type_code));
+#endif
+        size_t amt_data = read_at (evbuf->data, evbuf->length - EVENT_HEADER_SIZE, offset + EVENT_HEADER_SIZE, m_counters);
+        if (amt_data != evbuf->length - EVENT_HEADER_SIZE) {
+            // Runs off the end of the file, same as when mapped.
+            release_payload (evbuf);
+            evbuf->heaped = NULL;
+            evbuf->allocator = NULL;
+            evbuf->data = NULL;
+        }
+        return 0;
+    }
+
+
+    // FIXME: this shouldn't be necessary
+    // And then m_evbuf and m_min/max_timestamp can go away too
+    int binlog::check_event (struct event_buffer *evbuf) {
+        if (evbuf->data != NULL &&
+            evbuf->server_id < MAX_SERVER_ID &&
+            evbuf->type_code > MIN_TYPE_CODE &&
+            evbuf->type_code < MAX_TYPE_CODE &&
+            evbuf->length > MIN_EVENT_LENGTH &&
+            evbuf->length < MAX_EVENT_LENGTH &&
+            evbuf->timestamp >= m_min_timestamp &&
+            evbuf->timestamp <= m_max_timestamp) {
+            return 1;
+        } else {
+            return 0;
+        }
+    }
+
+
+    off64_t binlog::next_after (struct event_buffer *evbuf) {
+        /* Can't actually use next_position, because it will vary between
+         * messages that are from master and messages that are from slave.
+         * Usually, only the FDE is from the slave. But, still...
+         */
+        return evbuf->offset + evbuf->length;
+    }
+
+
+    off64_t binlog::file_size () {
+        if (m_map) {
+            return m_map_size;
+        }
+        if (m_compressed) {
+            return m_compressed->size ();
+        }
+        if (m_stbuf && !m_follow) {
+            return m_stbuf->st_size;
+        }
+        struct stat st;
+        COUNT (++m_counters.syscalls);
+        if (::fstat (m_fd, &st) < 0) {
+            throw std::runtime_error (std::string ("fstat: ") + ::strerror (errno));
+        }
+        return st.st_size;
+    }
+
+
+    bool binlog::read_header (off64_t offset, char *header) {
+        if (m_map) {
+            if (offset < 0 || (size_t)offset + EVENT_HEADER_SIZE > m_map_size) {
+                return false;
+            }
+            memcpy (header, m_map + offset, EVENT_HEADER_SIZE);
+            return true;
+        }
+        return offset >= 0 && read_at (header, EVENT_HEADER_SIZE, offset, m_counters) == EVENT_HEADER_SIZE;
+    }
+
+
+    size_t binlog::read_at (void *buf, size_t len, off64_t offset, binlog_counters &counters) {
+        phase_timer reading (counters.phase_ns[binlog_counters::PHASE_READ]);
+        if (m_compressed) {
+            size_t amt_read = m_compressed->read (buf, len, offset);
+            COUNT (counters.bytes_read += amt_read);
+            return amt_read;
+        }
+        if (m_stream) {
+            return m_stream->read (buf, len, offset, counters);
+        }
+        COUNT (++counters.syscalls);
+        ssize_t amt_read = ::pread (m_fd, buf, len, offset);
+        if (amt_read < 0) {
+            throw std::runtime_error (std::string ("pread: ") + ::strerror (errno));
+        }
+        COUNT (counters.bytes_read += amt_read);
+        return amt_read;
+    }
+
+
+    off64_t binlog::skip_filtered (off64_t offset) {
+        event_buffer header;
+        while (read_header (offset, (char*)&header)) {
+            // Rotations and stops get read regardless, they're how we
+            // know the file is done.
+            if (header.length < EVENT_HEADER_SIZE || header.length > MAX_EVENT_LENGTH ||
+                m_filter->wants (header) || ends_file (&header)) {
+                break;
+            }
+            offset += header.length;
+        }
+        return offset;
+    }
+
+
+    bool binlog::confirm_chain (off64_t offset) {
+        const off64_t size = file_size ();
+        char header[EVENT_HEADER_SIZE];
+        for (int hop = 0; hop <= RESYNC_CONFIRM_HOPS; ++hop) {
+            if (!read_header (offset, header) || !plausible_header (header, m_min_timestamp, m_max_timestamp)) {
+                return false;
+            }
+            off64_t next = offset + header_length (header);
+            if (next > size) {
+                // The candidate itself has to fit, anything later may
+                // just be half written.
+                return hop > 0;
+            } else if (next == size) {
+                return true;
+            }
+            offset = next;
+        }
+        return true;
+    }
+
+
+    off64_t binlog::resync_block (const char *buf, size_t avail, off64_t base, size_t lo, size_t hi, int direction) {
+        // Candidates that pass the header checks, in file order. They're
+        // rare enough that collecting them beats scanning twice.
+        std::vector<size_t> candidates;
+        size_t i = lo;
+#if defined(__SSE2__)
+        const __m128i ts_lo = _mm_set1_epi8 ((char)(m_min_timestamp >> 24));
+        const __m128i ts_span = _mm_set1_epi8 ((char)((m_max_timestamp >> 24) - (m_min_timestamp >> 24)));
+        for (; i + 15 <= hi && i + RESYNC_MASK_SPAN <= avail; i += 16) {
+            unsigned int mask = resync_mask (buf + i, ts_lo, ts_span);
+            while (mask) {
+                size_t at = i + __builtin_ctz (mask);
+                mask &= mask - 1;
+                if (plausible_header (buf + at, m_min_timestamp, m_max_timestamp)) {
+                    candidates.push_back (at);
+                }
+            }
+        }
+#endif
+        for (; i <= hi && i + EVENT_HEADER_SIZE <= avail; ++i) {
+            if (plausible_header (buf + i, m_min_timestamp, m_max_timestamp)) {
+                candidates.push_back (i);
+            }
+        }
+        if (direction > 0) {
+            for (size_t c = 0; c < candidates.size (); ++c) {
+                if (confirm_chain (base + candidates[c])) {
+                    return base + candidates[c];
+                }
+            }
+        } else {
+            for (size_t c = candidates.size (); c > 0; --c) {
+                if (confirm_chain (base + candidates[c - 1])) {
+                    return base + candidates[c - 1];
+                }
+            }
+        }
+        return -1;
+    }
+
+
+    off64_t binlog::nearest_offset (off64_t starting_offset, struct event_buffer *outbuf, int direction, binlog_counters &counters) {
+        const off64_t last = file_size () - (off64_t)EVENT_HEADER_SIZE;
+        COUNT (++counters.resyncs);
+#if DEBUG
+        fprintf (stderr, "In nearest offset mode, got fd=%d, starting_offset=%llu\n", m_fd, (long long)starting_offset);
+#endif
+        if (direction == 0) {
+            direction = 1;
+        }
+        std::vector<char> block;
+        size_t block_size = RESYNC_MIN_BLOCK;
+        off64_t scanned = 0;
+        off64_t offset = starting_offset;
+        while (scanned < MAX_RETRIES && offset >= 0 && offset <= last) {
+            // This round looks at positions [lo, hi], and needs the
+            // bytes from lo up to a header (or a resync_mask) past hi.
+            off64_t lo, hi;
+            if (direction > 0) {
+                lo = offset;
+                hi = std::min (last, offset + (off64_t)block_size - 1);
+            } else {
+                hi = offset;
+                lo = std::max ((off64_t)0, offset - (off64_t)block_size + 1);
+            }
+            size_t want = (size_t)(hi - lo) + 32;
+            const char *buf;
+            size_t avail;
+            if (m_map) {
+                buf = m_map + lo;
+                avail = std::min (want, m_map_size - (size_t)lo);
+            } else {
+                block.resize (want);
+                buf = &block[0];
+                avail = read_at (&block[0], want, lo, counters);
+            }
+            off64_t found = resync_block (buf, avail, lo, 0, (size_t)(hi - lo), direction);
+            if (found >= 0) {
+                COUNT (counters.resync_bytes_skipped += found > starting_offset ? found - starting_offset : starting_offset - found);
+                if (outbuf != NULL) {
+                    struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+                    init_event (evbuf);
+                    if (read_event (evbuf, found) < 0) {
+                        dispose_event (evbuf);
+                        return -1;
+                    }
+                    reset_event (outbuf);
+                    copy_event (outbuf, evbuf);
+                    dispose_event (evbuf);
+                }
+                return found;
+            }
+            scanned += hi - lo + 1;
+            offset = direction > 0 ? hi + 1 : lo - 1;
+            block_size = std::min (block_size * 2, RESYNC_MAX_BLOCK);
+        }
+#if DEBUG
+        fprintf (stderr, "Unable to find anything (offset=%llu)\n",(long long) offset);
+#endif
+        COUNT (counters.resync_bytes_skipped += scanned);
+        return -2;
+    }
+
+
+    off64_t binlog::nearest_time (time_t target, struct event_buffer *outbuf) {
+        // Narrow [lo, hi) down to where the first event at or after
+        // target starts, lo is always an event earlier than target
+        // (or the first one), hi just a place in the file.
+        off64_t lo = sizeof (BINLOG_MAGIC);
+        off64_t hi = file_size ();
+        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+        init_event (evbuf);
+        while (hi - lo > TIME_BISECT_SPAN) {
+            off64_t mid = lo + (hi - lo) / 2;
+            reset_event (evbuf);
+            off64_t found = nearest_offset (mid, evbuf, 1, m_counters);
+            if (found == -1) {
+                dispose_event (evbuf);
+                return found;
+            }
+#if DEBUG
+            fprintf (stderr, "lo=%lld hi=%lld, found %lld at %lld\n", (long long)lo, (long long)hi, (long long)(found >= 0 ? evbuf->timestamp : 0), (long long)found);
+#endif
+            if (found >= 0 && found < hi && (time_t)evbuf->timestamp < target) {
+                lo = found;
+            } else {
+                hi = mid;
+            }
+        }
+        dispose_event (evbuf);
+        return closest_time (lo, target, outbuf);
+    }
+
+
+    off64_t binlog::closest_time (off64_t offset, time_t target, struct event_buffer *outbuf) {
+        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+        struct event_buffer *before = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+        init_event (evbuf);
+        init_event (before);
+        bool have_before = false;
+        off64_t found = -2;
+        for (;;) {
+            reset_event (evbuf);
+            if (read_event (evbuf, offset) < 0 || evbuf->data == NULL) {
+                // Nothing late enough. Same as when nearest_offset
+                // runs off the end, there's no record to start at.
+                break;
+            }
+            if ((time_t)evbuf->timestamp >= target) {
+                struct event_buffer *best = evbuf;
+                if (have_before && target - (time_t)before->timestamp < (time_t)evbuf->timestamp - target) {
+                    best = before;
+                }
+                found = best->offset;
+                if (outbuf != NULL) {
+                    reset_event (outbuf);
+                    copy_event (outbuf, best);
+                }
+                break;
+            }
+            offset = next_after (evbuf);
+            std::swap (evbuf, before);
+            have_before = true;
+        }
+        dispose_event (evbuf);
+        dispose_event (before);
+        return found;
+    }
+
+
+    off64_t binlog::walk_chain (off64_t offset, off64_t until) {
+        char header[EVENT_HEADER_SIZE];
+        while (offset < until) {
+            if (!read_header (offset, header)) {
+                break;
+            }
+            uint32_t length = header_length (header);
+            if (length < EVENT_HEADER_SIZE) {
+                // Can't go anywhere from here, so nothing after it is on the chain.
+                return file_size ();
+            }
+            offset += length;
+        }
+        return offset;
+    }
+
+
+    struct binlog::scan_state {
+        struct chunk {
+            chunk () : raw (0), start (-1), end (-1), done (false) { }
+            off64_t raw;	// where the chunk was cut
+            off64_t start;	// its first event
+            off64_t end;	// where its chain crosses into the next chunk
+            std::string out;
+            bool done;
+        };
+
+        struct thread_arg {
+            scan_state *state;
+            scan_worker *worker;
+            // the thread's own, added to the binlog's after each phase
+            binlog_counters counters;
+        };
+
+        scan_state (binlog *b) : owner (b), phase (0), next (0), emitted (0), max_ahead (0) {
+            pthread_mutex_init (&lock, NULL);
+            pthread_cond_init (&cond, NULL);
+        }
+        ~scan_state () {
+            pthread_cond_destroy (&cond);
+            pthread_mutex_destroy (&lock);
+        }
+
+        // Start a thread per arg for the current phase and wait for them,
+        // emitting finished chunks to os meanwhile if it's given.
+        void run (std::vector<thread_arg> &args, std::ostream *os);
+        void fail (const std::string &what);
+
+        binlog *owner;
+        std::vector<chunk> chunks;
+        int phase;		// 1: locate chunk starts, 2: run workers
+        size_t next;		// next chunk to hand out
+        size_t emitted;		// chunks written out so far
+        size_t max_ahead;	// how far past emitted workers may get
+        std::string error;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+    };
+
+
+    void binlog::scan_state::fail (const std::string &what) {
+        pthread_mutex_lock (&lock);
+        if (error.empty ()) {
+            error = what;
+        }
+        pthread_cond_broadcast (&cond);
+        pthread_mutex_unlock (&lock);
+    }
+
+
+    void binlog::scan_state::run (std::vector<thread_arg> &args, std::ostream *os) {
+        next = 0;
+        std::vector<pthread_t> threads;
+        for (size_t t = 0; t < args.size (); ++t) {
+            pthread_t thread;
+            // pthread_create returns its error, errno's left alone
+            int rc = pthread_create (&thread, NULL, &binlog::scan_thread, &args[t]);
+            if (rc != 0) {
+                fail (std::string ("pthread_create: ") + ::strerror (rc));
+                break;
+            }
+            threads.push_back (thread);
+        }
+        if (os) {
+            pthread_mutex_lock (&lock);
+            for (size_t c = 0; c < chunks.size () && error.empty (); ++c) {
+                while (!chunks[c].done && error.empty ()) {
+                    pthread_cond_wait (&cond, &lock);
+                }
+                if (!error.empty ()) {
+                    break;
+                }
+                std::string out;
+                out.swap (chunks[c].out);
+                emitted = c + 1;
+                pthread_cond_broadcast (&cond);
+                pthread_mutex_unlock (&lock);
+                os->write (out.data (), out.size ());
+                pthread_mutex_lock (&lock);
+            }
+            pthread_mutex_unlock (&lock);
+        }
+        for (size_t t = 0; t < threads.size (); ++t) {
+            pthread_join (threads[t], NULL);
+        }
+    }
+
+
+    void* binlog::scan_thread (void *arg) {
+        scan_state::thread_arg *a = (scan_state::thread_arg*)arg;
+        scan_state &state = *a->state;
+        std::string out;
+        pthread_mutex_lock (&state.lock);
+        for (;;) {
+            // Don't get too far ahead of the writer, finished chunks sit in memory.
+            while (state.phase == 2 && state.next < state.chunks.size () &&
+                   state.next >= state.emitted + state.max_ahead && state.error.empty ()) {
+                pthread_cond_wait (&state.cond, &state.lock);
+            }
+            if (state.next >= state.chunks.size () || !state.error.empty ()) {
+                break;
+            }
+            size_t c = state.next++;
+            pthread_mutex_unlock (&state.lock);
+            try {
+                if (state.phase == 1) {
+                    state.owner->scan_locate (state, c, a->counters);
+                } else {
+                    out.clear ();
+                    state.owner->scan_process (state, c, *a->worker, out, a->counters);
+                }
+            } catch (std::exception &e) {
+                state.fail (e.what ());
+                return NULL;
+            }
+            pthread_mutex_lock (&state.lock);
+            if (state.phase == 2) {
+                state.chunks[c].out.swap (out);
+                state.chunks[c].done = true;
+                pthread_cond_broadcast (&state.cond);
+            }
+        }
+        pthread_mutex_unlock (&state.lock);
+        return NULL;
+    }
+
+
+    void binlog::scan_locate (scan_state &state, size_t c, binlog_counters &counters) {
+        scan_state::chunk &chunk = state.chunks[c];
+        off64_t limit = c + 1 < state.chunks.size () ? state.chunks[c + 1].raw : file_size ();
+        // The first chunk starts on an event, the rest have to find one.
+        chunk.start = c == 0 ? chunk.raw : nearest_offset (chunk.raw, NULL, 1, counters);
+        if (chunk.start >= 0) {
+            chunk.end = walk_chain (chunk.start, limit);
+        }
+    }
+
+
+    void binlog::scan_process (scan_state &state, size_t c, scan_worker &worker, std::string &out, binlog_counters &counters) {
+        bool last = c + 1 == state.chunks.size ();
+        off64_t offset = state.chunks[c].start;
+        off64_t stop = last ? file_size () : state.chunks[c + 1].start;
+        event_buffer evbuf;
+        init_event (&evbuf);
+        // Mapped, so read_event only copies headers around.
+        while (offset < stop && read_event (&evbuf, offset) == 0) {
+            count_event (counters, evbuf);
+            // Rejected by the header, the payload isn't even looked at.
+            if (!m_filter || m_filter->header_matches (evbuf)) {
+                verify_event (&evbuf);
+                // Without table maps to keep track of this doesn't
+                // change the filter, every thread can use it.
+                if (!m_filter || m_filter->matches (evbuf)) {
+                    worker.event (event_view (&evbuf), out);
+                }
+            }
+            if (evbuf.length < EVENT_HEADER_SIZE) {
+                break;
+            }
+            offset += evbuf.length;
+        }
+    }
+
+
+    void binlog::parallel_scan (const std::vector<scan_worker*> &workers, std::ostream &os) {
+        if (workers.empty ()) {
+            return;
+        }
+        phase_timer scanning (m_counters.phase_ns[binlog_counters::PHASE_SCAN]);
+        off64_t start = m_evbuf->offset;
+
+        // Table maps don't survive being cut up into chunks.
+        if (m_map == NULL || workers.size () == 1 || (m_filter && m_filter->needs_table_maps ())) {
+            struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+            init_event (evbuf);
+            std::string out;
+            off64_t offset = start;
+            try {
+                for (;;) {
+                    reset_event (evbuf);
+                    if (m_filter) {
+                        offset = skip_filtered (offset);
+                    }
+                    if (read_event (evbuf, offset) < 0) {
+                        break;
+                    }
+                    count_event (m_counters, *evbuf);
+                    verify_event (evbuf);
+                    if (!m_filter || m_filter->matches (*evbuf)) {
+                        out.clear ();
+                        workers[0]->event (event_view (evbuf), out);
+                        os.write (out.data (), out.size ());
+                    }
+                    if (evbuf->length < EVENT_HEADER_SIZE) {
+                        break;
+                    }
+                    offset = next_after (evbuf);
+                }
+            } catch (...) {
+                dispose_event (evbuf);
+                throw;
+            }
+            dispose_event (evbuf);
+            return;
+        }
+
+        off64_t size = file_size ();
+        scan_state state (this);
+        off64_t chunk_size = (size - start) / (off64_t)(workers.size () * SCAN_CHUNKS_PER_THREAD);
+        chunk_size = std::max (SCAN_MIN_CHUNK, std::min (SCAN_MAX_CHUNK, chunk_size));
+        for (off64_t raw = start; raw < size; raw += chunk_size) {
+            state.chunks.push_back (scan_state::chunk ());
+            state.chunks.back ().raw = raw;
+        }
+        if (state.chunks.empty ()) {
+            return;
+        }
+        std::vector<scan_state::thread_arg> args (workers.size ());
+        for (size_t t = 0; t < workers.size (); ++t) {
+            args[t].state = &state;
+            args[t].worker = workers[t];
+        }
+
+        state.phase = 1;
+        state.run (args, NULL);
+        for (size_t t = 0; t < args.size (); ++t) {
+            m_counters.merge (args[t].counters);
+            args[t].counters.reset ();
+        }
+        if (!state.error.empty ()) {
+            throw std::runtime_error (state.error);
+        }
+
+        // Stitch the chunks together along the chain from the start.
+        // A chunk whose resync disagrees (or found nothing) is redone
+        // from where the previous one's chain actually ended.
+        for (size_t c = 0; c + 1 < state.chunks.size (); ++c) {
+            off64_t expected = state.chunks[c].end;
+            scan_state::chunk &next = state.chunks[c + 1];
+            if (next.start != expected) {
+#if DEBUG
+                fprintf (stderr, "chunk %lu resynced to %lld, chain says %lld\n", (unsigned long)(c + 1), (long long)next.start, (long long)expected);
+#endif
+                off64_t limit = c + 2 < state.chunks.size () ? state.chunks[c + 2].raw : size;
+                next.start = expected;
+                next.end = expected < limit ? walk_chain (expected, limit) : expected;
+            }
+        }
+
+        state.phase = 2;
+        state.max_ahead = workers.size () * 2;
+        state.run (args, &os);
+        for (size_t t = 0; t < args.size (); ++t) {
+            m_counters.merge (args[t].counters);
+            args[t].counters.reset ();
+        }
+        if (!state.error.empty ()) {
+            throw std::runtime_error (state.error);
+        }
+    }
+
+
+    off64_t binlog::indexed_seek (const binlog_index &index, off64_t starting_offset, time_t target, struct event_buffer *outbuf) {
+        if (index.size () == 0) {
+            return -2;
+        }
+        if (target > 0) {
+            // The index only gets us close, the answer has to be the
+            // one nearest_time would have found. The record before the
+            // first one at or after target is earlier than target, and
+            // with a stride the first match can be anywhere after it.
+            size_t i = index.lower_bound_time (target);
+            return closest_time (index[i > 0 ? i - 1 : 0].offset, target, outbuf);
+        }
+
+        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+        init_event (evbuf);
+        off64_t offset = index[index.floor_offset (starting_offset)].offset;
+        for (;;) {
+            reset_event (evbuf);
+            if (read_event (evbuf, offset) < 0 || evbuf->data == NULL) {
+                break;
+            }
+            if (offset >= starting_offset) {
+                if (outbuf != NULL) {
+                    reset_event (outbuf);
+                    copy_event (outbuf, evbuf);
+                }
+                dispose_event (evbuf);
+                return offset;
+            }
+            offset = next_after (evbuf);
+        }
+        // Ran off the end, there's nothing there.
+        dispose_event (evbuf);
+        return -2;
+    }
+
+
+    off64_t binlog::stream_seek (off64_t starting_offset, time_t target, struct event_buffer *outbuf) {
+        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+        init_event (evbuf);
+        while (target > 0 ? outbuf->timestamp < target : outbuf->offset < starting_offset) {
+            reset_event (evbuf);
+            if (read_event (evbuf, next_after (outbuf)) < 0 || evbuf->data == NULL) {
+                // Ran off the end without getting there, so there's
+                // nothing to start at, same as for a file.
+                dispose_event (evbuf);
+                return -2;
+            }
+            // Hand the event over rather than copying it, it's the
+            // only copy there's going to be.
+            reset_event (outbuf);
+            move_event (outbuf, evbuf);
+        }
+        dispose_event (evbuf);
+        return outbuf->offset;
+    }
+
+
+    off64_t binlog::stream_start () {
+        // Whoever's writing it may have started it anywhere, but a
+        // whole binlog (zcat mysql-bin.000042.gz |) is what we expect.
+        char magic[sizeof(BINLOG_MAGIC)];
+        if (read_at (magic, sizeof(BINLOG_MAGIC), 0, m_counters) == sizeof(BINLOG_MAGIC) &&
+            ::memcmp (magic, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) == 0) {
+            return sizeof(BINLOG_MAGIC);
+        }
+        return 0;
+    }
+
+
+    gtid_set binlog::previous_gtids () {
+        if (m_stream) {
+            throw std::runtime_error ("previous_gtids: a pipe has gone past it");
+        }
+        // Right after the format description
+        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+        init_event (evbuf);
+        gtid_set previous;
+        try {
+            off64_t offset = sizeof (BINLOG_MAGIC);
+            if (read_event (evbuf, offset) >= 0 && evbuf->data != NULL && evbuf->type_code == FORMAT_DESCRIPTION_EVENT) {
+                offset = next_after (evbuf);
+                reset_event (evbuf);
+                if (read_event (evbuf, offset) >= 0 && evbuf->data != NULL && evbuf->type_code == PREVIOUS_GTIDS_LOG_EVENT) {
+                    previous = gtid_set (*evbuf);
+                }
+            }
+        } catch (...) {
+            dispose_event (evbuf);
+            throw;
+        }
+        dispose_event (evbuf);
+        return previous;
+    }
+
+
+    bool binlog::seek_gtid (const gtid &target) {
+        phase_timer seeking (m_counters.phase_ns[binlog_counters::PHASE_SEEK]);
+        if (m_stream) {
+            struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+            init_event (evbuf);
+            gtid id;
+            bool found = event_gtid (*m_evbuf, id) && id == target;
+            while (!found) {
+                reset_event (evbuf);
+                if (read_event (evbuf, next_after (m_evbuf)) < 0 || evbuf->data == NULL) {
+                    break;
+                }
+                reset_event (m_evbuf);
+                move_event (m_evbuf, evbuf);
+                found = event_gtid (*m_evbuf, id) && id == target;
+            }
+            dispose_event (evbuf);
+            return found;
+        }
+
+        // Already in an earlier file, no need to look
+        if (previous_gtids ().contains (target)) {
+            return false;
+        }
+        off64_t offset;
+        binlog_index index;
+        if (m_stbuf != NULL && !m_filename.empty () && index.open (m_filename, *m_stbuf)) {
+            offset = index.find_gtid (target);
+        } else {
+            if (m_map) {
+                ::madvise ((void*)m_map, m_map_size, MADV_RANDOM);
+            }
+            offset = bisect_gtid (target);
+            if (m_map) {
+                ::madvise ((void*)m_map, m_map_size, MADV_SEQUENTIAL);
+            }
+        }
+        if (offset < 0) {
+            return false;
+        }
+        reset_event (m_evbuf);
+        read_event (m_evbuf, offset);
+        return m_evbuf->data != NULL;
+    }
+
+
+    off64_t binlog::scan_gtids (off64_t offset, off64_t until, const gtid &target, bool exact, uint64_t &gno) {
+        char header[EVENT_HEADER_SIZE];
+        struct gtid_event_buffer g;
+        uint64_t highest = 0;
+        while (offset < until && read_header (offset, header)) {
+            uint32_t length = header_length (header);
+            if (length < EVENT_HEADER_SIZE) {
+                break;
+            }
+            if ((uint8_t)header[offsetof (event_buffer, type_code)] == GTID_LOG_EVENT && length >= EVENT_HEADER_SIZE + sizeof (g)) {
+                if (m_map) {
+                    if ((size_t)offset + EVENT_HEADER_SIZE + sizeof (g) > m_map_size) {
+                        break;
+                    }
+                    memcpy (&g, m_map + offset + EVENT_HEADER_SIZE, sizeof (g));
+                } else if (read_at (&g, sizeof (g), offset + EVENT_HEADER_SIZE, m_counters) != sizeof (g)) {
+                    break;
+                }
+                if (memcmp (g.sid, target.sid, sizeof (g.sid)) == 0) {
+                    if (!exact || g.gno == target.gno) {
+                        gno = g.gno;
+                        return offset;
+                    }
+                    highest = std::max<uint64_t> (highest, g.gno);
+                }
+            }
+            offset += length;
+        }
+        // Not found, how far the sid's numbers got is what bisect_gtid wants to know
+        gno = highest;
+        return -1;
+    }
+
+
+    off64_t binlog::bisect_gtid (const gtid &target) {
+        // If target is in the file, it starts somewhere in [lo, hi).
+        // lo is always an event, hi just a place in the file.
+        off64_t lo = sizeof (BINLOG_MAGIC);
+        off64_t hi = file_size ();
+        // Whether a later transaction from target's server turned up
+        bool later = false;
+        uint64_t gno = 0;
+        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+        init_event (evbuf);
+        while (hi - lo > GTID_BISECT_SPAN) {
+            off64_t mid = lo + (hi - lo) / 2;
+            reset_event (evbuf);
+            off64_t found = nearest_offset (mid, evbuf, 1, m_counters);
+            off64_t at = found >= 0 && found < hi ? scan_gtids (found, hi, target, false, gno) : -1;
+            if (at >= 0 && gno == target.gno) {
+                dispose_event (evbuf);
+                return at;
+            }
+            if (at >= 0 && gno < target.gno) {
+                lo = at;
+            } else {
+                // Only later ones from mid on, or none of the server's at all
+                later = later || at >= 0;
+                hi = mid;
+            }
+        }
+        dispose_event (evbuf);
+        off64_t at = scan_gtids (lo, hi, target, true, gno);
+        if (at < 0 && (later || gno > target.gno)) {
+            // The numbers went past it without it turning up, so
+            // they're out of order. Look at every one.
+            at = scan_gtids (sizeof (BINLOG_MAGIC), file_size (), target, true, gno);
+        }
+        return at;
+    }
+
+
+    size_t binlog::build_index (unsigned int stride) {
+        if (m_filename.empty () || m_stbuf == NULL) {
+            throw std::runtime_error ("build_index: binlog wasn't opened by file name");
+        }
+        if (m_stream) {
+            throw std::runtime_error ("build_index: can't index a pipe");
+        }
+        if (stride == 0) {
+            stride = 1;
+        }
+        std::vector<index_record> records;
+        std::vector<index_gtid_record> gtids;
+        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
+        init_event (evbuf);
+        off64_t offset = sizeof (BINLOG_MAGIC);
+        for (size_t n = 0; ; ++n) {
+            reset_event (evbuf);
+            if (read_event (evbuf, offset) < 0 || evbuf->data == NULL) {
+                break;
+            }
+            if (n % stride == 0) {
+                index_record r;
+                r.offset = offset;
+                r.timestamp = evbuf->timestamp;
+                r.type_code = evbuf->type_code;
+                // A truncated XID_EVENT has no id to speak of
+                r.xid = evbuf->type_code == XID_EVENT && event_data_len (evbuf) >= sizeof (struct xid_event_buffer) ?
+                    ((struct xid_event_buffer*)evbuf->data)->id : 0;
+                records.push_back (r);
+            }
+            gtid id;
+            if (event_gtid (*evbuf, id)) {
+                index_gtid_record g;
+                memcpy (g.sid, id.sid, sizeof (g.sid));
+                g.gno = id.gno;
+                g.offset = offset;
+                gtids.push_back (g);
+            }
+            offset = next_after (evbuf);
+        }
+        dispose_event (evbuf);
+        std::sort (gtids.begin (), gtids.end (), gtid_record_less);
+        binlog_index::write (m_filename, *m_stbuf, stride, records, gtids);
+        return records.size ();
+    }
+
+
+    binlog_index::binlog_index ()
+        : m_map (NULL), m_map_size (0), m_header (NULL), m_records (NULL), m_count (0), m_gtids (NULL), m_gtid_count (0)
+    { }
+
+
+    binlog_index::~binlog_index () {
+        close ();
+    }
+
+
+    std::string binlog_index::path_for (const std::string &filename) {
+        return filename + ".ybidx";
+    }
+
+
+    void binlog_index::write (const std::string &filename, const struct stat &st,
+                              uint32_t stride, const std::vector<index_record> &records,
+                              const std::vector<index_gtid_record> &gtids) {
+        struct index_file_header h;
+        memset (&h, 0, sizeof (h));
+        memcpy (h.magic, INDEX_MAGIC, sizeof (h.magic));
+        h.version = INDEX_VERSION;
+        h.stride = stride;
+        h.record_size = sizeof (struct index_record);
+        h.binlog_size = st.st_size;
+        h.binlog_mtime = st.st_mtime;
+        h.count = records.size ();
+        h.gtid_count = gtids.size ();
+
+        // Write next to it and rename over, so readers never see half an index.
+        std::string path = path_for (filename);
+        std::string tmp = path + ".tmp";
+        FILE *f = fopen (tmp.c_str (), "wb");
+        if (f == NULL) {
+            throw std::runtime_error (std::string ("fopen: ") + ::strerror (errno));
+        }
+        if (fwrite (&h, sizeof (h), 1, f) != 1 ||
+            (!records.empty () && fwrite (&records[0], sizeof (struct index_record), records.size (), f) != records.size ()) ||
+            (!gtids.empty () && fwrite (&gtids[0], sizeof (struct index_gtid_record), gtids.size (), f) != gtids.size ())) {
+            int err = errno;
+            fclose (f);
+            unlink (tmp.c_str ());
+            throw std::runtime_error (std::string ("fwrite: ") + ::strerror (err));
+        }
+        if (fclose (f) != 0 || rename (tmp.c_str (), path.c_str ()) != 0) {
+            int err = errno;
+            unlink (tmp.c_str ());
+            throw std::runtime_error (std::string ("write index: ") + ::strerror (err));
+        }
+    }
+
+
+    bool binlog_index::open (const std::string &filename, const struct stat &st) {
+        close ();
+        int fd = ::open (path_for (filename).c_str (), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat ist;
+        if (::fstat (fd, &ist) < 0 || (size_t)ist.st_size < sizeof (struct index_file_header)) {
+            ::close (fd);
+            return false;
+        }
+        void *map = ::mmap (NULL, (size_t)ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close (fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        m_map = (const char*)map;
+        m_map_size = (size_t)ist.st_size;
+        const struct index_file_header *h = (const struct index_file_header*)m_map;
+        if (memcmp (h->magic, INDEX_MAGIC, sizeof (h->magic)) != 0 ||
+            h->version != INDEX_VERSION ||
+            h->record_size != sizeof (struct index_record) ||
+            h->stride == 0 ||
+            h->binlog_size != (uint64_t)st.st_size ||
+            h->binlog_mtime != (int64_t)st.st_mtime ||
+            h->count > (m_map_size - sizeof (*h)) / sizeof (struct index_record) ||
+            h->gtid_count > (m_map_size - sizeof (*h) - h->count * sizeof (struct index_record)) / sizeof (struct index_gtid_record)) {
+#if DEBUG
+            fprintf (stderr, "Ignoring stale or bogus index %s\n", path_for (filename).c_str ());
+#endif
+            close ();
+            return false;
+        }
+        // Lookups are bisections, readahead would only get in the way.
+        ::madvise ((void*)m_map, m_map_size, MADV_RANDOM);
+        m_header = h;
+        m_records = (const struct index_record*)(m_map + sizeof (*h));
+        m_count = h->count;
+        m_gtids = (const struct index_gtid_record*)(m_records + m_count);
+        m_gtid_count = h->gtid_count;
+        return true;
+    }
+
+
+    void binlog_index::close () {
+        if (m_map) {
+            ::munmap ((void*)m_map, m_map_size);
+        }
+        m_map = NULL;
+        m_map_size = 0;
+        m_header = NULL;
+        m_records = NULL;
+        m_count = 0;
+        m_gtids = NULL;
+        m_gtid_count = 0;
+    }
+
+
+    size_t binlog_index::lower_bound_time (time_t target) const {
+        size_t lo = 0, hi = m_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if ((time_t)m_records[mid].timestamp < target) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+
+    size_t binlog_index::floor_offset (off64_t offset) const {
+        size_t lo = 0, hi = m_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if ((off64_t)m_records[mid].offset <= offset) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo > 0 ? lo - 1 : 0;
+    }
+
+
+    off64_t binlog_index::find_gtid (const gtid &g) const {
+        size_t lo = 0, hi = m_gtid_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            int c = memcmp (m_gtids[mid].sid, g.sid, sizeof (g.sid));
+            if (c < 0 || (c == 0 && m_gtids[mid].gno < g.gno)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < m_gtid_count && m_gtids[lo].gno == g.gno && memcmp (m_gtids[lo].sid, g.sid, sizeof (g.sid)) == 0) {
+            return (off64_t)m_gtids[lo].offset;
+        }
+        return -1;
+    }
+
+
+    // Decompresses from a span start onwards, carrying on through
+    // gzip members and zstd frames. Only one thread uses it at a time.
+    struct compressed_file::decoder : boost::noncopyable {
+        decoder (int f, format k);
+        ~decoder ();
+
+        // Start over at a span that can be started at (not a SPAN_ZSTD_PART)
+        void start (const span_record &at, const std::string &window);
+        // Decompress up to len bytes into out. Stops early where a gzip
+        // member or zstd frame ends (ended), at the end of the file
+        // (eof), and if blocks, at the end of a deflate block (at_block).
+        size_t decompress (char *out, size_t len, bool blocks);
+        // Decompress len bytes and throw them away
+        void skip (uint64_t len);
+        // Where the next compressed byte is
+        uint64_t position () const { return in_offset + in_pos; }
+
+        int fd;
+        format kind;
+        bool ended;
+        bool at_block;
+        // at_block: bits of the byte before position () still to go
+        int bits;
+        bool eof;
+        // in the middle of a member or frame, so running out of input is an error
+        bool inside;
+        // gzip: started in the middle of a member, so it's raw deflate up to the trailer
+        bool raw;
+        z_stream z;
+#if defined(YBINLOGP_ZSTD)
+        ZSTD_DStream *zstd;
+#endif
+        std::vector<unsigned char> in;
+        uint64_t in_offset;	// of in[0]
+        size_t in_pos;
+        size_t in_len;
+
+    private:
+        // At least need bytes of input from in_pos on, false at the end of the file
+        bool fill (size_t need);
+        size_t decompress_gzip (char *out, size_t len, bool blocks);
+        size_t decompress_zstd (char *out, size_t len);
+        void end_member ();
+    };
+
+
+    compressed_file::decoder::decoder (int f, format k)
+        : fd (f), kind (k), ended (false), at_block (false), bits (0), eof (false), inside (false), raw (false),
+          in (SPAN_INPUT_CHUNK), in_offset (0), in_pos (0), in_len (0)
+    {
+        memset (&z, 0, sizeof (z));
+        if (inflateInit2 (&z, 15 + 16) != Z_OK) {
+            throw std::runtime_error ("inflateInit2: out of memory");
+        }
+#if defined(YBINLOGP_ZSTD)
+        zstd = NULL;
+        if (kind == ZSTD && (zstd = ZSTD_createDStream ()) == NULL) {
+            inflateEnd (&z);
+            throw std::runtime_error ("ZSTD_createDStream: out of memory");
+        }
+#endif
+    }
+
+
+    compressed_file::decoder::~decoder () {
+        inflateEnd (&z);
+#if defined(YBINLOGP_ZSTD)
+        if (zstd) {
+            ZSTD_freeDStream (zstd);
+        }
+#endif
+    }
+
+
+    bool compressed_file::decoder::fill (size_t need) {
+        while (in_len - in_pos < need) {
+            if (in_pos > 0) {
+                memmove (&in[0], &in[in_pos], in_len - in_pos);
+                in_offset += in_pos;
+                in_len -= in_pos;
+                in_pos = 0;
+            }
+            ssize_t amt_read = ::pread (fd, &in[in_len], in.size () - in_len, in_offset + in_len);
+            if (amt_read < 0) {
+                throw std::runtime_error (std::string ("pread: ") + ::strerror (errno));
+            } else if (amt_read == 0) {
+                return false;
+            }
+            in_len += amt_read;
+        }
+        return true;
+    }
+
+
+    void compressed_file::decoder::start (const span_record &at, const std::string &window) {
+        in_offset = at.compressed_offset;
+        in_pos = in_len = 0;
+        ended = at_block = eof = false;
+        inside = true;
+#if defined(YBINLOGP_ZSTD)
+        if (kind == ZSTD) {
+            size_t rc = ZSTD_initDStream (zstd);
+            if (ZSTD_isError (rc)) {
+                throw std::runtime_error (std::string ("ZSTD_initDStream: ") + ZSTD_getErrorName (rc));
+            }
+            return;
+        }
+#endif
+        raw = at.kind == SPAN_DEFLATE;
+        if (inflateReset2 (&z, raw ? -15 : 15 + 16) != Z_OK) {
+            throw std::runtime_error ("inflateReset2 failed");
+        }
+        if (!raw) {
+            return;
+        }
+        // Like zran: the block starts bits into the byte before, and
+        // refers back to the 32K before it.
+        if (at.bits) {
+            unsigned char last;
+            if (::pread (fd, &last, 1, at.compressed_offset - 1) != 1) {
+                throw std::runtime_error ("gzip: span index doesn't match the file");
+            }
+            inflatePrime (&z, at.bits, last >> (8 - at.bits));
+        }
+        std::vector<unsigned char> history (DEFLATE_WINDOW);
+        uLongf history_len = history.size ();
+        if (::uncompress (&history[0], &history_len, (const Bytef*)window.data (), window.size ()) != Z_OK ||
+            inflateSetDictionary (&z, &history[0], history_len) != Z_OK) {
+            throw std::runtime_error ("gzip: bad window in span index");
+        }
+    }
+
+
+    size_t compressed_file::decoder::decompress (char *out, size_t len, bool blocks) {
+        ended = at_block = false;
+        if (eof) {
+            return 0;
+        }
+#if defined(YBINLOGP_ZSTD)
+        if (kind == ZSTD) {
+            return decompress_zstd (out, len);
+        }
+#endif
+        return decompress_gzip (out, len, blocks);
+    }
+
+
+    size_t compressed_file::decoder::decompress_gzip (char *out, size_t len, bool blocks) {
+        z.next_out = (Bytef*)out;
+        z.avail_out = len;
+        while (z.avail_out) {
+            if (in_pos == in_len && !fill (1)) {
+                throw std::runtime_error ("gzip: unexpected end of file");
+            }
+            z.next_in = &in[in_pos];
+            z.avail_in = in_len - in_pos;
+            int rc = ::inflate (&z, blocks ? Z_BLOCK : Z_NO_FLUSH);
+            in_pos = in_len - z.avail_in;
+            if (rc == Z_STREAM_END) {
+                end_member ();
+                break;
+            } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                throw std::runtime_error (std::string ("gzip: ") + (z.msg ? z.msg : "corrupt data"));
+            }
+            // 128: just finished a block (or the header), 64: it was the last one
+            if (blocks && (z.data_type & 128) && !(z.data_type & 64)) {
+                at_block = true;
+                bits = z.data_type & 7;
+                break;
+            }
+        }
+        return len - z.avail_out;
+    }
+
+
+    void compressed_file::decoder::end_member () {
+        ended = true;
+        inside = false;
+        // Raw deflate leaves the crc and length to us
+        if (raw && !fill (8)) {
+            throw std::runtime_error ("gzip: unexpected end of file");
+        } else if (raw) {
+            in_pos += 8;
+        }
+        // Another member, or the end. gzip ignores trailing garbage, so do we.
+        if (fill (2) && in[in_pos] == 0x1f && in[in_pos + 1] == 0x8b) {
+            raw = false;
+            if (inflateReset2 (&z, 15 + 16) != Z_OK) {
+                throw std::runtime_error ("inflateReset2 failed");
+            }
+            inside = true;
+        } else {
+            eof = true;
+        }
+    }
+
+
+    size_t compressed_file::decoder::decompress_zstd (char *out, size_t len) {
+#if defined(YBINLOGP_ZSTD)
+        ZSTD_outBuffer output = { out, len, 0 };
+        while (output.pos < output.size) {
+            if (in_pos == in_len && !fill (1)) {
+                if (inside) {
+                    throw std::runtime_error ("zstd: unexpected end of file");
+                }
+                eof = true;
+                break;
+            }
+            ZSTD_inBuffer input = { &in[in_pos], in_len - in_pos, 0 };
+            size_t rc = ZSTD_decompressStream (zstd, &output, &input);
+            in_pos += input.pos;
+            if (ZSTD_isError (rc)) {
+                throw std::runtime_error (std::string ("zstd: ") + ZSTD_getErrorName (rc));
+            }
+            // 0 once a frame is done and flushed, skippable ones included
+            inside = rc != 0;
+            if (rc == 0) {
+                ended = true;
+                break;
+            }
+        }
+        return output.pos;
+#else
+        (void)out;
+        (void)len;
+        throw std::runtime_error ("zstd: built without zstd support (YBINLOGP_ZSTD)");
+#endif
+    }
+
+
+    void compressed_file::decoder::skip (uint64_t len) {
+        std::vector<char> scratch (SPAN_OUTPUT_CHUNK);
+        while (len > 0) {
+            size_t got = decompress (&scratch[0], std::min ((uint64_t)scratch.size (), len), false);
+            if (got == 0 && eof) {
+                throw std::runtime_error ("compressed file: shorter than its span index says");
+            }
+            len -= got;
+        }
+    }
+
+
+    bool stream_buffer::is_stream (int fd) {
+        return ::lseek (fd, 0, SEEK_CUR) < 0 && errno == ESPIPE;
+    }
+
+
+    stream_buffer::stream_buffer (int fd)
+        : m_fd (fd), m_ring (STREAM_RING_SIZE), m_head (0), m_len (0), m_offset (0), m_eof (false)
+    { }
+
+
+    size_t stream_buffer::read (void *buf, size_t len, off64_t offset, binlog_counters &counters) {
+        if (offset < m_offset) {
+            throw std::runtime_error ((boost::format ("can't go back to offset %d in a pipe, it's been read up to %d")
+                                       % offset % m_offset).str ());
+        }
+        while (!m_eof && m_offset + (off64_t)m_len < offset + (off64_t)len) {
+            // Nothing before offset is going to be asked for again,
+            // make room.
+            size_t skip = (size_t)std::min<off64_t> (offset - m_offset, m_len);
+            m_head = (m_head + skip) % m_ring.size ();
+            m_len -= skip;
+            m_offset += skip;
+            if (len > m_ring.size ()) {
+                grow (len);
+            }
+            read_more (counters);
+        }
+        if (offset >= m_offset + (off64_t)m_len) {
+            return 0;
+        }
+        size_t at = (m_head + (size_t)(offset - m_offset)) % m_ring.size ();
+        size_t n = (size_t)std::min<off64_t> (len, m_offset + m_len - offset);
+        size_t first = std::min (n, m_ring.size () - at);
+        memcpy (buf, &m_ring[at], first);
+        memcpy ((char*)buf + first, &m_ring[0], n - first);
+        return n;
+    }
+
+
+    void stream_buffer::read_more (binlog_counters &counters) {
+        // Only COUNT uses it, which may be compiled out
+        (void)counters;
+        // The free part of the ring runs from the end of what's
+        // buffered, maybe wrapping round to the start.
+        size_t tail = (m_head + m_len) % m_ring.size ();
+        size_t free = m_ring.size () - m_len;
+        struct iovec iov[2];
+        iov[0].iov_base = &m_ring[tail];
+        iov[0].iov_len = std::min (free, m_ring.size () - tail);
+        iov[1].iov_base = &m_ring[0];
+        iov[1].iov_len = free - iov[0].iov_len;
+        ssize_t amt_read;
+        do {
+            COUNT (++counters.syscalls);
+            amt_read = ::readv (m_fd, iov, iov[1].iov_len ? 2 : 1);
+        } while (amt_read < 0 && errno == EINTR);
+        if (amt_read < 0) {
+            throw std::runtime_error (std::string ("readv: ") + ::strerror (errno));
+        }
+        if (amt_read == 0) {
+            m_eof = true;
+        }
+        COUNT (counters.bytes_read += amt_read);
+        m_len += amt_read;
+    }
+
+
+    void stream_buffer::grow (size_t len) {
+        size_t size = m_ring.size ();
+        while (size < len) {
+            size *= 2;
+        }
+        // Straighten it out while we're at it
+        std::vector<char> ring (size);
+        size_t first = std::min (m_len, m_ring.size () - m_head);
+        memcpy (&ring[0], &m_ring[m_head], first);
+        memcpy (&ring[first], &m_ring[0], m_len - first);
+        m_ring.swap (ring);
+        m_head = 0;
+    }
+
+
+    compressed_file::format compressed_file::detect (int fd) {
+        unsigned char magic[4];
+        ssize_t amt_read = ::pread (fd, magic, sizeof (magic), 0);
+        if (amt_read >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+            return GZIP;
+        }
+        // A frame, or one of the 16 skippable frame magics
+        if (amt_read == 4 && (read_le32 (magic) == 0xFD2FB528 || (read_le32 (magic) & 0xFFFFFFF0) == 0x184D2A50)) {
+            return ZSTD;
+        }
+        return NOT_COMPRESSED;
+    }
+
+
+    std::string compressed_file::path_for (const std::string &filename) {
+        return filename + ".ybcz";
+    }
+
+
+    compressed_file::compressed_file (int fd, format kind, const std::string &filename)
+        : m_fd (fd), m_kind (kind), m_filename (filename), m_complete (false), m_decoder (NULL),
+          m_decoder_at (NO_SPAN), m_decoding (false), m_last_read (NO_SPAN), m_sequential (false),
+          m_readahead (true), m_thread_running (false), m_stopping (false), m_current_offset (0)
+    {
+        if (kind != GZIP && kind != ZSTD) {
+            throw std::invalid_argument ("compressed_file: not a gzip or zstd file");
+        }
+#if !defined(YBINLOGP_ZSTD)
+        if (kind == ZSTD) {
+            throw std::runtime_error ("zstd compressed binlog, but built without zstd support (YBINLOGP_ZSTD)");
+        }
+#endif
+        struct stat st;
+        if (::fstat (fd, &st) < 0) {
+            throw std::runtime_error (std::string ("fstat: ") + ::strerror (errno));
+        }
+        memset (&m_frontier, 0, sizeof (m_frontier));
+        m_frontier.kind = kind == GZIP ? SPAN_GZIP_MEMBER : SPAN_ZSTD_FRAME;
+        if ((filename.empty () || !load_index (st)) && kind == ZSTD) {
+            read_seek_table (st.st_size);
+        }
+        m_decoder = new decoder (fd, kind);
+        pthread_mutex_init (&m_lock, NULL);
+        pthread_cond_init (&m_cond, NULL);
+    }
+
+
+    compressed_file::~compressed_file () {
+        stop_readahead ();
+        delete m_decoder;
+        pthread_cond_destroy (&m_cond);
+        pthread_mutex_destroy (&m_lock);
+    }
+
+
+    uint64_t compressed_file::size () {
+        pthread_mutex_lock (&m_lock);
+        try {
+            while (!m_complete) {
+                get_span (m_spans.size ());
+            }
+        } catch (...) {
+            pthread_mutex_unlock (&m_lock);
+            throw;
+        }
+        uint64_t size = m_spans.empty () ? 0 : m_spans.back ().offset + m_spans.back ().length;
+        pthread_mutex_unlock (&m_lock);
+        return size;
+    }
+
+
+    size_t compressed_file::read (void *buf, size_t len, uint64_t offset) {
+        char *out = (char*)buf;
+        size_t done = 0;
+        while (done < len) {
+            uint64_t at = offset + done;
+            if (!m_current_data || at < m_current_offset || at >= m_current_offset + m_current_data->size ()) {
+                buffer data;
+                pthread_mutex_lock (&m_lock);
+                try {
+                    // Anything past the known spans has to be found first
+                    size_t span = find_span (at);
+                    while (span == m_spans.size () && !m_complete) {
+                        get_span (span);
+                        span = find_span (at);
+                    }
+                    if (span < m_spans.size ()) {
+                        data = get_span (span);
+                        m_current_offset = m_spans[span].offset;
+                        if (span != m_last_read) {
+                            m_sequential = span == m_last_read + 1;
+                            m_last_read = span;
+                            if (m_sequential && m_readahead && !m_thread_running &&
+                                pthread_create (&m_thread, NULL, &compressed_file::readahead_thread, this) == 0) {
+                                m_thread_running = true;
+                            }
+                            pthread_cond_broadcast (&m_cond);
+                        }
+                    }
+                } catch (...) {
+                    pthread_mutex_unlock (&m_lock);
+                    throw;
+                }
+                pthread_mutex_unlock (&m_lock);
+                m_current_data = data;
+                if (!data) {
+                    break;
+                }
+            }
+            size_t from = at - m_current_offset;
+            size_t n = std::min (len - done, m_current_data->size () - from);
+            memcpy (out + done, &(*m_current_data)[from], n);
+            done += n;
+        }
+        return done;
+    }
+
+
+    void compressed_file::set_readahead (bool readahead) {
+        if (!readahead) {
+            stop_readahead ();
+        }
+        pthread_mutex_lock (&m_lock);
+        m_readahead = readahead;
+        pthread_mutex_unlock (&m_lock);
+    }
+
+
+    size_t compressed_file::find_span (uint64_t offset) const {
+        size_t lo = 0, hi = m_spans.size ();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (m_spans[mid].offset + m_spans[mid].length <= offset) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+
+    compressed_file::buffer compressed_file::get_span (size_t span) {
+        for (;;) {
+            std::map<size_t, buffer>::iterator cached = m_cache.find (span);
+            if (cached != m_cache.end ()) {
+                return cached->second;
+            }
+            if (span > m_spans.size () || (span == m_spans.size () && m_complete)) {
+                return buffer ();
+            }
+            if (!m_decoding) {
+                break;
+            }
+            // Whatever the decoder's busy with may be this one
+            pthread_cond_wait (&m_cond, &m_lock);
+        }
+        m_decoding = true;
+        pthread_mutex_unlock (&m_lock);
+        buffer data;
+        try {
+            data = decode (span);
+        } catch (...) {
+            pthread_mutex_lock (&m_lock);
+            m_decoding = false;
+            m_decoder_at = NO_SPAN;
+            pthread_cond_broadcast (&m_cond);
+            throw;
+        }
+        pthread_mutex_lock (&m_lock);
+        m_decoding = false;
+        if (data) {
+            cache (span, data);
+        }
+        pthread_cond_broadcast (&m_cond);
+        return data;
+    }
+
+
+    compressed_file::buffer compressed_file::decode (size_t span) {
+        if (span == m_spans.size ()) {
+            return discover ();
+        }
+        // Nobody else adds spans while we hold the decoder, so they
+        // can be looked at without the lock.
+        const span_record &r = m_spans[span];
+        if (m_decoder_at != span) {
+            const span_record &from = m_spans[r.restart];
+            m_decoder_at = NO_SPAN;
+            m_decoder->start (from, m_windows[r.restart]);
+            m_decoder->skip (r.offset - from.offset);
+        }
+        m_decoder_at = NO_SPAN;
+        buffer data (new std::vector<char> (r.length));
+        size_t done = 0;
+        while (done < r.length) {
+            size_t got = m_decoder->decompress (&(*data)[done], r.length - done, false);
+            if (got == 0 && m_decoder->eof) {
+                throw std::runtime_error ("compressed file: shorter than its span index says");
+            }
+            done += got;
+        }
+        m_decoder_at = span + 1;
+        return data;
+    }
+
+
+    compressed_file::buffer compressed_file::discover () {
+        const size_t index = m_spans.size ();
+        span_record r = m_frontier;
+        std::string window = m_frontier_window;
+        if (m_decoder_at != index) {
+            m_decoder_at = NO_SPAN;
+            if (r.kind == SPAN_ZSTD_PART) {
+                const span_record &from = m_spans[r.restart];
+                m_decoder->start (from, m_windows[r.restart]);
+                m_decoder->skip (r.offset - from.offset);
+            } else {
+                m_decoder->start (r, window);
+            }
+        }
+        m_decoder_at = NO_SPAN;
+
+        // Where the zstd frame being decompressed can be started from
+        size_t frame_span = r.kind == SPAN_ZSTD_PART ? r.restart : index;
+        span_record next;
+        memset (&next, 0, sizeof (next));
+        std::string next_window;
+        buffer data (new std::vector<char>);
+        data->reserve (SPAN_SIZE + SPAN_OUTPUT_CHUNK);
+        for (;;) {
+            size_t used = data->size ();
+            // gzip goes on to the end of the block once the span's big enough
+            bool full = used >= SPAN_SIZE;
+            size_t want = full ? SPAN_OUTPUT_CHUNK : std::min (SPAN_OUTPUT_CHUNK, SPAN_SIZE - used);
+            data->resize (used + want);
+            size_t got = m_decoder->decompress (&(*data)[used], want, full);
+            data->resize (used + got);
+            if (m_decoder->eof) {
+                break;
+            }
+            if (m_decoder->ended) {
+                // Every gzip member starts a span. A zstd frame does
+                // once the span's full, or right away if this span is
+                // the tail of a bigger frame, which the next frame
+                // can't be restarted from. Nothing yet means this span
+                // starts at the next one instead.
+                if (m_kind == GZIP || data->size () >= SPAN_SIZE || data->empty () || r.kind == SPAN_ZSTD_PART) {
+                    span_record &start = data->empty () ? r : next;
+                    start.kind = m_kind == GZIP ? SPAN_GZIP_MEMBER : SPAN_ZSTD_FRAME;
+                    start.compressed_offset = m_decoder->position ();
+                    start.bits = 0;
+                    if (!data->empty ()) {
+                        break;
+                    }
+                    window.clear ();
+                }
+                frame_span = index;
+            } else if (data->size () >= SPAN_SIZE && m_kind == GZIP && m_decoder->at_block) {
+                next.kind = SPAN_DEFLATE;
+                next.compressed_offset = m_decoder->position ();
+                next.bits = m_decoder->bits;
+                next_window = deflate_window (&(*data)[data->size () - DEFLATE_WINDOW], DEFLATE_WINDOW);
+                break;
+            } else if (data->size () >= SPAN_SIZE && m_kind == ZSTD) {
+                next.kind = SPAN_ZSTD_PART;
+                next.restart = frame_span;
+                next.compressed_offset = frame_span == index ? r.compressed_offset : m_spans[frame_span].compressed_offset;
+                break;
+            }
+        }
+
+        const bool eof = m_decoder->eof;
+        pthread_mutex_lock (&m_lock);
+        if (!data->empty ()) {
+            r.length = data->size ();
+            if (r.kind != SPAN_ZSTD_PART) {
+                r.restart = index;
+            }
+            r.window_len = window.size ();
+            m_spans.push_back (r);
+            m_windows.push_back (window);
+        }
+        if (eof) {
+            m_complete = true;
+        } else {
+            next.offset = r.offset + data->size ();
+            m_frontier = next;
+            m_frontier_window = next_window;
+        }
+        pthread_mutex_unlock (&m_lock);
+        if (eof) {
+            save_index ();
+            return data->empty () ? buffer () : data;
+        }
+        m_decoder_at = index + 1;
+        return data;
+    }
+
+
+    void compressed_file::cache (size_t span, buffer data) {
+        m_cache[span] = data;
+        while (m_cache.size () > SPAN_CACHE) {
+            // Spans behind the reader go first, then the furthest ahead
+            std::map<size_t, buffer>::iterator victim = m_cache.begin ();
+            if (m_last_read == NO_SPAN || victim->first >= m_last_read) {
+                victim = --m_cache.end ();
+            }
+            m_cache.erase (victim);
+        }
+    }
+
+
+    bool compressed_file::load_index (const struct stat &st) {
+        FILE *f = fopen (path_for (m_filename).c_str (), "rb");
+        if (f == NULL) {
+            return false;
+        }
+        struct span_file_header h;
+        bool ok = fread (&h, sizeof (h), 1, f) == 1 &&
+            memcmp (h.magic, SPAN_INDEX_MAGIC, sizeof (h.magic)) == 0 &&
+            h.version == SPAN_INDEX_VERSION &&
+            h.format == (uint32_t)m_kind &&
+            h.record_size == sizeof (struct span_record) &&
+            h.binlog_size == (uint64_t)st.st_size &&
+            h.binlog_mtime == (int64_t)st.st_mtime;
+        std::vector<span_record> spans;
+        std::vector<std::string> windows;
+        uint64_t offset = 0;
+        for (uint64_t i = 0; ok && i < h.count; ++i) {
+            span_record r;
+            ok = fread (&r, sizeof (r), 1, f) == 1 &&
+                r.offset == offset && r.length > 0 &&
+                (r.kind == SPAN_ZSTD_PART ? r.restart < i && spans[r.restart].kind == SPAN_ZSTD_FRAME : r.restart == i) &&
+                r.window_len <= compressBound (DEFLATE_WINDOW);
+            if (ok) {
+                std::string window (r.window_len, '\0');
+                ok = r.window_len == 0 || fread (&window[0], r.window_len, 1, f) == 1;
+                spans.push_back (r);
+                windows.push_back (window);
+                offset += r.length;
+            }
+        }
+        fclose (f);
+        if (!ok) {
+#if DEBUG
+            fprintf (stderr, "Ignoring stale or bogus span index %s\n", path_for (m_filename).c_str ());
+#endif
+            return false;
+        }
+        m_spans.swap (spans);
+        m_windows.swap (windows);
+        m_complete = true;
+        return true;
+    }
+
+
+    void compressed_file::save_index () {
+        struct stat st;
+        if (m_filename.empty () || ::fstat (m_fd, &st) < 0) {
+            return;
+        }
+        struct span_file_header h;
+        memset (&h, 0, sizeof (h));
+        memcpy (h.magic, SPAN_INDEX_MAGIC, sizeof (h.magic));
+        h.version = SPAN_INDEX_VERSION;
+        h.format = m_kind;
+        h.record_size = sizeof (struct span_record);
+        h.binlog_size = st.st_size;
+        h.binlog_mtime = st.st_mtime;
+        h.count = m_spans.size ();
+
+        // Same as binlog_index::write, but it's only a shortcut, so
+        // not being able to write it (a read-only archive, say) is fine.
+        std::string path = path_for (m_filename);
+        std::string tmp = path + ".tmp";
+        FILE *f = fopen (tmp.c_str (), "wb");
+        if (f == NULL) {
+            return;
+        }
+        bool ok = fwrite (&h, sizeof (h), 1, f) == 1;
+        for (size_t i = 0; ok && i < m_spans.size (); ++i) {
+            ok = fwrite (&m_spans[i], sizeof (struct span_record), 1, f) == 1 &&
+                (m_windows[i].empty () || fwrite (m_windows[i].data (), m_windows[i].size (), 1, f) == 1);
+        }
+        if (fclose (f) != 0 || !ok || rename (tmp.c_str (), path.c_str ()) != 0) {
+            unlink (tmp.c_str ());
+        }
+    }
+
+
+    void compressed_file::read_seek_table (off64_t compressed_size) {
+        // The footer: frame count, descriptor (bit 7: entries have a
+        // checksum), magic. Without it it's plain zstd, whose spans
+        // get found as it's read.
+        unsigned char footer[ZSTD_SEEKABLE_FOOTER];
+        if (compressed_size < (off64_t)(8 + ZSTD_SEEKABLE_FOOTER) ||
+            ::pread (m_fd, footer, sizeof (footer), compressed_size - sizeof (footer)) != (ssize_t)sizeof (footer) ||
+            read_le32 (footer + 5) != ZSTD_SEEKABLE_MAGIC || (footer[4] & 0x7c)) {
+            return;
+        }
+        uint64_t frames = read_le32 (footer);
+        size_t entry_size = footer[4] & 0x80 ? 12 : 8;
+        uint64_t table_size = frames * entry_size + ZSTD_SEEKABLE_FOOTER;
+        if (table_size + 8 > (uint64_t)compressed_size) {
+            return;
+        }
+        std::vector<unsigned char> table (table_size + 8);
+        if (::pread (m_fd, &table[0], table.size (), compressed_size - table.size ()) != (ssize_t)table.size () ||
+            read_le32 (&table[0]) != ZSTD_SKIPPABLE_MAGIC || read_le32 (&table[4]) != table_size) {
+            return;
+        }
+        std::vector<span_record> spans;
+        uint64_t compressed_offset = 0, offset = 0;
+        for (uint64_t i = 0; i < frames; ++i) {
+            const unsigned char *entry = &table[8 + i * entry_size];
+            uint32_t compressed_len = read_le32 (entry);
+            uint32_t len = read_le32 (entry + 4);
+            // Small frames share a span, big ones are cut up into several
+            if (len > 0 && !spans.empty () && spans.back ().kind == SPAN_ZSTD_FRAME &&
+                spans.back ().length + len <= SPAN_SIZE) {
+                spans.back ().length += len;
+            } else if (len > 0) {
+                size_t frame = spans.size ();
+                for (uint64_t part = 0; part < len; part += SPAN_SIZE) {
+                    span_record r;
+                    memset (&r, 0, sizeof (r));
+                    r.offset = offset + part;
+                    r.length = std::min ((uint64_t)SPAN_SIZE, len - part);
+                    r.restart = frame;
+                    r.compressed_offset = compressed_offset;
+                    r.kind = part == 0 ? SPAN_ZSTD_FRAME : SPAN_ZSTD_PART;
+                    spans.push_back (r);
+                }
+            }
+            compressed_offset += compressed_len;
+            offset += len;
+        }
+        if (compressed_offset + table.size () != (uint64_t)compressed_size) {
+#if DEBUG
+            fprintf (stderr, "Ignoring a zstd seek table that doesn't add up\n");
+#endif
+            return;
+        }
+        m_spans.swap (spans);
+        m_windows.resize (m_spans.size ());
+        m_complete = true;
+    }
+
+
+    void* compressed_file::readahead_thread (void *arg) {
+        ((compressed_file*)arg)->readahead ();
+        return NULL;
+    }
+
+
+    void compressed_file::readahead () {
+        pthread_mutex_lock (&m_lock);
+        while (!m_stopping) {
+            size_t span = readahead_target ();
+            if (span == NO_SPAN || m_decoding) {
+                pthread_cond_wait (&m_cond, &m_lock);
+                continue;
+            }
+            try {
+                get_span (span);
+            } catch (std::exception &) {
+                // The reader gets to the same error itself
+                m_readahead = false;
+            }
+        }
+        pthread_mutex_unlock (&m_lock);
+    }
+
+
+    size_t compressed_file::readahead_target () const {
+        if (!m_readahead || !m_sequential || m_last_read == NO_SPAN) {
+            return NO_SPAN;
+        }
+        for (size_t span = m_last_read + 1; span <= m_last_read + SPAN_READAHEAD; ++span) {
+            if (span >= m_spans.size ()) {
+                return span == m_spans.size () && !m_complete ? span : NO_SPAN;
+            } else if (m_cache.find (span) == m_cache.end ()) {
+                return span;
+            }
+        }
+        return NO_SPAN;
+    }
+
+
+    void compressed_file::stop_readahead () {
+        pthread_mutex_lock (&m_lock);
+        bool running = m_thread_running;
+        m_stopping = true;
+        pthread_cond_broadcast (&m_cond);
+        pthread_mutex_unlock (&m_lock);
+        if (running) {
+            pthread_join (m_thread, NULL);
+        }
+        pthread_mutex_lock (&m_lock);
+        m_thread_running = false;
+        m_stopping = false;
+        pthread_mutex_unlock (&m_lock);
+    }
+
+
+    statement_search::statement_search ()
+    { }
+
+
+    statement_search::~statement_search () {
+        for (size_t i = 0; i < m_regexes.size (); ++i) {
+            regfree (m_regexes[i]);
+            delete m_regexes[i];
+        }
+    }
+
+
+    void statement_search::add_literal (const std::string &literal) {
+        m_literals.push_back (literal);
+    }
+
+
+    void statement_search::add_regex (const std::string &pattern) {
+        regex_t *re = new regex_t;
+        int rc = regcomp (re, pattern.c_str (), REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            char msg[256];
+            regerror (rc, re, msg, sizeof (msg));
+            delete re;
+            throw std::invalid_argument ((boost::format ("bad regex '%s': %s") % pattern % msg).str ());
+        }
+        m_regexes.push_back (re);
+    }
+
+
+    bool statement_search::matches (const char *statement, size_t len) const {
+        if (find_literal (statement, len, m_literals)) {
+            return true;
+        }
+        for (size_t i = 0; i < m_regexes.size (); ++i) {
+#if defined(REG_STARTEND)
+            regmatch_t span;
+            span.rm_so = 0;
+            span.rm_eo = len;
+            if (regexec (m_regexes[i], statement, 1, &span, REG_STARTEND) == 0) {
+                return true;
+            }
+#else
+            std::string copy (statement, len);
+            if (regexec (m_regexes[i], copy.c_str (), 0, NULL, 0) == 0) {
+                return true;
+            }
+#endif
+        }
+        return false;
+    }
+
+
+    bool statement_search::matches (const event_buffer &evbuf) const {
+        if (evbuf.type_code != QUERY_EVENT || evbuf.data == NULL ||
+            event_data_len ((&evbuf)) < sizeof (struct query_event_buffer)) {
+            return false;
+        }
+        const struct query_event_buffer *q = (const struct query_event_buffer*)evbuf.data;
+        if (sizeof (struct query_event_buffer) + q->status_var_len + q->db_name_len + 1 > event_data_len ((&evbuf))) {
+            return false;
+        }
+        return matches (query_event_statement ((&evbuf)), query_event_statement_len ((&evbuf)));
+    }
+
+
+    event_filter::event_filter ()
+        : m_from (0), m_until (0), m_require (0), m_reject (0)
+    { }
+
+
+    void event_filter::add_type (uint8_t type_code) {
+        m_types.resize (256, false);
+        m_types[type_code] = true;
+    }
+
+
+    void event_filter::add_server_id (uint32_t server_id) {
+        m_server_ids.insert (server_id);
+    }
+
+
+    void event_filter::set_time_range (time_t from, time_t until) {
+        m_from = from;
+        m_until = until;
+    }
+
+
+    void event_filter::set_flags (uint16_t require, uint16_t reject) {
+        m_require = require;
+        m_reject = reject;
+    }
+
+
+    void event_filter::add_database (const std::string &database) {
+        m_databases.insert (database);
+    }
+
+
+    void event_filter::add_table (const std::string &table) {
+        m_tables.insert (table);
+    }
+
+
+    bool event_filter::header_matches (const event_buffer &header) const {
+        return (m_types.empty () || m_types[header.type_code]) &&
+            (m_server_ids.empty () || m_server_ids.count (header.server_id)) &&
+            (m_from == 0 || (time_t)header.timestamp >= m_from) &&
+            (m_until == 0 || (time_t)header.timestamp <= m_until) &&
+            (header.flags & m_require) == m_require &&
+            !(header.flags & m_reject) &&
+            (!m_search || header.type_code == QUERY_EVENT);
+    }
+
+
+    bool event_filter::wants (const event_buffer &header) const {
+        return header_matches (header) || (needs_table_maps () && header.type_code == TABLE_MAP_EVENT);
+    }
+
+
+    bool event_filter::name_matches (const std::string &database, const std::string &table) const {
+        if (!m_databases.empty () && !m_databases.count (database)) {
+            return false;
+        }
+        return m_tables.empty () || m_tables.count (table) || m_tables.count (database + "." + table);
+    }
+
+
+    bool event_filter::matches (const event_buffer &evbuf) {
+        if (!needs_payload ()) {
+            return header_matches (evbuf);
+        }
+        if (!needs_table_maps ()) {
+            return header_matches (evbuf) && m_search->matches (evbuf);
+        }
+        if (evbuf.type_code == TABLE_MAP_EVENT) {
+            // Has to be tracked even when the header says no, the row
+            // events that follow may well be let through.
+            uint64_t table_id;
+            std::string names[2];
+            if (!table_map_names (evbuf, table_id, names[0], names[1])) {
+                return false;
+            }
+            bool passes = name_matches (names[0], names[1]);
+            if (passes) {
+                m_table_ids.insert (table_id);
+            } else {
+                m_table_ids.erase (table_id);
+            }
+            return passes && header_matches (evbuf);
+        }
+        if (!header_matches (evbuf)) {
+            return false;
+        }
+        if (!m_tables.empty () && !is_rows_event (evbuf.type_code)) {
+            // Nothing else says which table it's about
+            return false;
+        }
+        if (evbuf.type_code == QUERY_EVENT) {
+            // The statement can name any table, all there is to go by
+            // is its default database.
+            if (evbuf.data == NULL || event_data_len ((&evbuf)) < sizeof (struct query_event_buffer)) {
+                return false;
+            }
+            const struct query_event_buffer *q = (const struct query_event_buffer*)evbuf.data;
+            if (sizeof (struct query_event_buffer) + q->status_var_len + q->db_name_len > event_data_len ((&evbuf))) {
+                return false;
+            }
+            if (!m_databases.empty () && !m_databases.count (std::string (query_event_db_name ((&evbuf)), q->db_name_len))) {
+                return false;
+            }
+        } else if (is_rows_event (evbuf.type_code)) {
+            if (evbuf.data == NULL || event_data_len ((&evbuf)) < sizeof (struct rows_event_buffer)) {
+                return false;
+            }
+            return m_table_ids.count (read_le ((const unsigned char*)evbuf.data, sizeof (((struct rows_event_buffer*)0)->table_id))) > 0;
+        }
+        return !m_search || m_search->matches (evbuf);
+    }
+
+
+    binlog::format_description_entry::format_description_entry (const struct event_buffer &evbuf)
+        : format_version (0), create_timestamp (0), header_len (0), checksum_alg (CHECKSUM_UNDEF)
+    {
+        if (evbuf.type_code != FORMAT_DESCRIPTION_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for format_description_entry") % evbuf.type_code).str ());
+        }
+        size_t size = evbuf.length - EVENT_HEADER_SIZE;
+        if (size < sizeof (struct format_description_event_buffer)) {
+            throw std::runtime_error ("format description event too short");
+        }
+        struct format_description_event_buffer *f = (struct format_description_event_buffer*)evbuf.data;
+        format_version = f->format_version;
+        create_timestamp = f->create_timestamp;
+        server_version.assign (f->server_version, strnlen (f->server_version, sizeof (f->server_version)));
+        header_len = f->header_len;
+
+        // The post-header lengths run to the end of the event, except
+        // that newer servers follow them with the checksum algorithm
+        // and room for the FDE's own checksum.
+        const unsigned char *p = (const unsigned char*)evbuf.data + sizeof (struct format_description_event_buffer);
+        size_t n = size - sizeof (struct format_description_event_buffer);
+        if (checksum_aware (server_version) && n >= 1 + 4) {
+            n -= 1 + 4;
+            checksum_alg = p[n];
+        }
+        post_header_len.assign (p, p + n);
+    }
+
+
+    binlog::query_entry::query_entry (const struct event_buffer &evbuf)
+        : thread_id (0), query_time (0), error_code (0)
+    {
+        if (evbuf.type_code != QUERY_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for query_entry") % evbuf.type_code).str ());
+        }
+        struct query_event_buffer *q = (struct query_event_buffer*)(evbuf.data);
+        thread_id = q->thread_id;
+        query_time = q->query_time;
+        error_code = q->error_code;
+        database = query_event_db_name ((&evbuf));
+        size_t statement_len = query_event_statement_len ((&evbuf));
+        statement = std::string ((const char*)query_event_statement ((&evbuf)), statement_len);
+    }
+
+
+    binlog::rand_entry::rand_entry (const struct event_buffer &evbuf)
+        : seed_1 (0), seed_2 (0)
+    {
+        if (evbuf.type_code != RAND_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for rand_entry") % evbuf.type_code).str ());
+        }
+        struct rand_event_buffer *r = (struct rand_event_buffer*)evbuf.data;
+        seed_1 = r->seed_1;
+        seed_2 = r->seed_2;
+    }
+
+
+    binlog::intvar_entry::intvar_entry (const struct event_buffer &evbuf)
+        : type (0), value (0)
+    {
+        if (evbuf.type_code != INTVAR_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for intvar_entry") % evbuf.type_code).str ());
+        }
+        struct intvar_event_buffer *i = (struct intvar_event_buffer*)(evbuf.data);
+        type = i->type;
+        value = i->value;
+    }
+
+
+    binlog::rotate_entry::rotate_entry (const struct event_buffer &evbuf)
+        : next_position (4) // defaults to 4 to skip the magic bytes in the file
+    {
+        if (evbuf.type_code != ROTATE_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for rotate_entry") % evbuf.type_code).str ());
+        }
+        struct rotate_event_buffer *r = (struct rotate_event_buffer*)evbuf.data;
+        next_position = r->next_position;
+        size_t len = rotate_event_file_name_len((&evbuf));
+        next_file = std::string ((const char*)rotate_event_file_name((&evbuf)), len);
+    }
+
+
+    binlog::xid_entry::xid_entry (const struct event_buffer &evbuf)
+        : id (0)
+    {
+        if (evbuf.type_code != XID_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for id_entry") % evbuf.type_code).str ());
+        }
+        struct xid_event_buffer *x = (struct xid_event_buffer*)evbuf.data;
+        id = x->id;
+    }
+
+
+    binlog::gtid_entry::gtid_entry (const struct event_buffer &evbuf)
+        : flags (0), last_committed (0), sequence_number (0)
+    {
+        if (evbuf.type_code != GTID_LOG_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for gtid_entry") % evbuf.type_code).str ());
+        }
+        if (!event_gtid (evbuf, id)) {
+            throw std::runtime_error ("GTID_LOG_EVENT is too short to have a GTID");
+        }
+        flags = ((struct gtid_event_buffer*)evbuf.data)->flags;
+        // 5.7 added the logical clock, type 2 is the only one there is
+        const unsigned char *p = (const unsigned char*)evbuf.data + sizeof (struct gtid_event_buffer);
+        if (event_data_len ((&evbuf)) >= sizeof (struct gtid_event_buffer) + 17 && p[0] == 2) {
+            last_committed = (int64_t)read_le (p + 1, 8);
+            sequence_number = (int64_t)read_le (p + 9, 8);
+        }
+    }
+
+
+    gtid::gtid ()
+        : gno (0)
+    {
+        memset (sid, 0, sizeof (sid));
+    }
+
+
+    gtid gtid::parse (const std::string &text) {
+        gtid g;
+        // The uuid's dashes are optional, like MySQL has them
+        size_t colon = text.find (':');
+        size_t digits = 0;
+        for (size_t i = 0; i < colon && i < text.size (); ++i) {
+            if (text[i] == '-') {
+                continue;
+            }
+            int v = hex_value (text[i]);
+            if (v < 0 || digits == 2 * sizeof (g.sid)) {
+                digits = 0;
+                break;
+            }
+            g.sid[digits / 2] |= v << (digits % 2 ? 0 : 4);
+            ++digits;
+        }
+        char *end = NULL;
+        if (digits == 2 * sizeof (g.sid) && colon != std::string::npos && colon + 1 < text.size () &&
+            isdigit ((unsigned char)text[colon + 1])) {
+            g.gno = strtoull (text.c_str () + colon + 1, &end, 10);
+        }
+        if (end == NULL || *end != '\0' || g.gno == 0) {
+            throw std::invalid_argument (std::string ("not a GTID (uuid:number): ") + text);
+        }
+        return g;
+    }
+
+
+    std::string gtid::sid_str () const {
+        static const char hex[] = "0123456789abcdef";
+        std::string s;
+        s.reserve (36);
+        for (size_t i = 0; i < sizeof (sid); ++i) {
+            if (i == 4 || i == 6 || i == 8 || i == 10) {
+                s += '-';
+            }
+            s += hex[sid[i] >> 4];
+            s += hex[sid[i] & 0xf];
+        }
+        return s;
+    }
+
+
+    std::string gtid::str () const {
+        return (boost::format ("%s:%llu") % sid_str () % (unsigned long long)gno).str ();
+    }
+
+
+    bool gtid::operator== (const gtid &rhs) const {
+        return gno == rhs.gno && memcmp (sid, rhs.sid, sizeof (sid)) == 0;
+    }
+
+
+    bool gtid::operator< (const gtid &rhs) const {
+        int c = memcmp (sid, rhs.sid, sizeof (sid));
+        return c < 0 || (c == 0 && gno < rhs.gno);
+    }
+
+
+    gtid_set::gtid_set (const struct event_buffer &evbuf) {
+        if (evbuf.type_code != PREVIOUS_GTIDS_LOG_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for gtid_set") % evbuf.type_code).str ());
+        }
+        const unsigned char *p = (const unsigned char*)evbuf.data;
+        size_t size = evbuf.data ? event_data_len ((&evbuf)) : 0;
+        if (size < sizeof (struct previous_gtids_event_buffer)) {
+            throw std::runtime_error ("PREVIOUS_GTIDS_LOG_EVENT runs past the end of the event");
+        }
+        uint64_t sids = read_le (p, 8);
+        size_t offset = sizeof (struct previous_gtids_event_buffer);
+        for (uint64_t i = 0; i < sids; ++i) {
+            if (size - offset < 16 + 8) {
+                throw std::runtime_error ("PREVIOUS_GTIDS_LOG_EVENT runs past the end of the event");
+            }
+            std::vector<std::pair<uint64_t, uint64_t> > &ranges = m_intervals[std::string ((const char*)p + offset, 16)];
+            uint64_t n = read_le (p + offset + 16, 8);
+            offset += 16 + 8;
+            if (n > (size - offset) / 16) {
+                throw std::runtime_error ("PREVIOUS_GTIDS_LOG_EVENT runs past the end of the event");
+            }
+            for (uint64_t j = 0; j < n; ++j, offset += 16) {
+                ranges.push_back (std::make_pair (read_le (p + offset, 8), read_le (p + offset + 8, 8)));
+            }
+            std::sort (ranges.begin (), ranges.end ());
+        }
+    }
+
+
+    bool gtid_set::contains (const gtid &g) const {
+        interval_map::const_iterator it = m_intervals.find (std::string ((const char*)g.sid, sizeof (g.sid)));
+        if (it == m_intervals.end ()) {
+            return false;
+        }
+        // The last range starting at or before gno
+        const std::vector<std::pair<uint64_t, uint64_t> > &ranges = it->second;
+        std::vector<std::pair<uint64_t, uint64_t> >::const_iterator r =
+            std::upper_bound (ranges.begin (), ranges.end (), std::make_pair (g.gno, (uint64_t)-1));
+        return r != ranges.begin () && g.gno < (r - 1)->second;
+    }
+
+
+    std::string gtid_set::str () const {
+        std::string out;
+        for (interval_map::const_iterator it = m_intervals.begin (); it != m_intervals.end (); ++it) {
+            gtid g;
+            memcpy (g.sid, it->first.data (), sizeof (g.sid));
+            if (!out.empty ()) {
+                out += ',';
+            }
+            out += g.sid_str ();
+            for (size_t i = 0; i < it->second.size (); ++i) {
+                uint64_t start = it->second[i].first, end = it->second[i].second;
+                out += ':';
+                append_uint (out, start);
+                if (end - start > 1) {
+                    out += '-';
+                    append_uint (out, end - 1);
+                }
+            }
+        }
+        return out;
+    }
+
+
+    binlog::table_map_entry::table_map_entry (const struct event_buffer &evbuf)
+        : table_id (0), flags (0)
+    {
+        if (evbuf.type_code != TABLE_MAP_EVENT) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for table_map_entry") % evbuf.type_code).str ());
+        }
+        const std::string buf (evbuf.data, event_data_len ((&evbuf)));
+        const unsigned char *p = (const unsigned char*)buf.data ();
+        check_span (0, sizeof (struct table_map_event_buffer), buf.size ());
+        struct table_map_event_buffer *t = (struct table_map_event_buffer*)evbuf.data;
+        table_id = read_le (t->table_id, sizeof (t->table_id));
+        flags = t->flags;
+
+        size_t offset = sizeof (struct table_map_event_buffer);
+        std::string *names[2] = { &database, &table };
+        for (int i = 0; i < 2; ++i) {
+            check_span (offset, 1, buf.size ());
+            size_t len = p[offset];
+            check_span (offset + 1, len + 1, buf.size ());
+            names[i]->assign (buf, offset + 1, len);
+            offset += len + 2;
+        }
+
+        size_t columns = read_packed (buf, offset);
+        check_span (offset, columns, buf.size ());
+        column_types.assign (p + offset, p + offset + columns);
+        offset += columns;
+
+        size_t meta_len = read_packed (buf, offset);
+        check_span (offset, meta_len, buf.size ());
+        size_t meta_end = offset + meta_len;
+        column_meta.resize (columns);
+        for (size_t c = 0; c < columns; ++c) {
+            size_t len = column_meta_size (column_types[c]);
+            check_span (offset, len, meta_end);
+            column_meta[c] = read_le (p + offset, len);
+            offset += len;
+        }
+        offset = meta_end;
+
+        check_span (offset, (columns + 7) / 8, buf.size ());
+        nullable.resize (columns);
+        for (size_t c = 0; c < columns; ++c) {
+            nullable[c] = bit_set (buf.data () + offset, c);
+        }
+    }
+
+
+    std::string binlog::column_value::str () const {
+        switch (kind) {
+        case INT:
+            return (boost::format ("%d") % int_value).str ();
+        case UINT:
+            return (boost::format ("%u") % uint_value).str ();
+        case DOUBLE:
+            return (boost::format (type == MYSQL_TYPE_FLOAT ? "%.7g" : "%.15g") % double_value).str ();
+        case BYTES:
+        case TEXT:
+            return string_value;
+        default:
+            return "NULL";
+        }
+    }
+
+
+    struct binlog::rows_entry::data {
+        std::string payload;
+        boost::shared_ptr<const table_map_entry> table;
+        size_t columns;
+        // Offsets of the columns present bitmap of each image and the
+        // size of the NULL bitmap that goes with it. Only updates have
+        // two different ones.
+        size_t present[2];
+        size_t null_bytes[2];
+        int images_per_row;
+        size_t rows_start;
+        // where each image starts, filled in by scan ()
+        mutable std::vector<uint32_t> images;
+        mutable bool scanned;
+
+        void scan () const;
+        /** Find where image's columns start, from columns.size () up
+            to and including upto. next and present_seen carry on from
+            where the last call left off. */
+        void walk (size_t image_offset, int image, size_t upto, std::vector<uint32_t> &columns,
+                   size_t &next, size_t &present_seen) const;
+    };
+
+
+    void binlog::rows_entry::data::walk (size_t image_offset, int image, size_t upto, std::vector<uint32_t> &offsets,
+                                         size_t &next, size_t &present_seen) const {
+        const char *bitmap = payload.data () + present[image];
+        const char *nulls = payload.data () + image_offset;
+        for (size_t c = offsets.size (); c <= upto && c < columns; ++c) {
+            if (!bit_set (bitmap, c)) {
+                offsets.push_back (ABSENT_COLUMN);
+            } else if (bit_set (nulls, present_seen++)) {
+                offsets.push_back (NULL_COLUMN);
+            } else {
+                size_t size = column_size (table->column_types[c], table->column_meta[c], payload, next);
+                check_span (next, size, payload.size ());
+                offsets.push_back (next);
+                next += size;
+            }
+        }
+    }
+
+
+    void binlog::rows_entry::data::scan () const {
+        std::vector<uint32_t> offsets;
+        size_t offset = rows_start;
+        while (offset < payload.size ()) {
+            int image = images.size () % images_per_row;
+            check_span (offset, null_bytes[image], payload.size ());
+            images.push_back (offset);
+            offsets.clear ();
+            size_t next = offset + null_bytes[image], present_seen = 0;
+            walk (offset, image, columns, offsets, next, present_seen);
+            offset = next;
+        }
+        if (images.size () % images_per_row) {
+            throw std::runtime_error ("update rows event has a before image without an after image");
+        }
+        scanned = true;
+    }
+
+
+    binlog::rows_entry::rows_entry (const struct event_buffer &evbuf, const table_map_cache &tables)
+        : type_code (evbuf.type_code), table_id (0), flags (0)
+    {
+        if (!is_rows_event (evbuf.type_code)) {
+            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for rows_entry") % evbuf.type_code).str ());
+        }
+        if (evbuf.data == NULL) {
+            throw std::runtime_error ("event had NULL data");
+        }
+        boost::shared_ptr<data> d (new data);
+        d->payload.assign (evbuf.data, event_data_len ((&evbuf)));
+        const std::string &buf = d->payload;
+        check_span (0, sizeof (struct rows_event_buffer), buf.size ());
+        struct rows_event_buffer *r = (struct rows_event_buffer*)buf.data ();
+        table_id = read_le (r->table_id, sizeof (r->table_id));
+        flags = r->flags;
+        if (!(d->table = tables.find (table_id))) {
+            throw std::runtime_error ((boost::format ("no TABLE_MAP_EVENT for table_id %d") % table_id).str ());
+        }
+
+        size_t offset = sizeof (struct rows_event_buffer);
+        if (type_code >= WRITE_ROWS_EVENT) {
+            // v2, skip the extra data, its length includes itself
+            check_span (offset, 2, buf.size ());
+            offset += read_le ((const unsigned char*)buf.data () + offset, 2);
+        }
+        d->columns = read_packed (buf, offset);
+        if (d->columns > d->table->columns ()) {
+            throw std::runtime_error ((boost::format ("rows event has %d columns, table map %d") % d->columns % d->table->columns ()).str ());
+        }
+        d->images_per_row = is_update_rows_event (type_code) ? 2 : 1;
+        size_t bitmap_bytes = (d->columns + 7) / 8;
+        for (int i = 0; i < 2; ++i) {
+            if (i == d->images_per_row) {
+                d->present[i] = d->present[0];
+                d->null_bytes[i] = d->null_bytes[0];
+                break;
+            }
+            check_span (offset, bitmap_bytes, buf.size ());
+            d->present[i] = offset;
+            size_t present = 0;
+            for (size_t c = 0; c < d->columns; ++c) {
+                present += bit_set (buf.data () + offset, c);
+            }
+            d->null_bytes[i] = (present + 7) / 8;
+            offset += bitmap_bytes;
+        }
+        d->rows_start = offset;
+        d->scanned = false;
+        m_data = d;
+    }
+
+
+    const binlog::table_map_entry& binlog::rows_entry::table () const {
+        return *m_data->table;
+    }
+
+
+    size_t binlog::rows_entry::size () const {
+        if (!m_data->scanned) {
+            m_data->scan ();
+        }
+        return m_data->images.size () / m_data->images_per_row;
+    }
+
+
+    binlog::rows_entry::row binlog::rows_entry::before (size_t i) const {
+        if (type_code == WRITE_ROWS_EVENT_V1 || type_code == WRITE_ROWS_EVENT) {
+            throw std::invalid_argument ("WRITE_ROWS_EVENT rows have no before image");
+        }
+        if (i >= size ()) {
+            throw std::out_of_range ("row index out of range");
+        }
+        return row (m_data, m_data->images[i * m_data->images_per_row], 0);
+    }
+
+
+    binlog::rows_entry::row binlog::rows_entry::after (size_t i) const {
+        if (type_code == DELETE_ROWS_EVENT_V1 || type_code == DELETE_ROWS_EVENT) {
+            throw std::invalid_argument ("DELETE_ROWS_EVENT rows have no after image");
+        }
+        if (i >= size ()) {
+            throw std::out_of_range ("row index out of range");
+        }
+        int image = m_data->images_per_row - 1;
+        return row (m_data, m_data->images[i * m_data->images_per_row + image], image);
+    }
+
+
+    binlog::rows_entry::row binlog::rows_entry::operator[] (size_t i) const {
+        return m_data->images_per_row == 1 && type_code != WRITE_ROWS_EVENT_V1 && type_code != WRITE_ROWS_EVENT ?
+            before (i) : after (i);
+    }
+
+
+    binlog::rows_entry::row::row (const boost::shared_ptr<const data> &data, size_t offset, int image)
+        : m_data (data), m_offset (offset), m_image (image),
+          m_next (offset + data->null_bytes[image]), m_present_seen (0)
+    { }
+
+
+    size_t binlog::rows_entry::row::columns () const {
+        return m_data->columns;
+    }
+
+
+    bool binlog::rows_entry::row::present (size_t column) const {
+        if (column >= m_data->columns) {
+            throw std::out_of_range ("column index out of range");
+        }
+        return bit_set (m_data->payload.data () + m_data->present[m_image], column);
+    }
+
+
+    void binlog::rows_entry::row::walk (size_t column) const {
+        if (column >= m_data->columns) {
+            throw std::out_of_range ("column index out of range");
+        }
+        m_data->walk (m_offset, m_image, column, m_columns, m_next, m_present_seen);
+    }
+
+
+    bool binlog::rows_entry::row::is_null (size_t column) const {
+        walk (column);
+        return m_columns[column] == NULL_COLUMN;
+    }
+
+
+    binlog::column_value binlog::rows_entry::row::value (size_t column) const {
+        walk (column);
+        uint8_t type = m_data->table->column_types[column];
+        uint16_t meta = m_data->table->column_meta[column];
+        uint32_t offset = m_columns[column];
+        if (offset == NULL_COLUMN || offset == ABSENT_COLUMN) {
+            column_value v;
+            v.type = type;
+            return v;
+        }
+        return decode_column (type, meta, m_data->payload, offset, column_size (type, meta, m_data->payload, offset));
+    }
+
+
+    bool table_map_cache::update (const event_buffer &evbuf) {
+        if (evbuf.type_code == FORMAT_DESCRIPTION_EVENT) {
+            clear ();
+        } else if (evbuf.type_code == TABLE_MAP_EVENT && evbuf.data != NULL) {
+            boost::shared_ptr<binlog::table_map_entry> table (new binlog::table_map_entry (evbuf));
+            m_tables[table->table_id] = table;
+            return true;
+        }
+        return false;
+    }
+
+
+    boost::shared_ptr<const binlog::table_map_entry> table_map_cache::find (uint64_t table_id) const {
+        std::map<uint64_t, boost::shared_ptr<const binlog::table_map_entry> >::const_iterator it = m_tables.find (table_id);
+        return it == m_tables.end () ? boost::shared_ptr<const binlog::table_map_entry> () : it->second;
+    }
+
+
+    transaction_reader::transaction_reader (binlog &log, uint64_t max_buffered)
+        : m_log (log), m_max_buffered (max_buffered), m_started (false), m_step (false), m_done (false)
+    { }
+
+
+    transaction_reader::iterator transaction_reader::begin () {
+        if (!m_started) {
+            advance ();
+        }
+        return iterator (this);
+    }
+
+
+    void transaction_reader::add (const binlog::entry &ev) {
+        const event_buffer *evbuf = ev.get_buffer ();
+        if (m_current.events == 0) {
+            m_current.start = evbuf->offset;
+        }
+        m_current.end = evbuf->offset + evbuf->length;
+        m_current.timestamp = evbuf->timestamp;
+        ++m_current.events;
+        m_current.bytes += evbuf->length;
+        if (!m_current.buffered) {
+            return;
+        }
+        if (m_current.bytes > m_max_buffered) {
+            // Too big to hold, it'll have to be read again by offset
+            std::vector<binlog::entry> ().swap (m_current.entries);
+            m_current.buffered = false;
+            return;
+        }
+        m_current.entries.push_back (ev);
+    }
+
+
+    void transaction_reader::advance () {
+        m_current = transaction ();
+        if (!m_started) {
+            m_it = m_log.begin ();
+            m_started = true;
+        } else if (m_step) {
+            // Only now, so a followed binlog hands out a commit
+            // without waiting for the event after it.
+            ++m_it;
+        }
+        m_step = false;
+
+        // Inside BEGIN ... COMMIT
+        bool open = false;
+        // Events so far that only say what comes next: a GTID, or
+        // context for a statement
+        uint64_t leading = 0;
+        // The ones of those that are context. They go with whatever
+        // follows them, and don't make a transaction on their own.
+        uint64_t context = 0;
+        for (; m_it != m_end; ++m_it) {
+            const event_buffer &ev = *m_it->get_buffer ();
+            switch (ev.type_code) {
+            case QUERY_EVENT:
+                if (statement_is (ev, "BEGIN")) {
+                    if (m_current.events > leading) {
+                        // Never finished, the BEGIN starts the next one
+                        return;
+                    }
+                    open = true;
+                    add (*m_it);
+                } else {
+                    add (*m_it);
+                    if (!open) {
+                        m_current.ending = transaction::AUTOCOMMIT;
+                    } else if (statement_is (ev, "COMMIT")) {
+                        m_current.ending = transaction::COMMIT;
+                    } else if (statement_is_rollback (ev)) {
+                        m_current.ending = transaction::ROLLBACK;
+                    } else {
+                        break;
+                    }
+                    m_step = true;
+                    return;
+                }
+                break;
+            case XID_EVENT:
+                if (open) {
+                    add (*m_it);
+                    const struct xid_event_buffer *x = (const struct xid_event_buffer*)ev.data;
+                    if (x != NULL && event_data_len ((&ev)) >= sizeof (*x)) {
+                        m_current.xid = x->id;
+                    }
+                    m_current.ending = transaction::COMMIT;
+                    m_step = true;
+                    return;
+                }
+                break;
+            case GTID_LOG_EVENT:
+            case ANONYMOUS_GTID_LOG_EVENT:
+                if (m_current.events > context) {
+                    // Never finished, the GTID starts the next one
+                    return;
+                }
+                add (*m_it);
+                ++leading;
+                break;
+            case INTVAR_EVENT:
+            case RAND_EVENT:
+            case USER_VAR_EVENT:
+                // Context for the statement that follows
+                add (*m_it);
+                if (!open) {
+                    ++leading;
+                    ++context;
+                }
+                break;
+            default:
+                if (open) {
+                    add (*m_it);
+                }
+                break;
+            }
+        }
+        // The end, part way through one or not
+        m_done = m_current.events == 0;
+    }
+
+
+    event_stats::event_stats ()
+        : m_first_timestamp (0), m_last_timestamp (0),
+          m_last_database_counter (NULL), m_last_table_id (0), m_last_table_counter (NULL),
+          m_last_minute (0), m_last_minute_counter (NULL)
+    {
+        memset (m_query_times, 0, sizeof (m_query_times));
+    }
+
+
+    void event_stats::add (const event_buffer &evbuf) {
+        if (m_total.events == 0 || evbuf.timestamp < m_first_timestamp) {
+            m_first_timestamp = evbuf.timestamp;
+        }
+        if (evbuf.timestamp > m_last_timestamp) {
+            m_last_timestamp = evbuf.timestamp;
+        }
+        m_total.add (evbuf.length);
+        m_types[evbuf.type_code].add (evbuf.length);
+        uint32_t minute = evbuf.timestamp / 60;
+        if (m_last_minute_counter == NULL || minute != m_last_minute) {
+            m_last_minute_counter = &m_minutes[minute];
+            m_last_minute = minute;
+        }
+        m_last_minute_counter->add (evbuf.length);
+
+        if (evbuf.data == NULL) {
+            return;
+        }
+        if (evbuf.type_code == QUERY_EVENT) {
+            const struct query_event_buffer *q = (const struct query_event_buffer*)evbuf.data;
+            if (event_data_len ((&evbuf)) < sizeof (*q) ||
+                sizeof (*q) + q->status_var_len + q->db_name_len > event_data_len ((&evbuf))) {
+                return;
+            }
+            size_t bucket = 0;
+            for (uint32_t t = q->query_time; t; t >>= 1) {
+                ++bucket;
+            }
+            ++m_query_times[bucket];
+            if (q->error_code) {
+                ++m_errors[q->error_code];
+            }
+            const char *database = query_event_db_name ((&evbuf));
+            if (m_last_database_counter == NULL || m_last_database.size () != q->db_name_len ||
+                memcmp (m_last_database.data (), database, q->db_name_len) != 0) {
+                m_last_database.assign (database, q->db_name_len);
+                m_last_database_counter = &m_databases[m_last_database];
+            }
+            m_last_database_counter->add (evbuf.length);
+        } else if (evbuf.type_code == TABLE_MAP_EVENT) {
+            uint64_t table_id;
+            table_name name;
+            if (!table_map_names (evbuf, table_id, name.database, name.table)) {
+                return;
+            }
+            // Usually the same table as last time
+            boost::unordered_map<uint64_t, table_name>::iterator it = m_table_names.find (table_id);
+            if (it != m_table_names.end () && it->second.database == name.database && it->second.table == name.table) {
+                return;
+            }
+            settle (table_id);
+            m_table_names[table_id] = name;
+        } else if (is_rows_event (evbuf.type_code)) {
+            if (event_data_len ((&evbuf)) < sizeof (struct rows_event_buffer)) {
+                return;
+            }
+            uint64_t table_id = read_le ((const unsigned char*)evbuf.data, sizeof (((struct rows_event_buffer*)0)->table_id));
+            if (m_last_table_counter == NULL || table_id != m_last_table_id) {
+                m_last_table_counter = &m_table_rows[table_id];
+                m_last_table_id = table_id;
+            }
+            m_last_table_counter->add (evbuf.length);
+        }
+    }
+
+
+    void event_stats::settle (uint64_t table_id) {
+        boost::unordered_map<uint64_t, counter>::iterator rows = m_table_rows.find (table_id);
+        if (rows == m_table_rows.end ()) {
+            return;
+        }
+        boost::unordered_map<uint64_t, table_name>::const_iterator name = m_table_names.find (table_id);
+        if (name == m_table_names.end ()) {
+            m_unmapped[table_id].add (rows->second);
+        } else {
+            m_databases[name->second.database].add (rows->second);
+            m_tables[name->second.database + "." + name->second.table].add (rows->second);
         }
-        return 0;
+        m_table_rows.erase (rows);
+        m_last_table_counter = NULL;
     }
 
-    template<typename Ch,  typename Tr>
-    void print_statement_event(std::basic_ostream<Ch, Tr> &os, const event_buffer &ev, int verbosity, char *database_limit) {
-        if (ev.data == NULL) {
+
+    void event_stats::merge (const event_stats &rhs) {
+        if (rhs.m_total.events == 0) {
             return;
         }
-        switch ((enum e_event_types)ev.type_code) {
-        case QUERY_EVENT: {
-            size_t statement_len = query_event_statement_len((&ev));
-            char *statement = (char*)alloca (statement_len + 1);
-            memcpy (statement, (const char*)query_event_statement((&ev)), statement_len);
-            statement[statement_len] = '\0';
-            char* db_name = query_event_db_name((&ev));
-            if (database_limit != NULL && strncmp (db_name, database_limit, strlen (database_limit)) != 0) {
-                return;
-            }
-            if (verbosity <= 1 || strncmp(statement, "BEGIN", 5) != 0) {
-                os << statement << '\n';
-            }
-            break;
+        if (m_total.events == 0 || rhs.m_first_timestamp < m_first_timestamp) {
+            m_first_timestamp = rhs.m_first_timestamp;
         }
-        case XID_EVENT: {
-            if (verbosity <= 1) {
-                os << "COMMIT\n";
+        m_last_timestamp = std::max (m_last_timestamp, rhs.m_last_timestamp);
+        m_total.add (rhs.m_total);
+        for (size_t i = 0; i < 256; ++i) {
+            m_types[i].add (rhs.m_types[i]);
+        }
+        for (size_t i = 0; i < QUERY_TIME_BUCKETS; ++i) {
+            m_query_times[i] += rhs.m_query_times[i];
+        }
+        for (std::map<uint16_t, uint64_t>::const_iterator it = rhs.m_errors.begin (); it != rhs.m_errors.end (); ++it) {
+            m_errors[it->first] += it->second;
+        }
+        for (boost::unordered_map<uint32_t, counter>::const_iterator it = rhs.m_minutes.begin (); it != rhs.m_minutes.end (); ++it) {
+            m_minutes[it->first].add (it->second);
+        }
+        for (boost::unordered_map<std::string, counter>::const_iterator it = rhs.m_databases.begin (); it != rhs.m_databases.end (); ++it) {
+            m_databases[it->first].add (it->second);
+        }
+        for (boost::unordered_map<std::string, counter>::const_iterator it = rhs.m_tables.begin (); it != rhs.m_tables.end (); ++it) {
+            m_tables[it->first].add (it->second);
+        }
+        // rhs's rows by table_id go under the names rhs knows, the
+        // rest wait for a name from somewhere
+        for (boost::unordered_map<uint64_t, counter>::const_iterator it = rhs.m_table_rows.begin (); it != rhs.m_table_rows.end (); ++it) {
+            boost::unordered_map<uint64_t, table_name>::const_iterator name = rhs.m_table_names.find (it->first);
+            if (name == rhs.m_table_names.end ()) {
+                m_unmapped[it->first].add (it->second);
+            } else {
+                m_databases[name->second.database].add (it->second);
+                m_tables[name->second.database + "." + name->second.table].add (it->second);
             }
-            break;
         }
-        default:
-            break;
+        for (boost::unordered_map<uint64_t, counter>::const_iterator it = rhs.m_unmapped.begin (); it != rhs.m_unmapped.end (); ++it) {
+            m_unmapped[it->first].add (it->second);
+        }
+        for (boost::unordered_map<uint64_t, table_name>::const_iterator it = rhs.m_table_names.begin (); it != rhs.m_table_names.end (); ++it) {
+            m_table_names.insert (*it);
         }
     }
-}
 
 
-namespace yelp {
-    // This thing is a tad slow compared to jbrown's original fprintf version, but it's ostream compatible...
-    std::ostream& operator<< (std::ostream &os, const event_buffer &ev) {
-        using namespace boost;
+    void event_stats::settled (boost::unordered_map<std::string, counter> &databases,
+                               boost::unordered_map<std::string, counter> &tables) const {
+        databases = m_databases;
+        tables = m_tables;
+        // Rows under a table_id's current name, and rows from before
+        // its first table map, under whatever name it's known by.
+        const boost::unordered_map<uint64_t, counter> *by_id[2] = { &m_table_rows, &m_unmapped };
+        for (int i = 0; i < 2; ++i) {
+            for (boost::unordered_map<uint64_t, counter>::const_iterator it = by_id[i]->begin (); it != by_id[i]->end (); ++it) {
+                boost::unordered_map<uint64_t, table_name>::const_iterator name = m_table_names.find (it->first);
+                if (name == m_table_names.end ()) {
+                    databases["?"].add (it->second);
+                    tables[(boost::format ("? (table_id %llu)") % (unsigned long long)it->first).str ()].add (it->second);
+                } else {
+                    databases[name->second.database].add (it->second);
+                    tables[name->second.database + "." + name->second.table].add (it->second);
+                }
+            }
+        }
+    }
 
-        const time_t t = ev.timestamp;
-        os << "BYTE OFFSET " << (long long)ev.offset << "\n"
-           << "------------------------\n"
-           << "timestamp:          " << ev.timestamp << " = " << ctime(&t)
-           << "type_code:          " << event_types[ev.type_code] << "\n";
-        if (q_mode > 1) {
-            return os;
+
+    void event_stats::report (std::ostream &os) const {
+        typedef std::pair<std::string, counter> named;
+        boost::unordered_map<std::string, counter> databases, tables;
+        settled (databases, tables);
+        boost::format row ("  %-40s %12llu %16llu\n");
+        boost::format heading ("%-42s %12s %16s\n");
+        boost::format count_heading ("%-42s %12s\n");
+        char when[2][32];
+        uint32_t timestamps[2] = { m_first_timestamp, m_last_timestamp };
+        for (int i = 0; i < 2; ++i) {
+            time_t t = timestamps[i];
+            struct tm tm;
+            localtime_r (&t, &tm);
+            strftime (when[i], sizeof (when[i]), "%Y-%m-%d %H:%M:%S", &tm);
         }
-        os << "server id:          " << ev.server_id << "\n"
-           << "length:             " << ev.length << "\n"
-           << "next pos:           " << (unsigned long long)ev.next_position << "\n"
-           << "flags:              ";
-        for (int i=16; i > 0; --i) {
-            os << (format ("%hhd") % get_bit (ev.flags, i));
+
+        os << heading % "" % "events" % "bytes";
+        os << row % "total" % (unsigned long long)m_total.events % (unsigned long long)m_total.bytes;
+        if (m_total.events) {
+            os << boost::format ("  from %s to %s\n") % when[0] % when[1];
         }
-        os << "\n";
-        for (int i=16; i > 0; --i) {
-            if (get_bit (ev.flags, i)) {
-                os << "                        " << flags[i-1] << "\n";
+
+        std::vector<named> sorted;
+        for (size_t i = 0; i < 256; ++i) {
+            if (m_types[i].events) {
+                sorted.push_back (named (i < sizeof (event_types) / sizeof (event_types[0]) ? event_types[i] : (boost::format ("%d") % i).str (),
+                                         m_types[i]));
             }
         }
-        if (ev.data == NULL) {
-            return os;
-        }
-        switch ((e_event_types)ev.type_code) {
-        case QUERY_EVENT: {
-            struct query_event_buffer *q = (struct query_event_buffer*)(ev.data);
-            char* db_name = query_event_db_name((&ev));
-            size_t statement_len = query_event_statement_len((&ev));
-            char *statement = (char*)alloca (statement_len + 1);
-            memcpy (statement, (const char*)query_event_statement((&ev)), statement_len);
-            statement[statement_len] = '\0';
-            if (statement == NULL) {
-                std::cerr << "strndupa: " << ::strerror (errno) << "\n";
-                return os;
-            }
-            os << "thread id:          " << q->thread_id << "\n"
-               << "query time (s):     " << q->query_time << "\n";
-            if (q->error_code == 0) {
-                os << "error code:         " << q->error_code << "\n";
-            } else {
-                os << "ERROR CODE:         " << q->error_code << "\n";
+        const char *titles[3] = { "event type", "database", "table" };
+        const boost::unordered_map<std::string, counter> *maps[3] = { NULL, &databases, &tables };
+        for (int m = 0; m < 3; ++m) {
+            if (maps[m]) {
+                sorted.assign (maps[m]->begin (), maps[m]->end ());
             }
-            os << "status var length:  " << q->status_var_len << "\n"
-               << "db_name:            " << db_name << "\n"
-               << "statement length:   " << statement_len << "\n";
-            if (q_mode == 0) {
-                os << "statement:          " << statement << "\n";
+            // Biggest first
+            std::sort (sorted.begin (), sorted.end (), bytes_descending);
+            os << "\n" << heading % titles[m] % "events" % "bytes";
+            for (size_t i = 0; i < sorted.size (); ++i) {
+                // Statements run without a default database
+                const std::string &name = sorted[i].first.empty () ? std::string ("(none)") : sorted[i].first;
+                os << row % name % (unsigned long long)sorted[i].second.events % (unsigned long long)sorted[i].second.bytes;
             }
-            break;
         }
-        case ROTATE_EVENT: {
-            struct rotate_event_buffer *r = (struct rotate_event_buffer*)ev.data;
-            size_t len = rotate_event_file_name_len((&ev));
-            // ghetto inlined strndupa...
-            char *file_name = (char*)alloca (len + 1);
-            memcpy (file_name, (const char*)rotate_event_file_name((&ev)), len);
-            file_name[len] = '\0';
-            os << "next log position:  " << (unsigned long long)r->next_position << "\n"
-               << "next file name:     " << file_name << "\n";
-            break;
+
+        os << "\n" << count_heading % "query_time (QUERY_EVENTs)" % "events";
+        size_t buckets = QUERY_TIME_BUCKETS;
+        while (buckets > 1 && m_query_times[buckets - 1] == 0) {
+            --buckets;
         }
-        case INTVAR_EVENT: {
-            struct intvar_event_buffer *i = (struct intvar_event_buffer*)ev.data;
-            os << "variable type:      " << intvar_types[i->type] << "\n"
-               << "value: 	            " << (unsigned long long)i->value << "\n";
-            break;
+        for (size_t b = 0; b < buckets; ++b) {
+            std::string range = b < 2 ? (boost::format ("%ds") % b).str ()
+                : (boost::format ("%llu-%llus") % (1ULL << (b - 1)) % ((1ULL << b) - 1)).str ();
+            os << boost::format ("  %-40s %12llu\n") % range % (unsigned long long)m_query_times[b];
         }
-        case RAND_EVENT: {
-            struct rand_event_buffer *r = (struct rand_event_buffer*)ev.data;
-            os << "seed 1:	            " << (unsigned long long)r->seed_1 << "\n"
-           << "seed 2:	            " << (unsigned long long)r->seed_2 << "\n";
-            break;
+
+        os << "\n" << count_heading % "error_code (QUERY_EVENTs)" % "events";
+        for (std::map<uint16_t, uint64_t>::const_iterator it = m_errors.begin (); it != m_errors.end (); ++it) {
+            os << boost::format ("  %-40d %12llu\n") % it->first % (unsigned long long)it->second;
         }
-        case FORMAT_DESCRIPTION_EVENT: {
-            struct format_description_event_buffer *f = (struct format_description_event_buffer*)ev.data;
-            os << "binlog version:     " << f->format_version << "\n"
-               << "server version:     " << f->server_version << "\n"
-               << "variable length:    " << format_description_event_data_len((&ev)) << "\n";
-            break;
+
+        os << "\n" << heading % "minute" % "events" % "bytes";
+        std::vector<std::pair<uint32_t, counter> > minutes (m_minutes.begin (), m_minutes.end ());
+        std::sort (minutes.begin (), minutes.end (), minute_ascending);
+        for (size_t i = 0; i < minutes.size (); ++i) {
+            time_t t = (time_t)minutes[i].first * 60;
+            struct tm tm;
+            char minute[32];
+            localtime_r (&t, &tm);
+            strftime (minute, sizeof (minute), "%Y-%m-%d %H:%M", &tm);
+            os << row % minute % (unsigned long long)minutes[i].second.events % (unsigned long long)minutes[i].second.bytes;
         }
-        case XID_EVENT: {
-            struct xid_event_buffer *x = (struct xid_event_buffer*)ev.data;
-            os << "xid id:             " << (unsigned long long)x->id << "\n";
-            break;
+    }
+
+
+    binlog::entry binlog::event_view::to_entry () const {
+        return entry (m_buffer);
+    }
+
+
+    binlog::entry::entry () {
+        init_event (&m_buffer);
+    }
+
+
+    binlog::entry::entry (const entry &rhs) {
+        copy_event (&m_buffer, &rhs.m_buffer);
+    }
+
+
+    binlog::entry::entry (const event_buffer *evbuf) {
+        if (evbuf) {
+            copy_event (&m_buffer, evbuf);
+        } else {
+            init_event (&m_buffer);
         }
-        default:
-            break;
+    }
+
+
+    binlog::entry& yelp::binlog::entry::operator= (const entry &rhs) {
+        if (this != &rhs) {
+            reset_event (&m_buffer);
+            copy_event (&m_buffer, &rhs.m_buffer);
         }
-        return os;
+        return *this;
     }
 
-    binlog::binlog (const std::string &filename, off64_t starting_offset, time_t starting_time)
-        : m_fd (-1), m_owns_file (true), m_stbuf (new struct stat), m_evbuf (NULL),
-          m_min_timestamp (0), m_max_timestamp (::time(NULL))
-    {
-        if (stat (filename.c_str (), m_stbuf)) {
-            throw std::runtime_error (std::string ("stat: ") + ::strerror (errno));
+
+#if __cplusplus >= 201103L
+    binlog::entry::entry (entry &&rhs) {
+        move_event (&m_buffer, &rhs.m_buffer);
+    }
+
+
+    binlog::entry& yelp::binlog::entry::operator= (entry &&rhs) {
+        if (this != &rhs) {
+            reset_event (&m_buffer);
+            move_event (&m_buffer, &rhs.m_buffer);
         }
+        return *this;
+    }
+#endif
 
-        int oflags = O_RDONLY;
-#ifndef DARWIN
-        oflags |= O_LARGEFILE;
-#endif /* DARWIN */
-        if ((m_fd = ::open (filename.c_str (), oflags)) <= 0) {
-            throw std::runtime_error (std::string ("open: ") + ::strerror (errno));
+
+    void binlog::entry::swap (entry &rhs) {
+        event_buffer tmp;
+        move_event (&tmp, &m_buffer);
+        move_event (&m_buffer, &rhs.m_buffer);
+        move_event (&rhs.m_buffer, &tmp);
+    }
+
+
+    void binlog::entry::reset () {
+        reset_event (&m_buffer);
+    }
+
+
+    bool binlog::entry::operator== (const entry &rhs) const {
+        return memcmp (&m_buffer, &rhs.m_buffer, sizeof (event_buffer)) == 0;
+    }
+
+
+    binlog::entry::~entry () {
+        release_payload (&m_buffer);
+    }
+
+
+    binlog::iterator::iterator (const iterator &rhs)
+        : m_entry (rhs.m_entry), m_binlog (rhs.m_binlog)
+    { }
+
+
+    binlog::iterator& binlog::iterator::operator= (const iterator& rhs) {
+        iterator tmp (rhs);
+        m_entry.swap (tmp.m_entry);
+        m_binlog = tmp.m_binlog;
+        return *this;
+    }
+
+
+    binlog::iterator binlog::begin () {
+        count_event (m_counters, *m_evbuf);
+        verify_event (m_evbuf);
+        iterator it (m_evbuf, this);
+        if (m_filter && !m_filter->matches (*m_evbuf)) {
+            ++it;
         }
-        
-        m_evbuf = (struct event_buffer*)malloc (sizeof (struct event_buffer));
-        init_event (m_evbuf);
-        if (check_file (m_evbuf) < 0) {
-            throw std::runtime_error (std::string ("read_fde: ") + ::strerror (errno));
+        return it;
+    }
+
+
+    void binlog::iterator::advance_to (off64_t offset) {
+        // Reuse m_entry rather than building a fresh one per event.
+        m_entry.reset ();
+        const boost::shared_ptr<event_filter> &filter = m_binlog->m_filter;
+        for (;;) {
+            if (filter) {
+                offset = m_binlog->skip_filtered (offset);
+            }
+            int rc = m_binlog->read_event (m_entry.get_buffer (), offset);
+            event_buffer *ev = m_entry.get_buffer ();
+            // Following, so the end of the file just means the server
+            // hasn't written the rest yet. A bogus length won't get
+            // any better by waiting though.
+            if (m_binlog->m_follow &&
+                (rc < 0 || (ev->data == NULL && ev->length >= EVENT_HEADER_SIZE && ev->length <= MAX_EVENT_LENGTH))) {
+                off64_t needed = offset + (rc < 0 ? EVENT_HEADER_SIZE : ev->length);
+                m_entry.reset ();
+                if (!m_binlog->wait_for_data (needed)) {
+                    return;
+                }
+                continue;
+            }
+            if (rc < 0) {
+                m_entry.reset ();
+                return;
+            }
+            count_event (m_binlog->m_counters, *ev);
+            if (ev->type_code == FORMAT_DESCRIPTION_EVENT && ev->data != NULL) {
+                m_binlog->note_format (ev);
+            }
+            m_binlog->verify_event (ev);
+            if (ends_file (ev)) {
+                m_binlog->m_file_ended = true;
+                if (ev->type_code == ROTATE_EVENT && ev->data != NULL) {
+                    m_binlog->m_rotated_to = rotate_entry (*ev).next_file;
+                }
+            }
+            if (filter && !filter->matches (*ev)) {
+                // Following, a rejected rotation still ends the file.
+                bool done = m_binlog->m_follow && ends_file (ev);
+                offset = m_binlog->next_after (ev);
+                m_entry.reset ();
+                if (done) {
+                    return;
+                }
+                continue;
+            }
+            return;
         }
-        m_min_timestamp = m_evbuf->timestamp;
+    }
 
-        off64_t offset = 0;
-        if (starting_time > 0) {
-            offset = nearest_time (starting_time, m_evbuf);
-        } else if (starting_offset) {
-            offset = nearest_offset (starting_offset, m_evbuf, 1);
+
+    binlog::iterator& binlog::iterator::operator++ () {
+        if (m_binlog->m_follow && ends_file (m_entry.get_buffer ())) {
+            m_entry.reset ();
+            return *this;
         }
+        advance_to (m_binlog->next_after (m_entry.get_buffer ()));
+        return *this;
+    }
 
-        if (offset < 0) {
-            throw std::runtime_error (std::string ("no records found: ") + ::strerror (errno));
+
+    binlog::iterator::postfix_proxy binlog::iterator::operator++ (int) {
+        bool done = m_binlog->m_follow && ends_file (m_entry.get_buffer ());
+        off64_t offset = m_binlog->next_after (m_entry.get_buffer ());
+        postfix_proxy tmp;
+        tmp.m_entry.swap (m_entry);
+        if (!done) {
+            advance_to (offset);
         }
+        return tmp;
     }
 
 
-    binlog::binlog (int fd)
-        : m_fd (fd), m_owns_file (false), m_stbuf (NULL), m_evbuf (NULL),
-          m_min_timestamp (0), m_max_timestamp (::time(NULL))
+    binlog_set::binlog_set (const std::vector<std::string> &files, off64_t starting_offset, time_t starting_time,
+                            binlog::read_mode mode)
+        : m_files (files), m_index (0), m_mode (mode), m_file_done (false), m_follow (false), m_follow_timeout (-1),
+          m_verify (true), m_size (0), m_prefetch_fd (-1), m_prefetch_index (0)
     {
-        m_evbuf = (struct event_buffer*)malloc (sizeof (struct event_buffer));
-        init_event (m_evbuf);
-        read_event (m_evbuf, ::lseek (m_fd, 0, SEEK_CUR));
-        m_min_timestamp = m_evbuf->timestamp;
+        if (m_files.empty ()) {
+            throw std::invalid_argument ("binlog_set: no binlogs given");
+        }
+        size_t first = 0;
+        if (starting_time > 0) {
+            // The target is in the last file that was started before it.
+            for (size_t i = 1; i < m_files.size (); ++i) {
+                binlog b (m_files[i], 0, 0, binlog::READ_SYSCALL);
+                if (b.first_timestamp () > starting_time) {
+                    break;
+                }
+                first = i;
+            }
+        }
+        if (!open (first, first == 0 ? starting_offset : 0, starting_time)) {
+            next_file ();
+        }
     }
 
 
-    binlog::binlog(boost::python::object file) 
-        : m_fd (boost::python::extract<int> (file.attr("fileno") ())), m_owns_file (false), m_stbuf (NULL), m_evbuf (NULL),
-          m_min_timestamp (0), m_max_timestamp (::time(NULL))
+    binlog_set::binlog_set (const std::vector<std::string> &files, const gtid &start, binlog::read_mode mode)
+        : m_files (files), m_index (0), m_mode (mode), m_file_done (false), m_follow (false), m_follow_timeout (-1),
+          m_verify (true), m_size (0), m_prefetch_fd (-1), m_prefetch_index (0)
     {
-        m_evbuf = (struct event_buffer*)malloc (sizeof (struct event_buffer));
-        init_event (m_evbuf);
-        read_event (m_evbuf, ::lseek (m_fd, 0, SEEK_CUR));
-        m_min_timestamp = m_evbuf->timestamp;
+        if (m_files.empty ()) {
+            throw std::invalid_argument ("binlog_set: no binlogs given");
+        }
+        size_t first = find_gtid (start);
+        if (first == m_files.size () || !open (first, 0, 0, &start)) {
+            throw std::runtime_error (std::string ("binlog_set: no binlog has ") + start.str ());
+        }
     }
 
 
-    binlog::~binlog () {
-        dispose_event (m_evbuf);
-        if (m_owns_file) {
-            ::close (m_fd);
+    binlog_set::~binlog_set () {
+        close_prefetch ();
+        m_it = binlog::iterator ();
+        m_end = binlog::iterator ();
+    }
+
+
+    std::vector<std::string> binlog_set::read_index (const std::string &index_file) {
+        std::ifstream in (index_file.c_str ());
+        if (!in) {
+            throw std::runtime_error (std::string ("open ") + index_file + ": " + ::strerror (errno));
         }
-        delete m_stbuf;
+        std::string dir = dir_name (index_file);
+        std::vector<std::string> files;
+        std::string line;
+        while (std::getline (in, line)) {
+            size_t end = line.find_last_not_of (" \t\r\n");
+            if (end == std::string::npos) {
+                continue;
+            }
+            line.erase (end + 1);
+            files.push_back (line[0] == '/' ? line : dir + line);
+        }
+        return files;
     }
 
 
-    /**
-     * Read the FDE and set the server-id
-     **/
-    int binlog::check_file (struct event_buffer *evbuf) {
-        char magic[sizeof(BINLOG_MAGIC)];
-        if (::read (m_fd, magic, sizeof(BINLOG_MAGIC)) != sizeof(BINLOG_MAGIC)) {
-            std::cout << "ass\n";
-            return -1;
+    std::vector<std::string> binlog_set::expand (const std::string &pattern) {
+        if (ends_with (pattern, ".index")) {
+            return read_index (pattern);
         }
-        if (::memcmp (magic, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) != 0) {
-            errno = EINVAL;
-            return -1;
+        std::vector<std::string> files;
+        if (pattern.find_first_of ("*?[") == std::string::npos) {
+            files.push_back (pattern);
+            return files;
         }
-        if (read_event (evbuf, sizeof(BINLOG_MAGIC)) < 0) {
-            return -1;
+        glob_t g;
+        int rc = ::glob (pattern.c_str (), 0, NULL, &g);
+        if (rc == GLOB_NOMATCH) {
+            return files;
+        } else if (rc != 0) {
+            throw std::runtime_error (std::string ("glob: ") + pattern);
         }
-#if DEBUG
-        std::cout << *evbuf;
-#endif
-        struct format_description_event_buffer *f = (struct format_description_event_buffer*) evbuf->data;
-        if (f->format_version != BINLOG_VERSION) {
-            errno = EINVAL;
-            return -1;
+        // glob sorts, and mysql-bin.* also matches the index and our sidecars
+        for (size_t i = 0; i < g.gl_pathc; ++i) {
+            std::string path = g.gl_pathv[i];
+            if (!ends_with (path, ".index") && !ends_with (path, ".ybidx") && !ends_with (path, ".ybcz")) {
+                files.push_back (path);
+            }
         }
-        return 0;
+        globfree (&g);
+        return files;
     }
 
 
-    int binlog::read_event (struct event_buffer *evbuf, off64_t offset) {
-        if (::lseek (m_fd, offset, SEEK_SET) < 0) {
-            throw std::runtime_error (std::string ("lseek:") + ::strerror (errno));
-        }
-        ssize_t amt_read = ::read (m_fd, (void*)evbuf, EVENT_HEADER_SIZE);
-        evbuf->offset = offset;
-        evbuf->data = NULL;
-        if (amt_read < 0) {
-            throw std::runtime_error (std::string ("read: ") + ::strerror (errno));
-        } else if ((size_t)amt_read != EVENT_HEADER_SIZE) {
-            return -1;
+    void binlog_set::set_follow (bool follow, int timeout_ms) {
+        m_follow = follow;
+        m_follow_timeout = timeout_ms;
+        if (m_binlog) {
+            // Pick the current event up again without the mapping.
+            open (m_index, m_it == m_end ? 0 : m_it->get_buffer ()->offset, 0);
         }
-        // Here we could check the timestamp, but there's a tendency
-        // for timestamps to not always be in linear order... huh?
-#if DEBUG
-        fprintf (stdout, "newing %lu bytes\n", evbuf->length - EVENT_HEADER_SIZE);
-#endif
-        if (evbuf->length - EVENT_HEADER_SIZE > sizeof (evbuf->payload)) {
-            evbuf->heaped = new char[evbuf->length - EVENT_HEADER_SIZE];
-            evbuf->data = evbuf->heaped;
-        } else {
-            evbuf->heaped = NULL;
-            evbuf->data = (char*)&(evbuf->payload);
+    }
+
+
+    void binlog_set::set_verify_checksums (bool verify) {
+        m_verify = verify;
+        if (m_binlog) {
+            m_binlog->set_verify_checksums (verify);
         }
-#if DEBUG
-        fprintf(stderr, "newed %lu bytes at 0x%p for a %s\n", evbuf->length - EVENT_HEADER_SIZE, evbuf->data, event_types[evbuf->type_code]);
-#endif
-        if (read (m_fd, evbuf->data, evbuf->length - EVENT_HEADER_SIZE) < 0) {
-            throw std::runtime_error (std::string ("read extra (short): ") + ::strerror (errno));
+    }
+
+
+    const std::string& binlog_set::current_file () const {
+        static const std::string none;
+        return m_binlog ? m_files[m_index] : none;
+    }
+
+
+    void binlog_set::set_filter (boost::shared_ptr<event_filter> filter) {
+        m_filter = filter;
+        if (m_binlog) {
+            m_binlog->set_filter (filter);
+            if (m_it != m_end && filter && !filter->matches (*m_it->get_buffer ())) {
+                advance ();
+            }
         }
-        return 0;
     }
 
 
-    // FIXME: this shouldn't be necessary
-    // And then m_evbuf and m_min/max_timestamp can go away too
-    int binlog::check_event (struct event_buffer *evbuf) {
-        if (evbuf->server_id < MAX_SERVER_ID &&
-            evbuf->type_code > MIN_TYPE_CODE &&
-            evbuf->type_code < MAX_TYPE_CODE &&
-            evbuf->length > MIN_EVENT_LENGTH &&
-            evbuf->length < MAX_EVENT_LENGTH &&
-            evbuf->timestamp >= m_min_timestamp &&
-            evbuf->timestamp <= m_max_timestamp) {
-            return 1;
-        } else {
-            return 0;
+    void binlog_set::advance () {
+        ++m_it;
+        if (m_it == m_end) {
+            // The binlog saw the rotation even if the filter didn't
+            // let it through, it decides where we go next.
+            m_file_done = m_binlog->file_ended ();
+            m_rotate_to = m_binlog->rotated_to ();
+        }
+        if (m_it == m_end && m_follow && !m_file_done) {
+            // Timed out waiting for more of this file.
+            close_prefetch ();
+            m_end = m_it = binlog::iterator ();
+            close_binlog ();
+            m_index = m_files.size ();
+        } else if (m_it == m_end) {
+            next_file ();
+        } else if (!m_follow && m_prefetch_index <= m_index && m_it->get_buffer ()->offset >= m_size / 2) {
+            prefetch ();
         }
     }
 
 
-    off64_t binlog::next_after (struct event_buffer *evbuf) {
-        /* Can't actually use next_position, because it will vary between
-         * messages that are from master and messages that are from slave.
-         * Usually, only the FDE is from the slave. But, still...
-         */
-        return evbuf->offset + evbuf->length;
+    void binlog_set::next_file () {
+        for (;;) {
+            size_t next = next_index ();
+            if (next >= m_files.size ()) {
+                close_prefetch ();
+                m_it = binlog::iterator ();
+                m_end = binlog::iterator ();
+                close_binlog ();
+                m_index = next;
+                return;
+            }
+            if (open (next, 0, 0)) {
+                return;
+            }
+        }
     }
 
 
-    off64_t binlog::nearest_offset (off64_t starting_offset, struct event_buffer *outbuf, int direction) {
-        unsigned int num_increments = 0;
-        off64_t offset;
-        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
-        init_event (evbuf);
-        offset = starting_offset;
-#if DEBUG
-        fprintf (stderr, "In nearest offset mode, got fd=%d, starting_offset=%llu\n", fd, (long long)starting_offset);
-#endif
-        while (num_increments < MAX_RETRIES && offset >= 0 && offset <= m_stbuf->st_size - (off64_t)EVENT_HEADER_SIZE) {
-            reset_event (evbuf);
-            if (read_event (evbuf, offset) < 0) {
-                dispose_event (evbuf);
-                return -1;
-            }
-            // FIXME: inline the check for the time and get rid of check_event
-            if (check_event (evbuf)) {
-                if (outbuf != NULL) {
-                    reset_event (outbuf);
-                    copy_event (outbuf, evbuf);
+    size_t binlog_set::next_index () {
+        if (!m_rotate_to.empty ()) {
+            for (size_t i = m_index + 1; i < m_files.size (); ++i) {
+                if (base_name (m_files[i]) == m_rotate_to) {
+                    return i;
                 }
-                dispose_event (evbuf);
-                return offset;
-            } else {
-                offset += direction;
-                ++num_increments;
+            }
+            // Not listed, but if it's sitting next to this one and we
+            // haven't been there, that's where the server went.
+            std::string path = dir_name (m_files[m_index]) + m_rotate_to;
+            // When following, the server may not have got round to
+            // writing its header yet.
+            bool there = m_follow ? wait_for_file (path, sizeof (BINLOG_MAGIC) + EVENT_HEADER_SIZE, m_follow_timeout)
+                                  : ::access (path.c_str (), R_OK) == 0;
+            if (std::find (m_files.begin (), m_files.end (), path) == m_files.end () && there) {
+                m_files.insert (m_files.begin () + m_index + 1, path);
+                return m_index + 1;
             }
         }
-        dispose_event (evbuf);
-#if DEBUG
-        fprintf (stderr, "Unable to find anything (offset=%llu)\n",(long long) offset);
-#endif
-        return -2;
+        return m_index + 1;
     }
 
 
-    int binlog::nearest_time (time_t target, struct event_buffer *outbuf) {
-        off64_t file_size = m_stbuf->st_size;
-        struct event_buffer *evbuf = (struct event_buffer*)malloc (sizeof(struct event_buffer));
-        init_event(evbuf);
-        off64_t offset = file_size / 2;
-        off64_t next_increment = file_size / 4;
-        int directionality = 1;
-        off64_t found, last_found = 0;
-        while (next_increment > 2) {
-            long long delta;
-            reset_event (evbuf);
-            found = nearest_offset (offset, evbuf, directionality);
-            if (found == -1) {
-                return found;
-            } else if (found == -2) {
-                fprintf (stderr, "Ran off the end of the file, probably going to have a bad match\n");
-                last_found = found;
-                break;
-            }
-            last_found = found;
-            delta = (evbuf->timestamp - target);
-            if (delta > 0) {
-                directionality = -1;
-            } else if (delta < 0) {
-                directionality = 1;
-            }
-#if DEBUG
-            fprintf (stderr, "delta=%lld at %llu, directionality=%d, next_increment=%lld\n", (long long)delta, (unsigned long long)found, directionality, (long long)next_increment);
-#endif
-            if (delta == 0) {
-                break;
-            }
-            if (directionality == -1) {
-                offset += (next_increment  * directionality);
+    size_t binlog_set::find_gtid (const gtid &start) {
+        // Each file's previous GTIDs include everything in the ones
+        // before it, so find the first file whose previous GTIDs
+        // include start, it's in the one before that.
+        size_t lo = 0, hi = m_files.size ();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            binlog b (m_files[mid], 0, 0, binlog::READ_SYSCALL);
+            if (b.previous_gtids ().contains (start)) {
+                hi = mid;
             } else {
-                offset += (next_increment * directionality);
+                lo = mid + 1;
             }
-            next_increment /= 2;
-        }
-        if (outbuf) {
-            copy_event (outbuf, evbuf);
         }
-        dispose_event (evbuf);
-        return last_found;
+        // Before the first file means it's been purged
+        return lo > 0 ? lo - 1 : m_files.size ();
     }
 
 
-    binlog::format_description_entry::format_description_entry (const struct event_buffer &evbuf)
-        : format_version (0), create_timestamp (0)
-    {
-        if (evbuf.type_code != FORMAT_DESCRIPTION_EVENT) {
-            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for format_description_entry") % evbuf.type_code).str ());
+    bool binlog_set::open (size_t index, off64_t starting_offset, time_t starting_time, const gtid *start) {
+        // The iterator's entry may be the old binlog's pool memory, let
+        // go of it before the binlog.
+        m_it = binlog::iterator ();
+        m_end = binlog::iterator ();
+        close_binlog ();
+        m_rotate_to.clear ();
+        m_file_done = false;
+        m_index = index;
+
+        struct stat st;
+        m_size = ::stat (m_files[index].c_str (), &st) == 0 ? st.st_size : 0;
+        m_binlog.reset (new binlog (m_files[index], starting_offset, starting_time, m_mode));
+        if (start != NULL && !m_binlog->seek_gtid (*start)) {
+            return false;
         }
-        struct format_description_event_buffer *f = (struct format_description_event_buffer*)evbuf.data;
-        format_version = f->format_version;
-        create_timestamp = f->create_timestamp;
-        server_version = f->server_version;
+        m_binlog->set_verify_checksums (m_verify);
+        m_binlog->set_filter (m_filter);
+        if (m_follow) {
+            m_binlog->set_follow (true, m_follow_timeout);
+        }
+        if (m_prefetch_index == index) {
+            close_prefetch ();
+        }
+        m_it = m_binlog->begin ();
+        m_end = m_binlog->end ();
+        return m_it != m_end;
     }
 
 
-    binlog::query_entry::query_entry (const struct event_buffer &evbuf)
-        : thread_id (0), query_time (0), error_code (0)
-    {
-        if (evbuf.type_code != QUERY_EVENT) {
-            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for query_entry") % evbuf.type_code).str ());
+    void binlog_set::close_binlog () {
+        if (m_binlog) {
+            m_counters.merge (m_binlog->counters ());
+            m_binlog.reset ();
         }
-        struct query_event_buffer *q = (struct query_event_buffer*)(evbuf.data);
-        thread_id = q->thread_id;
-        query_time = q->query_time;
-        error_code = q->error_code;
-        database = query_event_db_name ((&evbuf));
-        size_t statement_len = query_event_statement_len ((&evbuf));
-        statement = std::string ((const char*)query_event_statement ((&evbuf)), statement_len);
     }
 
 
-    binlog::rand_entry::rand_entry (const struct event_buffer &evbuf)
-        : seed_1 (0), seed_2 (0)
-    {
-        if (evbuf.type_code != RAND_EVENT) {
-            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for rand_entry") % evbuf.type_code).str ());
+    binlog_counters binlog_set::counters () const {
+        binlog_counters all (m_counters);
+        if (m_binlog) {
+            all.merge (m_binlog->counters ());
         }
-        struct rand_event_buffer *r = (struct rand_event_buffer*)evbuf.data;
-        seed_1 = r->seed_1;
-        seed_2 = r->seed_2;
+        return all;
     }
 
 
-    binlog::intvar_entry::intvar_entry (const struct event_buffer &evbuf)
-        : type (0), value (0)
-    {
-        if (evbuf.type_code != INTVAR_EVENT) {
-            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for intvar_entry") % evbuf.type_code).str ());
+    void binlog_set::prefetch () {
+        size_t next = next_index ();
+        // Don't try again for this file, whether or not this works.
+        m_prefetch_index = next;
+        if (next >= m_files.size ()) {
+            return;
         }
-        struct intvar_event_buffer *i = (struct intvar_event_buffer*)(evbuf.data);
-        type = i->type;
-        value = i->value;
+        close_prefetch ();
+        int fd = ::open (m_files[next].c_str (), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+#ifdef POSIX_FADV_WILLNEED
+        ::posix_fadvise (fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+#endif
+        // Keep it open until we get there, the kernel's reading it.
+        m_prefetch_fd = fd;
     }
 
 
-    binlog::rotate_entry::rotate_entry (const struct event_buffer &evbuf)
-        : next_position (4) // defaults to 4 to skip the magic bytes in the file
-    {
-        if (evbuf.type_code != ROTATE_EVENT) {
-            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for rotate_entry") % evbuf.type_code).str ());
+    void binlog_set::close_prefetch () {
+        if (m_prefetch_fd >= 0) {
+            ::close (m_prefetch_fd);
+            m_prefetch_fd = -1;
         }
-        struct rotate_event_buffer *r = (struct rotate_event_buffer*)evbuf.data;
-        next_position = r->next_position;
-        size_t len = rotate_event_file_name_len((&evbuf));
-        next_file = std::string ((const char*)rotate_event_file_name((&evbuf)), len);
     }
 
 
-    binlog::xid_entry::xid_entry (const struct event_buffer &evbuf)
-        : id (0)
+
+    replication_stream::replication_stream (const std::string &host, uint16_t port, const std::string &user,
+                                            const std::string &password, uint32_t server_id)
+        : m_fd (-1), m_server_id (server_id), m_seq (0), m_buffer (STREAM_BUFFER), m_pos (0), m_len (0),
+          m_start_position (sizeof (BINLOG_MAGIC)), m_follow (false), m_follow_timeout (-1), m_verify (true),
+          m_started (false), m_done (false), m_checksum_len (0)
     {
-        if (evbuf.type_code != XID_EVENT) {
-            throw std::invalid_argument ((boost::format ("event_buffer has type_code %d, not valid for id_entry") % evbuf.type_code).str ());
+        m_fd = connect_server (host, port);
+        try {
+            login (user, password);
+        } catch (...) {
+            ::close (m_fd);
+            throw;
         }
-        struct xid_event_buffer *x = (struct xid_event_buffer*)evbuf.data;
-        id = x->id;
     }
 
 
-    binlog::entry::entry () {
-        init_event (&m_buffer);
+    replication_stream::~replication_stream () {
+        ::close (m_fd);
     }
 
 
-    binlog::entry::entry (const entry &rhs) {
-        copy_event (&m_buffer, &rhs.m_buffer);
+    void replication_stream::set_start (const std::string &file, uint32_t position) {
+        m_start_file = file;
+        m_start_position = position < sizeof (BINLOG_MAGIC) ? sizeof (BINLOG_MAGIC) : position;
     }
 
 
-    binlog::entry::entry (const event_buffer *evbuf) {
-        if (evbuf) {
-            copy_event (&m_buffer, evbuf);
-        } else {
-            init_event (&m_buffer);
+    void replication_stream::set_follow (bool follow, int timeout_ms) {
+        m_follow = follow;
+        m_follow_timeout = timeout_ms;
+    }
+
+
+    replication_stream::iterator replication_stream::begin () {
+        if (!m_started) {
+            start_dump ();
+            m_started = true;
+            advance ();
         }
+        return iterator (this);
     }
 
 
-    binlog::entry& yelp::binlog::entry::operator= (const entry &rhs) {
-        reset_event (&m_buffer);
-        copy_event (&m_buffer, &rhs.m_buffer);
-        return *this;
+    void replication_stream::send_packet (const std::string &payload) {
+        std::string packet;
+        put_le32 (packet, (uint32_t)payload.size () | (uint32_t)m_seq++ << 24);
+        packet += payload;
+        size_t sent = 0;
+        while (sent < packet.size ()) {
+#if defined(MSG_NOSIGNAL)
+            ssize_t n = ::send (m_fd, packet.data () + sent, packet.size () - sent, MSG_NOSIGNAL);
+#else
+            ssize_t n = ::send (m_fd, packet.data () + sent, packet.size () - sent, 0);
+#endif
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw std::runtime_error (std::string ("send: ") + ::strerror (errno));
+            }
+            sent += n;
+        }
     }
 
 
-    bool binlog::entry::operator== (const entry &rhs) const {
-        return memcmp (&m_buffer, &rhs.m_buffer, sizeof (event_buffer)) == 0;
+    bool replication_stream::fill (size_t want) {
+        while (m_len - m_pos < want) {
+            // Shuffle down what's left only once the next packet
+            // doesn't fit after it.
+            if (m_pos + want > m_buffer.size ()) {
+                memmove (&m_buffer[0], &m_buffer[m_pos], m_len - m_pos);
+                m_len -= m_pos;
+                m_pos = 0;
+                if (want > m_buffer.size ()) {
+                    m_buffer.resize (want);
+                }
+            }
+            if (m_started && m_follow) {
+                phase_timer waiting (m_counters.phase_ns[binlog_counters::PHASE_WAIT]);
+                struct pollfd pfd;
+                pfd.fd = m_fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                COUNT (++m_counters.syscalls);
+                int rc = ::poll (&pfd, 1, m_follow_timeout);
+                if (rc < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (rc < 0) {
+                    throw std::runtime_error (std::string ("poll: ") + ::strerror (errno));
+                }
+                if (rc == 0) {
+                    return false;
+                }
+            }
+            phase_timer reading (m_counters.phase_ns[binlog_counters::PHASE_READ]);
+            COUNT (++m_counters.syscalls);
+            ssize_t n = ::recv (m_fd, &m_buffer[m_len], m_buffer.size () - m_len, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw std::runtime_error (std::string ("recv: ") + ::strerror (errno));
+            }
+            if (n == 0) {
+                return false;
+            }
+            COUNT (m_counters.bytes_read += n);
+            m_len += n;
+        }
+        return true;
     }
 
 
-    binlog::entry::~entry () {
-        delete[] m_buffer.heaped;
+    bool replication_stream::read_packet (const char *&payload, size_t &len) {
+        m_joined.clear ();
+        for (;;) {
+            if (!fill (4)) {
+                return false;
+            }
+            const unsigned char *h = (const unsigned char*)&m_buffer[m_pos];
+            size_t n = h[0] | h[1] << 8 | h[2] << 16;
+            m_seq = h[3] + 1;
+            if (!fill (4 + n)) {
+                return false;
+            }
+            payload = &m_buffer[m_pos + 4];
+            m_pos += 4 + n;
+            if (n < MAX_PACKET && m_joined.empty ()) {
+                len = n;
+                return true;
+            }
+            m_joined.insert (m_joined.end (), payload, payload + n);
+            if (n < MAX_PACKET) {
+                payload = &m_joined[0];
+                len = m_joined.size ();
+                return true;
+            }
+        }
     }
 
 
-    binlog::iterator::iterator (const iterator &rhs)
-        : m_entry (rhs.m_entry), m_binlog (rhs.m_binlog)
-    { }
+    void replication_stream::expect_packet (const char *&payload, size_t &len) {
+        if (!read_packet (payload, len)) {
+            throw std::runtime_error ("the server hung up");
+        }
+        if (len == 0) {
+            throw std::runtime_error ("empty packet from the server");
+        }
+    }
 
 
-    /*
-    binlog::iterator::iterator& binlog::iterator::operator= (const iterator& rhs) {
-        iterator tmp (rhs);
-        std::swap (*this, tmp);
-        return *this;
+    void replication_stream::login (const std::string &user, const std::string &password) {
+        const char *p;
+        size_t len;
+        expect_packet (p, len);
+        if ((uint8_t)p[0] == PACKET_ERR) {
+            throw std::runtime_error ("connect: " + server_error (p, len));
+        }
+        if (p[0] != 10) {
+            throw std::runtime_error ((boost::format ("connect: unsupported protocol version %d") % (int)p[0]).str ());
+        }
+        // Protocol::HandshakeV10: version, connection id, the first 8
+        // bytes of the scramble, a filler, the low capability flags,
+        // and then from 4.1 on the rest of the flags and scramble and
+        // the auth plugin's name.
+        const char *end = p + len;
+        const char *version = p + 1;
+        const char *nul = (const char*)memchr (version, 0, end - version);
+        if (nul == NULL || end - nul < 1 + 4 + 8 + 1 + 2) {
+            throw std::runtime_error ("connect: bad handshake");
+        }
+        m_server_version.assign (version, nul);
+        const char *q = nul + 1 + 4;
+        std::string scramble (q, 8);
+        q += 8 + 1;
+        uint32_t capabilities = (uint8_t)q[0] | (uint8_t)q[1] << 8;
+        q += 2;
+        if (end - q >= 1 + 2 + 2 + 1 + 10) {
+            capabilities |= ((uint8_t)q[3] | (uint8_t)q[4] << 8) << 16;
+            size_t scramble_len = (uint8_t)q[5];
+            q += 1 + 2 + 2 + 1 + 10;
+            if (capabilities & CLIENT_SECURE_CONNECTION) {
+                // The rest of the scramble and a NUL, at least 13 bytes.
+                size_t n = std::max<size_t> (13, scramble_len > 8 ? scramble_len - 8 : 0);
+                n = std::min<size_t> (n, end - q);
+                scramble.append (q, std::min (n, SCRAMBLE_LEN - 8));
+                q += n;
+            }
+        }
+        if (!(capabilities & CLIENT_PROTOCOL_41) || !(capabilities & CLIENT_SECURE_CONNECTION)) {
+            throw std::runtime_error ("connect: the server is older than 4.1");
+        }
+
+        // Protocol::HandshakeResponse41, mysql_native_password's token
+        // whatever the server's default plugin is. It asks for another
+        // if it wants one.
+        uint32_t flags = CLIENT_LONG_PASSWORD | CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION |
+            (capabilities & CLIENT_PLUGIN_AUTH);
+        std::string response;
+        put_le32 (response, flags);
+        put_le32 (response, MAX_PACKET + 1);
+        // utf8_general_ci, and reserved
+        response += (char)33;
+        response.append (23, '\0');
+        response += user;
+        response += '\0';
+        std::string token = native_password (password, scramble);
+        response += (char)token.size ();
+        response += token;
+        if (flags & CLIENT_PLUGIN_AUTH) {
+            response += "mysql_native_password";
+            response += '\0';
+        }
+        send_packet (response);
+
+        for (;;) {
+            expect_packet (p, len);
+            if ((uint8_t)p[0] == PACKET_OK) {
+                return;
+            }
+            if ((uint8_t)p[0] == PACKET_ERR) {
+                throw std::runtime_error ("login: " + server_error (p, len));
+            }
+            if ((uint8_t)p[0] != PACKET_EOF || len == 1) {
+                // More data for a plugin we don't speak, or an
+                // old_password switch.
+                throw std::runtime_error ("login: unsupported auth plugin, the account has to use mysql_native_password");
+            }
+            // Protocol::AuthSwitchRequest, the plugin and a fresh scramble
+            end = p + len;
+            nul = (const char*)memchr (p + 1, 0, len - 1);
+            std::string plugin (p + 1, nul ? nul : end);
+            if (plugin != "mysql_native_password" || nul == NULL) {
+                throw std::runtime_error ("login: unsupported auth plugin " + plugin +
+                                          ", the account has to use mysql_native_password");
+            }
+            scramble.assign (nul + 1, std::min<size_t> (end - nul - 1, SCRAMBLE_LEN));
+            send_packet (native_password (password, scramble));
+        }
     }
-    */
 
 
-    binlog::iterator& binlog::iterator::operator++ () {
-        off64_t offset = m_binlog->next_after (m_entry.get_buffer ());
-        m_entry = entry ();
-        if (m_binlog->read_event (m_entry.get_buffer (), offset) < 0) {
-            m_entry = entry ();
+    bool replication_stream::query (const std::string &statement, std::string &value, std::string &error) {
+        m_seq = 0;
+        send_packet (std::string (1, (char)COM_QUERY) + statement);
+        value.clear ();
+        const char *p;
+        size_t len;
+        expect_packet (p, len);
+        if ((uint8_t)p[0] == PACKET_ERR) {
+            error = server_error (p, len);
+            return false;
+        }
+        if ((uint8_t)p[0] == PACKET_OK) {
+            return true;
+        }
+        // A result set: column count, column definitions, EOF, rows, EOF
+        do {
+            expect_packet (p, len);
+        } while (!((uint8_t)p[0] == PACKET_EOF && len < 9));
+        bool first = true;
+        for (;;) {
+            expect_packet (p, len);
+            if ((uint8_t)p[0] == PACKET_EOF && len < 9) {
+                return true;
+            }
+            if ((uint8_t)p[0] == PACKET_ERR) {
+                error = server_error (p, len);
+                return false;
+            }
+            uint64_t n;
+            const char *q = p;
+            if (first && (uint8_t)p[0] != 0xfb && get_lenenc (q, p + len, n) && n <= (uint64_t)(p + len - q)) {
+                value.assign (q, n);
+            }
+            first = false;
+        }
+    }
+
+
+    void replication_stream::start_dump () {
+        // A server with binlog_checksum=CRC32 won't dump to a replica
+        // that hasn't said it knows about checksums. One from before
+        // them doesn't have the variable.
+        std::string checksum, error;
+        if (query ("SELECT @@global.binlog_checksum", checksum, error) && !checksum.empty () && checksum != "NONE") {
+            std::string ignored;
+            if (!query ("SET @master_binlog_checksum = @@global.binlog_checksum", ignored, error)) {
+                throw std::runtime_error ("SET @master_binlog_checksum: " + error);
+            }
+            // Up to the FDE, which says for itself
+            m_checksum_len = 4;
+        }
+
+        std::string dump (1, (char)COM_BINLOG_DUMP);
+        put_le32 (dump, m_start_position);
+        put_le16 (dump, m_follow ? 0 : BINLOG_DUMP_NON_BLOCK);
+        put_le32 (dump, m_server_id);
+        dump += m_start_file;
+        m_seq = 0;
+        send_packet (dump);
+        m_file = m_start_file;
+    }
+
+
+    void replication_stream::advance () {
+        // Nothing to give back, the payload is in m_buffer.
+        m_entry.reset ();
+        for (;;) {
+            const char *p;
+            size_t len;
+            // The server hung up, or following, had nothing for too long.
+            if (!read_packet (p, len)) {
+                m_done = true;
+                return;
+            }
+            if (len > 0 && (uint8_t)p[0] == PACKET_EOF && len < 9) {
+                // A non-blocking dump has sent everything there is.
+                m_done = true;
+                return;
+            }
+            if (len > 0 && (uint8_t)p[0] == PACKET_ERR) {
+                throw std::runtime_error ("binlog dump: " + server_error (p, len));
+            }
+            if (len < 1 + EVENT_HEADER_SIZE || p[0] != PACKET_OK) {
+                throw std::runtime_error ((boost::format ("binlog dump: unexpected %d byte packet") % len).str ());
+            }
+            event_buffer *ev = m_entry.get_buffer ();
+            memcpy ((void*)ev, p + 1, EVENT_HEADER_SIZE);
+            if (ev->length != len - 1) {
+                throw std::runtime_error ((boost::format ("binlog dump: event length %d in a %d byte packet")
+                                           % ev->length % (len - 1)).str ());
+            }
+            // The events the server makes up have no position
+            ev->offset = ev->next_position >= ev->length ? ev->next_position - ev->length : 0;
+            ev->checksum_len = m_checksum_len;
+            ev->data = (char*)p + 1 + EVENT_HEADER_SIZE;
+            count_event (m_counters, *ev);
+            if (ev->type_code == FORMAT_DESCRIPTION_EVENT) {
+                binlog::format_description_entry format (*ev);
+                m_checksum_len = format.checksum_len ();
+                // See binlog::note_format
+                ev->checksum_len = format.checksum_alg == binlog::format_description_entry::CHECKSUM_UNDEF ? 0 : 4;
+            }
+            if (m_verify && m_checksum_len && ev->checksum_len && !checksum_matches (ev)) {
+                throw std::runtime_error ((boost::format ("checksum mismatch in event at %s:%d") % m_file % ev->offset).str ());
+            }
+            if (ev->type_code == ROTATE_EVENT) {
+                m_file = binlog::rotate_entry (*ev).next_file;
+            }
+            if (m_filter && !(m_filter->wants (*ev) && m_filter->matches (*ev))) {
+                m_entry.reset ();
+                continue;
+            }
+            return;
         }
-        return *this;
     }
 }
 
 
-int main (int argc, char **argv) {
+// ybinlogp-bench links the library without the command line tool
+#ifndef YBINLOGP_NO_MAIN
+static int run (int argc, char **argv) {
 	int opt;
 	time_t target_time = 0;
 	off64_t starting_offset = 0;
 	int show_all = 0;
 	int num_to_show = 1;
-    char *database_limit = NULL;
+    boost::shared_ptr<yelp::event_filter> filter (new yelp::event_filter);
+    bool filtering = false;
+    boost::shared_ptr<yelp::statement_search> search;
+    bool count_given = false;
+    yelp::output_format format = yelp::FORMAT_TEXT;
+    const char *export_path = NULL;
+    int index_stride = 0;
+    int num_threads = 1;
+    int set_mode = 0;
+    int follow = 0;
+    bool verify_checksums = true;
+    bool stats = false;
+    bool stats_io = false;
+    // 'yb', what we ask a server for its binlogs as
+    uint32_t server_id = 0x7962;
+    const char *start_gtid = NULL;
+    yelp::gtid gtid_start;
+    struct timeval started;
+    gettimeofday (&started, NULL);
 
 	/* Parse args */
-	while ((opt = getopt(argc, argv, "t:o:a:qQ")) != -1) {
+	while ((opt = getopt_long(argc, argv, "t:o:a:qQi:j:SfCD:T:e:s:U:g:G:F:X:", long_options, NULL)) != -1) {
 		switch (opt) {
         case 't':		/* Time mode */
             target_time = atol(optarg);
@@ -859,6 +8103,7 @@ int main (int argc, char **argv) {
             starting_offset = atoll(optarg);
             break;
         case 'a':
+            count_given = true;
             if (strncmp(optarg, "all", 3) == 0) {
                 num_to_show = 2;
                 show_all = 1;
@@ -880,7 +8125,109 @@ int main (int argc, char **argv) {
             return 1;
             break;
         case 'D':
-            database_limit = strdup(optarg);
+            filter->add_database (optarg);
+            filtering = true;
+            break;
+        case 'T':
+            filter->add_table (optarg);
+            filtering = true;
+            break;
+        case 'e': {
+            int type_code = parse_event_type (optarg);
+            if (type_code < 0) {
+                fprintf (stderr, "Unknown event type %s\n", optarg);
+                return 1;
+            }
+            filter->add_type ((uint8_t)type_code);
+            filtering = true;
+            break;
+        }
+        case 's': {
+            uint32_t id;
+            if (!parse_server_id (optarg, id)) {
+                fprintf (stderr, "Bad server id %s\n", optarg);
+                return 1;
+            }
+            filter->add_server_id (id);
+            filtering = true;
+            break;
+        }
+        case 'g':
+        case 'G':
+            if (!search) {
+                search.reset (new yelp::statement_search);
+                filter->set_search (search);
+                filtering = true;
+            }
+            if (opt == 'g') {
+                search->add_literal (optarg);
+            } else {
+                try {
+                    search->add_regex (optarg);
+                } catch (std::invalid_argument &e) {
+                    fprintf (stderr, "%s\n", e.what ());
+                    return 1;
+                }
+            }
+            break;
+        case 'F':
+            if (strcmp (optarg, "json") == 0) {
+                format = yelp::FORMAT_JSON;
+            } else if (strcmp (optarg, "tsv") == 0) {
+                format = yelp::FORMAT_TSV;
+            } else if (strcmp (optarg, "text") == 0) {
+                format = yelp::FORMAT_TEXT;
+            } else {
+                fprintf (stderr, "Unknown output format %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'X':
+            export_path = optarg;
+            break;
+        case OPT_STATS:
+            stats = true;
+            break;
+        case OPT_STATS_IO:
+            stats_io = true;
+            break;
+        case OPT_SERVER_ID:
+            if (!parse_server_id (optarg, server_id)) {
+                fprintf (stderr, "Bad server id %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_GTID:
+            try {
+                gtid_start = yelp::gtid::parse (optarg);
+            } catch (std::invalid_argument &e) {
+                fprintf (stderr, "%s\n", e.what ());
+                return 1;
+            }
+            start_gtid = optarg;
+            break;
+        case 'U':
+            filter->set_time_range (0, atol(optarg));
+            filtering = true;
+            break;
+        case 'S':
+            set_mode = 1;
+            break;
+        case 'f':
+            follow = 1;
+            break;
+        case 'C':
+            verify_checksums = false;
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            if (num_threads < 1)
+                num_threads = 1;
+            break;
+        case 'i':
+            index_stride = atoi(optarg);
+            if (index_stride < 1)
+                index_stride = 1;
             break;
         default:
             usage();
@@ -891,20 +8238,134 @@ int main (int argc, char **argv) {
 		usage();
 		return 1;
 	}
+    if ((search || follow) && !count_given) {
+        show_all = 1;
+    }
 
-    yelp::binlog binlog (argv[optind], starting_offset, target_time);
-    if (show_all) {
-        std::copy (binlog.begin (), binlog.end (),
-                   std::ostream_iterator<yelp::binlog::entry> (std::cout, "\n"));
-    } else {
-        yelp::binlog::iterator it = binlog.begin ();
-        yelp::binlog::iterator end = binlog.end ();
-        for (int n = 0; n < num_to_show && it != end ; ++n) {
-            if (q_mode) {
-                ::print_statement_event(std::cout, *(it->get_buffer()), q_mode, database_limit);
-            }
-            std::cout << *(it++);
+    server_url url;
+    if (parse_server_url (argv[optind], url)) {
+        if (target_time || index_stride || start_gtid) {
+            fprintf (stderr, "-t, -i and --gtid need a binlog file, give a server -o and a binlog to start from\n");
+            return 1;
+        }
+        if (url.password.empty () && getenv ("MYSQL_PWD")) {
+            url.password = getenv ("MYSQL_PWD");
+        }
+        yelp::replication_stream stream (url.host, url.port, url.user, url.password, server_id);
+        stream.set_start (url.file, (uint32_t)starting_offset);
+        stream.set_verify_checksums (verify_checksums);
+        if (filtering) {
+            stream.set_filter (filter);
         }
+        read_events (stream, stats, export_path, follow, show_all, num_to_show, format);
+        if (stats_io) {
+            std::cout.flush ();
+            report_io (stream.counters (), started);
+        }
+        return 0;
+    } else if (strncmp (argv[optind], "mysql://", 8) == 0) {
+        fprintf (stderr, "Can't make out %s, expected mysql://[user[:password]@]host[:port][/binlog]\n", argv[optind]);
+        return 1;
+    }
+
+    // - is a binlog piped in, read once, front to back
+    bool from_stdin = strcmp (argv[optind], "-") == 0;
+    const char *logfile = from_stdin ? "/dev/stdin" : argv[optind];
+
+    if (index_stride) {
+        yelp::binlog binlog (logfile, 0, 0);
+        size_t n = binlog.build_index (index_stride);
+        fprintf (stderr, "Indexed %lu events in %s\n", (unsigned long)n, yelp::binlog_index::path_for (argv[optind]).c_str ());
+        return 0;
+    }
+
+    if ((set_mode || follow) && !from_stdin) {
+        std::vector<std::string> files;
+        for (int i = optind; i < argc; ++i) {
+            std::vector<std::string> expanded = yelp::binlog_set::expand (argv[i]);
+            files.insert (files.end (), expanded.begin (), expanded.end ());
+        }
+        if (files.empty ()) {
+            fprintf (stderr, "No binlogs found\n");
+            return 1;
+        }
+        boost::shared_ptr<yelp::binlog_set> binlogs;
+        try {
+            binlogs.reset (start_gtid ? new yelp::binlog_set (files, gtid_start)
+                                      : new yelp::binlog_set (files, starting_offset, target_time));
+        } catch (std::runtime_error &e) {
+            fprintf (stderr, "%s\n", e.what ());
+            return 1;
+        }
+        binlogs->set_verify_checksums (verify_checksums);
+        if (filtering) {
+            binlogs->set_filter (filter);
+        }
+        read_events (*binlogs, stats, export_path, follow, show_all, num_to_show, format);
+        if (stats_io) {
+            std::cout.flush ();
+            report_io (binlogs->counters (), started);
+        }
+        return 0;
+    }
+
+    yelp::binlog binlog (logfile, starting_offset, target_time);
+    if (start_gtid && !binlog.seek_gtid (gtid_start)) {
+        fprintf (stderr, "%s isn't in %s\n", start_gtid, argv[optind]);
+        return 1;
+    }
+    binlog.set_verify_checksums (verify_checksums);
+    if (filtering) {
+        binlog.set_filter (filter);
+    }
+    if (stats) {
+        // One thread just scans serially
+        std::vector<yelp::scan_worker*> workers;
+        for (int t = 0; t < num_threads; ++t) {
+            workers.push_back (new stats_worker);
+        }
+        binlog.parallel_scan (workers, std::cout);
+        yelp::event_stats &totals = ((stats_worker*)workers[0])->stats ();
+        for (int t = 1; t < num_threads; ++t) {
+            totals.merge (((stats_worker*)workers[t])->stats ());
+        }
+        totals.report (std::cout);
+        for (int t = 0; t < num_threads; ++t) {
+            delete workers[t];
+        }
+    } else if (export_path) {
+        uint64_t n = export_events (binlog.begin (), binlog.end (), export_path);
+        fprintf (stderr, "Exported %llu events to %s\n", (unsigned long long)n, export_path);
+    } else if (follow) {
+        // Only - gets here, a pipe follows itself: reading it waits for the writer.
+        follow_events (binlog.begin (), binlog.end (), show_all ? 0 : num_to_show, format);
+    } else if (show_all && num_threads > 1) {
+        std::vector<yelp::scan_worker*> workers;
+        for (int t = 0; t < num_threads; ++t) {
+            workers.push_back (new print_worker (format));
+        }
+        binlog.parallel_scan (workers, std::cout);
+        for (int t = 0; t < num_threads; ++t) {
+            delete workers[t];
+        }
+    } else {
+        print_events (binlog.begin (), binlog.end (), show_all, num_to_show, format);
+    }
+    if (stats_io) {
+        std::cout.flush ();
+        report_io (binlog.counters (), started);
     }
     return 0;
 }
+
+// Whatever goes wrong reading (a checksum mismatch, a truncated
+// file, the server turning us away) gets reported, not a core dump.
+int main (int argc, char **argv) {
+    try {
+        return run (argc, argv);
+    } catch (const std::exception &e) {
+        fprintf (stderr, "%s\n", e.what ());
+        return 1;
+    }
+}
+#endif
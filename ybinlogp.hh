@@ -9,6 +9,9 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <regex.h>
+#include <stdio.h>
+#include <pthread.h>
 
 #include <string>
 #include <iterator>
@@ -16,6 +19,10 @@
 #include <boost/utility.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/python.hpp>
+#include <vector>
+#include <map>
+#include <set>
+#include <boost/unordered_map.hpp>
 
 #if defined(DARWIN)
 // Darwin doesn't disinguish between 32 and 64 bit offsets, everything is 64bit...
@@ -23,11 +30,14 @@
 typedef off_t off64_t;
 #endif
 
+namespace yelp {
+    class payload_allocator;
+}
+
 extern "C" {
     // we tack on extra stuff at the end 
-    // TODO: this here is "wrong", the FDE determines the real
-    // EVENT_HEADER_SIZE in it's header_len field and that's the value
-    // that should really be used. It just happens to be 19 now.
+    // The FDE's header_len says how long headers really are, but it's
+    // 19 for every v4 binlog, binlog::check_file refuses anything else.
     const size_t EVENT_HEADER_SIZE = 19;
     // Room for event data. Semiarbitrarily picked...
     const size_t EVENT_PAYLOAD_SIZE = 32 - EVENT_HEADER_SIZE;
@@ -46,9 +56,13 @@ extern "C" {
         uint16_t	flags;
         // Extra stuff tacked on
         off64_t		offset;
+        // Bytes of checksum at the end of the event, included in length
+        uint8_t		checksum_len;
         // Technically we only need 1 of these two pointers, but then we'd just need more checks all over the code
         char*		heaped;
         char*		data;
+        // Where heaped came from, NULL means new[]
+        yelp::payload_allocator*	allocator;
         // Could use C99 FAM, but that's rarely fun in the long run and we'd
         // need to know the size of the event up front or realloc.
         char		payload[EVENT_PAYLOAD_SIZE];
@@ -63,6 +77,9 @@ extern "C" {
         // random data
     };
     
+    // Length of the event's data, without the header or checksum
+#define event_data_len(e) (e->length - EVENT_HEADER_SIZE - e->checksum_len)
+
 #define format_description_event_data(e) (e->data + ((struct format_description_event_buffer*)e->data)->header_length)
 #define format_description_event_data_len(e) (((struct format_description_event_buffer*)e->data)->header_len - EVENT_HEADER_SIZE)
     
@@ -78,7 +95,7 @@ extern "C" {
     };
     
 #define query_event_statement(e) (e->data + sizeof(struct query_event_buffer) + ((struct query_event_buffer*)e->data)->status_var_len + ((struct query_event_buffer*)e->data)->db_name_len + 1)
-#define query_event_statement_len(e) (e->length - EVENT_HEADER_SIZE - sizeof(struct query_event_buffer) - ((struct query_event_buffer*)e->data)->status_var_len - ((struct query_event_buffer*)e->data)->db_name_len - 1)
+#define query_event_statement_len(e) (event_data_len(e) - sizeof(struct query_event_buffer) - ((struct query_event_buffer*)e->data)->status_var_len - ((struct query_event_buffer*)e->data)->db_name_len - 1)
 #define query_event_db_name(e) (e->data + sizeof(struct query_event_buffer) + ((struct query_event_buffer*)e->data)->status_var_len)
     
     struct rand_event_buffer {
@@ -101,7 +118,158 @@ extern "C" {
     };
     
 #define rotate_event_file_name(e) (e->data + sizeof (struct rotate_event_buffer))
-#define rotate_event_file_name_len(e) (e->length - EVENT_HEADER_SIZE - sizeof (struct rotate_event_buffer))
+#define rotate_event_file_name_len(e) (event_data_len(e) - sizeof (struct rotate_event_buffer))
+
+    struct table_map_event_buffer {
+        uint8_t		table_id[6];
+        uint16_t	flags;
+        // database name    (1 byte length, name, NUL)
+        // table name       (1 byte length, name, NUL)
+        // column count     (packed integer)
+        // column types     (1 byte each)
+        // metadata         (packed integer length, per column type)
+        // nullable columns (bitmap)
+    };
+
+    struct rows_event_buffer {
+        uint8_t		table_id[6];
+        uint16_t	flags;
+        // extra data       (v2 events only, 2 byte length including itself)
+        // column count     (packed integer)
+        // columns present  (bitmap, two of them for updates: before and after)
+        // rows             (per image: bitmap of NULL present columns, then the values)
+    };
+
+    struct gtid_event_buffer {
+        uint8_t		flags;		// 5.6's commit flag, FLAG_MAY_HAVE_SBR since 8.0
+        uint8_t		sid[16];	// uuid of the server that ran it
+        uint64_t	gno;		// transaction number on that server
+        // 5.7+: logical clock type (2), last_committed and sequence_number (8 bytes each)
+    };
+
+    struct previous_gtids_event_buffer {
+        uint64_t	n_sids;
+        // per sid: the sid (16 bytes), n_intervals (8 bytes), then
+        // n_intervals start, end pairs (8 bytes each, end exclusive)
+    };
+
+    struct rows_query_event_buffer {
+        uint8_t		length;		// truncated, ignore it
+        // statement        (the rest, not NUL)
+    };
+
+#define rows_query_event_statement(e) (e->data + sizeof (struct rows_query_event_buffer))
+#define rows_query_event_statement_len(e) (event_data_len(e) - sizeof (struct rows_query_event_buffer))
+
+    // Sidecar index file (<binlog>.ybidx), a header followed by
+    // count index_records sorted by offset, then gtid_count
+    // index_gtid_records sorted by sid and gno.
+    struct index_file_header {
+        char		magic[4];	// "YBIX"
+        uint32_t	version;
+        uint32_t	stride;		// every stride'th event is indexed
+        uint32_t	record_size;
+        // the binlog as it was when indexed
+        uint64_t	binlog_size;
+        int64_t		binlog_mtime;
+        uint64_t	count;
+        uint64_t	gtid_count;
+    };
+
+    struct index_record {
+        uint64_t	offset;
+        uint32_t	timestamp;
+        uint8_t		type_code;
+        uint64_t	xid;		// XID_EVENT id, 0 for everything else
+    };
+
+    // Every GTID_LOG_EVENT, whatever the stride
+    struct index_gtid_record {
+        uint8_t		sid[16];
+        uint64_t	gno;
+        uint64_t	offset;
+    };
+
+    // Sidecar span index of a compressed binlog (<binlog>.ybcz), a
+    // header followed by count span_records, each followed by its
+    // window_len bytes of (zlib compressed) window.
+    struct span_file_header {
+        char		magic[4];	// "YBCZ"
+        uint32_t	version;
+        uint32_t	format;		// compressed_file::format
+        uint32_t	record_size;
+        // the compressed binlog as it was when indexed
+        uint64_t	binlog_size;
+        int64_t		binlog_mtime;
+        uint64_t	count;
+    };
+
+    struct span_record {
+        uint64_t	offset;		// in the uncompressed data
+        uint32_t	length;		// uncompressed
+        uint64_t	restart;	// the span decompression has to start from
+        uint64_t	compressed_offset;	// where the restart span's data starts
+        uint8_t		kind;		// e_span_kinds
+        uint8_t		bits;		// SPAN_DEFLATE: bits of the byte before compressed_offset still to go
+        uint32_t	window_len;
+    };
+
+    enum e_span_kinds {
+        SPAN_GZIP_MEMBER = 1,	// a gzip member starts here
+        SPAN_DEFLATE = 2,	// in the middle of a member, needs bits and the window
+        SPAN_ZSTD_FRAME = 3,	// a zstd frame starts here
+        SPAN_ZSTD_PART = 4	// in the middle of a zstd frame, decompressed from restart
+    };
+
+    // Columnar export (yelp::column_writer): a header describing the
+    // columns, batches of rows stored a column at a time, a footer
+    // with the database dictionary and where the batches are, and a
+    // trailer pointing at the footer. Little-endian, and everything
+    // starts 8 byte aligned so it can be used straight off a mmap.
+    struct column_file_header {
+        char		magic[4];	// "YBCX"
+        uint32_t	version;
+        uint32_t	column_count;
+        uint32_t	batch_rows;	// rows per batch, the last one can have fewer
+        // column_count column_descs
+    };
+
+    enum e_column_kinds {
+        COLUMN_UINT = 1,		// width byte unsigned integers
+        COLUMN_DICTIONARY = 2,		// uint32_t index into the footer's dictionary, COLUMN_NONE if none
+        COLUMN_BLOB = 3,		// rows + 1 uint64_t offsets into the bytes that follow them
+    };
+
+    const uint32_t COLUMN_NONE = 0xffffffff;
+
+    struct column_desc {
+        char		name[24];	// NUL padded
+        uint32_t	kind;		// e_column_kinds
+        uint32_t	width;		// bytes per row (the offsets, for a blob)
+    };
+
+    struct column_batch_header {
+        char		magic[4];	// "YBCB"
+        uint32_t	rows;
+        uint64_t	size;		// including this header
+        // each column in header order, padded to 8 bytes
+    };
+
+    struct column_footer {
+        char		magic[4];	// "YBCF"
+        uint32_t	dictionary_count;
+        uint64_t	rows;
+        uint64_t	batch_count;
+        // batch_count file offsets of the batches, then
+        // dictionary_count + 1 offsets into the dictionary's bytes,
+        // which follow them, all uint64_t
+    };
+
+    struct column_trailer {
+        uint64_t	footer_offset;
+        char		magic[4];	// "YBCX"
+        uint32_t	version;
+    };
     
 #pragma pack(pop)
 }
@@ -110,22 +278,520 @@ extern "C" {
 /** */
 namespace yelp {
 
+    /** Where the binlog gets payload buffers for events that don't fit
+        in event_buffer::payload and aren't mapped.
+
+        Only the binlog's own buffers (the iterator's entry, scratch
+        buffers while seeking) come from here, entries copied out of
+        an iterator always use new[] so they can outlive the binlog.
+    */
+    class payload_allocator : boost::noncopyable {
+    public:
+        payload_allocator () : m_in_use (0), m_high_water (0), m_allocations (0) { }
+        virtual ~payload_allocator () { }
+
+        /** Get at least size bytes. */
+        virtual char* allocate (size_t size) = 0;
+        /** Give back a buffer, size is what was passed to allocate. */
+        virtual void release (char *buf, size_t size) = 0;
+
+        /** Bytes currently handed out. */
+        size_t in_use () const { return m_in_use; }
+        /** Most bytes ever handed out at once. */
+        size_t high_water () const { return m_high_water; }
+        /** Number of allocate () calls. */
+        size_t allocations () const { return m_allocations; }
+
+    protected:
+        void note_allocate (size_t size) {
+            ++m_allocations;
+            m_in_use += size;
+            if (m_in_use > m_high_water) {
+                m_high_water = m_in_use;
+            }
+        }
+        void note_release (size_t size) { m_in_use -= size; }
+
+    private:
+        size_t m_in_use;
+        size_t m_high_water;
+        size_t m_allocations;
+    };
+
+    /** Power-of-two size class slab pool. Released buffers are kept on
+        per-class free lists and handed out again, so a scan settles
+        down to a handful of buffers no matter how many events it
+        reads. Not thread safe, it's meant to be per binlog.
+    */
+    class slab_allocator : public payload_allocator {
+    public:
+        /** \param max_cached bytes to keep on the free lists before giving memory back */
+        explicit slab_allocator (size_t max_cached = 64 * 1024 * 1024);
+        virtual ~slab_allocator ();
+
+        virtual char* allocate (size_t size);
+        virtual void release (char *buf, size_t size);
+
+        /** Bytes sitting on the free lists. */
+        size_t cached () const { return m_cached; }
+        /** allocate () calls served from a free list. */
+        size_t reuses () const { return m_reuses; }
+
+    private:
+        static size_t size_class (size_t size);
+
+        std::vector<std::vector<char*> > m_free;
+        size_t m_max_cached;
+        size_t m_cached;
+        size_t m_reuses;
+    };
+
+    /** What a binlog has been up to, for working out where a slow
+        scan spends its time: read syscalls, resyncing, payload
+        allocations or whatever the caller does with the events.
+
+        Counting costs an increment here and there, plus a clock read
+        around each syscall and each seek. Define YBINLOGP_NO_COUNTERS
+        to compile all of it out, the counters then stay zero and
+        enabled () says so.
+
+        bytes_read is what came in through read/pread, a mapped file
+        reads nothing that way. Events are counted as they're read for
+        iteration and parallel_scan, whether or not the filter lets
+        them through; ones a filter skipped by their header alone
+        aren't read and don't count.
+    */
+    struct binlog_counters {
+        enum phase {
+            PHASE_OPEN,		// the constructor, up to seeking
+            PHASE_SEEK,		// finding the starting offset or time
+            PHASE_READ,		// in read/pread, opening and seeking included
+            PHASE_WAIT,		// following, waiting for the server
+            PHASE_SCAN,		// parallel_scan, all of it
+            PHASE_COUNT
+        };
+
+        binlog_counters () { reset (); }
+        void reset ();
+        /** Add rhs's counts to these. */
+        void merge (const binlog_counters &rhs);
+        /** A line per counter that isn't zero, and per phase that took any time. */
+        void report (std::ostream &os) const;
+
+        static bool enabled ();
+        static const char* phase_name (int phase);
+
+        double seconds (int phase) const { return phase_ns[phase] / 1e9; }
+
+        uint64_t syscalls;
+        uint64_t bytes_read;
+        uint64_t events;
+        uint64_t event_bytes;
+        uint64_t events_by_type[256];
+        /** Searches for an event from an arbitrary offset, and the bytes they stepped over. */
+        uint64_t resyncs;
+        uint64_t resync_bytes_skipped;
+        /** Payload buffers read_event had to get, and their sizes. */
+        uint64_t allocations;
+        uint64_t bytes_allocated;
+        uint64_t phase_ns[PHASE_COUNT];
+    };
+
+    /** A global transaction id: the uuid of the server a transaction
+        ran on and its number there, as in uuid:gno. */
+    struct gtid {
+        gtid ();
+        /** Parse uuid:gno, throws std::invalid_argument if it isn't one. */
+        static gtid parse (const std::string &text);
+        /** The uuid, dashes and all. */
+        std::string sid_str () const;
+        std::string str () const;
+        bool operator== (const gtid &rhs) const;
+        bool operator< (const gtid &rhs) const;
+        uint8_t sid[16];
+        uint64_t gno;
+    };
+
+    /** A set of GTIDs, ranges of transaction numbers per server uuid,
+        the way PREVIOUS_GTIDS_LOG_EVENT (and @@gtid_executed) hold
+        them. */
+    class gtid_set {
+    public:
+        gtid_set () { }
+        /** The GTIDs of every earlier binlog, from a
+            PREVIOUS_GTIDS_LOG_EVENT. Throws std::invalid_argument for
+            any other event, std::runtime_error if it's cut short. */
+        explicit gtid_set (const struct event_buffer &evbuf);
+
+        bool contains (const gtid &g) const;
+        bool empty () const { return m_intervals.empty (); }
+        /** uuid:1-5:7,uuid:1-3, like MySQL prints them. */
+        std::string str () const;
+
+    private:
+        // sid (the raw 16 bytes) to [start, end) ranges, sorted
+        typedef std::map<std::string, std::vector<std::pair<uint64_t, uint64_t> > > interval_map;
+        interval_map m_intervals;
+    };
+
+    /** The sidecar offset/timestamp index of a binlog, plus where
+        each GTID_LOG_EVENT is.
+
+        The index is mapped and searched in place, so a lookup only
+        touches the pages a binary search lands on. It's only used if
+        the binlog's size and mtime match what was recorded when it
+        was built, an active binlog that's been appended to simply has
+        no index until it's rebuilt (binlog::build_index, ybinlogp -i).
+    */
+    class binlog_index : boost::noncopyable {
+    public:
+        binlog_index ();
+        ~binlog_index ();
+
+        /** Where the index for the binlog filename lives. */
+        static std::string path_for (const std::string &filename);
+
+        /** Write an index for filename, replacing any existing one.
+            \param st stat of the binlog the records were read from */
+        static void write (const std::string &filename, const struct stat &st,
+                           uint32_t stride, const std::vector<index_record> &records,
+                           const std::vector<index_gtid_record> &gtids);
+
+        /** Map the index for filename. Returns false if there isn't
+            one or it doesn't match st. */
+        bool open (const std::string &filename, const struct stat &st);
+        bool is_open () const { return m_records != NULL; }
+
+        uint32_t stride () const { return m_header ? m_header->stride : 0; }
+        size_t size () const { return m_count; }
+        const index_record& operator[] (size_t i) const { return m_records[i]; }
+
+        /** First record with a timestamp >= target, size () if none. */
+        size_t lower_bound_time (time_t target) const;
+        /** Last record starting at or before offset, 0 if none. */
+        size_t floor_offset (off64_t offset) const;
+
+        /** Number of GTID_LOG_EVENTs indexed, every one in the file. */
+        size_t gtids () const { return m_gtid_count; }
+        /** Offset of the GTID_LOG_EVENT of g, -1 if the file hasn't got one. */
+        off64_t find_gtid (const gtid &g) const;
+
+    private:
+        void close ();
+
+        const char *m_map;
+        size_t m_map_size;
+        const index_file_header *m_header;
+        const index_record *m_records;
+        size_t m_count;
+        const index_gtid_record *m_gtids;
+        size_t m_gtid_count;
+    };
+
+    /** A gzip or zstd compressed binlog, read at any offset of the
+        uncompressed data without decompressing it to disk.
+
+        The data is cut into spans of a few MB that can be decompressed
+        on their own: at deflate block boundaries of a gzip member
+        (with the 32K of history they need, like zlib's zran example)
+        and at zstd frames. A zstd file in the seekable format lists
+        its frames, anything else has its spans found by decompressing
+        it once front to back, which a sequential read does anyway.
+        The span index then gets saved next to the file (<file>.ybcz)
+        so seeking in it later only decompresses the spans it lands
+        in. A zstd frame bigger than a span can't be entered in the
+        middle, seeking into it decompresses from the frame's start:
+        recompress in the seekable format (or in smaller frames) for
+        that.
+
+        Sequential reads have the spans after the one being read
+        decompressed ahead on a thread of its own.
+
+        zstd needs building with YBINLOGP_ZSTD (and -lzstd), otherwise
+        zstd files are refused.
+
+        Reading is meant for one thread, the readahead thread works
+        behind its back.
+    */
+    class compressed_file : boost::noncopyable {
+    public:
+        enum format {
+            NOT_COMPRESSED,
+            GZIP,
+            ZSTD
+        };
+
+        /** What fd holds, by its first bytes. */
+        static format detect (int fd);
+
+        /** Where the span index for the binlog filename lives. */
+        static std::string path_for (const std::string &filename);
+
+        /** Constructor
+
+            \param fd the compressed file, which stays the caller's
+            \param kind what detect said
+            \param filename where it is, for the span index, empty for no index
+        */
+        compressed_file (int fd, format kind, const std::string &filename);
+        ~compressed_file ();
+
+        format kind () const { return m_kind; }
+
+        /** Size of the uncompressed data. Unless the spans are all
+            known, this decompresses the rest of the file to find out. */
+        uint64_t size ();
+
+        /** Copy up to len bytes from offset of the uncompressed data
+            to buf, fewer at the end. Throws std::runtime_error if the
+            file is corrupt. */
+        size_t read (void *buf, size_t len, uint64_t offset);
+
+        /** Decompress ahead of sequential reads on another thread, on
+            by default. */
+        void set_readahead (bool readahead);
+
+        /** Spans known so far. */
+        size_t spans () const { return m_spans.size (); }
+
+    private:
+        struct decoder;
+        typedef boost::shared_ptr<std::vector<char> > buffer;
+
+        /** The span holding offset, or spans () if it's past the known ones. Call locked. */
+        size_t find_span (uint64_t offset) const;
+        /** The decompressed span, from the cache or decompressed now,
+            empty past the end. Call locked, waits for the decoder. */
+        buffer get_span (size_t span);
+        /** Run the decoder for span. Call holding the decoder, unlocked. */
+        buffer decode (size_t span);
+        /** Decompress the span after the known ones, noting where the
+            one after it starts. Empty at the end. Like decode. */
+        buffer discover ();
+        /** Call locked. */
+        void cache (size_t span, buffer data);
+        bool load_index (const struct stat &st);
+        void save_index ();
+        void read_seek_table (off64_t compressed_size);
+
+        static void* readahead_thread (void *arg);
+        void readahead ();
+        /** The span the readahead thread should decompress next, or -1. Call locked. */
+        size_t readahead_target () const;
+        void stop_readahead ();
+
+        int m_fd;
+        format m_kind;
+        std::string m_filename;
+        std::vector<span_record> m_spans;
+        // window of each SPAN_DEFLATE span, zlib compressed
+        std::vector<std::string> m_windows;
+        // every span is in m_spans
+        bool m_complete;
+        // where the first span not in m_spans starts
+        span_record m_frontier;
+        std::string m_frontier_window;
+        // Only whoever set m_decoding may use m_decoder (and add
+        // spans), without holding m_lock while it does.
+        decoder *m_decoder;
+        // the span the decoder carries on with, -1 if it has to start over
+        size_t m_decoder_at;
+        bool m_decoding;
+        std::map<size_t, buffer> m_cache;
+        // last span read (), and whether it followed the one before
+        size_t m_last_read;
+        bool m_sequential;
+        bool m_readahead;
+        bool m_thread_running;
+        bool m_stopping;
+        pthread_t m_thread;
+        pthread_mutex_t m_lock;
+        pthread_cond_t m_cond;
+        // read ()'s own copy of the span it read last, so reads
+        // within it don't need the lock
+        uint64_t m_current_offset;
+        buffer m_current_data;
+    };
+
+    /** A pipe, socket or anything else that can only be read once,
+        front to back, read through a ring buffer so that binlog can
+        ask it for bytes at an offset the way it asks a file.
+
+        Offsets count from the first byte read off the fd. Reading has
+        to go forward: a read that needs more off the fd lets go of
+        everything before its offset, and asking for anything before
+        that throws. The fd is read as
+        much at a time as the ring has room for, both free stretches
+        of it with one readv (), and the ring only grows for an event
+        that doesn't fit in it.
+    */
+    class stream_buffer : boost::noncopyable {
+    public:
+        /** Is fd something that can't be read at an offset? */
+        static bool is_stream (int fd);
+
+        explicit stream_buffer (int fd);
+
+        /** Copy up to len bytes at offset into buf, blocking until
+            they've been written. Fewer at the end of the stream. */
+        size_t read (void *buf, size_t len, off64_t offset, binlog_counters &counters);
+
+    private:
+        /** One readv () into the free part of the ring. */
+        void read_more (binlog_counters &counters);
+        /** Make room for len bytes. */
+        void grow (size_t len);
+
+        int m_fd;
+        std::vector<char> m_ring;
+        // the byte at m_offset is at m_ring[m_head], m_len of them are buffered
+        size_t m_head;
+        size_t m_len;
+        off64_t m_offset;
+        bool m_eof;
+    };
+
+    /** Looks for literals and regexes in QUERY_EVENT statements,
+        where they sit in the event, without formatting anything. An
+        event matches if any one of them does.
+
+        Literals are found 16 positions at a time (SSE2): a position
+        is only compared in full if the literal's first and last bytes
+        are both there. Regexes are POSIX extended ones.
+
+        Matching doesn't change anything, so one can be shared by
+        several threads.
+    */
+    class statement_search : boost::noncopyable {
+    public:
+        statement_search ();
+        ~statement_search ();
+
+        void add_literal (const std::string &literal);
+        /** Throws std::invalid_argument if regcomp doesn't like it. */
+        void add_regex (const std::string &pattern);
+        bool empty () const { return m_literals.empty () && m_regexes.empty (); }
+
+        bool matches (const char *statement, size_t len) const;
+        /** Does evbuf's statement match? Only QUERY_EVENTs have one. */
+        bool matches (const event_buffer &evbuf) const;
+
+    private:
+        std::vector<std::string> m_literals;
+        std::vector<regex_t*> m_regexes;
+    };
+
+    /** Which events a binlog (or binlog_set) hands out, see
+        binlog::set_filter. An empty filter passes everything.
+
+        Types, server ids, times and flags only need the header, and
+        the header is all that's read of an event they reject:
+        iteration steps over it by its length. Database and table
+        names need the event itself and only constrain the events that
+        name them: QUERY_EVENTs by their default database, table maps,
+        and row events by the table map of their table_id. Everything
+        else passes them.
+
+        A statement search (set_search) only lets through the
+        QUERY_EVENTs it finds something in, everything else is skipped
+        by its header.
+
+        It keeps track of which table_ids passed, so with databases or
+        tables it's meant for one pass over the events, in order.
+        Without them matches () doesn't change anything and threads
+        can share it.
+    */
+    class event_filter {
+    public:
+        event_filter ();
+
+        /** Only pass these types, every call adds one. */
+        void add_type (uint8_t type_code);
+        /** Only pass these servers, every call adds one. */
+        void add_server_id (uint32_t server_id);
+        /** Only pass from <= timestamp <= until, 0 leaves that end open. */
+        void set_time_range (time_t from, time_t until);
+        /** Only pass events with all of require and none of reject set in their flags. */
+        void set_flags (uint16_t require, uint16_t reject);
+        /** Only pass these databases, every call adds one. */
+        void add_database (const std::string &database);
+        /** Only pass these tables, table or database.table, every call
+            adds one. That's their TABLE_MAP_EVENTs and row events,
+            nothing else gets through once there's a table. */
+        void add_table (const std::string &table);
+        /** Only pass QUERY_EVENTs whose statement search matches. */
+        void set_search (boost::shared_ptr<const statement_search> search) { m_search = search; }
+
+        /** Does the header pass the type, server id, time and flag predicates? */
+        bool header_matches (const event_buffer &header) const;
+        /** Is the event worth reading at all? It is if the header
+            matches, or if it's a table map we have to keep track of. */
+        bool wants (const event_buffer &header) const;
+        /** Does the event pass everything? Has to see every event
+            wants () says yes to, in order. */
+        bool matches (const event_buffer &evbuf);
+        /** Whether matches () looks past the header. */
+        bool needs_payload () const { return needs_table_maps () || m_search; }
+        /** Whether matches () has to see the table maps, in order. */
+        bool needs_table_maps () const { return !m_databases.empty () || !m_tables.empty (); }
+
+    private:
+        bool name_matches (const std::string &database, const std::string &table) const;
+
+        // indexed by type_code, empty passes every type
+        std::vector<bool> m_types;
+        std::set<uint32_t> m_server_ids;
+        time_t m_from;
+        time_t m_until;
+        uint16_t m_require;
+        uint16_t m_reject;
+        std::set<std::string> m_databases;
+        std::set<std::string> m_tables;
+        // table_ids whose latest TABLE_MAP_EVENT passed
+        std::set<uint64_t> m_table_ids;
+        boost::shared_ptr<const statement_search> m_search;
+    };
+
+    class scan_worker;
+    class table_map_cache;
+
     /** */
     class binlog {
     public:
 
+        /** How events are pulled off disk. */
+        enum read_mode {
+            /** lseek + read into the event buffer, heap for large payloads */
+            READ_SYSCALL,
+            /** map the file and point event_buffer::data into the mapping */
+            READ_MMAP
+        };
+
         /** */
         struct format_description_entry {
-            format_description_entry () : format_version (0), create_timestamp (0) { }
+            /** binlog_checksum, as in the FDE */
+            enum checksum_alg_t {
+                CHECKSUM_OFF = 0,
+                CHECKSUM_CRC32 = 1,
+                /** written by a server that predates checksums (< 5.6.1) */
+                CHECKSUM_UNDEF = 255
+            };
+            format_description_entry () : format_version (0), create_timestamp (0), header_len (0), checksum_alg (CHECKSUM_UNDEF) { }
             format_description_entry (const struct event_buffer &evbuf);
             bool operator== (const format_description_entry &rhs) const {
                 return format_version == rhs.format_version &&
                     create_timestamp == rhs.create_timestamp &&
                     server_version == rhs.server_version;
             }
+            /** Bytes of checksum at the end of every other event in the file. */
+            size_t checksum_len () const { return checksum_alg == CHECKSUM_CRC32 ? 4 : 0; }
             uint16_t format_version;
             uint32_t create_timestamp;
             std::string server_version;
+            uint8_t header_len;
+            /** Post-header length of each event type, type_code - 1 indexes it. */
+            std::vector<uint8_t> post_header_len;
+            uint8_t checksum_alg;
         };
 
         /** */
@@ -189,17 +855,179 @@ namespace yelp {
             uint64_t id;
         };
 
-        /** */
+        /** A GTID_LOG_EVENT, which starts each transaction once a
+            server has gtid_mode=ON. The logical clock is 0 for 5.6,
+            which doesn't write one. */
+        struct gtid_entry {
+            gtid_entry () : flags (0), last_committed (0), sequence_number (0) { }
+            gtid_entry (const struct event_buffer &evbuf);
+            bool operator== (const gtid_entry &rhs) const {
+                return id == rhs.id && flags == rhs.flags;
+            }
+            /** The id as text, uuid:gno, for the python bindings. */
+            std::string str () const { return id.str (); }
+            yelp::gtid id;
+            uint8_t flags;
+            int64_t last_committed;
+            int64_t sequence_number;
+        };
+
+        /** A TABLE_MAP_EVENT: the table the row events after it with
+            the same table_id apply to, and its columns. */
+        struct table_map_entry {
+            table_map_entry () : table_id (0), flags (0) { }
+            table_map_entry (const struct event_buffer &evbuf);
+            bool operator== (const table_map_entry &rhs) const {
+                return table_id == rhs.table_id &&
+                    database == rhs.database &&
+                    table == rhs.table &&
+                    column_types == rhs.column_types &&
+                    column_meta == rhs.column_meta;
+            }
+            size_t columns () const { return column_types.size (); }
+            uint64_t table_id;
+            uint16_t flags;
+            std::string database;
+            std::string table;
+            /** MYSQL_TYPE_* of each column */
+            std::vector<uint8_t> column_types;
+            /** The metadata of each column (eg. VARCHAR length, DECIMAL
+                precision and scale), up to two bytes, first byte low. */
+            std::vector<uint16_t> column_meta;
+            std::vector<bool> nullable;
+        };
+
+        /** One column of a row, decoded. Integers come out signed,
+            the table map doesn't say which columns are UNSIGNED. */
+        struct column_value {
+            enum kind_t {
+                NULL_VALUE,
+                INT,
+                UINT,		// BIT, ENUM, SET, TIMESTAMP, YEAR
+                DOUBLE,
+                BYTES,		// strings and blobs as stored, JSON in MySQL's binary format
+                TEXT		// DECIMAL and dates/times, formatted the way MySQL prints them
+            };
+            column_value () : type (0), kind (NULL_VALUE), int_value (0), uint_value (0), double_value (0) { }
+            /** The value as text, NULL for NULL. */
+            std::string str () const;
+            uint8_t type;
+            kind_t kind;
+            int64_t int_value;
+            uint64_t uint_value;
+            double double_value;
+            std::string string_value;
+        };
+
+        /** A WRITE_ROWS_EVENT, UPDATE_ROWS_EVENT or DELETE_ROWS_EVENT
+            (v1 or v2).
+
+            Decoding is lazy. Constructing one copies the payload and
+            reads the column bitmaps, where the rows start is worked out
+            on the first size () or row lookup, and a row only skips
+            over the columns in front of the one asked for. Nothing is
+            converted until row::value, so pulling one column out of a
+            big event doesn't pay for the others.
+        */
+        struct rows_entry {
+            struct data;
+
+            /** One row image. Stays valid after the rows_entry is gone. */
+            struct row {
+                size_t columns () const;
+                /** Whether the event has the column at all (UPDATEs can leave some out). */
+                bool present (size_t column) const;
+                bool is_null (size_t column) const;
+                /** Decode column, a NULL_VALUE if it's NULL or not present. */
+                column_value value (size_t column) const;
+
+            private:
+                row (const boost::shared_ptr<const data> &data, size_t offset, int image);
+                /** Fill m_columns in up to and including column. */
+                void walk (size_t column) const;
+
+                boost::shared_ptr<const data> m_data;
+                // payload offset of the image's NULL bitmap
+                size_t m_offset;
+                // 0 uses the first columns present bitmap, 1 the second
+                int m_image;
+                // payload offset of each column walked so far, or NULL_COLUMN / ABSENT_COLUMN
+                mutable std::vector<uint32_t> m_columns;
+                mutable size_t m_next;
+                mutable size_t m_present_seen;
+
+                friend struct rows_entry;
+            };
+
+            /** \param tables has to have seen the TABLE_MAP_EVENT for this event's table_id */
+            rows_entry (const struct event_buffer &evbuf, const table_map_cache &tables);
+
+            uint8_t type_code;
+            uint64_t table_id;
+            uint16_t flags;
+
+            const table_map_entry& table () const;
+            /** Number of rows. An UPDATE's row is the before and after image together. */
+            size_t size () const;
+            /** The row as it was, for UPDATEs and DELETEs. */
+            row before (size_t i) const;
+            /** The row as it is now, for WRITEs and UPDATEs. */
+            row after (size_t i) const;
+            /** The row written or deleted, the after image of an UPDATE. */
+            row operator[] (size_t i) const;
+
+        private:
+            boost::shared_ptr<const data> m_data;
+        };
+
+        struct entry;
+
+        /** A borrowed look at an event: the header plus a span over
+            the payload. The payload lives in the binlog's mapping or in
+            the entry the view came from, so a view is only good until
+            the iterator it came from moves on. Use to_entry () to keep
+            an event around. */
+        struct event_view {
+            event_view () : m_buffer (NULL) { }
+            explicit event_view (const event_buffer *evbuf) : m_buffer (evbuf) { }
+
+            const event_buffer& header () const { return *m_buffer; }
+            off64_t offset () const { return m_buffer->offset; }
+            uint8_t type_code () const { return m_buffer->type_code; }
+            const char* data () const { return m_buffer->data; }
+            size_t size () const { return m_buffer->data ? event_data_len (m_buffer) : 0; }
+            bool empty () const { return m_buffer == NULL || m_buffer->data == NULL; }
+
+            /** Make an owning copy of the event. */
+            entry to_entry () const;
+
+        private:
+            const event_buffer *m_buffer;
+        };
+
+        /** An event. Copying an entry always copies the payload, so a
+            copy outlives the binlog it came from, while moving (or
+            swap) just hands the buffer over. */
         struct entry {
             entry ();
             entry (const entry &rhs);
             entry (const event_buffer *evbuf);
             entry& operator= (const entry &rhs);
+#if __cplusplus >= 201103L
+            entry (entry &&rhs);
+            entry& operator= (entry &&rhs);
+#endif
             bool operator== (const entry &rhs) const;
             ~entry ();
 
+            void swap (entry &rhs);
+
+            /** Drop the payload and go back to being an empty entry. */
+            void reset ();
+
             event_buffer* get_buffer () { return &m_buffer; }
             const event_buffer* get_buffer () const { return &m_buffer; }
+            event_view view () const { return event_view (&m_buffer); }
             
             /*
               If this was nice and actually to be used from c++, it
@@ -210,63 +1038,55 @@ namespace yelp {
             event_buffer m_buffer;
         };
 
-        /** */
+        /** Input iterator over the events in a binlog.
+
+            The iterator owns the current entry and reuses it on every
+            operator++, dereferencing hands out a reference to it. When
+            the file is mapped that means walking the file doesn't
+            allocate or copy anything. Copy the entry (or use
+            view ().to_entry ()) if it has to outlive the next
+            increment. The python bindings do exactly that.
+        */
         struct iterator {
             typedef ptrdiff_t difference_type;
-            typedef std::forward_iterator_tag iterator_category;
+            typedef std::input_iterator_tag iterator_category;
             typedef entry value_type;
-            // The astute reader will notice the this iterator's
-            // traits shows that reference is a value_type. This is
-            // because the iterator is generating values. The entries
-            // don't exist in the parent binlog, but are created on
-            // operator++ calls. Therefore, to ensure that the value
-            // survives the iterator for the python bindings...  it's
-            // a value rather than reference. Yes, it's copy heavy.
-            // Also, this isn't a problem in C++ since reference &
-            // scope enforcement ensures things will work. 
-            // This also makes operator-> sad.
-            typedef value_type reference;
-            typedef const value_type const_reference;
-            typedef value_type* pointer;
-            typedef const value_type* const_pointer;
-            reference operator* () { return m_entry; }
-            const_reference operator* () const { return m_entry; }
-            pointer operator-> () { return &m_entry; }
-            const_pointer operator-> () const { return &m_entry; }
-
-            /* 
-            // "Proper" C++ definition, but see above for why not. 
-            // Making python bindings less angry.
-            typedef value_type& reference;
+            typedef const value_type& reference;
             typedef const value_type& const_reference;
-            typedef value_type* pointer;
+            typedef const value_type* pointer;
             typedef const value_type* const_pointer;
-            reference operator* () { return m_entry; }
-            const_reference operator* () const { return m_entry; }
-            pointer operator-> () { return &(operator* ()); }
-            const_pointer operator-> () const { return &(operator* ()); }
-            */
+            reference operator* () const { return m_entry; }
+            pointer operator-> () const { return &m_entry; }
+            event_view view () const { return m_entry.view (); }
 
             bool operator== (const iterator &rhs) const {
                 return m_entry == rhs.m_entry;
             }
             bool operator!= (const iterator &rhs) const { return ! operator== (rhs); }
 
+            /** What it++ returns. Holds the entry the iterator was
+                pointing at, handed over rather than copied, so *it++
+                works like it does for any input iterator. */
+            struct postfix_proxy {
+                reference operator* () const { return m_entry; }
+                pointer operator-> () const { return &m_entry; }
+            private:
+                value_type m_entry;
+                friend struct iterator;
+            };
+
             iterator& operator++ ();
-            iterator operator++ (int) {
-                iterator tmp (*this);
-                ++(*this);
-                return tmp;
-            }
+            postfix_proxy operator++ (int);
 
             iterator () : m_entry (), m_binlog (NULL) { }
             iterator (const iterator &rhs);
+            iterator& operator= (const iterator& rhs);
 
         private:
             iterator (const entry &ev, binlog *binlog) : m_entry (ev), m_binlog (binlog) { }
 
-            // Verboten for now, feel free to add if you need...
-            iterator& operator= (const iterator& rhs);
+            /** Read the event at offset into m_entry, or become end (). */
+            void advance_to (off64_t offset);
 
             value_type m_entry;
             binlog *m_binlog;
@@ -279,16 +1099,23 @@ namespace yelp {
             \param filename name of the binlog file to process
             \param starting_offset start reading from first entry after this offset
             \param starting_time start reading from first entry closest to this time
+            \param mode how to read events, falls back to READ_SYSCALL if the file can't be mapped
 
             \note time trumphs offset
+            \note gzip and zstd compressed files are read through compressed_file, offsets are uncompressed ones
+            \note a pipe (eg. /dev/stdin) is read through stream_buffer, front to back, so the offset or
+            time is found by reading up to it
         */
-        binlog (const std::string &filename, off64_t starting_offset, time_t starting_time);
+        binlog (const std::string &filename, off64_t starting_offset, time_t starting_time, read_mode mode = READ_MMAP);
 
         /** Constructor
 
-            \param fd file to read, must be positioned right
+            \param fd file to read, must be positioned right (compressed files start at their first event regardless)
+            \param mode how to read events, falls back to READ_SYSCALL if the file can't be mapped
+
+            \note a pipe or socket is read through stream_buffer, see stream_start
         */
-        binlog (int fd);
+        binlog (int fd, read_mode mode = READ_MMAP);
 
         /** Constructor for passing in python file objects.
 
@@ -300,15 +1127,150 @@ namespace yelp {
 
         virtual ~binlog ();
 
-        iterator begin () { return iterator (m_evbuf, this); }
+        iterator begin ();
         iterator end () { return iterator (); }
 
+        /** Follow the file as the server writes it, like tail -f.
+
+            Instead of ending at the end of the file, iteration waits
+            (on inotify, or kqueue on Darwin, not by polling) for the
+            rest of the next event to be written, so events are only
+            handed out once they're complete. A ROTATE_EVENT or
+            STOP_EVENT ends the file, binlog_set moves on from there.
+
+            A growing file can't stay mapped, so this switches to
+            READ_SYSCALL. Call it before iterating. Compressed files
+            can't be followed, nor can pipes, reading one waits for
+            the writer anyway.
+
+            \param timeout_ms give up (end the iteration) after waiting this long, -1 waits forever
+        */
+        void set_follow (bool follow, int timeout_ms = -1);
+        bool following () const { return m_follow; }
+
+        /** A descriptor that, once it's readable, makes waiting for a
+            followed file to grow give up as if the timeout had run
+            out. It's how another thread stops one that's following.
+            The binlog neither reads nor closes it, -1 (the default)
+            for none. */
+        void set_follow_interrupt (int fd) { m_interrupt_fd = fd; }
+        int follow_interrupt () const { return m_interrupt_fd; }
+
+        /** Whether iteration has got as far as the event that
+            finishes the file, the server's ROTATE_EVENT or STOP_EVENT,
+            whether or not the filter let it through. */
+        bool file_ended () const { return m_file_ended; }
+        /** The file that ROTATE_EVENT named, empty until there's been one. */
+        const std::string& rotated_to () const { return m_rotated_to; }
+
+        /** Check the CRC32 of every event handed out (iteration and
+            parallel_scan) if the file has checksums, and throw
+            std::runtime_error on a mismatch. On by default, it's cheap
+            (PCLMUL where the CPU has it), but off is cheaper still. */
+        void set_verify_checksums (bool verify) { m_verify = verify; }
+        bool verify_checksums () const { return m_verify; }
+
+        /** The file's format description event, as far as we've seen
+            it. Defaults (no checksums) until one has been read. */
+        const format_description_entry& format () const { return m_format; }
+
+        /** Timestamp of the format description event, ie. when the file was started. */
+        time_t first_timestamp () const { return m_min_timestamp; }
+
+        /** The GTIDs of the binlogs before this one, from the
+            PREVIOUS_GTIDS_LOG_EVENT after the format description. Empty
+            if there isn't one (before 5.6, or gtid_mode was never on).
+            Not for pipes, they've moved on past it. */
+        gtid_set previous_gtids ();
+
+        /** Start iterating at the GTID_LOG_EVENT of target rather than
+            wherever the constructor got to. Returns false, leaving the
+            start alone, if the file hasn't got it. Call it before
+            iterating.
+
+            With a sidecar index it's a lookup. Without one it bisects
+            the file on target's transaction numbers, which only go up
+            within a file, and reads just the headers of the stretch it
+            narrows down to. Should the numbers turn out not to be in
+            order (a replica applying in parallel without
+            replica_preserve_commit_order), it falls back to reading
+            every header. A pipe is read forward to it, and to the end
+            if it isn't there. */
+        bool seek_gtid (const gtid &target);
+
+        /** The mode actually in use, which may differ from the one requested. */
+        read_mode mode () const { return m_map ? READ_MMAP : READ_SYSCALL; }
+
+        /** What reading the file has cost so far, see binlog_counters. */
+        const binlog_counters& counters () const { return m_counters; }
+        void reset_counters () { m_counters.reset (); }
+
+        /** Run every event from the current position to the end of
+            the file through workers, one thread per worker, and write
+            what they produce to os in file order.
+
+            The file is cut into chunks at fixed offsets. In a first
+            pass each chunk resyncs to its first event (nearest_offset)
+            and follows the chain to the next chunk. Where that doesn't
+            land exactly on the next chunk's first event, the chain wins
+            and the next chunk is redone from there, so by the time a
+            worker sees an event every chunk starts and ends on the
+            chain and nothing is missed or seen twice.
+
+            Needs a mapped file, otherwise (or with a single worker)
+            it's a plain serial scan on the calling thread. Exceptions
+            thrown by workers are rethrown as std::runtime_error.
+        */
+        void parallel_scan (const std::vector<scan_worker*> &workers, std::ostream &os);
+
+        /** Scan the whole file and write a sidecar index holding every
+            stride'th event, and every GTID_LOG_EVENT, which later
+            (filename, offset, time) constructors and seek_gtid will
+            seek with. Needs the filename
+            constructor, and a file rather than a pipe. Returns the
+            number of records written. */
+        size_t build_index (unsigned int stride = 1);
+
+        /** Use allocator for payload buffers, an empty pointer means
+            plain new[]. Defaults to a slab_allocator. Buffers already
+            handed out go back to the allocator they came from, so the
+            old one is kept until the binlog goes away. Iterators (and their entries) hold buffers
+            from the allocator and mustn't outlive the binlog, copies
+            of an entry are safe. */
+        void set_allocator (boost::shared_ptr<payload_allocator> allocator);
+        boost::shared_ptr<payload_allocator> allocator () const { return m_allocator; }
+
+        /** Only hand out the events filter passes, an empty pointer
+            means all of them. Applies to iteration and parallel_scan
+            (which scans serially if the filter needs table maps, they
+            don't survive being cut into chunks). Call it before
+            iterating. */
+        void set_filter (boost::shared_ptr<event_filter> filter) { m_filter = filter; }
+        boost::shared_ptr<event_filter> filter () const { return m_filter; }
+
     private:
+        /**
+         * Map m_fd read-only. Returns false (and leaves m_map NULL)
+         * if the file isn't something we can map, eg. a pipe.
+         */
+        bool map_file ();
+
         /**
          * Check if a file looks valid (binlog version, magic bytes etc
          */
         int check_file (struct event_buffer *evbuf);
 
+        /**
+         * Take the file's format (checksums etc) from a format
+         * description event, and fix up its checksum_len.
+         **/
+        void note_format (struct event_buffer *evbuf);
+
+        /**
+         * Throw if verifying and evbuf's checksum doesn't match.
+         **/
+        void verify_event (const struct event_buffer *evbuf) const;
+
         /**
          * Check to see if an event looks valid.
          **/
@@ -317,8 +1279,10 @@ namespace yelp {
         /**
          * Read an event from the specified offset into the given event buffer.
          *
-         * Will also malloc() space for any dynamic portions of the event, if the
-         * event passes check_event.
+         * When the file is mapped, evbuf->data points into the mapping
+         * and nothing is allocated or copied. Otherwise space for any
+         * dynamic portions of the event is new[]'ed. Either way, data is
+         * left NULL if the length is bogus or runs off the end of the file.
          **/
         int read_event (struct event_buffer *evbuf, off64_t offset);
 
@@ -338,29 +1302,914 @@ namespace yelp {
          * Get the first event after starting_offset in fd
          *
          * If evbuf is non-null, copy it into there
+         *
+         * Reads the file a block at a time and looks for plausible
+         * headers in memory, checking 16 positions at once where SSE2
+         * is available. A candidate only counts once the offset +
+         * length chain after it checks out for a few events too.
+         *
+         * Counts the resync in counters, parallel_scan's threads each
+         * pass their own.
          */
-        off64_t nearest_offset (off64_t starting_offset, struct event_buffer *outbuf, int direction);
+        off64_t nearest_offset (off64_t starting_offset, struct event_buffer *outbuf, int direction, binlog_counters &counters);
+
+        /**
+         * Find the first (direction > 0) or last (direction < 0)
+         * plausible header among the positions [lo, hi] of buf, which
+         * holds the avail bytes starting at file offset base. Returns
+         * the file offset or -1.
+         **/
+        off64_t resync_block (const char *buf, size_t avail, off64_t base, size_t lo, size_t hi, int direction);
+
+        /**
+         * Does the header at offset look like an event, and do the
+         * next few events it chains to look like events too?
+         **/
+        bool confirm_chain (off64_t offset);
+
+        /**
+         * Read up to len bytes at offset, from the file or through
+         * m_compressed or m_stream. Returns how many there were.
+         **/
+        size_t read_at (void *buf, size_t len, off64_t offset, binlog_counters &counters);
+
+        /**
+         * Read the raw header at offset. Returns false at end of file.
+         **/
+        bool read_header (off64_t offset, char *header);
+
+        /** Size of the file as of opening it (or now, for fds we don't own or while following). */
+        off64_t file_size ();
+
+        /**
+         * Block until the file is at least size bytes long. Returns
+         * false if the follow timeout ran out, the file went away or
+         * the follow interrupt went off.
+         **/
+        bool wait_for_data (off64_t size);
+
+        /**
+         * The first event from offset on that the filter wants,
+         * stepping over the others by their headers alone. Stops at
+         * anything with a bogus length, or the end, for read_event to
+         * deal with.
+         **/
+        off64_t skip_filtered (off64_t offset);
+
+        /**
+         * Follow the chain from offset until it reaches until, returns
+         * where it ended up. Only reads headers.
+         **/
+        off64_t walk_chain (off64_t offset, off64_t until);
+
+        /** parallel_scan's bookkeeping, see ybinlogp.cc */
+        struct scan_state;
+        static void* scan_thread (void *arg);
+        void scan_locate (scan_state &state, size_t chunk, binlog_counters &counters);
+        void scan_process (scan_state &state, size_t chunk, scan_worker &worker, std::string &out, binlog_counters &counters);
 
         /**
          * Binary-search to find the record closest to the requested time
          **/
-        int nearest_time (time_t target, struct event_buffer *outbuf);
+        off64_t nearest_time (time_t target, struct event_buffer *outbuf);
+
+        /**
+         * Where nearest_time and indexed_seek both end up: follow the
+         * chain from the event at offset (which has to be before
+         * target) to the first event at or after target, and take the
+         * one before it instead if that's strictly closer. -2 if no
+         * event is that late.
+         **/
+        off64_t closest_time (off64_t offset, time_t target, struct event_buffer *outbuf);
+
+        /**
+         * Seek with a sidecar index: start at the indexed event at or
+         * before the one we want and follow the chain from there.
+         * Finds the first event at or after starting_offset, or if
+         * target is set, the same event nearest_time would.
+         **/
+        off64_t indexed_seek (const binlog_index &index, off64_t starting_offset, time_t target, struct event_buffer *outbuf);
+
+        /**
+         * Follow the chain from offset, reading only headers and the
+         * GTID_LOG_EVENTs' ids, to the first GTID_LOG_EVENT starting
+         * before until with target's sid, or with exact, target
+         * itself. Returns its offset and sets gno, or -1.
+         **/
+        off64_t scan_gtids (off64_t offset, off64_t until, const gtid &target, bool exact, uint64_t &gno);
+
+        /**
+         * seek_gtid without an index, see there.
+         **/
+        off64_t bisect_gtid (const gtid &target);
+
+        /**
+         * indexed_seek for a stream, reading forward from the event in
+         * outbuf since there's no going back. -2 if the stream ends
+         * before getting there.
+         **/
+        off64_t stream_seek (off64_t starting_offset, time_t target, struct event_buffer *outbuf);
+
+        /**
+         * Where the first event of a stream we're handed an fd to is:
+         * after the magic if it starts with one, otherwise right at the
+         * start.
+         **/
+        off64_t stream_start ();
 
     private:
+        std::string m_filename;
         int m_fd;
         bool m_owns_file;
         struct stat *m_stbuf;
         event_buffer *m_evbuf;
+        const char *m_map;
+        size_t m_map_size;
+        // NULL unless the file is compressed
+        compressed_file *m_compressed;
+        // NULL unless m_fd is a pipe or the like
+        stream_buffer *m_stream;
+        boost::shared_ptr<payload_allocator> m_allocator;
+        // Earlier allocators that still had buffers out, see set_allocator
+        std::vector<boost::shared_ptr<payload_allocator> > m_retired_allocators;
+        boost::shared_ptr<event_filter> m_filter;
         time_t m_min_timestamp;
         time_t m_max_timestamp;
+        format_description_entry m_format;
+        // m_format.checksum_len (), what read_event sets on events
+        uint8_t m_checksum_len;
+        bool m_verify;
+        bool m_follow;
+        int m_follow_timeout;
+        bool m_file_ended;
+        std::string m_rotated_to;
+        // inotify instance (kqueue on Darwin) watching m_fd's file while following
+        int m_watch_fd;
+        // see set_follow_interrupt
+        int m_interrupt_fd;
+        binlog_counters m_counters;
+    };
+
+
+    /** A series of binlogs read as one, eg. everything a
+        mysql-bin.index lists.
+
+        At the end of each file the set moves on to the file named by
+        its last ROTATE_EVENT, or if there wasn't one, the next file in
+        the list. A rotation to a file that isn't in the list is
+        followed too if it's next to the current file. Once the
+        iteration is halfway through a file the next one is opened and
+        the kernel told to start reading it (posix_fadvise WILLNEED),
+        so there's no stall on the switch.
+
+        Iteration is single pass: there's one position, kept by the
+        set, and begin () doesn't rewind it.
+    */
+    class binlog_set : boost::noncopyable {
+    public:
+        /** Input iterator over the events of every file in turn. */
+        struct iterator {
+            typedef ptrdiff_t difference_type;
+            typedef std::input_iterator_tag iterator_category;
+            typedef binlog::entry value_type;
+            typedef const value_type& reference;
+            typedef const value_type* pointer;
+
+            reference operator* () const { return *m_set->m_it; }
+            pointer operator-> () const { return &*m_set->m_it; }
+            bool operator== (const iterator &rhs) const {
+                return at_end () == rhs.at_end () && (at_end () || m_set == rhs.m_set);
+            }
+            bool operator!= (const iterator &rhs) const { return ! operator== (rhs); }
+            iterator& operator++ () {
+                m_set->advance ();
+                return *this;
+            }
+
+            iterator () : m_set (NULL) { }
+
+        private:
+            explicit iterator (binlog_set *set) : m_set (set) { }
+            bool at_end () const { return m_set == NULL || !m_set->m_binlog; }
+
+            binlog_set *m_set;
+
+            friend class binlog_set;
+        };
+
+        /** Constructor
+
+            \param files binlogs in order, see expand
+            \param starting_offset start reading from first entry after this offset in the first file
+            \param starting_time start reading from the file and entry closest to this time
+            \param mode how to read events
+
+            \note time trumphs offset
+        */
+        binlog_set (const std::vector<std::string> &files, off64_t starting_offset = 0, time_t starting_time = 0,
+                    binlog::read_mode mode = binlog::READ_MMAP);
+
+        /** Constructor, starting at a GTID
+
+            Every file's PREVIOUS_GTIDS_LOG_EVENT says what came before
+            it, so the file start is in is bisected for by opening a
+            handful of files, and binlog::seek_gtid finds it in there.
+            Throws std::runtime_error if start isn't in any of them.
+
+            \param files binlogs in order, see expand
+            \param start the GTID_LOG_EVENT to start at
+            \param mode how to read events
+        */
+        binlog_set (const std::vector<std::string> &files, const gtid &start,
+                    binlog::read_mode mode = binlog::READ_MMAP);
+        ~binlog_set ();
+
+        /** The binlogs a mysql-bin.index lists. Relative names are
+            relative to the directory the index is in. */
+        static std::vector<std::string> read_index (const std::string &index_file);
+
+        /** pattern as a list of binlogs: the contents of an .index
+            file, the (sorted) matches of a glob, or just the file. */
+        static std::vector<std::string> expand (const std::string &pattern);
+
+        iterator begin () { return iterator (this); }
+        iterator end () { return iterator (); }
+
+        /** Follow the files as they're written, see
+            binlog::set_follow. The set keeps going into the file a
+            rotation names, waiting for the server to create it if need
+            be, and ends when a wait times out. Call it before
+            iterating. */
+        void set_follow (bool follow, int timeout_ms = -1);
+
+        /** See binlog::set_verify_checksums, applies to every file. */
+        void set_verify_checksums (bool verify);
+
+        /** See binlog::set_filter, applies to every file. */
+        void set_filter (boost::shared_ptr<event_filter> filter);
+
+        /** The file being read, empty once everything's been read. */
+        const std::string& current_file () const;
+        const std::vector<std::string>& files () const { return m_files; }
+
+        /** The counters of every file read so far, see binlog::counters. */
+        binlog_counters counters () const;
+
+    private:
+        /** Move the shared position along, switching files as needed. */
+        void advance ();
+        /** Switch to the next file with anything in it, or the end. */
+        void next_file ();
+        /** Index of the file to read after the current one, m_files.size () if none. */
+        size_t next_index ();
+        /** Switch to file index, false if there's nothing in it. */
+        bool open (size_t index, off64_t starting_offset, time_t starting_time, const gtid *start = NULL);
+        /** Index of the file start is in, m_files.size () if none. */
+        size_t find_gtid (const gtid &start);
+        /** Let go of the current file, keeping its counters. */
+        void close_binlog ();
+        /** Get the kernel reading the next file. */
+        void prefetch ();
+        void close_prefetch ();
+
+        std::vector<std::string> m_files;
+        size_t m_index;
+        binlog::read_mode m_mode;
+        boost::shared_ptr<binlog> m_binlog;
+        binlog::iterator m_it;
+        binlog::iterator m_end;
+        // next_file of the last ROTATE_EVENT in the current file
+        std::string m_rotate_to;
+        // the current file ended with a ROTATE_EVENT or STOP_EVENT
+        bool m_file_done;
+        bool m_follow;
+        int m_follow_timeout;
+        bool m_verify;
+        boost::shared_ptr<event_filter> m_filter;
+        off64_t m_size;
+        int m_prefetch_fd;
+        size_t m_prefetch_index;
+        // of the files already read
+        binlog_counters m_counters;
+    };
+
+    /** Events straight from a MySQL server's replication stream,
+        rather than from binlogs copied off it: logs in like a replica,
+        asks for the binlogs with COM_BINLOG_DUMP and hands out the
+        events the server sends as binlog::entry, on through its
+        rotations, the way binlog_set does for files. Iteration is
+        single pass, like binlog_set's.
+
+        The socket is read a big buffer at a time (with a receive
+        buffer to match), and every whole packet in the buffer is
+        handed out before the next recv (). An entry's payload points
+        into the buffer, like a mapped binlog's into the mapping, so
+        copy the entry if it has to outlive the next increment.
+
+        Offsets are positions in the server's binlog, which
+        current_file () names. The events the server makes up to start
+        off with (a ROTATE_EVENT naming the file and, starting part way
+        in, its FDE) are at offset 0.
+
+        Logs in with mysql_native_password, so the account has to use
+        that (8.0 defaults to caching_sha2_password) and needs
+        REPLICATION SLAVE. ybinlogp-serve stands in for a server.
+    */
+    class replication_stream : boost::noncopyable {
+    public:
+        /** Input iterator over the events as they arrive. */
+        struct iterator {
+            typedef ptrdiff_t difference_type;
+            typedef std::input_iterator_tag iterator_category;
+            typedef binlog::entry value_type;
+            typedef const value_type& reference;
+            typedef const value_type* pointer;
+
+            reference operator* () const { return m_stream->m_entry; }
+            pointer operator-> () const { return &m_stream->m_entry; }
+            bool operator== (const iterator &rhs) const {
+                return at_end () == rhs.at_end () && (at_end () || m_stream == rhs.m_stream);
+            }
+            bool operator!= (const iterator &rhs) const { return ! operator== (rhs); }
+            iterator& operator++ () {
+                m_stream->advance ();
+                return *this;
+            }
+
+            iterator () : m_stream (NULL) { }
+
+        private:
+            explicit iterator (replication_stream *stream) : m_stream (stream) { }
+            bool at_end () const { return m_stream == NULL || m_stream->m_done; }
+
+            replication_stream *m_stream;
+
+            friend class replication_stream;
+        };
+
+        /** Constructor, connects and logs in. Throws std::runtime_error if either fails.
+
+            \param host name or address of the server
+            \param port the server's port, usually 3306
+            \param user account to log in as
+            \param password its password
+            \param server_id replica id to ask as, no other replica of the server may be using it
+        */
+        replication_stream (const std::string &host, uint16_t port, const std::string &user,
+                            const std::string &password, uint32_t server_id);
+        ~replication_stream ();
+
+        /** Start at position in file rather than at the start of the
+            server's first binlog. Call it before iterating. */
+        void set_start (const std::string &file, uint32_t position);
+
+        /** Wait for events once the server has sent everything it
+            has, like a replica does, rather than ending there. Ends
+            when a wait takes longer than timeout_ms (-1 waits forever)
+            or the server goes away. Call it before iterating. */
+        void set_follow (bool follow, int timeout_ms = -1);
+
+        /** See binlog::set_verify_checksums. */
+        void set_verify_checksums (bool verify) { m_verify = verify; }
+
+        /** See binlog::set_filter. */
+        void set_filter (boost::shared_ptr<event_filter> filter) { m_filter = filter; }
+
+        /** Asks for the binlogs, the first time. */
+        iterator begin ();
+        iterator end () { return iterator (); }
+
+        /** The binlog the current event is from, as the last ROTATE_EVENT named it. */
+        const std::string& current_file () const { return m_file; }
+
+        /** What the server said it was when we connected. */
+        const std::string& server_version () const { return m_server_version; }
+
+        /** syscalls and bytes read are the socket's, see binlog_counters. */
+        const binlog_counters& counters () const { return m_counters; }
+
+    private:
+        /** Send payload as the next packet of the current command. */
+        void send_packet (const std::string &payload);
+        /** Point payload at the next packet's, false if the server
+            hung up (or following, didn't send anything in time). Good
+            until the next call. */
+        bool read_packet (const char *&payload, size_t &len);
+        /** read_packet, but the server hanging up is an error. */
+        void expect_packet (const char *&payload, size_t &len);
+        /** Make sure there are want bytes from m_pos on, false if the server hung up or timed out. */
+        bool fill (size_t want);
+        void login (const std::string &user, const std::string &password);
+        /** Run statement, returning the first column of its first row
+            if it has any. false (and the message in error) if the
+            server refused it. */
+        bool query (const std::string &statement, std::string &value, std::string &error);
+        void start_dump ();
+        /** The next event the filter lets through into m_entry, or the end. */
+        void advance ();
+
+        int m_fd;
+        uint32_t m_server_id;
+        std::string m_server_version;
+        // sequence number of the next packet
+        uint8_t m_seq;
+        std::vector<char> m_buffer;
+        size_t m_pos;
+        size_t m_len;
+        // a payload that came in several packets, put back together
+        std::vector<char> m_joined;
+        std::string m_start_file;
+        uint32_t m_start_position;
+        bool m_follow;
+        int m_follow_timeout;
+        bool m_verify;
+        boost::shared_ptr<event_filter> m_filter;
+        bool m_started;
+        bool m_done;
+        binlog::entry m_entry;
+        std::string m_file;
+        // checksum_len of the events we're getting, from the server
+        // until there's been an FDE, then from that
+        uint8_t m_checksum_len;
+        binlog_counters m_counters;
+    };
+
+    /** The TABLE_MAP_EVENTs seen so far, by table_id, which row
+        events need to be decoded. Show it every event in order and
+        hand it to binlog::rows_entry. */
+    class table_map_cache {
+    public:
+        /** Remember evbuf if it's a TABLE_MAP_EVENT, forget everything
+            at a FORMAT_DESCRIPTION_EVENT (ie. the next file). Returns
+            true if evbuf was a table map. */
+        bool update (const event_buffer &evbuf);
+
+        /** The table map for table_id, an empty pointer if there's been none. */
+        boost::shared_ptr<const binlog::table_map_entry> find (uint64_t table_id) const;
+
+        void clear () { m_tables.clear (); }
+        size_t size () const { return m_tables.size (); }
+
+    private:
+        std::map<uint64_t, boost::shared_ptr<const binlog::table_map_entry> > m_tables;
+    };
+
+    /** A group of events the server committed together, see transaction_reader. */
+    struct transaction {
+        enum ending_t {
+            /** XID_EVENT, or a COMMIT query for non-transactional tables */
+            COMMIT,
+            /** a ROLLBACK query */
+            ROLLBACK,
+            /** a statement outside BEGIN ... COMMIT, eg. DDL, with any
+                INTVAR, RAND and USER_VAR events before it */
+            AUTOCOMMIT,
+            /** the file ended (or another BEGIN came) first */
+            UNFINISHED
+        };
+
+        transaction () : start (0), end (0), timestamp (0), xid (0), events (0), bytes (0), ending (UNFINISHED), buffered (true) { }
+
+        /** Offset of the first event */
+        off64_t start;
+        /** Offset just past the last event */
+        off64_t end;
+        /** When the last event was written, ie. when it committed */
+        uint32_t timestamp;
+        /** The XID_EVENT's, 0 without one */
+        uint64_t xid;
+        uint64_t events;
+        /** Total length of the events */
+        uint64_t bytes;
+        ending_t ending;
+        /** Whether entries holds every event. Over the reader's
+            max_buffered it holds none, read [start, end) again to get
+            at them. */
+        bool buffered;
+        std::vector<binlog::entry> entries;
+    };
+
+    /** Groups the events of a binlog into transactions, BEGIN up to
+        its XID_EVENT (or COMMIT or ROLLBACK query) and statements on
+        their own, each with the GTID_LOG_EVENT in front of it if
+        there is one. INTVAR, RAND and USER_VAR events go with the
+        transaction after them. Other events outside transactions
+        (format descriptions, rotates and so on) are skipped.
+
+        Small transactions come with copies of their events. Past
+        max_buffered bytes the events are let go of and only the
+        transaction's offsets and totals are kept, so a huge bulk load
+        costs no more memory than a small one.
+
+        It needs every event, so don't set a filter on the binlog.
+        Iteration is single pass, like binlog_set's.
+    */
+    class transaction_reader : boost::noncopyable {
+    public:
+        struct iterator {
+            typedef ptrdiff_t difference_type;
+            typedef std::input_iterator_tag iterator_category;
+            typedef transaction value_type;
+            typedef const value_type& reference;
+            typedef const value_type* pointer;
+
+            reference operator* () const { return m_reader->m_current; }
+            pointer operator-> () const { return &m_reader->m_current; }
+            bool operator== (const iterator &rhs) const {
+                return at_end () == rhs.at_end () && (at_end () || m_reader == rhs.m_reader);
+            }
+            bool operator!= (const iterator &rhs) const { return ! operator== (rhs); }
+            iterator& operator++ () {
+                m_reader->advance ();
+                return *this;
+            }
+
+            iterator () : m_reader (NULL) { }
+
+        private:
+            explicit iterator (transaction_reader *reader) : m_reader (reader) { }
+            bool at_end () const { return m_reader == NULL || m_reader->m_done; }
+
+            transaction_reader *m_reader;
+
+            friend class transaction_reader;
+        };
+
+        /** \param max_buffered bytes of events to keep copies of per transaction */
+        explicit transaction_reader (binlog &log, uint64_t max_buffered = 16 * 1024 * 1024);
+
+        /** Reads the first transaction the first time it's called. */
+        iterator begin ();
+        iterator end () { return iterator (); }
+
+    private:
+        /** Read the next transaction into m_current, or set m_done. */
+        void advance ();
+        /** Count ev into m_current, and copy it if there's room. */
+        void add (const binlog::entry &ev);
+
+        binlog &m_log;
+        uint64_t m_max_buffered;
+        binlog::iterator m_it;
+        binlog::iterator m_end;
+        bool m_started;
+        // m_it is the last event of m_current, step past it first
+        bool m_step;
+        bool m_done;
+        transaction m_current;
+    };
+
+    /** Totals over a binlog for capacity planning (ybinlogp --stats):
+        events and bytes by type, database and table, the query_time
+        histogram and error codes of QUERY_EVENTs, and events and bytes
+        per minute.
+
+        QUERY_EVENTs count toward their default database, row events
+        toward their table's. A row event's table comes from the
+        TABLE_MAP_EVENT before it. Events whose table map one thread
+        never saw (parallel_scan cut the file between them) are kept
+        by table_id until merge can match them to another thread's.
+        Fill one per thread, then merge them and report.
+    */
+    class event_stats : boost::noncopyable {
+    public:
+        struct counter {
+            counter () : events (0), bytes (0) { }
+            void add (uint64_t length) {
+                ++events;
+                bytes += length;
+            }
+            void add (const counter &rhs) {
+                events += rhs.events;
+                bytes += rhs.bytes;
+            }
+            uint64_t events;
+            uint64_t bytes;
+        };
+
+        /** Bucket 0 is 0s, bucket b > 0 is [2**(b-1), 2**b) seconds */
+        static const size_t QUERY_TIME_BUCKETS = 33;
+
+        event_stats ();
+
+        void add (const event_buffer &evbuf);
+        /** Add in what rhs counted. */
+        void merge (const event_stats &rhs);
+        /** The report, as plain text. */
+        void report (std::ostream &os) const;
+
+        const counter& total () const { return m_total; }
+
+    private:
+        struct table_name {
+            std::string database;
+            std::string table;
+        };
+
+        /** Count what table_id's rows got under its name, now that
+            it's about to mean another table (or we're done). */
+        void settle (uint64_t table_id);
+        /** The named counters, with every table_id settled. */
+        void settled (boost::unordered_map<std::string, counter> &databases,
+                      boost::unordered_map<std::string, counter> &tables) const;
+
+        counter m_total;
+        uint32_t m_first_timestamp;
+        uint32_t m_last_timestamp;
+        counter m_types[256];
+        boost::unordered_map<std::string, counter> m_databases;
+        boost::unordered_map<std::string, counter> m_tables;
+        // what each table_id means now, and its rows since it did
+        boost::unordered_map<uint64_t, table_name> m_table_names;
+        boost::unordered_map<uint64_t, counter> m_table_rows;
+        // rows from before the first table map for their table_id
+        boost::unordered_map<uint64_t, counter> m_unmapped;
+        uint64_t m_query_times[QUERY_TIME_BUCKETS];
+        std::map<uint16_t, uint64_t> m_errors;
+        // by timestamp / 60
+        boost::unordered_map<uint32_t, counter> m_minutes;
+
+        // Consecutive events mostly share these, save the lookups
+        std::string m_last_database;
+        counter *m_last_database_counter;
+        uint64_t m_last_table_id;
+        counter *m_last_table_counter;
+        uint32_t m_last_minute;
+        counter *m_last_minute_counter;
     };
 
+    /** What binlog::parallel_scan runs events through. */
+    class scan_worker {
+    public:
+        virtual ~scan_worker () { }
+
+        /** Called on a scan thread for each event of a chunk, in
+            file order. Whatever is appended to out gets written out,
+            in file order, once the chunk is done. */
+        virtual void event (const binlog::event_view &ev, std::string &out) = 0;
+    };
+
+    /** How event_formatter writes events out.
+
+        FORMAT_TEXT is what operator<< prints, the events aren't
+        separated.
+
+        FORMAT_JSON is a JSON object per line: offset, timestamp,
+        type_code, type, server_id, length, next_position and flags,
+        and for the events that have one an object named like the
+        Python entry property (query, rotate, xid, intvar, rand,
+        format_description, table_map, rows, gtid, previous_gtids,
+        rows_query) with their fields.
+        Strings are the event's bytes, with anything that isn't valid
+        UTF-8 escaped as \u00XX.
+
+        FORMAT_TSV is a line per event: offset, timestamp, type,
+        server_id, length, next_position, flags, database and detail.
+        Detail is the statement of a QUERY_EVENT, the next file of a
+        ROTATE_EVENT, the id of an XID_EVENT, type=value of an
+        INTVAR_EVENT, seed_1,seed_2 of a RAND_EVENT, the table of a
+        TABLE_MAP_EVENT, the table_id of a rows event, the uuid:gno
+        of a GTID_LOG_EVENT, the set of a PREVIOUS_GTIDS_LOG_EVENT and
+        the statement of a ROWS_QUERY_LOG_EVENT. Tabs,
+        newlines, carriage returns, NULs and backslashes are escaped
+        with a backslash, like LOAD DATA INFILE expects.
+    */
+    enum output_format {
+        FORMAT_TEXT,
+        FORMAT_JSON,
+        FORMAT_TSV
+    };
+
+    /** An event as text (see output_format), appended to a string.
+        Numbers are formatted by hand and the ctime string is only
+        worked out again when the second changes, which is what makes
+        printing a whole file cheap. Keep one around per thread rather
+        than one per event.
+    */
+    class event_formatter : boost::noncopyable {
+    public:
+        explicit event_formatter (output_format format = FORMAT_TEXT);
+
+        void format (std::string &out, const event_buffer &evbuf);
+        output_format style () const { return m_format; }
+
+    private:
+        void format_text (std::string &out, const event_buffer &evbuf);
+        void format_json (std::string &out, const event_buffer &evbuf);
+        void format_tsv (std::string &out, const event_buffer &evbuf);
+
+        output_format m_format;
+        // ctime of m_date_time
+        time_t m_date_time;
+        char m_date[32];
+        size_t m_date_len;
+    };
+
+    /** Prints events (and whatever else) to a file descriptor through
+        a buffer of buffer_size, so output goes out in large writes.
+        Whatever's left goes out on flush () or destruction. */
+    class event_printer : boost::noncopyable {
+    public:
+        explicit event_printer (int fd, output_format format = FORMAT_TEXT, size_t buffer_size = 1 << 20);
+        ~event_printer ();
+
+        void print (const event_buffer &evbuf) {
+            m_formatter.format (m_buffer, evbuf);
+            if (m_buffer.size () >= m_buffer_size) {
+                flush ();
+            }
+        }
+        void write (const char *data, size_t len) {
+            m_buffer.append (data, len);
+            if (m_buffer.size () >= m_buffer_size) {
+                flush ();
+            }
+        }
+        /** Throws std::runtime_error if write fails. */
+        void flush ();
+        output_format style () const { return m_formatter.style (); }
+
+    private:
+        int m_fd;
+        size_t m_buffer_size;
+        std::string m_buffer;
+        event_formatter m_formatter;
+    };
+
+    /** Events decoded a field at a time into arrays, for code that
+        would rather not deal with an object per event (the python
+        binding's binlog.read_batch). Only the fields asked for are
+        filled in, fields an event doesn't have (a rotate's thread_id)
+        are 0 or empty.
+    */
+    class event_batch {
+    public:
+        enum field {
+            OFFSET = 1 << 0,
+            TIMESTAMP = 1 << 1,
+            TYPE_CODE = 1 << 2,
+            SERVER_ID = 1 << 3,
+            LENGTH = 1 << 4,
+            NEXT_POSITION = 1 << 5,
+            FLAGS = 1 << 6,
+            THREAD_ID = 1 << 7,
+            QUERY_TIME = 1 << 8,
+            ERROR_CODE = 1 << 9,
+            DATABASE = 1 << 10,
+            STATEMENT = 1 << 11,
+            ALL_FIELDS = (1 << 12) - 1
+        };
+        static const size_t FIELD_COUNT = 12;
+
+        explicit event_batch (unsigned fields = ALL_FIELDS);
+
+        /** The name of field 1 << i, the enum's name in lower case. */
+        static const char* field_name (size_t i);
+        /** Throws std::invalid_argument if there's no field called name. */
+        static field field_named (const std::string &name);
+
+        unsigned fields () const { return m_fields; }
+        size_t size () const { return m_size; }
+        void clear ();
+        void add (const event_buffer &evbuf);
+
+        /** Clear, then add events from it until there are n or it
+            reaches end. it is left at the first event not added. */
+        template <typename Iterator>
+        size_t read (Iterator &it, const Iterator &end, size_t n) {
+            clear ();
+            for (; m_size < n && it != end; ++it) {
+                add (*it->get_buffer ());
+            }
+            return m_size;
+        }
+
+        std::vector<uint64_t> offset;
+        std::vector<uint32_t> timestamp;
+        std::vector<uint8_t> type_code;
+        std::vector<uint32_t> server_id;
+        std::vector<uint32_t> length;
+        std::vector<uint32_t> next_position;
+        std::vector<uint16_t> flags;
+        std::vector<uint32_t> thread_id;
+        std::vector<uint32_t> query_time;
+        std::vector<uint16_t> error_code;
+        // Strings are all of them back to back, event i's is
+        // [*_offsets[i], *_offsets[i + 1]). There are size () + 1
+        // offsets, starting at 0.
+        std::vector<uint64_t> database_offsets;
+        std::string databases;
+        std::vector<uint64_t> statement_offsets;
+        std::string statements;
+
+    private:
+        unsigned m_fields;
+        size_t m_size;
+    };
+
+    /** Writes event metadata to a columnar file for analytics (see
+        column_file_header for the layout): offset, timestamp,
+        type_code, server_id, length, and for QUERY_EVENTs thread_id,
+        query_time, error_code, the database (dictionary encoded) and
+        the statement (a blob), zeros and nothing for other events.
+
+        Rows are buffered and written a batch at a time, so memory use
+        doesn't grow with the binlog. The file is written next to
+        filename and only renamed into place by close (), a writer
+        that's destroyed without it leaves nothing behind.
+    */
+    class column_writer : boost::noncopyable {
+    public:
+        explicit column_writer (const std::string &filename, uint32_t batch_rows = 65536);
+        ~column_writer ();
+
+        void add (const event_buffer &evbuf);
+        /** Write what's left and the footer, and put the file in
+            place. Throws std::runtime_error if that fails. */
+        void close ();
+        uint64_t rows () const { return m_rows; }
+
+    private:
+        void write (const void *data, size_t len);
+        // zeros up to the next multiple of 8
+        void pad ();
+        template <typename T>
+        void write_column (const std::vector<T> &column);
+        void write_batch ();
+
+        std::string m_filename;
+        std::string m_tmp;
+        FILE *m_file;
+        // bytes written so far
+        uint64_t m_position;
+        uint32_t m_batch_rows;
+        uint64_t m_rows;
+        std::vector<uint64_t> m_batches;
+        std::map<std::string, uint32_t> m_dictionary_ids;
+        std::vector<std::string> m_dictionary;
+
+        // the batch being filled
+        std::vector<uint64_t> m_offset;
+        std::vector<uint32_t> m_timestamp;
+        std::vector<uint8_t> m_type_code;
+        std::vector<uint32_t> m_server_id;
+        std::vector<uint32_t> m_length;
+        std::vector<uint32_t> m_thread_id;
+        std::vector<uint32_t> m_query_time;
+        std::vector<uint16_t> m_error_code;
+        std::vector<uint32_t> m_database;
+        std::vector<uint64_t> m_statement_end;
+        std::string m_statements;
+    };
+
+    /** A file column_writer wrote, mapped for reading. */
+    class column_file : boost::noncopyable {
+    public:
+        /** Throws std::runtime_error if filename isn't a column file. */
+        explicit column_file (const std::string &filename);
+        ~column_file ();
+
+        uint64_t rows () const { return m_footer->rows; }
+        size_t columns () const { return m_header->column_count; }
+        const column_desc& column (size_t c) const { return m_columns[c]; }
+        /** Index of the column called name, columns () if there isn't one. */
+        size_t find_column (const std::string &name) const;
+
+        size_t batches () const { return m_batches.size (); }
+        uint32_t batch_rows (size_t b) const { return m_batches[b].rows; }
+        /** Column c of batch b: batch_rows values of its width. */
+        const void* data (size_t b, size_t c) const { return m_batches[b].columns[c]; }
+        /** Row i of blob column c in batch b. */
+        std::string blob (size_t b, size_t c, size_t i) const;
+
+        size_t dictionary_size () const { return m_footer->dictionary_count; }
+        std::string dictionary (uint32_t id) const;
+
+    private:
+        struct batch {
+            uint32_t rows;
+            std::vector<const char*> columns;
+        };
+
+        const char *m_map;
+        size_t m_map_size;
+        const column_file_header *m_header;
+        const column_desc *m_columns;
+        const column_footer *m_footer;
+        const uint64_t *m_dictionary_offsets;
+        const char *m_dictionary;
+        std::vector<batch> m_batches;
+    };
 
     std::ostream& operator<< (std::ostream &os, const event_buffer &evbuf);
 
-    std::ostream& operator<< (std::ostream &os, const binlog::entry &entry) {
+    inline std::ostream& operator<< (std::ostream &os, const binlog::entry &entry) {
         return os << *entry.get_buffer ();
     }
+
+    inline std::ostream& operator<< (std::ostream &os, const binlog::event_view &view) {
+        return os << view.header ();
+    }
 }
 
 
@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+# Times the python bindings on a binlog (make one with ybinlogp-gen) and
+# prints a JSON object per benchmark, like ybinlogp-bench does.
+
+import sys
+import time
+import json
+import ybinlogp
+
+def open_binlog(path):
+	log = open(path, 'rb')
+	log.seek(4)
+	return log, ybinlogp.binlog(log)
+
+def iterate(path):
+	log, binlog = open_binlog(path)
+	events = 0
+	length = 0
+	for entry in binlog:
+		events += 1
+		length += entry.event.length
+	return events, length
+
+def queries(path):
+	log, binlog = open_binlog(path)
+	events = 0
+	length = 0
+	for entry in binlog:
+		events += 1
+		length += entry.event.length
+		if entry.query:
+			entry.query.statement
+	return events, length
+
+def read_batch(path):
+	log, binlog = open_binlog(path)
+	events = 0
+	length = 0
+	while True:
+		batch = binlog.read_batch(65536, ['length', 'statement'])
+		lengths = batch['length']
+		if not len(lengths):
+			break
+		events += len(lengths)
+		length += sum(lengths)
+	return events, length
+
+def prefetch(path):
+	log, binlog = open_binlog(path)
+	events = 0
+	length = 0
+	for entry in binlog.prefetch():
+		events += 1
+		length += entry.event.length
+	return events, length
+
+BENCHMARKS = [
+	('python_iterate', iterate),
+	('python_queries', queries),
+	('python_read_batch', read_batch),
+	('python_prefetch', prefetch),
+]
+
+def main(argv):
+	if len(argv) < 2:
+		print ('Usage: %s <binlog> [benchmark ...]' % (argv[0]))
+		return 1
+	path = argv[1]
+	chosen = [b for b in BENCHMARKS if len(argv) == 2 or b[0] in argv[2:]]
+	runs = 3
+	for name, run in chosen:
+		best = None
+		for i in range(runs):
+			start = time.time()
+			events, length = run(path)
+			elapsed = time.time() - start
+			if best is None or elapsed < best[0]:
+				best = (elapsed, events, length)
+		seconds = max(best[0], 1e-9)
+		print (json.dumps({
+			'benchmark': name,
+			'file': path,
+			'runs': runs,
+			'events': best[1],
+			'bytes': best[2],
+			'seconds': round(best[0], 6),
+			'events_per_sec': round(best[1] / seconds),
+			'mb_per_sec': round(best[2] / seconds / (1024 * 1024), 2),
+		}))
+	return 0
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))